@@ -0,0 +1,479 @@
+/**
+ * \file acct.c
+ * \brief Exact per-inner-flow accounting.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "acct.h"
+#include "debug.h"
+#include "sock.h"
+#include "stats.h"
+#include "thread.h"
+#include "udptun.h"
+
+/**
+ * \def ACCT_TEMPLATE4
+ * \brief The IPFIX template id of v4 records.
+ */
+#define ACCT_TEMPLATE4 256
+
+/**
+ * \def ACCT_TEMPLATE6
+ * \brief The IPFIX template id of v6 records.
+ */
+#define ACCT_TEMPLATE6 257
+
+/**
+ * \def ACCT_FIELDS
+ * \brief The amount of fields per template.
+ */
+#define ACCT_FIELDS 12
+
+/**
+ * \def ACCT_HDR_SIZE
+ * \brief The IPFIX message header plus set header size.
+ */
+#define ACCT_HDR_SIZE 20
+
+/**
+ * \def ACCT_BATCH
+ * \brief The amount of expired entries taken out of a shard per lock.
+ */
+#define ACCT_BATCH 256
+
+/**
+ * \var static const uint16_t fields[][2]
+ * \brief The v4 template (element id, length), the addresses are
+ *        replaced by their v6 counterparts in the v6 template.
+ */
+static const uint16_t fields[ACCT_FIELDS][2] = {
+   {   8, 4 },                 /* sourceIPv4Address */
+   {  12, 4 },                 /* destinationIPv4Address */
+   {   7, 2 },                 /* sourceTransportPort */
+   {  11, 2 },                 /* destinationTransportPort */
+   {   4, 1 },                 /* protocolIdentifier */
+   {  61, 1 },                 /* flowDirection */
+   { 0x8000 | ACCT_IE_PEER, 2 },
+   {   2, 8 },                 /* packetDeltaCount */
+   {   1, 8 },                 /* octetDeltaCount */
+   { 152, 8 },                 /* flowStartMilliseconds */
+   { 153, 8 },                 /* flowEndMilliseconds */
+   { 136, 1 },                 /* flowEndReason */
+};
+
+/**
+ * \var static const int rec_len[]
+ * \brief The v4 and v6 record sizes.
+ */
+static const int rec_len[2] = { 49, 73 };
+
+/**
+ * \fn static inline int parse(const char *pkt, int len, int peer, int dir,
+ *                             struct acct_key *key)
+ * \brief Build the key of an inner packet. The ports of non-first
+ *        fragments and of other protocols than TCP and UDP are 0.
+ *
+ * \return 0 for success, -1 if the packet is too short or not IP
+ */
+static inline int parse(const char *pkt, int len, int peer, int dir,
+                        struct acct_key *key);
+
+/**
+ * \fn static inline uint64_t hash(const struct acct_key *key)
+ * \brief The 64-bit hash of a key.
+ */
+static inline uint64_t hash(const struct acct_key *key);
+
+/**
+ * \fn static void del(struct acct_shard *sh, uint32_t i)
+ * \brief Remove the entry of slot i, shifting the following entries of
+ *        its cluster back (no tombstones).
+ */
+static void del(struct acct_shard *sh, uint32_t i);
+
+/**
+ * \fn static uint8_t *put(uint8_t *p, uint64_t val, int len)
+ * \brief Write a big-endian field.
+ *
+ * \return The end of the field
+ */
+static uint8_t *put(uint8_t *p, uint64_t val, int len);
+
+/**
+ * \fn static void export(struct acct *a, struct acct_entry *e, uint64_t now,
+ *                        enum acct_reason reason)
+ * \brief Append the record of an entry to the pending data set,
+ *        out_lock held.
+ */
+static void export(struct acct *a, struct acct_entry *e, uint64_t now,
+                   enum acct_reason reason);
+
+/**
+ * \fn static void flush(struct acct *a, int v6, uint64_t now)
+ * \brief Write the pending data set of a family as an IPFIX message.
+ */
+static void flush(struct acct *a, int v6, uint64_t now);
+
+/**
+ * \fn static void write_templates(struct acct *a)
+ * \brief Write the template set as the first message of the file.
+ */
+static void write_templates(struct acct *a);
+
+/**
+ * \fn static void *acct_thread(void *arg)
+ * \brief Expire the table every ACCT_TICK ms.
+ */
+static void *acct_thread(void *arg);
+
+/**
+ * \fn static void acct_stats(FILE *fp, void *arg)
+ * \brief Dump the table counters.
+ */
+static void acct_stats(FILE *fp, void *arg);
+
+struct acct *acct_new(uint32_t flows, uint16_t idle, uint16_t active,
+                      const char *file) {
+   struct acct *a = calloc(1, sizeof(struct acct));
+   if (!a)
+      die("calloc");
+
+   /* load factor below 3/4 */
+   uint32_t per = (flows + ACCT_SHARDS - 1) / ACCT_SHARDS, cap = 16;
+   while (cap * 3 / 4 < per)
+      cap <<= 1;
+   for (int i=0; i<ACCT_SHARDS; i++) {
+      struct acct_shard *sh = &a->shards[i];
+      pthread_spin_init(&sh->lock, PTHREAD_PROCESS_PRIVATE);
+      sh->mask  = cap - 1;
+      sh->max   = cap * 3 / 4;
+      /* pages are only touched when used */
+      if (!(sh->slots = calloc(cap, sizeof(struct acct_entry))))
+         die("calloc");
+   }
+
+   a->base   = acct_now();
+   a->idle   = (idle ? idle : ACCT_IDLE) * 1000;
+   a->active = (active ? active : ACCT_ACTIVE) * 1000;
+   pthread_mutex_init(&a->out_lock, NULL);
+   if (file) {
+      if (!(a->out = fopen(file, "w")))
+         die("acct file");
+      write_templates(a);
+   }
+   debug_print("acct: %u slots per shard, %zuB\n", cap,
+               (size_t)cap * ACCT_SHARDS * sizeof(struct acct_entry));
+   return a;
+}
+
+struct acct *init_acct(struct tun_state *state) {
+   char file[512];
+   if (!state->acct_flows)
+      return NULL;
+   snprintf(file, sizeof(file), "%sacct%s%s.ipfix",
+            state->out_dir ? state->out_dir : "",
+            state->args->run_id ? "." : "",
+            state->args->run_id ? state->args->run_id : "");
+   struct acct *a = acct_new(state->acct_flows, state->acct_idle,
+                             state->acct_active, file);
+   stats_register("acct", acct_stats, a);
+   xthread_create(acct_thread, a, 1);
+   return a;
+}
+
+void acct_free(struct acct *a) {
+   acct_expire(a, acct_now(), 1);
+   if (a->out)
+      fclose(a->out);
+   for (int i=0; i<ACCT_SHARDS; i++) {
+      free(a->shards[i].slots);
+      pthread_spin_destroy(&a->shards[i].lock);
+   }
+   pthread_mutex_destroy(&a->out_lock);
+   free(a);
+}
+
+int parse(const char *pkt, int len, int peer, int dir, struct acct_key *key) {
+   int off, frag = 0;
+   memset(key, 0, sizeof(struct acct_key));
+   if ((pkt[0] & 0xf0) == 0x40) {
+      if (len < 20)
+         return -1;
+      memcpy(key->src, pkt+12, 4);
+      memcpy(key->dst, pkt+16, 4);
+      key->proto = pkt[9];
+      off        = (pkt[0] & 0x0f) << 2;
+      frag       = pkt[6] & 0x1f || pkt[7];
+   } else if ((pkt[0] & 0xf0) == 0x60) {
+      if (len < 40)
+         return -1;
+      memcpy(key->src, pkt+8, 32);
+      key->proto = pkt[6];
+      key->flags = ACCT_V6;
+      off        = 40;
+   } else
+      return -1;
+   if (!frag && len >= off + 4 &&
+         (key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP)) {
+      memcpy(&key->sport, pkt+off, 2);
+      memcpy(&key->dport, pkt+off+2, 2);
+   }
+   key->peer   = peer;
+   key->flags |= dir;
+   return 0;
+}
+
+uint64_t hash(const struct acct_key *key) {
+   uint64_t w[5];
+   memcpy(w, key, sizeof(w));
+   uint64_t h = w[0] * 0x9e3779b97f4a7c15ULL + w[1] * 0xc2b2ae3d27d4eb4fULL +
+                w[2] * 0x165667b19e3779f9ULL + w[3] * 0x27d4eb2f165667c5ULL +
+                w[4];
+   /* murmur3 64-bit finalizer */
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return h;
+}
+
+void acct_update(struct acct *a, const char *pkt, int len, int peer, int dir) {
+   struct acct_key key;
+   if (parse(pkt, len, peer, dir, &key) < 0)
+      return;
+   uint64_t h   = hash(&key);
+   uint32_t tag = (h >> 32) | 1;
+   uint32_t now = acct_now() - a->base;
+   struct acct_shard *sh = &a->shards[h & (ACCT_SHARDS - 1)];
+
+   pthread_spin_lock(&sh->lock);
+   for (uint32_t i = (tag >> 1) & sh->mask; ; i = (i + 1) & sh->mask) {
+      struct acct_entry *e = &sh->slots[i];
+      if (e->tag == tag && !memcmp(&e->key, &key, sizeof(struct acct_key))) {
+         e->pkts++;
+         e->bytes += len;
+         e->last   = now;
+         break;
+      }
+      if (!e->tag) {
+         if (sh->len >= sh->max) {
+            sh->dropped++;
+            break;
+         }
+         e->tag   = tag;
+         e->first = e->last = now;
+         e->pkts  = 1;
+         e->bytes = len;
+         e->key   = key;
+         sh->len++;
+         sh->inserted++;
+         break;
+      }
+   }
+   pthread_spin_unlock(&sh->lock);
+}
+
+void del(struct acct_shard *sh, uint32_t i) {
+   uint32_t j = i;
+   while (1) {
+      j = (j + 1) & sh->mask;
+      struct acct_entry *e = &sh->slots[j];
+      if (!e->tag)
+         break;
+      /* move e to the hole unless its home slot lies in (i, j] */
+      uint32_t home = (e->tag >> 1) & sh->mask;
+      if (((j - home) & sh->mask) >= ((j - i) & sh->mask)) {
+         sh->slots[i] = *e;
+         i = j;
+      }
+   }
+   sh->slots[i].tag = 0;
+   sh->len--;
+}
+
+uint32_t acct_expire(struct acct *a, uint64_t now, int all) {
+   struct acct_entry batch[ACCT_BATCH];
+   uint8_t reason[ACCT_BATCH];
+   uint32_t removed = 0, rel = now - a->base;
+   for (int s=0; s<ACCT_SHARDS; s++) {
+      struct acct_shard *sh = &a->shards[s];
+      uint32_t i = 0, n;
+      int done = 0;
+      while (!done) {
+         /* the forwarding threads spin on this lock: only copy the
+          * expired entries out, records are built and written below */
+         n = 0;
+         pthread_spin_lock(&sh->lock);
+         for (; i<=sh->mask && sh->len && n<ACCT_BATCH; i++) {
+            struct acct_entry *e = &sh->slots[i];
+            /* a removal shifts the next entry in slot i */
+            while (e->tag && (all || rel - e->last >= a->idle) &&
+                   n < ACCT_BATCH) {
+               if (e->pkts) {
+                  batch[n]    = *e;
+                  reason[n++] = all ? ACCT_FORCED_END : ACCT_IDLE_TIMEOUT;
+               }
+               del(sh, i);
+               removed++;
+            }
+            /* full, resume at slot i */
+            if (n == ACCT_BATCH)
+               break;
+            if (e->tag && rel - e->first >= a->active) {
+               if (e->pkts) {
+                  batch[n]    = *e;
+                  reason[n++] = ACCT_ACTIVE_TIMEOUT;
+               }
+               e->first = rel;
+               e->pkts  = 0;
+               e->bytes = 0;
+            }
+         }
+         done = i > sh->mask || !sh->len;
+         pthread_spin_unlock(&sh->lock);
+
+         if (!n)
+            continue;
+         pthread_mutex_lock(&a->out_lock);
+         for (uint32_t k=0; k<n; k++)
+            export(a, &batch[k], now, reason[k]);
+         pthread_mutex_unlock(&a->out_lock);
+      }
+   }
+   pthread_mutex_lock(&a->out_lock);
+   flush(a, 0, now);
+   flush(a, 1, now);
+   if (a->out)
+      fflush(a->out);
+   pthread_mutex_unlock(&a->out_lock);
+   return removed;
+}
+
+uint8_t *put(uint8_t *p, uint64_t val, int len) {
+   for (int i=len-1; i>=0; i--, val >>= 8)
+      p[i] = val & 0xff;
+   return p + len;
+}
+
+void export(struct acct *a, struct acct_entry *e, uint64_t now,
+            enum acct_reason reason) {
+   if (!e->pkts)
+      return;
+   int v6 = e->key.flags & ACCT_V6, alen = v6 ? 16 : 4;
+   a->records++;
+   a->exp_pkts  += e->pkts;
+   a->exp_bytes += e->bytes;
+   if (a->out) {
+      if (a->msg_len[v6] + rec_len[v6] > ACCT_MSG_SIZE - ACCT_HDR_SIZE)
+         flush(a, v6, now);
+      uint8_t *p = a->msg[v6] + a->msg_len[v6];
+      memcpy(p, e->key.src, alen); p += alen;
+      memcpy(p, e->key.dst, alen); p += alen;
+      memcpy(p, &e->key.sport, 2); p += 2;
+      memcpy(p, &e->key.dport, 2); p += 2;
+      *p++ = e->key.proto;
+      *p++ = !!(e->key.flags & ACCT_RX);
+      p = put(p, e->key.peer, 2);
+      p = put(p, e->pkts, 8);
+      p = put(p, e->bytes, 8);
+      p = put(p, a->base + e->first, 8);
+      p = put(p, a->base + e->last, 8);
+      *p++ = reason;
+      a->msg_len[v6] += rec_len[v6];
+   }
+}
+
+void flush(struct acct *a, int v6, uint64_t now) {
+   uint8_t hdr[ACCT_HDR_SIZE], *p = hdr;
+   uint32_t len = a->msg_len[v6];
+   if (!a->out || !len)
+      return;
+   p = put(p, 10, 2);                            /* version */
+   p = put(p, ACCT_HDR_SIZE + len, 2);
+   p = put(p, now / 1000, 4);                    /* export time */
+   p = put(p, a->seq, 4);
+   p = put(p, 0, 4);                             /* observation domain */
+   p = put(p, v6 ? ACCT_TEMPLATE6 : ACCT_TEMPLATE4, 2);
+   p = put(p, 4 + len, 2);
+   if (fwrite(hdr, ACCT_HDR_SIZE, 1, a->out) != 1 ||
+         fwrite(a->msg[v6], len, 1, a->out) != 1) {
+      debug_print("acct: fwrite: %s\n", strerror(errno));
+   }
+   a->seq += len / rec_len[v6];
+   a->file_bytes += ACCT_HDR_SIZE + len;
+   a->msg_len[v6] = 0;
+}
+
+void write_templates(struct acct *a) {
+   uint8_t msg[16 + 4 + 2 * (4 + ACCT_FIELDS * 4 + 4)], *p = msg;
+   p = put(p, 10, 2);
+   p = put(p, sizeof(msg), 2);
+   p = put(p, acct_now() / 1000, 4);
+   p = put(p, 0, 4);
+   p = put(p, 0, 4);
+   p = put(p, 2, 2);                             /* template set */
+   p = put(p, sizeof(msg) - 16, 2);
+   for (int v6=0; v6<2; v6++) {
+      p = put(p, v6 ? ACCT_TEMPLATE6 : ACCT_TEMPLATE4, 2);
+      p = put(p, ACCT_FIELDS, 2);
+      for (int f=0; f<ACCT_FIELDS; f++) {
+         uint16_t id = fields[f][0], len = fields[f][1];
+         /* sourceIPv6Address, destinationIPv6Address */
+         if (v6 && f < 2) {
+            id  = f ? 28 : 27;
+            len = 16;
+         }
+         p = put(p, id, 2);
+         p = put(p, len, 2);
+         if (id & 0x8000)
+            p = put(p, ACCT_PEN, 4);
+      }
+   }
+   if (fwrite(msg, sizeof(msg), 1, a->out) != 1) {
+      debug_print("acct: fwrite: %s\n", strerror(errno));
+   }
+   a->file_bytes += sizeof(msg);
+}
+
+void *acct_thread(void *arg) {
+   struct acct *a = arg;
+   struct timespec tick = { ACCT_TICK / 1000, (ACCT_TICK % 1000) * 1000000 };
+   int old;
+   while (1) {
+      nanosleep(&tick, NULL);
+      /* do not get canceled while holding a lock */
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+      acct_expire(a, acct_now(), 0);
+      pthread_setcancelstate(old, NULL);
+   }
+   return NULL;
+}
+
+void acct_stats(FILE *fp, void *arg) {
+   struct acct *a = arg;
+   uint64_t flows = 0, inserted = 0, dropped = 0;
+   for (int i=0; i<ACCT_SHARDS; i++) {
+      flows    += a->shards[i].len;
+      inserted += a->shards[i].inserted;
+      dropped  += a->shards[i].dropped;
+   }
+   fprintf(fp, "flows %llu\n", (unsigned long long)flows);
+   fprintf(fp, "capacity %llu\n", (unsigned long long)a->shards[0].max * ACCT_SHARDS);
+   fprintf(fp, "inserted %llu\n", (unsigned long long)inserted);
+   fprintf(fp, "dropped_pkts %llu\n", (unsigned long long)dropped);
+   fprintf(fp, "records %llu\n", (unsigned long long)a->records);
+   fprintf(fp, "exported_pkts %llu\n", (unsigned long long)a->exp_pkts);
+   fprintf(fp, "exported_bytes %llu\n", (unsigned long long)a->exp_bytes);
+   fprintf(fp, "file_bytes %llu\n", (unsigned long long)a->file_bytes);
+}
@@ -0,0 +1,240 @@
+/**
+ * \file acct.h
+ * \brief Exact per-inner-flow accounting.
+ *
+ *    Every inner packet forwarded is counted in a flow table keyed by
+ *    its 5-tuple, direction and peer. The table is split into shards,
+ *    each an open-addressing (linear probing) array of one cache line
+ *    entries under a spinlock, sized once from acct-flows. Entries keep
+ *    their first and last seen timestamps; a timer thread removes the
+ *    entries idle for acct-idle seconds, and reports the flows active
+ *    for acct-active seconds with delta counts, like an IPFIX metering
+ *    process. Removed entries are written as IPFIX (RFC 7011) messages
+ *    to <output-dir>/acct[.<run-id>].ipfix. flowDirection is 0 (ingress)
+ *    for tun to network flows, the peer is exported as the
+ *    enterprise-specific element ACCT_IE_PEER.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_ACCT_H
+#define UDPTUN_ACCT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "state.h"
+
+/**
+ * \def ACCT_SHARDS
+ * \brief The amount of table shards (power of 2).
+ */
+#define ACCT_SHARDS 64
+
+/**
+ * \def ACCT_IDLE
+ * \brief The default idle timeout (sec).
+ */
+#define ACCT_IDLE 30
+
+/**
+ * \def ACCT_ACTIVE
+ * \brief The default active timeout (sec).
+ */
+#define ACCT_ACTIVE 300
+
+/**
+ * \def ACCT_TICK
+ * \brief The expiry period (ms).
+ */
+#define ACCT_TICK 1000
+
+/**
+ * \def ACCT_MSG_SIZE
+ * \brief The maximal size of an exported IPFIX message.
+ */
+#define ACCT_MSG_SIZE 8192
+
+/**
+ * \def ACCT_PEN
+ * \brief The enterprise number of ACCT_IE_PEER.
+ */
+#define ACCT_PEN 0
+
+/**
+ * \def ACCT_IE_PEER
+ * \brief The enterprise-specific element id of the peer.
+ */
+#define ACCT_IE_PEER 1
+
+/**
+ * \enum acct_reason
+ * \brief The IPFIX flowEndReason values.
+ */
+enum acct_reason {
+   ACCT_IDLE_TIMEOUT   = 1, /*!< idle entry removed */
+   ACCT_ACTIVE_TIMEOUT = 2, /*!< long-lived entry reported */
+   ACCT_FORCED_END     = 4, /*!< entry removed at shutdown */
+};
+
+/**
+ * \struct acct_key
+ *	\brief An inner flow.
+ */
+struct acct_key {
+   uint8_t  src[16];    /*!< The source address (v4 in the first 4 bytes) */
+   uint8_t  dst[16];    /*!< The destination address */
+   uint16_t sport;      /*!< The source port (network order), 0 if none */
+   uint16_t dport;      /*!< The destination port (network order), 0 if none */
+   uint16_t peer;       /*!< The peer (tunnel source port) */
+   uint8_t  proto;      /*!< The transport protocol */
+   uint8_t  flags;      /*!< ACCT_V6 | ACCT_RX */
+};
+
+/**
+ * \def ACCT_V6
+ * \brief acct_key flag, IPv6 flow.
+ */
+#define ACCT_V6 0x01
+
+/**
+ * \def ACCT_TX
+ * \brief acct_key direction, tun to network flow.
+ */
+#define ACCT_TX 0x00
+
+/**
+ * \def ACCT_RX
+ * \brief acct_key flag, network to tun flow.
+ */
+#define ACCT_RX 0x02
+
+/**
+ * \struct acct_entry
+ *	\brief A table slot (one cache line).
+ */
+struct acct_entry {
+   uint32_t tag;        /*!< Hash bits (home slot), 0 if the slot is free */
+   uint32_t first;      /*!< First packet (ms since the table creation) */
+   uint32_t last;       /*!< Last packet (ms since the table creation) */
+   uint32_t pkts;       /*!< Packets since first */
+   uint64_t bytes;      /*!< Bytes since first */
+   struct acct_key key; /*!< The flow */
+};
+
+/**
+ * \struct acct_shard
+ *	\brief A part of the flow table.
+ */
+struct acct_shard {
+   pthread_spinlock_t lock;   /*!< Protects the shard */
+   uint32_t mask;             /*!< The amount of slots - 1 */
+   uint32_t len;              /*!< Used slots */
+   uint32_t max;              /*!< Maximal used slots (load factor) */
+   struct acct_entry *slots;  /*!< The slots */
+   uint64_t inserted;         /*!< Flows inserted */
+   uint64_t dropped;          /*!< Packets of flows not inserted, shard full */
+} __attribute__((aligned(64)));
+
+/**
+ * \struct acct
+ *	\brief The flow table and its exporter.
+ */
+struct acct {
+   struct acct_shard shards[ACCT_SHARDS]; /*!< The table */
+   uint64_t base;             /*!< Table creation time (ms since epoch) */
+   uint32_t idle;             /*!< Idle timeout (ms) */
+   uint32_t active;           /*!< Active timeout (ms) */
+
+   FILE    *out;              /*!< The IPFIX file or NULL */
+   pthread_mutex_t out_lock;  /*!< Protects the exporter */
+   uint8_t  msg[2][ACCT_MSG_SIZE]; /*!< Pending v4 and v6 data sets */
+   uint32_t msg_len[2];       /*!< Pending data sets lengths */
+   uint32_t seq;              /*!< IPFIX sequence number (data records) */
+   uint64_t records;          /*!< Exported records */
+   uint64_t exp_pkts;         /*!< Packets of exported records */
+   uint64_t exp_bytes;        /*!< Bytes of exported records */
+   uint64_t file_bytes;       /*!< Written IPFIX bytes */
+};
+
+/**
+ * \def ACCT_UPDATE
+ * \brief Count an inner packet, peer is only evaluated if enabled.
+ */
+#define ACCT_UPDATE(state, pkt, len, peer, dir) \
+   do { if ((state)->acct) \
+           acct_update((state)->acct, pkt, len, peer, dir); } while (0)
+
+/**
+ * \fn struct acct *acct_new(uint32_t flows, uint16_t idle, uint16_t active,
+ *                           const char *file)
+ * \brief Allocate a flow table.
+ *
+ * \param flows The amount of concurrent flows to account for
+ * \param idle Idle timeout (sec), 0 for ACCT_IDLE
+ * \param active Active timeout (sec), 0 for ACCT_ACTIVE
+ * \param file The IPFIX file or NULL not to export
+ * \return The table
+ */
+struct acct *acct_new(uint32_t flows, uint16_t idle, uint16_t active,
+                      const char *file);
+
+/**
+ * \fn struct acct *init_acct(struct tun_state *state)
+ * \brief Allocate the table of the program, register its stats section
+ *        and start the expiry thread.
+ *
+ * \param state The program state
+ * \return The table, NULL if acct-flows is 0
+ */
+struct acct *init_acct(struct tun_state *state);
+
+/**
+ * \fn void acct_free(struct acct *a)
+ * \brief Export all entries and free a table.
+ *
+ * \param a The table
+ */
+void acct_free(struct acct *a);
+
+/**
+ * \fn void acct_update(struct acct *a, const char *pkt, int len, int peer, int dir)
+ * \brief Count an inner packet.
+ *
+ * \param a The table
+ * \param pkt The inner IP packet
+ * \param len The packet length
+ * \param peer The peer (tunnel source port)
+ * \param dir ACCT_TX or ACCT_RX
+ */
+void acct_update(struct acct *a, const char *pkt, int len, int peer, int dir);
+
+/**
+ * \fn uint32_t acct_expire(struct acct *a, uint64_t now, int all)
+ * \brief Remove and export the idle entries, report the active ones.
+ *
+ * \param a The table
+ * \param now The current time (ms since epoch)
+ * \param all 1 to remove all entries (ACCT_FORCED_END)
+ * \return The amount of removed entries
+ */
+uint32_t acct_expire(struct acct *a, uint64_t now, int all);
+
+/**
+ * \fn static inline uint64_t acct_now()
+ * \brief The coarse current time (ms since epoch), a vDSO call on Linux.
+ */
+static inline uint64_t acct_now() {
+   struct timespec ts;
+#if defined(CLOCK_REALTIME_COARSE)
+   clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+   clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+   return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+#endif
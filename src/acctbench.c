@@ -0,0 +1,160 @@
+/**
+ * \file acctbench.c
+ * \brief Flow accounting table benchmark (make bench-acct).
+ *
+ *    Inserts one packet of each of 1M distinct UDP flows in the table,
+ *    then counts packets of randomly chosen flows, then expires all the
+ *    flows as idle and exports them. Reports the cost per insertion,
+ *    update and export, the resident memory per flow and the IPFIX
+ *    output size as JSON, and exits non-zero if some packet was not
+ *    accounted for.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "sock.h"
+#include "acct.h"
+#include "bench.h"
+
+/**
+ * \def BENCH_FLOWS
+ * \brief The default amount of concurrent flows.
+ */
+#define BENCH_FLOWS 1000000
+
+/**
+ * \def BENCH_UPDATES
+ * \brief The default amount of packets of existing flows.
+ */
+#define BENCH_UPDATES 10000000
+
+/**
+ * \def BENCH_LEN
+ * \brief The packet length.
+ */
+#define BENCH_LEN 100
+
+/**
+ * \fn static void fill(char *pkt, uint32_t i)
+ * \brief Write the addresses and ports of flow i in a UDP/IPv4 packet.
+ */
+static void fill(char *pkt, uint32_t i);
+
+/**
+ * \fn static void usage(const char *prog)
+ * \brief Print usage and exit.
+ */
+static void usage(const char *prog);
+
+void fill(char *pkt, uint32_t i) {
+   uint32_t src = htonl(0x0a000000 | (i >> 16));
+   uint16_t sport = htons(i & 0xffff);
+   memcpy(pkt+12, &src, 4);
+   memcpy(pkt+20, &sport, 2);
+}
+
+void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [-n flows] [-u updates] [-o records.ipfix]\n",
+           prog);
+   exit(2);
+}
+
+int main(int argc, char **argv) {
+   uint32_t flows = BENCH_FLOWS, updates = BENCH_UPDATES;
+   char *out = NULL;
+   int opt;
+   while ((opt = getopt(argc, argv, "n:u:o:")) != -1) {
+      switch (opt) {
+         case 'n': flows   = strtoul(optarg, NULL, 10); break;
+         case 'u': updates = strtoul(optarg, NULL, 10); break;
+         case 'o': out     = optarg; break;
+         default:  usage(argv[0]);
+      }
+   }
+   if (!flows || flows > (1U << 24))
+      usage(argv[0]);
+
+   char file[] = "/tmp/acctbench.XXXXXX";
+   if (!out) {
+      int fd = mkstemp(file);
+      if (fd < 0)
+         die("mkstemp");
+      close(fd);
+   }
+
+   /* UDP/IPv4 10.x.y.z:port > 10.255.0.1:5001 */
+   char pkt[BENCH_LEN];
+   uint32_t dst = htonl(0x0aff0001);
+   uint16_t dport = htons(5001);
+   memset(pkt, 0, sizeof(pkt));
+   pkt[0] = 0x45;
+   pkt[9] = IPPROTO_UDP;
+   memcpy(pkt+16, &dst, 4);
+   memcpy(pkt+22, &dport, 2);
+
+   long rss_base = rss_kb("VmRSS");
+   struct acct *a = acct_new(flows, 0, 0, out ? out : file);
+
+   double t0 = now();
+   for (uint32_t i=0; i<flows; i++) {
+      fill(pkt, i);
+      acct_update(a, pkt, BENCH_LEN, 20000 + (i & 63), ACCT_TX);
+   }
+   double t1 = now();
+   long rss_full = rss_kb("VmRSS");
+
+   uint64_t x = 0x9e3779b97f4a7c15ULL;
+   for (uint32_t u=0; u<updates; u++) {
+      x ^= x >> 12;
+      x ^= x << 25;
+      x ^= x >> 27;
+      uint32_t i = (x * 0x2545f4914f6cdd1dULL >> 32) % flows;
+      fill(pkt, i);
+      acct_update(a, pkt, BENCH_LEN, 20000 + (i & 63), ACCT_TX);
+   }
+   double t2 = now();
+
+   /* all flows are idle an hour later */
+   uint32_t removed = acct_expire(a, acct_now() + 3600 * 1000, 0);
+   double t3 = now();
+
+   uint64_t inserted = 0, dropped = 0;
+   for (int s=0; s<ACCT_SHARDS; s++) {
+      inserted += a->shards[s].inserted;
+      dropped  += a->shards[s].dropped;
+   }
+   uint64_t pkts = (uint64_t)flows + updates;
+   int ok = inserted == flows && !dropped && removed == flows &&
+            a->records == flows && a->exp_pkts == pkts &&
+            a->exp_bytes == pkts * BENCH_LEN;
+
+   printf("{\n");
+   printf("  \"flows\": %u,\n", flows);
+   printf("  \"updates\": %u,\n", updates);
+   printf("  \"insert_ns\": %.1f,\n", (t1 - t0) / flows);
+   printf("  \"update_ns\": %.1f,\n", updates ? (t2 - t1) / updates : 0);
+   printf("  \"export_ns\": %.1f,\n", (t3 - t2) / flows);
+   printf("  \"records\": %llu,\n", (unsigned long long)a->records);
+   printf("  \"dropped_pkts\": %llu,\n", (unsigned long long)dropped);
+   printf("  \"ipfix_bytes\": %llu,\n", (unsigned long long)a->file_bytes);
+   printf("  \"rss_bytes_per_flow\": %ld,\n", rss_base >= 0 && rss_full >= 0 ?
+          (rss_full - rss_base) * 1024 / (long)flows : -1);
+   printf("  \"entry_bytes\": %zu,\n", sizeof(struct acct_entry));
+   printf("  \"ok\": %s\n", ok ? "true" : "false");
+   printf("}\n");
+
+   acct_free(a);
+   if (!out)
+      unlink(file);
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/**
+ * \file batch.c
+ * \brief Adaptive batching of the forwarding loops.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "batch.h"
+#include "debug.h"
+#include "timing.h"
+#include "stats.h"
+#include "txring.h"
+#include "udptun.h"
+
+/**
+ * \fn static int half_full(struct pkt_queue *q)
+ * \brief Check if a retry queue is more than half full.
+ */
+static int half_full(struct pkt_queue *q);
+
+/**
+ * \fn static void batch_stats(FILE *fp, void *arg)
+ * \brief Dump the controller decisions.
+ */
+static void batch_stats(FILE *fp, void *arg);
+
+int half_full(struct pkt_queue *q) {
+   return q && q->len > q->size / 2;
+}
+
+struct batch *init_batch(uint16_t max, uint32_t latency) {
+   if (!max)
+      return NULL;
+   struct batch *b = calloc(1, sizeof(struct batch));
+   b->max     = max;
+   b->latency = latency ? latency : BATCH_DEFAULT_LATENCY;
+   b->size    = 1;
+   b->t_win   = monotonic_us();
+   stats_register("batch", batch_stats, b);
+   debug_print("batch: max %u, latency %lldus\n", b->max,
+               (long long)b->latency);
+   return b;
+}
+
+void batch_round(struct tun_state *state, uint32_t pkts) {
+   struct batch *b = state->batch;
+   if (!b)
+      return;
+   b->win_pkts += pkts;
+   int64_t now = monotonic_us(), elapsed = now - b->t_win;
+   if (elapsed < BATCH_WINDOW_US)
+      return;
+
+   /* rate estimate, restarted after an idle period */
+   double rate = b->win_pkts * 1e6 / elapsed;
+   if (!b->windows || elapsed > 8 * BATCH_WINDOW_US)
+      b->rate = rate;
+   else
+      b->rate += (rate - b->rate) / 4;
+   b->t_win    = now;
+   b->win_pkts = 0;
+   b->windows++;
+
+   /* read batch: the arrivals within half the target */
+   double want = b->rate * b->latency / 2e6;
+   uint16_t size = want < 1 ? 1 : want > b->max ? b->max : (uint16_t)want;
+   if (half_full(state->txq_tun) || half_full(state->txq_net)) {
+      size = max(size / 2, 1);
+      b->backpressure++;
+   }
+   if (size > b->size)
+      b->grows++;
+   else if (size < b->size)
+      b->shrinks++;
+   b->size = size;
+
+   /* aggregate the tx-ring frames only when batches form */
+   b->flush = size > 1 ? b->latency / 2 : 0;
+
+   /* poll or block */
+   uint8_t poll = b->rate >= BATCH_POLL_RATE;
+   if (poll != b->poll) {
+      if (poll)
+         b->poll_on++;
+      else
+         b->poll_off++;
+      b->poll   = poll;
+      b->t_idle = 0;
+   }
+
+   int i = 0;
+   while (i < BATCH_HIST - 1 && size >> (i + 1))
+      i++;
+   b->hist[i]++;
+}
+
+void batch_kick(struct tun_state *state) {
+   struct txring *r = state->txq_net->ring;
+   struct batch *b = state->batch;
+   if (!r)
+      return;
+   if (!b || !b->flush) {
+      txring_kick(r);
+      return;
+   }
+   if (!r->pending) {
+      b->t_pending = 0;
+      return;
+   }
+
+   int64_t now = monotonic_us();
+   if (!b->t_pending)
+      b->t_pending = now;
+   if (r->pending >= b->size)
+      b->kick_size++;
+   else if (now - b->t_pending >= b->flush)
+      b->kick_timeout++;
+   else
+      return;
+   txring_kick(r);
+   b->t_pending = 0;
+}
+
+int64_t batch_wait(struct tun_state *state, int64_t now) {
+   struct batch *b = state->batch;
+   int64_t wait = -1;
+   if (b->poll && (!b->t_idle || now - b->t_idle < b->latency / 2))
+      return 0;
+
+   /* wake up for the flush timeout */
+   struct txring *r = state->txq_net->ring;
+   if (r && r->pending && b->flush && b->t_pending)
+      wait = max(b->t_pending + b->flush - now, (int64_t)0);
+   return wait;
+}
+
+void batch_woke(struct batch *b, int sel, int64_t wait, int64_t now) {
+   if (wait)
+      b->blocks++;
+   if (sel > 0) {
+      b->t_idle = 0;
+   } else if (!wait) {
+      b->polls++;
+      if (!b->t_idle)
+         b->t_idle = now;
+   }
+}
+
+void batch_stats(FILE *fp, void *arg) {
+   struct batch *b = arg;
+   fprintf(fp, "max %u\n", b->max);
+   fprintf(fp, "latency_us %lld\n", (long long)b->latency);
+   fprintf(fp, "rate %.0f\n", b->rate);
+   fprintf(fp, "size %u\n", b->size);
+   fprintf(fp, "flush_us %lld\n", (long long)b->flush);
+   fprintf(fp, "poll %u\n", b->poll);
+   fprintf(fp, "windows %llu\n", (unsigned long long)b->windows);
+   fprintf(fp, "grows %llu\n", (unsigned long long)b->grows);
+   fprintf(fp, "shrinks %llu\n", (unsigned long long)b->shrinks);
+   fprintf(fp, "backpressure %llu\n", (unsigned long long)b->backpressure);
+   fprintf(fp, "poll_on %llu\n", (unsigned long long)b->poll_on);
+   fprintf(fp, "poll_off %llu\n", (unsigned long long)b->poll_off);
+   fprintf(fp, "polls %llu\n", (unsigned long long)b->polls);
+   fprintf(fp, "blocks %llu\n", (unsigned long long)b->blocks);
+   fprintf(fp, "kick_size %llu\n", (unsigned long long)b->kick_size);
+   fprintf(fp, "kick_timeout %llu\n", (unsigned long long)b->kick_timeout);
+   for (int i=0; i<BATCH_HIST; i++)
+      fprintf(fp, "size%u.windows %llu\n", 1u << i,
+              (unsigned long long)b->hist[i]);
+}
@@ -0,0 +1,159 @@
+/**
+ * \file batch.h
+ * \brief Adaptive batching of the forwarding loops.
+ *
+ *    The controller measures the packet arrival rate of the main loop
+ *    (EWMA over BATCH_WINDOW_US windows) and the occupancy of the retry
+ *    queues, and splits the batch-latency target between:
+ *    - the read batch: the amount of packets read from a ready fd per
+ *      select() wake-up, i.e. the packets expected within half the
+ *      target, up to batch-max, halved while a retry queue is more
+ *      than half full;
+ *    - the aggregation flush timeout: tx-ring frames are sent once a
+ *      batch is pending or the oldest frame waited half the target;
+ *    - poll or block: above BATCH_POLL_RATE pkts/s the loop polls
+ *      select() without blocking for up to half the target before
+ *      blocking again.
+ *    At low load this is one read per wake-up, an immediate flush and
+ *    a blocking select(), as without the controller. The decisions
+ *    are counted in the "batch" stats section.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_BATCH_H
+#define UDPTUN_BATCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "state.h"
+#include "queue.h"
+
+/**
+ * \def BATCH_WINDOW_US
+ * \brief The rate estimation window (us).
+ */
+#define BATCH_WINDOW_US 1000
+
+/**
+ * \def BATCH_DEFAULT_LATENCY
+ * \brief The default latency target (us).
+ */
+#define BATCH_DEFAULT_LATENCY 200
+
+/**
+ * \def BATCH_POLL_RATE
+ * \brief The arrival rate above which the loop polls (pkts/s).
+ */
+#define BATCH_POLL_RATE 20000
+
+/**
+ * \def BATCH_HIST
+ * \brief Batch size histogram buckets (powers of 2).
+ */
+#define BATCH_HIST 8
+
+/**
+ * \struct batch
+ *	\brief The controller state and decisions.
+ */
+struct batch {
+   uint16_t max;           /*!< The maximal read batch */
+   int64_t  latency;       /*!< The latency target (us) */
+
+   double   rate;          /*!< The arrival rate estimate (pkts/s) */
+   int64_t  t_win;         /*!< The current window start (us) */
+   uint32_t win_pkts;      /*!< Packets read in the current window */
+   uint16_t size;          /*!< The read batch */
+   int64_t  flush;         /*!< The aggregation flush timeout (us) */
+   uint8_t  poll;          /*!< 1 to poll select() */
+   int64_t  t_idle;        /*!< Start of the current empty polls (us), 0 if none */
+   int64_t  t_pending;     /*!< Since when frames are pending (us), 0 if none */
+
+   uint64_t windows;       /*!< Estimation windows */
+   uint64_t grows;         /*!< Read batch increases */
+   uint64_t shrinks;       /*!< Read batch decreases */
+   uint64_t backpressure;  /*!< Windows with a half full retry queue */
+   uint64_t poll_on;       /*!< Switches to polling */
+   uint64_t poll_off;      /*!< Switches to blocking */
+   uint64_t polls;         /*!< Empty non-blocking select() */
+   uint64_t blocks;        /*!< Blocking select() */
+   uint64_t kick_size;     /*!< tx-ring flushes on a full batch */
+   uint64_t kick_timeout;  /*!< tx-ring flushes on the flush timeout */
+   uint64_t hist[BATCH_HIST]; /*!< Windows per read batch (1, 2-3, 4-7, ...) */
+};
+
+/**
+ * \fn struct batch *init_batch(uint16_t max, uint32_t latency)
+ * \brief Create the controller and register its stats section.
+ *
+ * \param max The maximal read batch, 0 to disable
+ * \param latency The latency target (us), 0 for BATCH_DEFAULT_LATENCY
+ * \return The controller, NULL if disabled
+ */
+struct batch *init_batch(uint16_t max, uint32_t latency);
+
+/**
+ * \fn void batch_round(struct tun_state *state, uint32_t pkts)
+ * \brief Account the packets read by a loop round and, once per
+ *        window, update the decisions.
+ *
+ * \param state The program state
+ * \param pkts The packets read by the round
+ */
+void batch_round(struct tun_state *state, uint32_t pkts);
+
+/**
+ * \fn void batch_kick(struct tun_state *state)
+ * \brief Flush the tx-ring if its frames are due.
+ *
+ * \param state The program state
+ */
+void batch_kick(struct tun_state *state);
+
+/**
+ * \fn int64_t batch_wait(struct tun_state *state, int64_t now)
+ * \brief The select() timeout wanted by the controller.
+ *
+ * \param state The program state
+ * \param now The monotonic time (us)
+ * \return 0 to poll, the time to the flush timeout (us), -1 for none
+ */
+int64_t batch_wait(struct tun_state *state, int64_t now);
+
+/**
+ * \fn void batch_woke(struct batch *b, int sel, int64_t wait, int64_t now)
+ * \brief Account a select() return.
+ *
+ * \param b The controller
+ * \param sel The select() return value
+ * \param wait The timeout passed to select() (us), -1 for none
+ * \param now The monotonic time (us)
+ */
+void batch_woke(struct batch *b, int sel, int64_t wait, int64_t now);
+
+/**
+ * \fn static inline int batch_size(struct tun_state *state)
+ * \brief The current read batch.
+ */
+static inline int batch_size(struct tun_state *state) {
+   return state->batch ? state->batch->size : 1;
+}
+
+/**
+ * \def BATCH_READ(state, q, pkts, call)
+ * \brief Repeat a read handler up to the read batch, while it reads a
+ *        packet and the retry queue q has room, and count the packets.
+ */
+#define BATCH_READ(state, q, pkts, call) do {                  \
+   int _n = batch_size(state);                                 \
+   while (_n-- > 0 && (call) > 0) {                            \
+      (pkts)++;                                                \
+      if (queue_full(q))                                       \
+         break;                                                \
+   }                                                           \
+} while (0)
+
+#endif
@@ -0,0 +1,59 @@
+/**
+ * \file bench.h
+ * \brief Helpers shared by the benchmark programs.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_BENCH_H
+#define UDPTUN_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "timing.h"
+
+/**
+ * \fn static inline uint64_t rnd()
+ * \brief xorshift64* pseudo-random generator, fixed seed.
+ */
+static inline uint64_t rnd() {
+   static uint64_t x = 0x9e3779b97f4a7c15ULL;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   return x * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * \fn static inline double now()
+ * \brief Monotonic time in ns.
+ */
+static inline double now() {
+   return monotonic_ns();
+}
+
+/**
+ * \fn static inline long rss_kb(const char *field)
+ * \brief Read a VmRSS/VmHWM field of /proc/self/status (kB), -1 if unknown.
+ */
+static inline long rss_kb(const char *field) {
+   FILE *fp = fopen("/proc/self/status", "r");
+   char line[256];
+   long kb = -1;
+   size_t len = strlen(field);
+   if (!fp)
+      return -1;
+   while (fgets(line, sizeof(line), fp))
+      if (!strncmp(line, field, len) && line[len] == ':') {
+         kb = strtol(line + len + 1, NULL, 10);
+         break;
+      }
+   fclose(fp);
+   return kb;
+}
+
+#endif
@@ -24,6 +24,18 @@
 #include "sock.h"
 #include "net.h"
 #include "xpcap.h"
+#include "queue.h"
+#include "impair.h"
+#include "startup.h"
+#include "batch.h"
+#include "spread.h"
+#include "rss.h"
+#include "lpm.h"
+#include "ecn.h"
+#include "perf.h"
+#include "hh.h"
+#include "acct.h"
+#include "family.h"
 
 /**
  * \var static volatile int loop
@@ -32,33 +44,47 @@
 static volatile int loop;
 
 /**
- * \fn static void tun_cli_in(int fd_net, int fd_tun, struct sockaddr_in *udp_addr, char *buf)
- * \brief Forward a packet in the tunnel.
+ * \fn static int tun_cli_in(int fd_tun, int fd_net4, int fd_net6, struct tun_state *state, char *buf)
+ * \brief Read a packet from tun and forward it in the tunnel.
  *
- * \param fd_net The udp socket fd.
  * \param fd_tun The tun interface fd.
- * \param udp_addr The address of the udp target.
+ * \param fd_net4 The v4 udp socket fd or -1.
+ * \param fd_net6 The v6 udp socket fd or -1.
+ * \param state The client state.
  * \param buf The buffer.
+ * \return 1 if a packet was read, 0 otherwise
  */ 
-static void tun_cli_in(int fd_tun, int fd_net4,  int fd_net6,
+static int tun_cli_in(int fd_tun, int fd_net4,  int fd_net6,
                        struct tun_state *state, char *buf);
-static void tun_cli_in4(int fd_net, int fd_tun, 
-                        struct tun_state *state, char *buf);
-static void tun_cli_in6(int fd_net, int fd_tun, 
-                        struct tun_state *state, char *buf);
-static void tun_cli_in4_aux(int fd_net, struct tun_state *state, char *buf, int recvd);
-static void tun_cli_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd);
 
 /**
- * \fn static void tun_cli_out4(int fd_net, int fd_tun, char *buf)
+ * \fn static void tun_cli_in_aux(int fd_net, struct pkt_queue *txq, struct tun_state *state, const struct ip_family *f, char *buf, int recvd)
+ * \brief Forward a packet in the tunnel (rss_send_t).
+ *
+ * \param fd_net The udp socket fd of the packet family.
+ * \param txq The retry queue.
+ * \param state The client state.
+ * \param f The packet family.
+ * \param buf The packet.
+ * \param recvd The packet length.
+ */ 
+static void tun_cli_in_aux(int fd_net, struct pkt_queue *txq, 
+                           struct tun_state *state, const struct ip_family *f,
+                           char *buf, int recvd);
+
+/**
+ * \fn static int tun_cli_out(int fd_net, int fd_tun, struct tun_state *state, const struct ip_family *f, char *buf)
  * \brief Forward a packet out of the tunnel.
  *
  * \param fd_net The udp socket fd.
  * \param fd_tun The tun interface fd.
+ * \param state The client state.
+ * \param f The socket family.
  * \param buf The buffer. 
+ * \return 1 if a datagram was read, 0 otherwise
  */ 
-static void tun_cli_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf);
-static void tun_cli_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf);
+static int tun_cli_out(int fd_net, int fd_tun, struct tun_state *state, 
+                        const struct ip_family *f, char *buf);
 
 static void tun_cli_single(struct arguments *args);
 static void tun_cli_dual(struct arguments *args);
@@ -81,152 +107,107 @@ void tun_cli(struct arguments *args) {
       tun_cli_single(args);
 }
 
-void tun_cli_in(int fd_tun, int fd_net4, int fd_net6,
-                struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
-   debug_print("recvd %db from tun\n", recvd);
-
-   switch (buf[0] & 0xf0) {
-      case 0x40:
-         tun_cli_in4_aux(fd_net4, state, buf, recvd);
-         break;
-      case 0x60:
-         tun_cli_in6_aux(fd_net6, state, buf, recvd);
-         break;
-      default:
-         debug_print("non-ip proto:%d\n", buf[0]);
-         break;
-   }
-}
-
-void tun_cli_in6(int fd_net, int fd_tun, 
-                 struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
-   debug_print("recvd %db from tun\n", recvd);
-   tun_cli_in6_aux(fd_net, state, buf, recvd);
-}
-
-void tun_cli_in4(int fd_net, int fd_tun, 
-                 struct tun_state *state, char *buf) {
+int tun_cli_in(int fd_tun, int fd_net4, int fd_net6,
+               struct tun_state *state, char *buf) {
+   PERF_BEGIN(PERF_TUN_READ);
    int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   PERF_END(PERF_TUN_READ, 1);
    debug_print("recvd %db from tun\n", recvd);
-   tun_cli_in4_aux(fd_net, state, buf, recvd);
-}
-
-void tun_cli_in4_aux(int fd_net, struct tun_state *state, char *buf, int recvd) {
-
-   /* lookup initial server database from file */
-   struct tun_rec *rec = NULL; 
-   in_addr_t priv_addr4 = (int) *((uint32_t *)(buf+16));
-   debug_print("%s\n", inet_ntoa((struct in_addr){priv_addr4}));
-
-   /* lookup private addr */
-   if ( (rec = g_hash_table_lookup(state->cli4, &priv_addr4)) ) {
-
-      /* Remove PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         recvd-=4;
-         memmove(buf, buf+4, recvd);
-      }
-      /* Add layer 4.5 header */
-      if (state->raw_header) {
-         buf -= state->raw_header_size;
-         recvd += state->raw_header_size;
-      }
-
-      int sent = xsendto4(fd_net, rec->sa4, buf, recvd);
-      debug_print("cli: wrote %dB to internet\n",sent);
+   if (recvd <= 0)
+      return 0;
 
+   const struct ip_family *f = ip_family_of(state, buf);
+   int fd_net = !f ? -1 : f->v6 ? fd_net6 : fd_net4;
+   if (fd_net >= 0) {
+      tun_cli_in_aux(fd_net, state->txq_net, state, f, buf, recvd);
    } else {
-      debug_print("lookup failed proto:%d sport:%d dport:%d\n", 
-                   (int) *((uint8_t *)(buf+9)), 
-                   (int) ntohs( *((uint16_t *)(buf+20)) ), 
-                   (int)ntohs( *((uint16_t *)(buf+22)) ));
+      debug_print("non-ip proto:%d\n", buf[0]);
    }
+   return 1;
 }
 
-void tun_cli_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd) {
-   struct tun_rec *rec = NULL; 
+void tun_cli_in_aux(int fd_net, struct pkt_queue *txq, 
+                    struct tun_state *state, const struct ip_family *f,
+                    char *buf, int recvd) {
+   if (recvd <= 0)
+      return;
 
-   /* lookup initial server database from file */
-   char priv_addr6[16], str_addr6[INET6_ADDRSTRLEN];
-   memcpy(priv_addr6, buf+24, 16);
-   debug_print("%s\n", inet_ntop(AF_INET6, priv_addr6, 
-                         str_addr6, INET6_ADDRSTRLEN));
-
-   /* lookup private addr */
-   if ( (rec = g_hash_table_lookup(state->cli6, priv_addr6)) ) {
+   /* Remove PlanetLab TUN PPI header */
+   if (state->planetlab) {
+      recvd-=4;
+      memmove(buf, buf+4, recvd);
+   }
 
-      /* Remove PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         recvd-=4;
-         memmove(buf, buf+4, recvd);
-      }
+   /* lookup private prefix */
+   PERF_BEGIN(PERF_LOOKUP);
+   struct tun_rec *rec = cli_lookup(state, f, buf);
+   PERF_END(PERF_LOOKUP, 1);
+   if (rec) {
+
+      PERF_BEGIN(PERF_ENCAP);
+      int tos = ecn_encap(state, buf);
+      HH_UPDATE(buf, recvd, rec->sport, HH_TX);
+      ACCT_UPDATE(state, buf, recvd, rec->sport, ACCT_TX);
+      /* Pick the source port of this flow */
+      if (state->port_range > 1)
+         fd_net = spread_fds(state, f)[spread_offset(state, buf)];
       /* Add layer 4.5 header */
       if (state->raw_header) {
          buf -= state->raw_header_size;
          recvd += state->raw_header_size;
       }
+      PERF_END(PERF_ENCAP, 1);
 
-      int sent = xsendto6(fd_net, rec->sa6, buf, recvd);
-      debug_print("cli: wrote %dB to udp\n",sent);
+      PERF_BEGIN(PERF_SEND);
+      int sent = queue_sendto(txq, fd_net, rec->sport, rec_sa(rec, f), 
+                                  f->salen, tos, buf, recvd);
+      PERF_END(PERF_SEND, 1);
+      debug_print("cli: wrote %dB to internet\n",sent);
 
    } else {
       debug_print("lookup failed proto:%d sport:%d dport:%d\n", 
-                   (int) *((uint8_t *)(buf+6)), 
-                   (int) ntohs( *((uint16_t *)(buf+40)) ), 
-                   (int)ntohs( *((uint16_t *)(buf+42)) ));
+                   (int) *((uint8_t *)(buf+f->proto)), 
+                   ip_port(f, buf, 0), ip_port(f, buf, 1));
    }
 }
 
-void tun_cli_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
-   int recvd = xrecv(fd_net, buf, BUFF_SIZE);
-
-   if (recvd > MIN_PKT_SIZE) {
-      debug_print("cli: recvd %dB from internet\n", recvd);
-
-      /* Remove layer 4.5 header */
-      if (state->raw_header) {
-         if (!state->udp)
-            recvd -= 20; 
-         recvd -= state->raw_header_size;
-         memmove(buf, buf+state->raw_header_size, recvd);
-      }
-      /* Add PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         buf-=4; recvd+=4;
-      }
-
-      int sent = xwrite(fd_tun, buf, recvd);
-      debug_print("cli: wrote %dB to tun\n", sent);
-   } else if (recvd < 0) {
-      /* recvd ICMP msg */
-      xrecverr(fd_net, buf, BUFF_SIZE, 0, NULL);
-   } else {
-      /* recvd unknown packet */
-      debug_print("recvd empty pkt\n");
-   }   
-}
-
-void tun_cli_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
-   int recvd = xrecv(fd_net, buf, BUFF_SIZE);
+int tun_cli_out(int fd_net, int fd_tun, struct tun_state *state, 
+                const struct ip_family *f, char *buf) {
+   PERF_BEGIN(PERF_RECV);
+   int tos, recvd = xrecvtos(fd_net, NULL, NULL, buf, BUFF_SIZE, &tos);
+   PERF_END(PERF_RECV, 1);
+   int ret = recvd > 0;
 
    if (recvd > MIN_PKT_SIZE) {
       debug_print("cli: recvd %dB from internet\n", recvd);
 
+      PERF_BEGIN(PERF_DECAP);
       /* Remove layer 4.5 header */
       if (state->raw_header) {
          if (!state->udp)
-            recvd -= 40; 
+            recvd -= f->hdr_len; 
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* Combine the outer ECN field */
+      if (ecn_decap(tos, buf, recvd) < 0)
+         return ret;
+      /* The server port the packet came from, only looked up when
+       * counted or matched against a per-peer tun impairment */
+      int from = 0;
+      if (hh_on || state->acct || (state->impair_tun && state->impair_tun->map))
+         from = hh_peer(state, buf);
+      HH_UPDATE(buf, recvd, from, HH_RX);
+      ACCT_UPDATE(state, buf, recvd, from, ACCT_RX);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
+      PERF_END(PERF_DECAP, 1);
 
-      int sent = xwrite(fd_tun, buf, recvd);
+      PERF_BEGIN(PERF_TUN_WRITE);
+      int sent = queue_write(state->txq_tun, fd_tun, from, buf, recvd);
+      PERF_END(PERF_TUN_WRITE, 1);
       debug_print("cli: wrote %dB to tun\n", sent);
    } else if (recvd < 0) {
       /* recvd ICMP msg */
@@ -235,20 +216,26 @@ void tun_cli_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
       /* recvd unknown packet */
       debug_print("recvd empty pkt\n");
    }   
+   return ret;
 }
 
 void tun_cli_single(struct arguments *args) {
    int fd_tun = 0, fd_net = 0; 
-   void (*tun_cli_in_func)(int,int,struct tun_state*,char*);
-   void (*tun_cli_out_func)(int,int,struct tun_state*,char*);
 
    /* init state */
    struct tun_state *state = init_tun_state(args);
+   const struct ip_family *f = state->ipv6 ? &ip_family6 : &ip_family4;
+   int fd_net4 = -1, fd_net6 = -1;
 
-   /* create tun if and sockets */   
-   tun(state, &fd_tun);
+   /* configure the tun if and set up the capture while the sockets
+      are created */
+   pthread_t tun_th = tun_async(state, &fd_tun);
+   xthread_create(capture_notun, (void *) state, 1);
+   int64_t t = startup_now();
    if (state->ipv6) {
-      if (state->udp)
+      if (state->udp && state->rss_workers)
+         fd_net = udp_reuse_sock6(state->port, state->public_addr6, 1);
+      else if (state->udp)
          fd_net = udp_sock6(state->port, 1, state->public_addr6);
       else
          fd_net = raw_sock6(state->port, state->public_addr6, 
@@ -256,10 +243,11 @@ void tun_cli_single(struct arguments *args) {
                                     state->port, 0), 
                              state->default_if, state->protocol_num, 
                             1, state->planetlab);
-      tun_cli_in_func = &tun_cli_in6;
-      tun_cli_out_func = &tun_cli_out6;
+      fd_net6 = fd_net;
    } else {
-      if (state->udp)
+      if (state->udp && state->rss_workers)
+         fd_net = udp_reuse_sock4(state->port, state->public_addr4, 1);
+      else if (state->udp)
          fd_net = udp_sock4(state->port, 1, state->public_addr4);
       else
          fd_net = raw_sock4(state->port, state->public_addr4, 
@@ -267,22 +255,38 @@ void tun_cli_single(struct arguments *args) {
                                     state->port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
-      tun_cli_in_func = &tun_cli_in4;
-      tun_cli_out_func = &tun_cli_out4;
+      fd_net4 = fd_net;
    }
 
-   /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
+   /* spread source ports */
+   int *fds_net = &fd_net;
+   if (state->port_range > 1) {
+      if (state->ipv6)
+         fds_net = state->spread6 = spread_socks(state, fd_net, 1, state->port, 
+                                                 state->public_addr6);
+      else
+         fds_net = state->spread4 = spread_socks(state, fd_net, 0, state->port, 
+                                                 state->public_addr4);
+   }
+
+   startup_phase("sockets", t);
+   pthread_join(tun_th, NULL);
+
+   /* wait for the capture threads */
    synchronize();
 
    /* run client */
    debug_print("running cli ...\n");    
    xthread_create(cli_thread, (void*) state, 1);
 
+   /* dispatch tun to workers */
+   if (state->rss_workers)
+      state->rss = init_rss(state, fd_tun, fd_net4, fd_net6, &tun_cli_in_aux);
+
    /* init select loop */
-   fd_set input_set;
+   fd_set input_set, output_set;
    struct timeval tv;
-   int sel = 0, fd_max = 0;
+   int sel = 0, fd_max = 0, fd_out = 0;
    char inbuf[BUFF_SIZE], outbuf[BUFF_SIZE];
    char *inbuffer, *outbuffer;
    inbuffer = inbuf;
@@ -302,36 +306,55 @@ void tun_cli_single(struct arguments *args) {
    loop = 1;
    signal(SIGINT, cli_shutdown);
    signal(SIGTERM, cli_shutdown);
+   perf_thread("main");
+   startup_mark("forwarding");
 
    while (loop) {
       FD_ZERO(&input_set);
-      FD_SET(fd_net, &input_set);
-      FD_SET(fd_tun, &input_set);
+      if (!queue_full(state->txq_tun))
+         fd_max = max(fd_max, spread_fd_set(state, fds_net, &input_set));
+      if (!state->rss && !queue_full(state->txq_net))
+         FD_SET(fd_tun, &input_set);
+
+      FD_ZERO(&output_set);
+      fd_out = queues_fd_set(state, &output_set);
 
-      sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
+      sel = impair_select(state, &input_set, &output_set,
+                          max(fd_max, fd_out), &tv, state->inactivity_timeout);
 
       if (sel == 0) {
          debug_print("timeout\n"); 
          break;
       } else if (sel > 0) {
-         if (FD_ISSET(fd_tun, &input_set)) { 
-            (*tun_cli_in_func)(fd_net, fd_tun, state, inbuffer);}
-         if (FD_ISSET(fd_net, &input_set)) 
-            (*tun_cli_out_func)(fd_net, fd_tun, state, outbuffer);
+         uint32_t pkts = 0;
+         queues_flush(state, &output_set);
+         if (FD_ISSET(fd_tun, &input_set))
+            BATCH_READ(state, state->txq_net, pkts,
+                       tun_cli_in(fd_tun, fd_net4, fd_net6, state, inbuffer));
+         for (int i=0; i<state->port_range; i++)
+            if (FD_ISSET(fds_net[i], &input_set)) 
+               BATCH_READ(state, state->txq_tun, pkts,
+                          tun_cli_out(fds_net[i], fd_tun, state, f, outbuffer));
+         batch_round(state, pkts);
       }
    }
 }
 
 void tun_cli_dual(struct arguments *args) {
    int fd_tun = 0, fd_net4 = 0, fd_net6 = 0; 
-   void (*tun_cli_in_func)(int,int,struct tun_state*,char*);
 
    /* init state */
    struct tun_state *state = init_tun_state(args);
 
-   /* create tun if and sockets */   
-   tun(state, &fd_tun);
-   if (state->udp) {
+   /* configure the tun if and set up the capture while the sockets
+      are created */
+   pthread_t tun_th = tun_async(state, &fd_tun);
+   xthread_create(capture_notun, (void *) state, 1);
+   int64_t t = startup_now();
+   if (state->udp && state->rss_workers) {
+      fd_net4 = udp_reuse_sock4(state->public_port, state->public_addr4, 1);
+      fd_net6 = udp_reuse_sock6(state->public_port, state->public_addr6, 1);
+   } else if (state->udp) {
       fd_net4 = udp_sock4(state->public_port, 1, state->public_addr4);
       fd_net6 = udp_sock6(state->public_port, 1, state->public_addr6);
    } else {
@@ -347,18 +370,33 @@ void tun_cli_dual(struct arguments *args) {
                             1, state->planetlab);
    }
 
-   /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
+   /* spread source ports */
+   int *fds_net4 = &fd_net4, *fds_net6 = &fd_net6;
+   if (state->port_range > 1) {
+      fds_net4 = state->spread4 = spread_socks(state, fd_net4, 0, 
+                                   state->public_port, state->public_addr4);
+      fds_net6 = state->spread6 = spread_socks(state, fd_net6, 1, 
+                                   state->public_port, state->public_addr6);
+   }
+
+   startup_phase("sockets", t);
+   pthread_join(tun_th, NULL);
+
+   /* wait for the capture threads */
    synchronize();
 
    /* run client */
    debug_print("running cli ...\n");    
    xthread_create(cli_thread, (void*) state, 1);
 
+   /* dispatch tun to workers */
+   if (state->rss_workers)
+      state->rss = init_rss(state, fd_tun, fd_net4, fd_net6, &tun_cli_in_aux);
+
    /* init select loop */
-   fd_set input_set;
+   fd_set input_set, output_set;
    struct timeval tv;
-   int sel = 0, fd_max = 0;
+   int sel = 0, fd_max = 0, fd_out = 0;
    char inbuf[BUFF_SIZE], outbuf[BUFF_SIZE];
    char *inbuffer, *outbuffer;
    inbuffer = inbuf;
@@ -378,25 +416,44 @@ void tun_cli_dual(struct arguments *args) {
    loop = 1;
    signal(SIGINT, cli_shutdown);
    signal(SIGTERM, cli_shutdown);
+   perf_thread("main");
+   startup_mark("forwarding");
 
    while (loop) {
       FD_ZERO(&input_set);
-      FD_SET(fd_net4, &input_set);
-      FD_SET(fd_net6, &input_set);
-      FD_SET(fd_tun, &input_set);
+      if (!queue_full(state->txq_tun)) {
+         fd_max = max(fd_max, spread_fd_set(state, fds_net4, &input_set));
+         fd_max = max(fd_max, spread_fd_set(state, fds_net6, &input_set));
+      }
+      if (!state->rss && !queue_full(state->txq_net))
+         FD_SET(fd_tun, &input_set);
+
+      FD_ZERO(&output_set);
+      fd_out = queues_fd_set(state, &output_set);
 
-      sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
+      sel = impair_select(state, &input_set, &output_set,
+                          max(fd_max, fd_out), &tv, state->inactivity_timeout);
 
       if (sel == 0) {
          debug_print("timeout\n"); 
          break;
       } else if (sel > 0) {
+         uint32_t pkts = 0;
+         queues_flush(state, &output_set);
          if (FD_ISSET(fd_tun, &input_set))      
-            tun_cli_in(fd_tun, fd_net4, fd_net6, state, inbuffer);
-         if (FD_ISSET(fd_net4, &input_set)) 
-            tun_cli_out4(fd_net4, fd_tun, state, outbuffer);
-         if (FD_ISSET(fd_net6, &input_set)) 
-            tun_cli_out6(fd_net6, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_net, pkts,
+                       tun_cli_in(fd_tun, fd_net4, fd_net6, state, inbuffer));
+         for (int i=0; i<state->port_range; i++) {
+            if (FD_ISSET(fds_net4[i], &input_set)) 
+               BATCH_READ(state, state->txq_tun, pkts,
+                          tun_cli_out(fds_net4[i], fd_tun, state, &ip_family4, 
+                                      outbuffer));
+            if (FD_ISSET(fds_net6[i], &input_set)) 
+               BATCH_READ(state, state->txq_tun, pkts,
+                          tun_cli_out(fds_net6[i], fd_tun, state, &ip_family6, 
+                                      outbuffer));
+         }
+         batch_round(state, pkts);
       }
    }
 }
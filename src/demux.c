@@ -0,0 +1,136 @@
+/**
+ * \file demux.c
+ * \brief Layer 4.5 header classifier.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "demux.h"
+#include "debug.h"
+#include "sock.h"
+#include "stats.h"
+#include "tunalloc.h"
+#include "destruct.h"
+
+/**
+ * \fn static void demux_stats(FILE *fp, void *arg)
+ * \brief Dump the per-experiment counters.
+ *
+ * \param fp The stats file
+ * \param arg The experiments (struct demux *)
+ */
+static void demux_stats(FILE *fp, void *arg);
+
+int demux_add(struct tun_state *state, const char *name, const char *line) {
+   char hex[256], tun_if[256], addr4[256], mask4[256];
+   int sig_len = 0;
+   int ret = sscanf(line, "%255s %d %255s %255s %255s",
+                    hex, &sig_len, tun_if, addr4, mask4);
+   if (ret != 2 && ret != 5) {
+      errno=EINVAL;
+      return -1;
+   }
+   if (!state->demux) {
+      state->demux = calloc(1, sizeof(struct demux));
+      stats_register("demux", demux_stats, state->demux);
+   }
+   struct demux *d = state->demux;
+   if (d->len >= DEMUX_MAX_EXP) {
+      errno=ENOMEM;
+      return -1;
+   }
+
+   struct demux_exp exp;
+   memset(&exp, 0, sizeof(exp));
+   exp.header = parse_raw_header(hex, &exp.header_size);
+   if (sig_len < 0 || sig_len > DEMUX_MAX_SIG || sig_len > exp.header_size) {
+      free(exp.header);
+      errno=EINVAL;
+      return -1;
+   }
+   exp.sig_len = sig_len;
+   memset(&exp.mask, 0xff, sig_len);
+   memcpy(&exp.sig, exp.header, sig_len);
+   exp.name = strdup(name);
+   if (ret == 5) {
+      exp.tun_if        = strdup(tun_if);
+      exp.private_addr4 = strdup(addr4);
+      exp.private_mask4 = strdup(mask4);
+   }
+   d->max_header_size = max(d->max_header_size, exp.header_size);
+
+   /* keep longest signatures first */
+   int i = d->len;
+   while (i > 0 && d->exp[i-1].sig_len < exp.sig_len) {
+      d->exp[i] = d->exp[i-1];
+      i--;
+   }
+   d->exp[i] = exp;
+   d->len++;
+
+   debug_print("experiment %s: header %s, signature %dB\n", name, hex, sig_len);
+   return 0;
+}
+
+void demux_tun(struct tun_state *state, int fd_tun) {
+   struct demux *d = state->demux;
+   if (!d) return;
+
+   for (int i=0; i<d->len; i++) {
+      struct demux_exp *exp = &d->exp[i];
+      exp->fd_tun = fd_tun;
+      if (!exp->private_addr4) continue;
+
+      char *new_if = create_tun4(exp->private_addr4, exp->private_mask4,
+                                 exp->tun_if, &exp->fd_tun);
+      if (new_if) {
+         free(exp->tun_if);
+         exp->tun_if = new_if;
+      }
+      if (exp->fd_tun) {
+         set_fd(exp->fd_tun);
+         set_nonblock(exp->fd_tun);
+      }
+      debug_print("experiment %s on %s\n", exp->name, exp->tun_if);
+   }
+}
+
+int demux_fd_set(struct demux *d, int fd_tun, fd_set *input_set) {
+   int fd_max = 0;
+   for (int i=0; i<d->len; i++) {
+      if (d->exp[i].fd_tun != fd_tun) {
+         FD_SET(d->exp[i].fd_tun, input_set);
+         fd_max = max(fd_max, d->exp[i].fd_tun);
+      }
+   }
+   return fd_max;
+}
+
+void free_demux(struct demux *d) {
+   for (int i=0; i<d->len; i++) {
+      struct demux_exp *exp = &d->exp[i];
+      free(exp->header);
+      free(exp->name);
+      free(exp->tun_if);
+      free(exp->private_addr4);
+      free(exp->private_mask4);
+   }
+   free(d);
+}
+
+void demux_stats(FILE *fp, void *arg) {
+   struct demux *d = arg;
+   fprintf(fp, "unmatched %llu\n", (unsigned long long)d->unmatched);
+   for (int i=0; i<d->len; i++) {
+      struct demux_exp *exp = &d->exp[i];
+      fprintf(fp, "%s.pkts_in %llu\n",  exp->name, (unsigned long long)exp->pkts_in);
+      fprintf(fp, "%s.bytes_in %llu\n", exp->name, (unsigned long long)exp->bytes_in);
+      fprintf(fp, "%s.pkts_out %llu\n", exp->name, (unsigned long long)exp->pkts_out);
+      fprintf(fp, "%s.bytes_out %llu\n",exp->name, (unsigned long long)exp->bytes_out);
+   }
+}
@@ -0,0 +1,172 @@
+/**
+ * \file demux.h
+ * \brief Layer 4.5 header classifier.
+ *
+ *    Several experiments (e.g. SPUD, QUIC, PLUS) can share one server
+ *    port, each one defined by a raw header whose first bytes are used
+ *    as signature. Incoming datagrams are matched against the registered
+ *    signatures, the matching header is stripped and the packet is
+ *    accounted to its experiment and written to its tun device.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_DEMUX_H
+#define UDPTUN_DEMUX_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "state.h"
+
+/**
+ * \def DEMUX_MAX_EXP
+ * \brief The maximal amount of experiments.
+ */
+#define DEMUX_MAX_EXP 16
+
+/**
+ * \def DEMUX_MAX_SIG
+ * \brief The maximal signature length in bytes (one 64-bit word).
+ */
+#define DEMUX_MAX_SIG 8
+
+/**
+ * \struct demux_exp
+ *	\brief An experiment, i.e. a layer 4.5 protocol.
+ */
+struct demux_exp {
+   uint64_t sig;           /*!< The signature word (header prefix) */
+   uint64_t mask;          /*!< The signature mask */
+   uint8_t  sig_len;       /*!< The signature length */
+   uint8_t  header_size;   /*!< The header size */
+   char    *header;        /*!< The raw header, prepended on send */
+   int      fd_tun;        /*!< The tun fd of this experiment */
+
+   char    *name;          /*!< The experiment name */
+   char    *tun_if;        /*!< The dedicated tun interface name or NULL */
+   char    *private_addr4; /*!< The dedicated tun address or NULL */
+   char    *private_mask4; /*!< The dedicated tun mask or NULL */
+
+   uint64_t pkts_in;       /*!< Packets received from the network */
+   uint64_t bytes_in;      /*!< Bytes received from the network */
+   uint64_t pkts_out;      /*!< Packets sent to the network */
+   uint64_t bytes_out;     /*!< Bytes sent to the network */
+};
+
+/**
+ * \struct demux
+ *	\brief The experiments, ordered by decreasing signature length.
+ */
+struct demux {
+   struct demux_exp exp[DEMUX_MAX_EXP]; /*!< The experiments */
+   uint8_t  len;                        /*!< Amount of experiments */
+   uint8_t  max_header_size;            /*!< Largest header size */
+   uint64_t unmatched;                  /*!< Unclassified datagrams */
+};
+
+/**
+ * \fn int demux_add(struct tun_state *state, const char *name, const char *line)
+ * \brief Register an experiment from a cfg line:
+ *          experiment <name> <header-hex> <sig-len> [<tun-if> <addr4> <mask4>]
+ *
+ * \param state The program state
+ * \param name The experiment name
+ * \param line The rest of the cfg line
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+int demux_add(struct tun_state *state, const char *name, const char *line);
+
+/**
+ * \fn void demux_tun(struct tun_state *state, int fd_tun)
+ * \brief Create the dedicated tun interfaces, the other experiments
+ *        use fd_tun.
+ *
+ * \param state The program state
+ * \param fd_tun The default tun fd
+ */
+void demux_tun(struct tun_state *state, int fd_tun);
+
+/**
+ * \fn int demux_fd_set(struct demux *d, int fd_tun, fd_set *input_set)
+ * \brief Add the dedicated tun fds to a fd_set.
+ *
+ * \param d The experiments
+ * \param fd_tun The default tun fd
+ * \param input_set The fd_set
+ * \return The max fd value
+ */
+int demux_fd_set(struct demux *d, int fd_tun, fd_set *input_set);
+
+/**
+ * \fn void free_demux(struct demux *d)
+ * \brief Free the experiments.
+ *
+ * \param d The experiments
+ */
+void free_demux(struct demux *d);
+
+/**
+ * \fn static inline struct demux_exp *demux_classify(struct demux *d, const char *buf, int len)
+ * \brief Match a datagram against the registered signatures.
+ *
+ *    The first 8 bytes are loaded once and compared to each signature
+ *    as masked 64-bit words, longest signature first.
+ *
+ * \param d The experiments
+ * \param buf The datagram
+ * \param len The datagram length
+ * \return The matching experiment or NULL
+ */
+static inline struct demux_exp *demux_classify(struct demux *d,
+                                               const char *buf, int len) {
+   uint64_t word = 0;
+   memcpy(&word, buf, len < DEMUX_MAX_SIG ? len : DEMUX_MAX_SIG);
+   for (int i=0; i<d->len; i++) {
+      struct demux_exp *exp = &d->exp[i];
+      if ((word & exp->mask) == exp->sig && len >= exp->header_size)
+         return exp;
+   }
+   d->unmatched++;
+   return NULL;
+}
+
+/**
+ * \fn static inline int demux_encap(struct demux_exp *exp, char **buf, int len)
+ * \brief Prepend the experiment header to a packet. The buffer must have
+ *        max_header_size bytes of headroom.
+ *
+ * \param exp The experiment
+ * \param buf A pointer to the packet, modified on return
+ * \param len The packet length
+ * \return The new packet length
+ */
+static inline int demux_encap(struct demux_exp *exp, char **buf, int len) {
+   *buf -= exp->header_size;
+   memcpy(*buf, exp->header, exp->header_size);
+   len += exp->header_size;
+   exp->pkts_out++;
+   exp->bytes_out += len;
+   return len;
+}
+
+/**
+ * \fn static inline int demux_decap(struct demux_exp *exp, char *buf, int len)
+ * \brief Strip the experiment header from a datagram.
+ *
+ * \param exp The experiment
+ * \param buf The datagram
+ * \param len The datagram length
+ * \return The new datagram length
+ */
+static inline int demux_decap(struct demux_exp *exp, char *buf, int len) {
+   exp->pkts_in++;
+   exp->bytes_in += len;
+   len -= exp->header_size;
+   memmove(buf, buf+exp->header_size, len);
+   return len;
+}
+
+#endif
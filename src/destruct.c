@@ -1,17 +1,71 @@
 /**
  * \file destruct.c
  *    \brief Destructors.
+ *
+ *    Open fds are tracked in a bitmap indexed by fd, made of chunks
+ *    allocated on first use and updated with atomic operations, so that
+ *    registering and deregistering a socket never takes a lock. Thread
+ *    and process ids are kept in sets split in shards by hash, each with
+ *    its own lock and growable array.
+ *
  * \author k.edeline
  * \version 0.1
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 
 #include "destruct.h"
 #include "sock.h"
 #include "debug.h"
+#include "stats.h"
+
+/**
+ * \def FD_CHUNK_BITS
+ * \brief log2 of the amount of fds per bitmap chunk.
+ */
+#define FD_CHUNK_BITS 16
+
+/**
+ * \def FD_CHUNK_WORDS
+ * \brief The amount of 64-bit words per bitmap chunk.
+ */
+#define FD_CHUNK_WORDS ((1 << FD_CHUNK_BITS) / 64)
+
+/**
+ * \def FD_CHUNKS
+ * \brief The amount of bitmap chunks, covering all non-negative fds.
+ */
+#define FD_CHUNKS (1 << (31 - FD_CHUNK_BITS))
+
+/**
+ * \def REG_SHARDS
+ * \brief The amount of shards per id set (power of 2).
+ */
+#define REG_SHARDS 16
+
+/**
+ * \struct reg_shard
+ *	\brief A shard of an id set.
+ */
+struct reg_shard {
+   pthread_mutex_t lock;   /*!< Protects the shard */
+   char           *ids;    /*!< The ids */
+   uint32_t        len;    /*!< Amount of ids */
+   uint32_t        cap;    /*!< Allocated ids */
+} __attribute__((aligned(64)));
+
+/**
+ * \struct reg
+ *	\brief A set of thread or process ids.
+ */
+struct reg {
+   size_t           size;                /*!< The id size */
+   struct reg_shard shards[REG_SHARDS];  /*!< The shards */
+};
 
 /**
  * \fn static void destruct()
@@ -20,40 +74,58 @@
 static void destruct();
 
 /**
- * \var pthread_t *ctid
- * \brief thread id list
+ * \fn static struct reg_shard *reg_shard(struct reg *r, const void *id)
+ * \brief The shard of an id (FNV-1a hash).
+ */
+static struct reg_shard *reg_shard(struct reg *r, const void *id);
+
+/**
+ * \fn static void reg_add(struct reg *r, const void *id)
+ * \brief Add an id to a set.
+ */
+static void reg_add(struct reg *r, const void *id);
+
+/**
+ * \fn static int reg_del(struct reg *r, const void *id)
+ * \brief Remove an id from a set.
+ *
+ * \return 0 if removed, -1 if not found
  */
-static volatile pthread_t *ctid;
+static int reg_del(struct reg *r, const void *id);
 
 /**
- * \var pid_t *cpid
- * \brief process id list
+ * \fn static char *reg_take(struct reg_shard *s, uint32_t *len)
+ * \brief Empty a shard and return its ids, to be freed by the caller.
  */
-static volatile pid_t *cpid;
+static char *reg_take(struct reg_shard *s, uint32_t *len);
 
 /**
- * \var int *fd
- * \brief open fd list
+ * \def REG_INITIALIZER
+ * \brief The static initializer of an id set of ids of a size, so that
+ *        ids can be registered before init_destructors().
  */
-static volatile int *fd;
+#define REG_INITIALIZER(id_size) { \
+   .size   = (id_size), \
+   .shards = { [0 ... REG_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } }, \
+}
 
 /**
- * \var unsigned int ctid_index
- * \brief length of thread id list
+ * \var static struct reg ctid
+ * \brief thread id set
  */
-static volatile unsigned int ctid_index;
+static struct reg ctid = REG_INITIALIZER(sizeof(pthread_t));
 
 /**
- * \var unsigned int cpid_index
- * \brief length of process id list
+ * \var static struct reg cpid
+ * \brief process id set
  */
-static volatile unsigned int cpid_index;
+static struct reg cpid = REG_INITIALIZER(sizeof(pid_t));
 
 /**
- * \var unsigned int fd_index
- * \brief length of fd list
+ * \var static uint64_t *fds[]
+ * \brief open fd bitmap chunks, NULL until a fd in range is registered
  */
-static volatile unsigned int fd_index;
+static uint64_t *fds[FD_CHUNKS];
 
 /**
  * \var static struct tun_state *prog_state
@@ -61,95 +133,161 @@ static volatile unsigned int fd_index;
  */
 static struct tun_state *prog_state;
 
-/**
- * \var pthread_mutex_t lock
- * \brief Semaphore for destructor/garbage collector
- */
-static pthread_mutex_t lock;
+struct reg_shard *reg_shard(struct reg *r, const void *id) {
+   const uint8_t *p = id;
+   uint32_t h = 2166136261u;
+   for (size_t i=0; i<r->size; i++)
+      h = (h ^ p[i]) * 16777619u;
+   return &r->shards[(h ^ (h >> 16)) & (REG_SHARDS-1)];
+}
 
-void set_pthread(pthread_t t) {
-   if (pthread_mutex_lock(&lock) != 0)
+void reg_add(struct reg *r, const void *id) {
+   struct reg_shard *s = reg_shard(r, id);
+   if (pthread_mutex_lock(&s->lock) != 0)
       die("mutex lock");
-   ctid[ctid_index++] = t;
-   if (pthread_mutex_unlock(&lock) != 0)
+   if (s->len == s->cap) {
+      s->cap = s->cap ? 2 * s->cap : 8;
+      if (!(s->ids = realloc(s->ids, s->cap * r->size)))
+         die("realloc");
+   }
+   memcpy(s->ids + s->len++ * r->size, id, r->size);
+   if (pthread_mutex_unlock(&s->lock) != 0)
       die("mutex unlock");
 }
 
-void set_cpid(pid_t p) {
-   if (pthread_mutex_lock(&lock) != 0)
+int reg_del(struct reg *r, const void *id) {
+   struct reg_shard *s = reg_shard(r, id);
+   int ret = -1;
+   if (pthread_mutex_lock(&s->lock) != 0)
       die("mutex lock");
-   cpid[cpid_index++] = p;
-   if (pthread_mutex_unlock(&lock) != 0)
+   /* recent ids first, swap with the last one */
+   for (uint32_t i=s->len; i-- > 0; ) {
+      if (memcmp(s->ids + i * r->size, id, r->size))
+         continue;
+      s->len--;
+      memcpy(s->ids + i * r->size, s->ids + s->len * r->size, r->size);
+      ret = 0;
+      break;
+   }
+   if (pthread_mutex_unlock(&s->lock) != 0)
       die("mutex unlock");
+   return ret;
 }
 
-void set_fd(int fds){
-   if (pthread_mutex_lock(&lock) != 0)
+char *reg_take(struct reg_shard *s, uint32_t *len) {
+   if (pthread_mutex_lock(&s->lock) != 0)
       die("mutex lock");
-   fd[fd_index++] = fds;
-   if (pthread_mutex_unlock(&lock) != 0)
+   char *ids = s->ids;
+   *len = s->len;
+   s->ids = NULL;
+   s->len = s->cap = 0;
+   if (pthread_mutex_unlock(&s->lock) != 0)
       die("mutex unlock");
+   return ids;
+}
+
+void set_pthread(pthread_t t) {
+   reg_add(&ctid, &t);
+}
+
+int unset_pthread(pthread_t t) {
+   return reg_del(&ctid, &t);
+}
+
+void set_cpid(pid_t p) {
+   reg_add(&cpid, &p);
+}
+
+int unset_cpid(pid_t p) {
+   return reg_del(&cpid, &p);
+}
+
+void set_fd(int fd) {
+   if (fd < 0)
+      return;
+   uint64_t **chunk = &fds[fd >> FD_CHUNK_BITS];
+   uint64_t *bm = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+   if (!bm) {
+      /* first fd of this range, the losing thread frees its chunk */
+      uint64_t *nbm = calloc(FD_CHUNK_WORDS, sizeof(uint64_t));
+      if (!nbm)
+         die("calloc");
+      if (__atomic_compare_exchange_n(chunk, &bm, nbm, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+         bm = nbm;
+      else
+         free(nbm);
+   }
+   int bit = fd & ((1 << FD_CHUNK_BITS) - 1);
+   __atomic_fetch_or(&bm[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+}
+
+void unset_fd(int fd) {
+   if (fd < 0)
+      return;
+   uint64_t *bm = __atomic_load_n(&fds[fd >> FD_CHUNK_BITS], __ATOMIC_ACQUIRE);
+   if (!bm)
+      return;
+   int bit = fd & ((1 << FD_CHUNK_BITS) - 1);
+   __atomic_fetch_and(&bm[bit / 64], ~(1ULL << (bit % 64)), __ATOMIC_RELAXED);
+}
+
+int close_fd(int fd) {
+   unset_fd(fd);
+   return close(fd);
 }
 
 void destruct() {
-   
-   if (pthread_mutex_lock(&lock) != 0)
-      die("mutex lock");
    debug_print("exiting ...\n");
 
-   // Ensure child process is killed and socket is closed   
-   /* thread ids */
-   for (unsigned int i=0; i<ctid_index; i++) {
-      if (!pthread_cancel(ctid[i])) {
-         debug_print("thread %u canceled\n", (unsigned int)ctid[i]);
-         pthread_join(ctid[i], NULL);
-         continue;
-      }   
-      debug_print("no response, killing %u ...\n", (unsigned int)ctid[i]);
-      pthread_kill(ctid[i], SIGKILL);
-      pthread_kill(ctid[i], SIGTERM);
+   // Ensure child process is killed and socket is closed
+   /* thread ids, taken out of the set so that exiting threads
+      do not detach while being joined */
+   for (int sh=0; sh<REG_SHARDS; sh++) {
+      uint32_t len;
+      pthread_t *ids = (pthread_t *)reg_take(&ctid.shards[sh], &len);
+      for (uint32_t i=0; i<len; i++) {
+         if (!pthread_cancel(ids[i])) {
+            debug_print("thread %u canceled\n", (unsigned int)ids[i]);
+            pthread_join(ids[i], NULL);
+            continue;
+         }
+         debug_print("no response, killing %u ...\n", (unsigned int)ids[i]);
+         pthread_kill(ids[i], SIGKILL);
+         pthread_kill(ids[i], SIGTERM);
+      }
+      free(ids);
    }
    /* process ids */
-   for (unsigned int i=0; i<cpid_index; i++) {
-      kill(cpid[i], SIGKILL);
-      kill(cpid[i], SIGTERM);
+   for (int sh=0; sh<REG_SHARDS; sh++) {
+      uint32_t len;
+      pid_t *ids = (pid_t *)reg_take(&cpid.shards[sh], &len);
+      for (uint32_t i=0; i<len; i++) {
+         kill(ids[i], SIGKILL);
+         kill(ids[i], SIGTERM);
+      }
+      free(ids);
+   }
+   /* file descriptors, chunks are kept as late unset_fd calls may 
+      still read them */
+   for (int c=0; c<FD_CHUNKS; c++) {
+      uint64_t *bm = __atomic_load_n(&fds[c], __ATOMIC_ACQUIRE);
+      if (!bm)
+         continue;
+      for (int w=0; w<FD_CHUNK_WORDS; w++) {
+         uint64_t bits = __atomic_exchange_n(&bm[w], 0, __ATOMIC_RELAXED);
+         for (; bits; bits &= bits - 1)
+            close((c << FD_CHUNK_BITS) + w * 64 + __builtin_ctzll(bits));
+      }
    }
-   /* file descriptors */
-   for (unsigned int i=0; i<fd_index; i++) 
-      close(fd[i]);
-
-   /* mallocs */
-   free((void*)ctid);free((void*)cpid);
-   free((void*)fd);
-
-   if (pthread_mutex_unlock(&lock) != 0)
-      die("mutex unlock");
-   pthread_mutex_destroy(&lock);
 
+   stats_dump(prog_state);
    free_tun_state(prog_state);
 }
 
 void init_destructors(struct tun_state *state) {
-   /* init & lock mutex */
-   if (pthread_mutex_init(&lock, NULL) != 0) 
-      die("mutex init");
-   if (pthread_mutex_lock(&lock) != 0)
-      die("mutex lock");
-   
-   /* Set Processes, Threads and File descriptors destructors*/
-   ctid = calloc(state->fd_lim, sizeof(pthread_t));
-   cpid = calloc(state->fd_lim, sizeof(pid_t));
-   fd   = calloc(state->fd_lim, sizeof(int));
-
-   ctid_index = 0;
-   cpid_index = 0;
-   fd_index   = 0;
-
+   /* Processes, Threads and File descriptors sets are static */
    atexit(destruct);
 
-   if (pthread_mutex_unlock(&lock) != 0)
-      die("mutex unlock");
-
    prog_state = state;
 }
-
@@ -29,6 +29,16 @@ void init_destructors(struct tun_state *state);
  */ 
 void set_pthread(pthread_t t);
 
+/**
+ * \fn int unset_pthread(pthread_t t)
+ * \brief Deregister a thread.
+ *
+ * \param t The thread id
+ * \return 0 if deregistered, -1 if not registered (or already
+ *         taken by the destructor)
+ */ 
+int unset_pthread(pthread_t t);
+
 /**
  * \fn void set_cpid(pid_t p)
  * \brief Register a process to be killed at destruction time.
@@ -37,13 +47,39 @@ void set_pthread(pthread_t t);
  */ 
 void set_cpid(pid_t p);
 
+/**
+ * \fn int unset_cpid(pid_t p)
+ * \brief Deregister a process.
+ *
+ * \param p The process id
+ * \return 0 if deregistered, -1 if not registered
+ */ 
+int unset_cpid(pid_t p);
+
 /**
  * \fn void set_fd(int fds)
- * \brief Register a fd to be closed at destruction time.
+ * \brief Register a fd to be closed at destruction time, lock-free.
  *
  * \param fds The fd
  */ 
 void set_fd(int fds);
 
+/**
+ * \fn void unset_fd(int fd)
+ * \brief Deregister a fd, lock-free.
+ *
+ * \param fd The fd
+ */ 
+void unset_fd(int fd);
+
+/**
+ * \fn int close_fd(int fd)
+ * \brief Deregister and close a fd.
+ *
+ * \param fd The fd
+ * \return The close() return value
+ */ 
+int close_fd(int fd);
+
 #endif 
 
@@ -0,0 +1,542 @@
+/**
+ * \file dpbench.c
+ * \brief Microbenchmarks of the data path kernels (make microbench).
+ *
+ *    Times the building blocks of the forwarding loops in isolation:
+ *    checksum, peer table lookups, raw header prepend and strip, header
+ *    field extraction, raw header parsing, ICMP forging and heavy-hitter
+ *    counting. Each kernel is run until it reaches a minimal duration,
+ *    the best of several rounds is kept and reported as ns/op and
+ *    bytes/cycle (TSC cycles on x86, or the -f frequency). Results are printed as JSON; with
+ *    -b, they are compared against a previously saved output.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <linux/errqueue.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
+
+#include "debug.h"
+#include "icmp.h"
+#include "lpm.h"
+#include "state.h"
+#include "hh.h"
+#include "bench.h"
+
+/**
+ * \def BENCH_MIN_NS
+ * \brief The minimal duration of a round.
+ */
+#define BENCH_MIN_NS 50000000.0
+
+/**
+ * \def BENCH_ROUNDS
+ * \brief The amount of rounds per kernel, the fastest one is kept.
+ */
+#define BENCH_ROUNDS 5
+
+/**
+ * \def BENCH_PKTS
+ * \brief The amount of distinct packets/keys iterated over (power of 2).
+ */
+#define BENCH_PKTS 1024
+
+/**
+ * \def BENCH_PEERS
+ * \brief The amount of peers in the lookup tables.
+ */
+#define BENCH_PEERS 1024
+
+/**
+ * \def BENCH_MAX
+ * \brief The maximal amount of kernels and baseline entries.
+ */
+#define BENCH_MAX 64
+
+/**
+ * \def BENCH_HEADROOM
+ * \brief Room in front of the packet buffers for header prepend.
+ */
+#define BENCH_HEADROOM 64
+
+/**
+ * \struct bench
+ *	\brief A kernel and its result.
+ */
+struct bench {
+   const char *name;               /*!< The kernel name */
+   int         arg;                /*!< Kernel argument (length) */
+   int         bytes;              /*!< Bytes processed per op */
+   void      (*fn)(struct bench *b, long iters); /*!< The kernel loop */
+
+   long        iters;              /*!< Ops per round */
+   double      ns;                 /*!< Best ns/op */
+};
+
+/**
+ * \struct baseline
+ *	\brief A saved result.
+ */
+struct baseline {
+   char   name[64];                /*!< The kernel name */
+   double ns;                      /*!< Saved ns/op */
+};
+
+/**
+ * \var static volatile uintptr_t sink
+ * \brief Kernel results, keeps the compiler from removing the loops.
+ */
+static volatile uintptr_t sink;
+
+/**
+ * \var static char *pkts[]
+ * \brief The test packets, alternating IPv4/UDP and IPv6/UDP.
+ */
+static char *pkts[BENCH_PKTS];
+
+/**
+ * \var static uint32_t keys4[]
+ * \brief IPv4 lookup keys (host order), hitting a peer.
+ */
+static uint32_t keys4[BENCH_PKTS];
+
+/**
+ * \var static uint8_t keys6[][16]
+ * \brief IPv6 lookup keys, hitting a peer.
+ */
+static uint8_t keys6[BENCH_PKTS][16];
+
+/**
+ * \var static int ports[]
+ * \brief Server lookup keys (source ports), hitting a peer.
+ */
+static int ports[BENCH_PKTS];
+
+/**
+ * \var static GHashTable *serv
+ * \brief The server peer table.
+ */
+static GHashTable *serv;
+
+/**
+ * \var static struct lpm4 *cli4
+ * \brief The IPv4 client peer table.
+ */
+static struct lpm4 *cli4;
+
+/**
+ * \var static struct lpm6 *cli6
+ * \brief The IPv6 client peer table.
+ */
+static struct lpm6 *cli6;
+
+/**
+ * \var static double ghz
+ * \brief Cycles per ns, 0 if unknown.
+ */
+static double ghz;
+
+/**
+ * \fn static double tsc_ghz()
+ * \brief Measure the TSC frequency against the monotonic clock.
+ *
+ * \return The frequency in GHz, 0 if there is no TSC
+ */
+static double tsc_ghz();
+
+/**
+ * \fn static void init_data()
+ * \brief Build the test packets and peer tables.
+ */
+static void init_data();
+
+/**
+ * \fn static void run(struct bench *b)
+ * \brief Calibrate the amount of iterations and time a kernel.
+ */
+static void run(struct bench *b);
+
+/**
+ * \fn static int load_baseline(const char *path, struct baseline *base)
+ * \brief Read the results of a previous run.
+ *
+ * \return The amount of results
+ */
+static int load_baseline(const char *path, struct baseline *base);
+
+static void bench_calcsum(struct bench *b, long iters);
+static void bench_serv_lookup(struct bench *b, long iters);
+static void bench_cli4_lookup(struct bench *b, long iters);
+static void bench_cli6_lookup(struct bench *b, long iters);
+static void bench_raw_prepend(struct bench *b, long iters);
+static void bench_raw_strip(struct bench *b, long iters);
+static void bench_fields4(struct bench *b, long iters);
+static void bench_fields6(struct bench *b, long iters);
+static void bench_parse_raw_header(struct bench *b, long iters);
+static void bench_hh_update(struct bench *b, long iters);
+#if defined(LINUX_OS)
+static void bench_forge_icmp(struct bench *b, long iters);
+#endif
+
+/**
+ * \var static struct bench benches[]
+ * \brief The kernels.
+ */
+static struct bench benches[] = {
+   { "calcsum/20",           20,   20,   bench_calcsum, 0, 0 },
+   { "calcsum/64",           64,   64,   bench_calcsum, 0, 0 },
+   { "calcsum/1500",         1500, 1500, bench_calcsum, 0, 0 },
+   { "serv_lookup",          0,    2,    bench_serv_lookup, 0, 0 },
+   { "cli4_lookup",          0,    4,    bench_cli4_lookup, 0, 0 },
+   { "cli6_lookup",          0,    16,   bench_cli6_lookup, 0, 0 },
+   { "raw_prepend/64",       64,   64,   bench_raw_prepend, 0, 0 },
+   { "raw_prepend/1500",     1500, 1500, bench_raw_prepend, 0, 0 },
+   { "raw_strip/64",         64,   64,   bench_raw_strip, 0, 0 },
+   { "raw_strip/1500",       1500, 1500, bench_raw_strip, 0, 0 },
+   { "fields4",              0,    24,   bench_fields4, 0, 0 },
+   { "fields6",              0,    44,   bench_fields6, 0, 0 },
+   { "parse_raw_header/8",   8,    16,   bench_parse_raw_header, 0, 0 },
+   { "parse_raw_header/32",  32,   64,   bench_parse_raw_header, 0, 0 },
+   { "hh_update/16",         16,   40,   bench_hh_update, 0, 0 },
+   { "hh_update/1024",       1024, 40,   bench_hh_update, 0, 0 },
+#if defined(LINUX_OS)
+   { "forge_icmp",           0,    28,   bench_forge_icmp, 0, 0 },
+#endif
+};
+
+/**
+ * \var static const uint8_t raw_header[]
+ * \brief The layer 4.5 header of the prepend and strip kernels.
+ */
+static const uint8_t raw_header[] = {
+   0xd8, 0x00, 0x00, 0xd8, 0x12, 0x34, 0x56, 0x78,
+   0x9a, 0xbc, 0xde, 0xf0, 0x00, 0x00, 0x00, 0x00,
+};
+
+double tsc_ghz() {
+#if defined(__x86_64__) || defined(__i386__)
+   double t0 = now();
+   uint64_t c0 = __rdtsc();
+   while (now() - t0 < 20000000.0)
+      ;
+   return (__rdtsc() - c0) / (now() - t0);
+#else
+   return 0;
+#endif
+}
+
+void init_data() {
+   serv = g_hash_table_new(g_direct_hash, g_direct_equal);
+   cli4 = lpm4_new();
+   cli6 = lpm6_new();
+   if (!serv || !cli4 || !cli6) {
+      perror("init_data");
+      exit(EXIT_FAILURE);
+   }
+
+   /* one /32 and /128 per peer, as with a plain dest file */
+   static int sport[BENCH_PEERS];
+   static uint8_t addr6[BENCH_PEERS][16];
+   uint32_t addr4[BENCH_PEERS];
+   for (int i=0; i<BENCH_PEERS; i++) {
+      sport[i] = 20000 + i;
+      g_hash_table_insert(serv, GINT_TO_POINTER(sport[i]), GUINT_TO_POINTER(i + 1));
+      addr4[i] = 0x0a000000 | (uint32_t)rnd() % 0xffffff;
+      lpm4_add(cli4, addr4[i], 32, i + 1);
+      addr6[i][0] = 0xfd;
+      for (int b=1; b<16; b++)
+         addr6[i][b] = rnd();
+      lpm6_add(cli6, addr6[i], 128, i + 1);
+   }
+   if (lpm6_build(cli6) < 0) {
+      perror("lpm6_build");
+      exit(EXIT_FAILURE);
+   }
+   init_hh(16);
+
+   for (int i=0; i<BENCH_PKTS; i++) {
+      int p = rnd() % BENCH_PEERS;
+      ports[i] = sport[p];
+      keys4[i] = addr4[p];
+      memcpy(keys6[i], addr6[p], 16);
+
+      char *pkt = calloc(1, BENCH_HEADROOM + 2048);
+      if (!pkt) {
+         perror("calloc");
+         exit(EXIT_FAILURE);
+      }
+      pkts[i] = pkt + BENCH_HEADROOM;
+      for (int b=0; b<2048; b++)
+         pkts[i][b] = rnd();
+      uint16_t port = htons(sport[p]);
+      if (i % 2) {
+         pkts[i][0] = 0x60;
+         pkts[i][6] = IPPROTO_UDP;
+         memcpy(pkts[i]+24, addr6[p], 16);
+         memcpy(pkts[i]+40, &port, 2);
+      } else {
+         uint32_t dst = htonl(addr4[p]);
+         pkts[i][0] = 0x45;
+         pkts[i][9] = IPPROTO_UDP;
+         memcpy(pkts[i]+16, &dst, 4);
+         memcpy(pkts[i]+20, &port, 2);
+      }
+   }
+}
+
+void bench_calcsum(struct bench *b, long iters) {
+   uintptr_t sum = 0;
+   for (long i=0; i<iters; i++)
+      sum += calcsum((unsigned short *)pkts[i & (BENCH_PKTS-1)], b->arg);
+   sink = sum;
+}
+
+void bench_serv_lookup(struct bench *UNUSED(b), long iters) {
+   uintptr_t sum = 0;
+   for (long i=0; i<iters; i++)
+      sum += (uintptr_t)g_hash_table_lookup(serv, 
+                                  GINT_TO_POINTER(ports[i & (BENCH_PKTS-1)]));
+   sink = sum;
+}
+
+void bench_cli4_lookup(struct bench *UNUSED(b), long iters) {
+   uintptr_t sum = 0;
+   for (long i=0; i<iters; i++)
+      sum += lpm4_lookup(cli4, keys4[i & (BENCH_PKTS-1)]);
+   sink = sum;
+}
+
+void bench_cli6_lookup(struct bench *UNUSED(b), long iters) {
+   uintptr_t sum = 0;
+   for (long i=0; i<iters; i++)
+      sum += lpm6_lookup(cli6, keys6[i & (BENCH_PKTS-1)]);
+   sink = sum;
+}
+
+void bench_raw_prepend(struct bench *b, long iters) {
+   /* the payload is moved to make room, as in peer mode */
+   for (long i=0; i<iters; i++) {
+      char *pkt = pkts[i & (BENCH_PKTS-1)];
+      memmove(pkt + sizeof(raw_header), pkt, b->arg);
+      memcpy(pkt, raw_header, sizeof(raw_header));
+   }
+   sink = pkts[0][0];
+}
+
+void bench_raw_strip(struct bench *b, long iters) {
+   /* as in the client and peer decapsulation */
+   for (long i=0; i<iters; i++) {
+      char *pkt = pkts[i & (BENCH_PKTS-1)];
+      memmove(pkt, pkt + sizeof(raw_header), b->arg);
+   }
+   sink = pkts[0][0];
+}
+
+void bench_fields4(struct bench *UNUSED(b), long iters) {
+   uintptr_t sum = 0;
+   for (long i=0; i<iters; i++) {
+      const char *pkt = pkts[(i & (BENCH_PKTS/2-1)) * 2];
+      uint32_t dst;
+      memcpy(&dst, pkt+16, 4);
+      sum += (pkt[0] & 0xf0) + ntohl(dst) + ntohs(*((uint16_t *)(pkt+20)));
+   }
+   sink = sum;
+}
+
+void bench_fields6(struct bench *UNUSED(b), long iters) {
+   uintptr_t sum = 0;
+   for (long i=0; i<iters; i++) {
+      const char *pkt = pkts[(i & (BENCH_PKTS/2-1)) * 2 + 1];
+      uint64_t dst[2];
+      memcpy(dst, pkt+24, 16);
+      sum += (pkt[0] & 0xf0) + (dst[0] ^ dst[1]) + ntohs(*((uint16_t *)(pkt+40)));
+   }
+   sink = sum;
+}
+
+void bench_parse_raw_header(struct bench *b, long iters) {
+   char hex[2 * 256 + 1];
+   for (int i=0; i<b->arg; i++)
+      sprintf(hex + 2*i, "%02x", raw_header[i % sizeof(raw_header)]);
+
+   uintptr_t sum = 0;
+   uint8_t size;
+   for (long i=0; i<iters; i++) {
+      char *header = parse_raw_header(hex, &size);
+      sum += header[size - 1];
+      free(header);
+   }
+   sink = sum;
+}
+
+void bench_hh_update(struct bench *b, long iters) {
+   for (long i=0; i<iters; i++) {
+      int p = i & (b->arg - 1);
+      hh_update(pkts[p], 1500, ports[p], HH_TX);
+   }
+   sink = hh_on;
+}
+
+#if defined(LINUX_OS)
+void bench_forge_icmp(struct bench *UNUSED(b), long iters) {
+   struct {
+      struct sock_extended_err ee;
+      struct sockaddr_in       offender;
+   } err;
+   memset(&err, 0, sizeof(err));
+   err.ee.ee_origin = SO_EE_ORIGIN_ICMP;
+   err.ee.ee_type   = ICMP_DEST_UNREACH;
+   err.ee.ee_code   = ICMP_PORT_UNREACH;
+   err.offender.sin_family      = AF_INET;
+   err.offender.sin_addr.s_addr = htonl(0xc0000201);
+
+   struct tun_state state;
+   memset(&state, 0, sizeof(state));
+   state.private_addr4 = "10.0.0.1";
+
+   uintptr_t sum = 0;
+   int len;
+   for (long i=0; i<iters; i++) {
+      struct iovec iov = { pkts[i & (BENCH_PKTS-1)], 8 };
+      char *pkt = forge_icmp(&len, &err.ee, &iov, &state);
+      sum += pkt[len - 1];
+      free(pkt);
+   }
+   sink = sum;
+}
+#endif
+
+void run(struct bench *b) {
+   long iters = 1000;
+   double elapsed;
+   for (;;) {
+      double start = now();
+      b->fn(b, iters);
+      elapsed = now() - start;
+      if (elapsed >= BENCH_MIN_NS / 10)
+         break;
+      iters *= 10;
+   }
+   b->iters = iters * (BENCH_MIN_NS / elapsed);
+   if (b->iters < 1)
+      b->iters = 1;
+
+   b->ns = 0;
+   for (int r=0; r<BENCH_ROUNDS; r++) {
+      double start = now();
+      b->fn(b, b->iters);
+      double ns = (now() - start) / b->iters;
+      if (!b->ns || ns < b->ns)
+         b->ns = ns;
+   }
+}
+
+int load_baseline(const char *path, struct baseline *base) {
+   FILE *fp = fopen(path, "r");
+   if (!fp) {
+      perror(path);
+      exit(EXIT_FAILURE);
+   }
+   int len = 0;
+   char line[512];
+   while (len < BENCH_MAX && fgets(line, sizeof(line), fp)) {
+      char *name = strstr(line, "\"name\": \"");
+      char *ns   = strstr(line, "\"ns_per_op\": ");
+      if (!name || !ns ||
+          sscanf(name, "\"name\": \"%63[^\"]\"", base[len].name) != 1 ||
+          sscanf(ns, "\"ns_per_op\": %lf", &base[len].ns) != 1)
+         continue;
+      len++;
+   }
+   fclose(fp);
+   return len;
+}
+
+int main(int argc, char *argv[]) {
+   const char *filter = NULL, *baseline = NULL, *output = NULL;
+   double threshold = 5.0;
+   int opt;
+   while ((opt = getopt(argc, argv, "b:f:o:r:t:h")) != -1) {
+      switch (opt) {
+         case 'b': baseline  = optarg; break;
+         case 'f': ghz       = atof(optarg); break;
+         case 'o': output    = optarg; break;
+         case 'r': filter    = optarg; break;
+         case 't': threshold = atof(optarg); break;
+         default:
+            fprintf(stderr, "usage: %s [-r prefix] [-o out.json] "
+                    "[-b baseline.json] [-t threshold%%] [-f ghz]\n", argv[0]);
+            return EXIT_FAILURE;
+      }
+   }
+   if (!ghz)
+      ghz = tsc_ghz();
+   init_data();
+
+   FILE *out = stdout;
+   if (output && !(out = fopen(output, "w"))) {
+      perror(output);
+      return EXIT_FAILURE;
+   }
+
+   int len = sizeof(benches) / sizeof(struct bench);
+   fprintf(out, "{\n  \"ghz\": %.3f,\n  \"benchmarks\": [", ghz);
+   for (int i=0, first=1; i<len; i++) {
+      struct bench *b = &benches[i];
+      if (filter && strncmp(b->name, filter, strlen(filter)))
+         continue;
+      run(b);
+      fprintf(out, "%s\n    {\"name\": \"%s\", \"bytes\": %d, \"iters\": %ld, "
+              "\"ns_per_op\": %.3f, \"cycles_per_op\": %.2f, "
+              "\"bytes_per_cycle\": %.3f}", first ? "" : ",",
+              b->name, b->bytes, b->iters, b->ns, b->ns * ghz,
+              ghz ? b->bytes / (b->ns * ghz) : 0);
+      fflush(out);
+      first = 0;
+   }
+   fprintf(out, "\n  ]\n}\n");
+   if (out != stdout)
+      fclose(out);
+   else
+      fflush(out);
+
+   if (!baseline)
+      return EXIT_SUCCESS;
+
+   /* compare ns/op, report regressions above threshold */
+   struct baseline base[BENCH_MAX];
+   int base_len = load_baseline(baseline, base), regressions = 0;
+   fprintf(stderr, "%-22s %12s %12s %9s\n", "benchmark", "base ns/op", "ns/op", "delta");
+   for (int i=0; i<len; i++) {
+      struct bench *b = &benches[i];
+      if (!b->iters)
+         continue;
+      for (int j=0; j<base_len; j++) {
+         if (strcmp(base[j].name, b->name))
+            continue;
+         double delta = (b->ns - base[j].ns) / base[j].ns * 100;
+         int slower = delta > threshold;
+         fprintf(stderr, "%-22s %12.3f %12.3f %+8.1f%%%s\n", b->name,
+                 base[j].ns, b->ns, delta, slower ? " REGRESSION" :
+                 delta < -threshold ? " improved" : "");
+         regressions += slower;
+         break;
+      }
+   }
+   return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
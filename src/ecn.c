@@ -0,0 +1,134 @@
+/**
+ * \file ecn.c
+ * \brief ECN and DSCP propagation between inner and outer headers.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ecn.h"
+#include "debug.h"
+#include "sock.h"
+#include "stats.h"
+
+/**
+ * \var static uint8_t mode
+ * \brief The propagation mode (enum ecn_mode).
+ */
+static uint8_t mode;
+
+/**
+ * \var static uint64_t ce_marked
+ * \brief Inner packets marked CE from the outer header.
+ */
+static uint64_t ce_marked;
+
+/**
+ * \var static uint64_t ect1_marked
+ * \brief Inner ECT(0) packets changed to ECT(1) from the outer header.
+ */
+static uint64_t ect1_marked;
+
+/**
+ * \var static uint64_t dropped
+ * \brief Not-ECT inner packets dropped on outer CE.
+ */
+static uint64_t dropped;
+
+/**
+ * \fn static void set_inner_ecn(char *pkt, int ecn)
+ * \brief Rewrite the ECN field of a packet.
+ */
+static void set_inner_ecn(char *pkt, int ecn);
+
+/**
+ * \fn static void ecn_stats(FILE *fp, void *arg)
+ * \brief Dump the decapsulation counters.
+ */
+static void ecn_stats(FILE *fp, void *arg);
+
+void init_ecn(uint8_t ecn_mode) {
+   mode = ecn_mode;
+   if (mode != ECN_MODE_OFF)
+      stats_register("ecn", ecn_stats, NULL);
+}
+
+void ecn_sock(int fd, int ipv6) {
+   if (mode == ECN_MODE_OFF)
+      return;
+   int on = 1;
+   if (ipv6) {
+#if defined(IPV6_RECVTCLASS)
+      if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &on, sizeof(on)))
+         die("IPV6_RECVTCLASS");
+#endif
+   } else {
+#if defined(IP_RECVTOS)
+      if (setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on)))
+         die("IP_RECVTOS");
+#endif
+   }
+}
+
+int ecn_decap(int tos, char *pkt, int len) {
+   if (mode == ECN_MODE_OFF || tos < 0)
+      return 0;
+   int inner_tos = ecn_inner_tos(pkt);
+   if (inner_tos < 0 || len < ((pkt[0] & 0xf0) == 0x40 ? 20 : 40))
+      return 0;
+
+   /* RFC 6040 section 4.2, normal mode */
+   int outer = tos & ECN_MASK, inner = inner_tos & ECN_MASK, ecn = inner;
+   if (outer == ECN_CE) {
+      if (inner == ECN_NOT_ECT) {
+         dropped++;
+         debug_print("ecn: dropping not-ECT pkt with outer CE\n");
+         return -1;
+      }
+      ecn = ECN_CE;
+   } else if (outer == ECN_ECT1 && inner == ECN_ECT0) {
+      ecn = ECN_ECT1;
+   }
+   if (ecn == inner)
+      return 0;
+
+   if (ecn == ECN_CE)
+      ce_marked++;
+   else
+      ect1_marked++;
+   set_inner_ecn(pkt, ecn);
+   return 0;
+}
+
+void set_inner_ecn(char *pkt, int ecn) {
+   uint8_t *p = (uint8_t *)pkt;
+   if ((p[0] & 0xf0) == 0x60) {
+      /* traffic class bits 2-3 are in the high nibble of byte 1 */
+      p[1] = (p[1] & ~(ECN_MASK << 4)) | (ecn << 4);
+      return;
+   }
+
+   /* incremental checksum update, RFC 1624 eqn. 3 */
+   uint16_t old = (p[0] << 8) | p[1];
+   p[1] = (p[1] & ~ECN_MASK) | ecn;
+   uint16_t new = (p[0] << 8) | p[1];
+   uint16_t check;
+   memcpy(&check, p+10, 2);
+   uint32_t sum = (uint16_t)~ntohs(check) + (uint16_t)~old + new;
+   sum = (sum & 0xffff) + (sum >> 16);
+   sum = (sum & 0xffff) + (sum >> 16);
+   check = htons(~sum);
+   memcpy(p+10, &check, 2);
+}
+
+void ecn_stats(FILE *fp, void *UNUSED(arg)) {
+   fprintf(fp, "mode %s\n", mode == ECN_MODE_TOS ? "tos" : "ecn");
+   fprintf(fp, "ce_marked %llu\n", (unsigned long long)ce_marked);
+   fprintf(fp, "ect1_marked %llu\n", (unsigned long long)ect1_marked);
+   fprintf(fp, "dropped %llu\n", (unsigned long long)dropped);
+}
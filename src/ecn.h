@@ -0,0 +1,125 @@
+/**
+ * \file ecn.h
+ * \brief ECN and DSCP propagation between inner and outer headers.
+ *
+ *    On encapsulation, the inner TOS/traffic class (or only its ECN
+ *    field) is copied to the outer header with a per-datagram IP_TOS or
+ *    IPV6_TCLASS cmsg. On decapsulation, the outer ECN field read with
+ *    IP_RECVTOS/IPV6_RECVTCLASS is combined into the inner header as
+ *    in RFC 6040 (normal mode): an outer CE mark is copied to an ECN
+ *    capable inner packet, and a not-ECT inner packet carried in a CE
+ *    outer datagram is dropped.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_ECN_H
+#define UDPTUN_ECN_H
+
+#include <stdint.h>
+
+#include "state.h"
+
+/**
+ * \def ECN_MASK
+ * \brief The ECN field of the TOS/traffic class.
+ */
+#define ECN_MASK   0x03
+
+/**
+ * \def ECN_NOT_ECT
+ * \brief Not ECN-capable transport.
+ */
+#define ECN_NOT_ECT 0x00
+
+/**
+ * \def ECN_ECT1
+ * \brief ECN-capable transport (1).
+ */
+#define ECN_ECT1   0x01
+
+/**
+ * \def ECN_ECT0
+ * \brief ECN-capable transport (0).
+ */
+#define ECN_ECT0   0x02
+
+/**
+ * \def ECN_CE
+ * \brief Congestion experienced.
+ */
+#define ECN_CE     0x03
+
+/**
+ * \enum ecn_mode
+ * \brief What is copied from the inner to the outer header.
+ */
+enum ecn_mode {
+   ECN_MODE_OFF = 0,  /*!< Default outer TOS, outer marks ignored */
+   ECN_MODE_ECN,      /*!< Copy the ECN field only */
+   ECN_MODE_TOS,      /*!< Copy DSCP and ECN */
+};
+
+/**
+ * \fn void init_ecn(uint8_t mode)
+ * \brief Set the propagation mode and register the stats section.
+ *
+ * \param mode The enum ecn_mode
+ */
+void init_ecn(uint8_t mode);
+
+/**
+ * \fn void ecn_sock(int fd, int ipv6)
+ * \brief Enable the reception of the outer TOS/traffic class on a socket.
+ *
+ * \param fd The socket fd
+ * \param ipv6 1 if AF_INET6
+ */
+void ecn_sock(int fd, int ipv6);
+
+/**
+ * \fn int ecn_decap(int tos, char *pkt, int len)
+ * \brief Combine the outer ECN field into the inner packet, with an
+ *        incremental IPv4 checksum update.
+ *
+ * \param tos The outer TOS/traffic class, -1 if unknown
+ * \param pkt The inner packet
+ * \param len The inner packet length
+ * \return 0 to forward the packet, -1 to drop it
+ */
+int ecn_decap(int tos, char *pkt, int len);
+
+/**
+ * \fn static inline int ecn_inner_tos(const char *pkt)
+ * \brief The TOS (IPv4) or traffic class (IPv6) of a packet.
+ *
+ * \return The TOS or -1 if not IP
+ */
+static inline int ecn_inner_tos(const char *pkt) {
+   const uint8_t *p = (const uint8_t *)pkt;
+   switch (p[0] >> 4) {
+      case 4: return p[1];
+      case 6: return ((p[0] & 0x0f) << 4) | (p[1] >> 4);
+      default: return -1;
+   }
+}
+
+/**
+ * \fn static inline int ecn_encap(struct tun_state *state, const char *pkt)
+ * \brief The outer TOS/traffic class of an encapsulated packet.
+ *
+ * \param state The program state
+ * \param pkt The inner packet
+ * \return The TOS, -1 to use the socket default
+ */
+static inline int ecn_encap(struct tun_state *state, const char *pkt) {
+   if (state->ecn_mode == ECN_MODE_OFF)
+      return -1;
+   int tos = ecn_inner_tos(pkt);
+   if (tos < 0 || state->ecn_mode == ECN_MODE_TOS)
+      return tos;
+   return tos & ECN_MASK;
+}
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * \file family.h
+ * \brief Per-family header descriptors of the data path.
+ *
+ *    The forwarding functions of the client, server and peer are
+ *    written once and take the descriptor of the inner and outer
+ *    address family, ip_family4 or ip_family6, instead of hardcoding
+ *    header offsets and sockaddr sizes. Both descriptors are constant
+ *    so that the single-stack loops pass a known pointer, and the
+ *    dual-stack loops pick one from the IP version nibble.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_FAMILY_H
+#define UDPTUN_FAMILY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "state.h"
+#include "lpm.h"
+#include "recs.h"
+
+/**
+ * \struct ip_family
+ *	\brief An address family of the data path.
+ */
+struct ip_family {
+   sa_family_t af;        /*!< AF_INET or AF_INET6 */
+   uint8_t     v6;        /*!< 1 for IPv6 */
+   uint8_t     hdr_len;   /*!< The IP header length (no options) */
+   uint8_t     proto;     /*!< The protocol (next header) offset */
+   uint8_t     src;       /*!< The source address offset */
+   uint8_t     dst;       /*!< The destination address offset */
+   socklen_t   salen;     /*!< The sockaddr length */
+};
+
+/**
+ * \var static const struct ip_family ip_family4
+ * \brief The IPv4 descriptor.
+ */
+static const struct ip_family ip_family4 = {
+   AF_INET, 0, 20, 9, 12, 16, sizeof(struct sockaddr_in)
+};
+
+/**
+ * \var static const struct ip_family ip_family6
+ * \brief The IPv6 descriptor.
+ */
+static const struct ip_family ip_family6 = {
+   AF_INET6, 1, 40, 6, 8, 24, sizeof(struct sockaddr_in6)
+};
+
+/**
+ * \fn static inline const struct ip_family *ip_family_of(struct tun_state *state, const char *buf)
+ * \brief The family of a packet read from tun.
+ *
+ * \param state The program state
+ * \param buf The packet, with the PlanetLab PPI header if any
+ * \return The descriptor, NULL if not IP
+ */
+static inline const struct ip_family *ip_family_of(struct tun_state *state,
+                                                   const char *buf) {
+   switch (buf[state->planetlab ? 4 : 0] & 0xf0) {
+      case 0x40: return &ip_family4;
+      case 0x60: return &ip_family6;
+      default:   return NULL;
+   }
+}
+
+/**
+ * \fn static inline int ip_port(const struct ip_family *f, const char *pkt, int dst)
+ * \brief The transport source or destination port of an inner packet.
+ *
+ * \param f The packet family
+ * \param pkt The inner IP packet
+ * \param dst 1 for the destination port
+ * \return The port (host order)
+ */
+static inline int ip_port(const struct ip_family *f, const char *pkt, int dst) {
+   uint16_t port;
+   memcpy(&port, pkt + f->hdr_len + (dst ? 2 : 0), 2);
+   return ntohs(port);
+}
+
+/**
+ * \fn static inline struct sockaddr *rec_sa(struct tun_rec *rec, const struct ip_family *f)
+ * \brief The peer address of a record in a family.
+ */
+static inline struct sockaddr *rec_sa(struct tun_rec *rec,
+                                      const struct ip_family *f) {
+   return f->v6 ? (struct sockaddr *)&rec->sa6 : (struct sockaddr *)&rec->sa4;
+}
+
+/**
+ * \fn static inline int sa_port(const struct sockaddr *sa)
+ * \brief The port of a v4 or v6 address (host order).
+ */
+static inline int sa_port(const struct sockaddr *sa) {
+   /* sin_port and sin6_port share their offset */
+   return ntohs(((const struct sockaddr_in *)sa)->sin_port);
+}
+
+/**
+ * \fn static inline void sa_set_port(struct sockaddr *sa, int port)
+ * \brief Set the port of a v4 or v6 address.
+ */
+static inline void sa_set_port(struct sockaddr *sa, int port) {
+   ((struct sockaddr_in *)sa)->sin_port = htons(port);
+}
+
+/**
+ * \fn static inline struct tun_rec *serv_learn(struct tun_state *state, const struct ip_family *f, const struct sockaddr_storage *from, int sport)
+ * \brief Add the peer of an unknown source port to the server table.
+ *
+ * \param state The program state
+ * \param f The outer family
+ * \param from The peer address
+ * \param sport The peer base source port
+ * \return The peer record, NULL if the store is full
+ */
+static inline struct tun_rec *serv_learn(struct tun_state *state,
+                                         const struct ip_family *f,
+                                         const struct sockaddr_storage *from,
+                                         int sport) {
+   uint32_t id = recs_add(state->recs);
+   struct tun_rec *rec = rec_get(state, id);
+   if (!rec)
+      return NULL;
+   memcpy(rec_sa(rec, f), from, f->salen);
+   sa_set_port(rec_sa(rec, f), sport);
+   rec->sport = sport;
+   serv_insert(state, sport, id);
+   return rec;
+}
+
+/**
+ * \fn static inline int *spread_fds(struct tun_state *state, const struct ip_family *f)
+ * \brief The source port sockets of a family.
+ */
+static inline int *spread_fds(struct tun_state *state,
+                              const struct ip_family *f) {
+   return f->v6 ? state->spread6 : state->spread4;
+}
+
+/**
+ * \fn static inline struct tun_rec *cli_lookup(struct tun_state *state, const struct ip_family *f, const char *pkt)
+ * \brief Route an inner packet to a peer by its destination address.
+ *
+ * \param state The program state
+ * \param f The packet family
+ * \param pkt The inner IP packet
+ * \return The peer record, NULL if none
+ */
+static inline struct tun_rec *cli_lookup(struct tun_state *state,
+                                         const struct ip_family *f,
+                                         const char *pkt) {
+   if (f->v6)
+      return rec_get(state, lpm6_lookup(state->cli6, (const uint8_t *)pkt + f->dst));
+   uint32_t addr;
+   memcpy(&addr, pkt + f->dst, 4);
+   return rec_get(state, lpm4_lookup(state->cli4, ntohl(addr)));
+}
+
+#endif
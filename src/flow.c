@@ -0,0 +1,1075 @@
+/**
+ * \file flow.c
+ * \brief Event-driven measurement flows (epoll).
+ *
+ *    Flows are kept in a table indexed by slot, the epoll data of a flow
+ *    holds its slot and generation so that events of a flow closed in
+ *    the same epoll_wait() batch are ignored once the slot is reused.
+ *    A timerfd drives TCP_INFO sampling and timeouts. Short flow jobs
+ *    count the connections to start again as theirs end, flow_run()
+ *    starts them between epoll_wait() calls.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <sys/epoll.h>
+#  include <sys/timerfd.h>
+#  include <sys/sendfile.h>
+#endif
+
+#include "flow.h"
+#include "debug.h"
+#include "timing.h"
+#include "sock.h"
+#include "stats.h"
+#include "destruct.h"
+#include "udptun.h"
+
+/**
+ * \def FLOW_LISTENER
+ * \brief epoll data flag of listening sockets, the low bits hold the index.
+ */
+#define FLOW_LISTENER (1ULL << 63)
+
+/**
+ * \def FLOW_TIMER
+ * \brief epoll data of the timerfd.
+ */
+#define FLOW_TIMER (1ULL << 62)
+
+/**
+ * \def FLOW_CLIENT(f)
+ * \brief Client flows are connecting, waiting or receiving.
+ */
+#define FLOW_CLIENT(f) ((f)->state <= FLOW_RECV)
+
+/**
+ * \def FLOW_MIN_CAP
+ * \brief The initial flow table size.
+ */
+#define FLOW_MIN_CAP 64
+
+/**
+ * \enum flow_state
+ * \brief The states of a flow.
+ */
+enum flow_state {
+   FLOW_FREE = 0,    /*!< Free slot */
+   FLOW_CONNECTING,  /*!< Client, connect() in progress */
+   FLOW_WAITING,     /*!< Client, established, waiting for the others (sync) */
+   FLOW_RECV,        /*!< Client, receiving */
+   FLOW_SEND,        /*!< Server, sending */
+   FLOW_CLOSING,     /*!< Server, file sent, waiting for the client FIN */
+   FLOW_ANSWER,      /*!< Server, answering requests until the client FIN */
+};
+
+/**
+ * \fn static uint32_t flow_alloc(struct flow_engine *e)
+ * \brief Take a free slot, grow the table if there is none.
+ *
+ * \return The slot, e->cap if the table is full
+ */
+static uint32_t flow_alloc(struct flow_engine *e);
+
+/**
+ * \fn static void flow_end(struct flow_engine *e, uint32_t i, int err)
+ * \brief Sample, record and close a flow, and free its slot.
+ *
+ * \param err 0 if the flow completed, an errno value otherwise
+ */
+static void flow_end(struct flow_engine *e, uint32_t i, int err);
+
+/**
+ * \fn static void flow_sample(struct flow *f)
+ * \brief Update the TCP_INFO sample of a flow.
+ */
+static void flow_sample(struct flow *f);
+
+/**
+ * \fn static int flow_ctl(struct flow_engine *e, int op, uint32_t i, uint32_t events)
+ * \brief Add or modify the epoll registration of a flow.
+ */
+static int flow_ctl(struct flow_engine *e, int op, uint32_t i, uint32_t events);
+
+/**
+ * \fn static void flow_accept(struct flow_engine *e, int l)
+ * \brief Accept the pending connections of a listener.
+ */
+static void flow_accept(struct flow_engine *e, int l);
+
+/**
+ * \fn static void flow_event(struct flow_engine *e, uint32_t i, uint32_t events)
+ * \brief Advance the state machine of a flow.
+ */
+static void flow_event(struct flow_engine *e, uint32_t i, uint32_t events);
+
+/**
+ * \fn static void flow_tick(struct flow_engine *e)
+ * \brief Sample the open flows and end the timed out ones.
+ */
+static void flow_tick(struct flow_engine *e);
+
+/**
+ * \fn static void flow_release(struct flow_engine *e)
+ * \brief Start reading on all waiting flows (sync).
+ */
+static void flow_release(struct flow_engine *e);
+
+/**
+ * \fn static int flow_open(struct flow_engine *e, struct sockaddr *sa, char *addr, int tun, int mss, int peer, uint32_t job)
+ * \brief Start a client flow.
+ *
+ * \param job The short flow job + 1, 0 for a transfer of the server file
+ * \return 0 if started, -1 on error (counted as failed)
+ */
+static int flow_open(struct flow_engine *e, struct sockaddr *sa, char *addr,
+                     int tun, int mss, int peer, uint32_t job);
+
+/**
+ * \fn static void flow_unstarted(struct flow_engine *e, int tun, uint32_t job)
+ * \brief Count a client flow that could not be started as failed and let
+ *        its short flow job start the next connection.
+ */
+static void flow_unstarted(struct flow_engine *e, int tun, uint32_t job);
+
+/**
+ * \fn static void flow_refill(struct flow_engine *e)
+ * \brief Start the due connections of the short flow jobs.
+ */
+static void flow_refill(struct flow_engine *e);
+
+/**
+ * \fn static int flow_request(struct flow_engine *e, struct flow *f)
+ * \brief Send the pipelined requests of an established short connection.
+ *
+ * \return 0 for success, an errno value otherwise
+ */
+static int flow_request(struct flow_engine *e, struct flow *f);
+
+/**
+ * \fn static void flow_reply(struct flow_engine *e, uint32_t i, uint32_t events)
+ * \brief Read the requests of an accepted flow and send the owed bytes.
+ */
+static void flow_reply(struct flow_engine *e, uint32_t i, uint32_t events);
+
+/**
+ * \fn static void parse_sizes(const char *val, struct flow_sizes *sz)
+ * \brief Parse an object size distribution, dies on error.
+ */
+static void parse_sizes(const char *val, struct flow_sizes *sz);
+
+/**
+ * \fn static uint32_t pick_object(struct flow_engine *e)
+ * \brief Draw an object size.
+ */
+static uint32_t pick_object(struct flow_engine *e);
+
+/**
+ * \fn static void hist_add(struct flow_hist *h, uint64_t v)
+ * \brief Count a sample (us).
+ */
+static void hist_add(struct flow_hist *h, uint64_t v);
+
+/**
+ * \fn static uint64_t hist_pct(const struct flow_hist *h, double p)
+ * \brief The upper bound of the bucket holding a percentile (us).
+ */
+static uint64_t hist_pct(const struct flow_hist *h, double p);
+
+/**
+ * \fn static void class_stats(FILE *fp, const char *name, const struct flow_class *c)
+ * \brief Dump the short connections of a path.
+ */
+static void class_stats(FILE *fp, const char *name, const struct flow_class *c);
+
+/**
+ * \fn static void flow_stats(FILE *fp, void *arg)
+ * \brief Dump the counters of an engine.
+ */
+static void flow_stats(FILE *fp, void *arg);
+
+void flow_stats(FILE *fp, void *arg) {
+   struct flow_engine *e = arg;
+   fprintf(fp, "started %llu\n", (unsigned long long)e->started);
+   fprintf(fp, "done %llu\n", (unsigned long long)e->done);
+   fprintf(fp, "failed %llu\n", (unsigned long long)e->failed);
+   fprintf(fp, "rejected %llu\n", (unsigned long long)e->rejected);
+   fprintf(fp, "bytes %llu\n", (unsigned long long)e->bytes);
+   fprintf(fp, "active %u\n", e->active);
+   fprintf(fp, "peak %u\n", e->peak);
+   fprintf(fp, "table_bytes %llu\n",
+           (unsigned long long)e->cap * sizeof(struct flow));
+   if (e->sizes) {
+      fprintf(fp, "short.requests %u\n", e->requests);
+      class_stats(fp, "short.notun", &e->cls[0]);
+      class_stats(fp, "short.tun", &e->cls[1]);
+   }
+}
+
+void class_stats(FILE *fp, const char *name, const struct flow_class *c) {
+   int64_t busy = c->busy;
+   if (c->active)
+      busy += monotonic_ns() - c->t_busy;
+   fprintf(fp, "%s.conns %llu\n", name, (unsigned long long)c->conns);
+   fprintf(fp, "%s.failed %llu\n", name, (unsigned long long)c->failed);
+   fprintf(fp, "%s.conn_per_s %.1f\n", name,
+           busy > 0 ? c->conns * 1e9 / busy : 0.0);
+   static const double pct[] = {50, 90, 99, 99.9};
+   static const char *pname[] = {"p50", "p90", "p99", "p999"};
+   for (int k=0; k<4; k++)
+      fprintf(fp, "%s.ttfb_%s_us %llu\n", name, pname[k],
+              (unsigned long long)hist_pct(&c->ttfb, pct[k]));
+   fprintf(fp, "%s.ttfb_max_us %llu\n", name, (unsigned long long)c->ttfb.max);
+   for (int k=0; k<4; k++)
+      fprintf(fp, "%s.fct_%s_us %llu\n", name, pname[k],
+              (unsigned long long)hist_pct(&c->fct, pct[k]));
+   fprintf(fp, "%s.fct_max_us %llu\n", name, (unsigned long long)c->fct.max);
+}
+
+uint64_t hist_pct(const struct flow_hist *h, double p) {
+   if (!h->n)
+      return 0;
+   uint64_t rank = (uint64_t)(h->n * p / 100.0), seen = 0;
+   for (uint32_t idx=0; idx<FLOW_HIST_LEN; idx++) {
+      seen += h->b[idx];
+      if (seen <= rank)
+         continue;
+      if (idx < 16)
+         return idx;
+      int k = (idx - 16) / 8 + 4;
+      uint64_t lo = (uint64_t)(8 + (idx - 16) % 8) << (k - 3);
+      uint64_t hi = lo + (1ULL << (k - 3)) - 1;
+      return hi < h->max ? hi : h->max;
+   }
+   return h->max;
+}
+
+#if defined(LINUX_OS)
+
+struct flow_engine *flow_engine_init(const char *name, const char *csv,
+                                     uint32_t sample_ms, uint16_t conn_timeout,
+                                     uint16_t idle_timeout) {
+   struct flow_engine *e = xmalloc(sizeof(struct flow_engine));
+   memset(e, 0, sizeof(struct flow_engine));
+   e->name         = name;
+   e->sample_ms    = sample_ms;
+   e->conn_timeout = conn_timeout * 1000000000LL;
+   e->idle_timeout = idle_timeout * 1000000000LL;
+   e->file         = -1;
+   e->buf          = xmalloc(BUFF_SIZE);
+
+   /* one fd per flow, the fd limit bounds the table */
+   struct rlimit rl;
+   if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+      die("getrlimit");
+   if (rl.rlim_cur < rl.rlim_max) {
+      rl.rlim_cur = rl.rlim_max;
+      if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+         debug_print("%s: setrlimit: %s\n", name, strerror(errno));
+      }
+      getrlimit(RLIMIT_NOFILE, &rl);
+   }
+   e->max = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1U << 24)) ?
+               (1U << 24) : (uint32_t)rl.rlim_cur;
+   e->free_head = e->cap;
+
+   if ((e->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      die("epoll_create1");
+   set_fd(e->epfd);
+
+   /* sampling & timeouts clock */
+   uint32_t tick = sample_ms ? sample_ms : FLOW_IDLE_TICK;
+   struct itimerspec its = {
+      {tick / 1000, (tick % 1000) * 1000000L},
+      {tick / 1000, (tick % 1000) * 1000000L},
+   };
+   if ((e->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+      die("timerfd_create");
+   set_fd(e->timer);
+   if (timerfd_settime(e->timer, 0, &its, NULL) < 0)
+      die("timerfd_settime");
+   struct epoll_event ev = {EPOLLIN, {.u64 = FLOW_TIMER}};
+   if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->timer, &ev) < 0)
+      die("epoll_ctl");
+
+   if (csv) {
+      if (!(e->out = fopen(csv, "w")))
+         die("fopen flows");
+      fprintf(e->out, "peer,remote,family,tun,status,bytes,connect_us,"
+                      "ttfb_us,duration_us,goodput_kbps,rtt_us,rtt_min_us,"
+                      "rttvar_us,cwnd,retrans,samples\n");
+      mode_t m = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+      chmod(csv, m);
+   }
+
+   stats_register(name, flow_stats, e);
+   debug_print("%s: flow engine, up to %u flows\n", name, e->max);
+   return e;
+}
+
+void flow_engine_free(struct flow_engine *e) {
+   for (uint32_t i=0; i<e->cap; i++)
+      if (e->flows[i].fd >= 0)
+         flow_end(e, i, ECANCELED);
+   for (int l=0; l<e->nlisten; l++)
+      close_fd(e->listeners[l]);
+   e->nlisten = 0;
+   if (e->file >= 0)
+      close(e->file);
+   close_fd(e->timer);
+   close_fd(e->epfd);
+   if (e->out)
+      fclose(e->out);
+   e->out = NULL;
+   free(e->buf);
+   free(e->flows);
+   free(e->jobs);
+   e->jobs  = NULL;
+   e->njobs = e->due = 0;
+   e->flows = NULL;
+   e->buf   = NULL;
+   e->cap   = e->free_head = 0;
+}
+
+uint32_t flow_alloc(struct flow_engine *e) {
+   if (e->free_head == e->cap) {
+      if (e->cap >= e->max)
+         return e->cap;
+      uint32_t ncap = e->cap ? 2 * e->cap : FLOW_MIN_CAP;
+      if (ncap > e->max)
+         ncap = e->max;
+      if (!(e->flows = realloc(e->flows, ncap * sizeof(struct flow))))
+         die("realloc");
+      memset(e->flows + e->cap, 0, (ncap - e->cap) * sizeof(struct flow));
+      /* the free list is empty, chain the new slots in order */
+      for (uint32_t i=e->cap; i<ncap; i++) {
+         e->flows[i].fd   = -1;
+         e->flows[i].next = i + 1;
+      }
+      e->free_head = e->cap;
+      e->cap = ncap;
+   }
+   uint32_t i = e->free_head;
+   struct flow *f = &e->flows[i];
+   e->free_head = f->next;
+
+   uint32_t gen = f->gen + 1;
+   memset(f, 0, sizeof(struct flow));
+   f->gen = gen;
+   f->fd  = -1;
+   return i;
+}
+
+int flow_ctl(struct flow_engine *e, int op, uint32_t i, uint32_t events) {
+   struct epoll_event ev;
+   ev.events   = events;
+   ev.data.u64 = ((uint64_t)e->flows[i].gen << 32) | i;
+   return epoll_ctl(e->epfd, op, e->flows[i].fd, &ev);
+}
+
+void flow_sample(struct flow *f) {
+   struct tcp_info ti;
+   socklen_t len = sizeof(ti);
+   if (getsockopt(f->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+      return;
+   f->rtt     = ti.tcpi_rtt;
+   f->rttvar  = ti.tcpi_rttvar;
+   f->cwnd    = ti.tcpi_snd_cwnd;
+   f->retrans = ti.tcpi_total_retrans;
+   if (ti.tcpi_rtt && (!f->rtt_min || ti.tcpi_rtt < f->rtt_min))
+      f->rtt_min = ti.tcpi_rtt;
+   f->samples++;
+}
+
+void flow_end(struct flow_engine *e, uint32_t i, int err) {
+   struct flow *f = &e->flows[i];
+   int64_t now = monotonic_ns();
+   if (f->state != FLOW_CONNECTING)
+      flow_sample(f);
+
+   if (e->out) {
+      struct sockaddr_storage ss;
+      socklen_t sslen = sizeof(ss);
+      char remote[INET6_ADDRSTRLEN] = "-";
+      int fam = 0;
+      if (!getpeername(f->fd, (struct sockaddr *)&ss, &sslen)) {
+         fam = ss.ss_family == AF_INET6 ? 6 : 4;
+         if (fam == 6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr,
+                      remote, sizeof(remote));
+         else
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr,
+                      remote, sizeof(remote));
+      }
+      int64_t dur = now - f->t_start;
+      int64_t xfer = f->t_first ? now - f->t_first : 0;
+      fprintf(e->out, "%d,%s,%d,%u,%s,%llu,%lld,%lld,%lld,%llu,%u,%u,%u,%u,%u,%u\n",
+              FLOW_CLIENT(f) ? (int)f->peer : -1, remote, fam, f->tun,
+              err ? strerror(err) : "ok", (unsigned long long)f->bytes,
+              f->t_est ? (long long)(f->t_est - f->t_start) / 1000 : -1LL,
+              f->t_first && f->t_est ? (long long)(f->t_first - f->t_est) / 1000 : -1LL,
+              (long long)dur / 1000,
+              xfer > 0 ? (unsigned long long)(f->bytes * 8000000ULL / (uint64_t)xfer) : 0ULL,
+              f->rtt, f->rtt_min, f->rttvar, f->cwnd, f->retrans, f->samples);
+   }
+
+   if (err) {
+      e->failed++;
+      debug_print("%s: flow %u closed on error: %s\n", e->name, i, strerror(err));
+   } else {
+      e->done++;
+   }
+   if (f->job) {
+      struct flow_class *c = &e->cls[f->tun];
+      if (err) {
+         c->failed++;
+      } else {
+         hist_add(&c->ttfb, (f->t_first - f->t_start) / 1000);
+         hist_add(&c->fct, (now - f->t_start) / 1000);
+         c->conns++;
+      }
+      if (!--c->active)
+         c->busy += now - c->t_busy;
+
+      /* the next connection of the job */
+      struct flow_job *j = &e->jobs[f->job - 1];
+      if (j->left) {
+         j->due++;
+         e->due++;
+      }
+   }
+   e->bytes += f->bytes;
+   if (f->state == FLOW_CONNECTING)
+      e->connecting--;
+   if (FLOW_CLIENT(f))
+      e->pending--;
+   e->active--;
+
+   /* closing removes the fd from the epoll set */
+   close_fd(f->fd);
+   f->fd    = -1;
+   f->state = FLOW_FREE;
+   f->next  = e->free_head;
+   e->free_head = i;
+
+   if (e->sync && !e->connecting)
+      flow_release(e);
+}
+
+int flow_connect(struct flow_engine *e, struct sockaddr *sa,
+                 char *addr, int tun, int mss, int peer) {
+   return flow_open(e, sa, addr, tun, mss, peer, 0);
+}
+
+int flow_open(struct flow_engine *e, struct sockaddr *sa, char *addr,
+              int tun, int mss, int peer, uint32_t job) {
+   sa_family_t sfam = sa->sa_family;
+   uint32_t i = flow_alloc(e);
+   e->started++;
+   e->pending++;
+   if (i == e->cap) {
+      debug_print("%s: flow table full\n", e->name);
+      flow_unstarted(e, tun, job);
+      return -1;
+   }
+   struct flow *f = &e->flows[i];
+   f->tun     = tun;
+   f->peer    = peer;
+   f->t_start = f->t_last = monotonic_ns();
+   f->state   = FLOW_CONNECTING;
+   e->connecting++;
+   e->active++;
+   if (e->active > e->peak)
+      e->peak = e->active;
+
+   if ((f->fd = socket(sfam, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       IPPROTO_TCP)) < 0) {
+      /* out of fds, not fatal */
+      debug_print("%s: socket: %s\n", e->name, strerror(errno));
+      f->fd = -1;
+      e->connecting--;
+      e->active--;
+      f->state = FLOW_FREE;
+      f->next  = e->free_head;
+      e->free_head = i;
+      flow_unstarted(e, tun, job);
+      return -1;
+   }
+   if (job) {
+      struct flow_class *c = &e->cls[tun];
+      if (!c->active++)
+         c->t_busy = f->t_start;
+      f->job = job;
+   }
+   set_fd(f->fd);
+
+   if (tun && setsockopt(f->fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)) < 0)
+      die("setsockopt maxseg");
+
+   /* bind the local address, ephemeral port */
+   size_t salen;
+   struct sockaddr *sout;
+   if (sfam == AF_INET6) {
+      sout  = (struct sockaddr *)get_addr6(addr, 0);
+      salen = sizeof(struct sockaddr_in6);
+   } else {
+      sout  = (struct sockaddr *)get_addr4(addr, 0);
+      salen = sizeof(struct sockaddr_in);
+   }
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+   /* short connections: pick the port at connect(), on the 4-tuple */
+   int on = 1;
+   if (job && setsockopt(f->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, 
+                         sizeof(on)) < 0) {
+      debug_print("%s: IP_BIND_ADDRESS_NO_PORT: %s\n", e->name, strerror(errno));
+   }
+#endif
+   int ret = bind(f->fd, sout, salen);
+   free(sout);
+   if (ret < 0) {
+      flow_end(e, i, errno);
+      return -1;
+   }
+   if (connect(f->fd, sa, salen) < 0 && errno != EINPROGRESS) {
+      flow_end(e, i, errno);
+      return -1;
+   }
+   if (flow_ctl(e, EPOLL_CTL_ADD, i, EPOLLOUT) < 0)
+      die("epoll_ctl");
+   return 0;
+}
+
+int flow_listen(struct flow_engine *e, char *addr, int port, int tun,
+                int mss, sa_family_t sfam, int backlog) {
+   if (e->nlisten == FLOW_MAX_LISTENERS) {
+      errno=ENOSPC;
+      die("flow_listen");
+   }
+   int s;
+   if ((s=socket(sfam, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+      die("socket");
+   set_fd(s);
+
+   /* Set Modified MSS for tunneled TCP, inherited by accepted sockets */
+   if (tun && setsockopt(s, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)) < 0)
+      die("setsockopt maxseg");
+   int on = 1;
+   if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) < 0)
+      die("setsockopt failed");
+
+   size_t salen;
+   struct sockaddr *sout;
+   if (sfam == AF_INET6) {
+      sout  = (struct sockaddr *)get_addr6(addr, port);
+      salen = sizeof(struct sockaddr_in6);
+   } else {
+      sout  = (struct sockaddr *)get_addr4(addr, port);
+      salen = sizeof(struct sockaddr_in);
+   }
+   if (bind(s, sout, salen) < 0) {
+      debug_print("died binding %s:%d ...\n", addr ? addr : "*", port);
+      die("bind tcp server");
+   }
+   free(sout);
+   if (listen(s, backlog) < 0)
+      die("listen");
+
+   struct epoll_event ev = {EPOLLIN, {.u64 = FLOW_LISTENER | e->nlisten}};
+   if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, s, &ev) < 0)
+      die("epoll_ctl");
+   e->listen_tun[e->nlisten] = tun;
+   e->listeners[e->nlisten++] = s;
+   debug_print("%s: listening at %s:%d ...\n", e->name, addr ? addr : "*", port);
+   return s;
+}
+
+void flow_serve(struct flow_engine *e, const char *file) {
+   struct stat st;
+   if ((e->file = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+      die("file note found");
+   if (fstat(e->file, &st) < 0)
+      die("fstat");
+   e->file_size = st.st_size;
+}
+
+void flow_accept(struct flow_engine *e, int l) {
+   int ws;
+   while ((ws = accept(e->listeners[l], NULL, NULL)) >= 0) {
+      uint32_t i = flow_alloc(e);
+      if (i == e->cap) {
+         close(ws);
+         e->rejected++;
+         continue;
+      }
+      set_fd(ws);
+      set_nonblock(ws);
+      struct flow *f = &e->flows[i];
+      f->fd      = ws;
+      f->tun     = e->listen_tun[l];
+      f->t_start = f->t_est = f->t_last = monotonic_ns();
+      f->state   = e->answer ? FLOW_ANSWER : FLOW_SEND;
+      e->started++;
+      e->active++;
+      if (e->active > e->peak)
+         e->peak = e->active;
+      flow_sample(f);
+      if (flow_ctl(e, EPOLL_CTL_ADD, i, e->answer ? EPOLLIN | EPOLLRDHUP
+                                                  : EPOLLOUT) < 0)
+         die("epoll_ctl");
+   }
+   if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+      /* EMFILE & co, retried on the next event */
+      debug_print("%s: accept: %s\n", e->name, strerror(errno));
+   }
+}
+
+void flow_release(struct flow_engine *e) {
+   e->held = 0;
+   for (uint32_t i=0; i<e->cap; i++) {
+      struct flow *f = &e->flows[i];
+      if (f->fd < 0 || f->state != FLOW_WAITING)
+         continue;
+      f->state  = FLOW_RECV;
+      f->t_last = monotonic_ns();
+      if (flow_ctl(e, EPOLL_CTL_MOD, i, EPOLLIN | EPOLLRDHUP) < 0)
+         die("epoll_ctl");
+      e->held++;
+   }
+   e->sync = 0;
+}
+
+void flow_event(struct flow_engine *e, uint32_t i, uint32_t events) {
+   struct flow *f = &e->flows[i];
+   ssize_t n = 0;
+   int err;
+   socklen_t len = sizeof(err);
+   int64_t now = monotonic_ns();
+
+   switch (f->state) {
+      case FLOW_CONNECTING:
+         if (getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+         if (err) {
+            flow_end(e, i, err);
+            return;
+         }
+         f->t_est = f->t_last = now;
+         f->state = e->sync ? FLOW_WAITING : FLOW_RECV;
+         e->connecting--;
+         flow_sample(f);
+         if (f->job && (err = flow_request(e, f))) {
+            flow_end(e, i, err);
+            return;
+         }
+         if (f->state == FLOW_WAITING) {
+            if (flow_ctl(e, EPOLL_CTL_MOD, i, 0) < 0)
+               die("epoll_ctl");
+            if (!e->connecting)
+               flow_release(e);
+         } else if (flow_ctl(e, EPOLL_CTL_MOD, i, EPOLLIN | EPOLLRDHUP) < 0) {
+            die("epoll_ctl");
+         }
+         return;
+
+      case FLOW_WAITING:
+         /* only errors are reported while waiting */
+         flow_end(e, i, ECONNRESET);
+         return;
+
+      case FLOW_RECV:
+         while ((n = recv(f->fd, e->buf, BUFF_SIZE, 0)) > 0) {
+            if (!f->t_first)
+               f->t_first = now;
+            f->bytes += n;
+         }
+         f->t_last = now;
+         if (f->job && f->bytes >= f->want) {
+            /* all objects received, the client closes */
+            flow_end(e, i, 0);
+         } else if (n == 0) {
+            /* server done, FIN sent back on close */
+            flow_end(e, i, 0);
+         } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            flow_end(e, i, errno);
+         }
+         return;
+
+      case FLOW_SEND:
+         if (events & (EPOLLERR | EPOLLHUP)) {
+            flow_end(e, i, ECONNRESET);
+            return;
+         }
+         while ((uint64_t)f->bytes < e->file_size) {
+            off_t off = f->bytes;
+            n = sendfile(f->fd, e->file, &off, e->file_size - f->bytes);
+            if (n <= 0)
+               break;
+            if (!f->t_first)
+               f->t_first = now;
+            f->bytes += n;
+            f->t_last = now;
+         }
+         if ((uint64_t)f->bytes < e->file_size) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+               flow_end(e, i, errno);
+            else if (n == 0)
+               flow_end(e, i, EIO);
+            return;
+         }
+         /* file sent, wait for the client to close */
+         shutdown(f->fd, SHUT_WR);
+         f->state  = FLOW_CLOSING;
+         f->t_last = now;
+         if (flow_ctl(e, EPOLL_CTL_MOD, i, EPOLLIN | EPOLLRDHUP) < 0)
+            die("epoll_ctl");
+         return;
+
+      case FLOW_CLOSING:
+         while ((n = recv(f->fd, e->buf, BUFF_SIZE, 0)) > 0)
+            ;
+         if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            flow_end(e, i, 0);
+         return;
+
+      case FLOW_ANSWER:
+         flow_reply(e, i, events);
+         return;
+
+      default:
+         return;
+   }
+}
+
+void hist_add(struct flow_hist *h, uint64_t v) {
+   uint32_t idx;
+   if (v < 16) {
+      idx = v;
+   } else {
+      int p = 63 - __builtin_clzll(v);
+      idx = 16 + (p - 4) * 8 + ((v >> (p - 3)) & 7);
+      if (idx >= FLOW_HIST_LEN)
+         idx = FLOW_HIST_LEN - 1;
+   }
+   h->b[idx]++;
+   h->n++;
+   if (v > h->max)
+      h->max = v;
+}
+
+void parse_sizes(const char *val, struct flow_sizes *sz) {
+   const char *p = val ? val : "1000";
+   uint32_t w = 0;
+   memset(sz, 0, sizeof(struct flow_sizes));
+   while (*p) {
+      char *end;
+      unsigned long lo = strtoul(p, &end, 10), hi = lo, cw = 1;
+      if (end == p)
+         break;
+      if (*end == '-')
+         hi = strtoul(end + 1, &end, 10);
+      if (*end == ':')
+         cw = strtoul(end + 1, &end, 10);
+      if (sz->len == FLOW_MAX_SIZES || !lo || lo > hi || hi > FLOW_MAX_OBJECT ||
+            !cw || (*end && *end != ','))
+         break;
+      w += cw;
+      sz->lo[sz->len] = lo;
+      sz->hi[sz->len] = hi;
+      sz->w[sz->len++] = w;
+      p = *end ? end + 1 : end;
+   }
+   if (*p || !sz->len) {
+      errno=EINVAL;
+      die("short-size");
+   }
+}
+
+uint32_t pick_object(struct flow_engine *e) {
+   /* xorshift64 */
+   uint64_t x = e->rnd;
+   x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+   e->rnd = x;
+   const struct flow_sizes *sz = e->sizes;
+   uint32_t c = 0, r = (x >> 32) % sz->w[sz->len - 1];
+   while (r >= sz->w[c])
+      c++;
+   return sz->lo[c] + (uint32_t)(x % ((uint64_t)sz->hi[c] - sz->lo[c] + 1));
+}
+
+void flow_short(struct flow_engine *e, const char *sizes, uint16_t requests) {
+   e->sizes = xmalloc(sizeof(struct flow_sizes));
+   parse_sizes(sizes, e->sizes);
+   e->requests = requests ? requests : 1;
+   if (e->requests > FLOW_MAX_REQUESTS) {
+      errno=EINVAL;
+      die("short-requests");
+   }
+   e->rnd = 0x9e3779b97f4a7c15ULL ^ (uint64_t)monotonic_ns();
+}
+
+void flow_start(struct flow_engine *e, struct sockaddr *sa, char *addr,
+                int tun, int mss, int peer, uint32_t count,
+                uint32_t concurrent) {
+   if (!count)
+      return;
+   if (!(e->jobs = realloc(e->jobs, (e->njobs + 1) * sizeof(struct flow_job))))
+      die("realloc");
+   struct flow_job *j = &e->jobs[e->njobs++];
+   memset(j, 0, sizeof(struct flow_job));
+   memcpy(&j->sa, sa, sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                                : sizeof(struct sockaddr_in));
+   j->addr = addr;
+   j->tun  = tun;
+   j->mss  = mss;
+   j->peer = peer;
+   j->left = count;
+   j->due  = concurrent ? (concurrent < count ? concurrent : count) : 1;
+   e->due += j->due;
+}
+
+void flow_answer(struct flow_engine *e) {
+   e->answer = 1;
+}
+
+void flow_unstarted(struct flow_engine *e, int tun, uint32_t job) {
+   e->failed++;
+   e->pending--;
+   if (!job)
+      return;
+   e->cls[tun].failed++;
+   if (e->jobs[job - 1].left) {
+      e->jobs[job - 1].due++;
+      e->due++;
+   }
+}
+
+void flow_refill(struct flow_engine *e) {
+   /* a connection that fails to start (full table, out of fds) is due
+    * again, retried once the next events were handled */
+   for (uint32_t k=0; k<e->njobs && e->due; k++) {
+      struct flow_job *j = &e->jobs[k];
+      while (j->due) {
+         j->due--;
+         e->due--;
+         if (!j->left)
+            continue;
+         j->left--;
+         if (flow_open(e, (struct sockaddr *)&j->sa, j->addr, j->tun,
+                       j->mss, j->peer, k + 1) < 0)
+            return;
+      }
+   }
+}
+
+int flow_request(struct flow_engine *e, struct flow *f) {
+   uint32_t req[FLOW_MAX_REQUESTS];
+   for (int r=0; r<e->requests; r++) {
+      uint32_t size = pick_object(e);
+      f->want += size;
+      req[r] = htonl(size);
+   }
+   size_t len = e->requests * sizeof(uint32_t);
+   ssize_t n = send(f->fd, req, len, MSG_NOSIGNAL);
+   if (n < 0)
+      return errno;
+   return (size_t)n == len ? 0 : EIO;
+}
+
+void flow_reply(struct flow_engine *e, uint32_t i, uint32_t events) {
+   struct flow *f = &e->flows[i];
+   int64_t now = monotonic_ns();
+   ssize_t n = 0;
+   int fin = 0;
+
+   if (events & EPOLLERR) {
+      flow_end(e, i, ECONNRESET);
+      return;
+   }
+
+   /* requests, possibly split across reads */
+   if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+      while ((n = recv(f->fd, e->buf, BUFF_SIZE, 0)) > 0) {
+         for (ssize_t k=0; k<n; k++) {
+            f->req = (f->req << 8) | (uint8_t)e->buf[k];
+            if (++f->req_len < sizeof(uint32_t))
+               continue;
+            f->want += f->req < FLOW_MAX_OBJECT ? f->req : FLOW_MAX_OBJECT;
+            f->req = f->req_len = 0;
+         }
+         f->t_last = now;
+      }
+      if (n == 0) {
+         fin = 1;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+         flow_end(e, i, errno);
+         return;
+      }
+   }
+
+   /* the payload is whatever the shared buffer holds */
+   while (f->want && !fin) {
+      size_t len = f->want < BUFF_SIZE ? f->want : BUFF_SIZE;
+      if ((n = send(f->fd, e->buf, len, MSG_NOSIGNAL)) <= 0)
+         break;
+      if (!f->t_first)
+         f->t_first = now;
+      f->want  -= n;
+      f->bytes += n;
+      f->t_last = now;
+   }
+   if (f->want && !fin && n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      flow_end(e, i, errno);
+      return;
+   }
+   if (fin) {
+      /* the client closes once it got everything it asked for */
+      flow_end(e, i, f->want ? ECONNRESET : 0);
+      return;
+   }
+
+   uint8_t sending = f->want != 0;
+   if (sending != f->sending) {
+      f->sending = sending;
+      if (flow_ctl(e, EPOLL_CTL_MOD, i, EPOLLIN | EPOLLRDHUP |
+                   (sending ? EPOLLOUT : 0)) < 0)
+         die("epoll_ctl");
+   }
+}
+
+void flow_tick(struct flow_engine *e) {
+   int64_t now = monotonic_ns();
+   for (uint32_t i=0; i<e->cap; i++) {
+      struct flow *f = &e->flows[i];
+      if (f->fd < 0)
+         continue;
+      switch (f->state) {
+         case FLOW_CONNECTING:
+            if (e->conn_timeout && now - f->t_start > e->conn_timeout)
+               flow_end(e, i, ETIMEDOUT);
+            continue;
+         case FLOW_WAITING:
+            continue;
+         case FLOW_CLOSING:
+            if (now - f->t_last > CLOSE_TIMEOUT * 1000000000LL)
+               flow_end(e, i, 0);
+            continue;
+         default:
+            break;
+      }
+      if (e->idle_timeout && now - f->t_last > e->idle_timeout) {
+         flow_end(e, i, ETIMEDOUT);
+         continue;
+      }
+      if (e->sample_ms)
+         flow_sample(f);
+   }
+   if (e->out)
+      fflush(e->out);
+}
+
+void flow_run(struct flow_engine *e) {
+   struct epoll_event events[FLOW_EVENTS];
+   uint64_t ticks;
+
+   if (e->sync && !e->connecting)
+      flow_release(e);
+
+   while (e->nlisten || e->pending || e->due) {
+      if (e->due)
+         flow_refill(e);
+      if (!e->nlisten && !e->pending)
+         break;
+      int n = epoll_wait(e->epfd, events, FLOW_EVENTS, -1);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         die("epoll_wait");
+      }
+      for (int k=0; k<n; k++) {
+         uint64_t data = events[k].data.u64;
+         if (data == FLOW_TIMER) {
+            if (read(e->timer, &ticks, sizeof(ticks)) == sizeof(ticks))
+               flow_tick(e);
+         } else if (data & FLOW_LISTENER) {
+            flow_accept(e, (int)(data & ~FLOW_LISTENER));
+         } else {
+            uint32_t i = (uint32_t)data;
+            /* stale event of a flow closed earlier in this batch */
+            if (i >= e->cap || e->flows[i].fd < 0 ||
+                  e->flows[i].gen != (uint32_t)(data >> 32))
+               continue;
+            flow_event(e, i, events[k].events);
+         }
+      }
+   }
+   /* all short connections ended, the ones that could not be started
+    * with nothing left to wait for count as failed */
+   if (!e->pending) {
+      for (uint32_t k=0; k<e->njobs; k++)
+         e->cls[e->jobs[k].tun].failed += e->jobs[k].left;
+      e->njobs = 0;
+      e->due   = 0;
+   }
+   if (e->out)
+      fflush(e->out);
+}
+
+#else
+
+struct flow_engine *flow_engine_init(const char *UNUSED(name),
+                                     const char *UNUSED(csv),
+                                     uint32_t UNUSED(sample_ms),
+                                     uint16_t UNUSED(conn_timeout),
+                                     uint16_t UNUSED(idle_timeout)) {
+   errno=ENOSYS;
+   die("flow engine requires epoll");
+   return NULL;
+}
+
+void flow_engine_free(struct flow_engine *UNUSED(e)) {}
+
+int flow_connect(struct flow_engine *UNUSED(e), struct sockaddr *UNUSED(sa),
+                 char *UNUSED(addr), int UNUSED(tun), int UNUSED(mss),
+                 int UNUSED(peer)) {
+   return -1;
+}
+
+int flow_listen(struct flow_engine *UNUSED(e), char *UNUSED(addr),
+                int UNUSED(port), int UNUSED(tun), int UNUSED(mss),
+                sa_family_t UNUSED(sfam), int UNUSED(backlog)) {
+   return -1;
+}
+
+void flow_serve(struct flow_engine *UNUSED(e), const char *UNUSED(file)) {}
+
+void flow_short(struct flow_engine *UNUSED(e), const char *UNUSED(sizes),
+                uint16_t UNUSED(requests)) {}
+
+void flow_start(struct flow_engine *UNUSED(e), struct sockaddr *UNUSED(sa),
+                char *UNUSED(addr), int UNUSED(tun), int UNUSED(mss),
+                int UNUSED(peer), uint32_t UNUSED(count),
+                uint32_t UNUSED(concurrent)) {}
+
+void flow_answer(struct flow_engine *UNUSED(e)) {}
+
+void flow_run(struct flow_engine *UNUSED(e)) {}
+
+#endif
@@ -0,0 +1,326 @@
+/**
+ * \file flow.h
+ * \brief Event-driven measurement flows.
+ *
+ *    An engine runs many TCP measurement flows (client or server side)
+ *    in the calling thread with epoll: each flow is a small state machine
+ *    (connecting, receiving or sending, closing) with its own timestamps
+ *    and TCP_INFO samples, so that the amount of concurrent flows is
+ *    bounded by fds rather than by threads and stacks. Servers send the
+ *    server file with sendfile() from a single descriptor, clients
+ *    receive into one shared buffer. A record per flow is appended to a
+ *    CSV file when the flow ends.
+ *
+ *    In the short flow mode, a client runs jobs of many short connections
+ *    to a destination, a few at a time: each connection pipelines a few
+ *    requests (the object size, 4 bytes in network byte order) as soon as
+ *    it is established, and is closed by the client once the objects are
+ *    received, which starts the next connection of the job. Servers send
+ *    the requested amount of bytes instead of the file. The connection
+ *    rate, time to first byte and flow completion time (both from
+ *    connect()) of the tunneled and direct connections are reported in
+ *    the stats section of the client engine.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_FLOW_H
+#define UDPTUN_FLOW_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+/**
+ * \def FLOW_EVENTS
+ * \brief The amount of events handled per epoll_wait() call.
+ */
+#define FLOW_EVENTS 256
+
+/**
+ * \def FLOW_MAX_LISTENERS
+ * \brief The maximal amount of listening sockets per engine.
+ */
+#define FLOW_MAX_LISTENERS 8
+
+/**
+ * \def FLOW_IDLE_TICK
+ * \brief The timer period (ms) when TCP_INFO sampling is disabled,
+ *        used for timeouts only.
+ */
+#define FLOW_IDLE_TICK 1000
+
+/**
+ * \def FLOW_MAX_SIZES
+ * \brief The maximal amount of classes of an object size distribution.
+ */
+#define FLOW_MAX_SIZES 16
+
+/**
+ * \def FLOW_MAX_REQUESTS
+ * \brief The maximal amount of pipelined requests per short connection.
+ */
+#define FLOW_MAX_REQUESTS 64
+
+/**
+ * \def FLOW_MAX_OBJECT
+ * \brief The maximal object size (bytes).
+ */
+#define FLOW_MAX_OBJECT (1U << 30)
+
+/**
+ * \def FLOW_HIST_LEN
+ * \brief The amount of log-linear histogram buckets (8 per power of 2,
+ *        exact below 16us, up to 2^40us).
+ */
+#define FLOW_HIST_LEN (16 + 37 * 8)
+
+/**
+ * \struct flow
+ *	\brief A measurement flow.
+ */
+struct flow {
+   int      fd;          /*!< The socket, -1 if the slot is free */
+   uint32_t gen;         /*!< Slot generation, filters stale events */
+   uint8_t  state;       /*!< enum flow_state */
+   uint8_t  tun;         /*!< Tunneled flow (TCP_MAXSEG set) */
+   uint16_t peer;        /*!< The destination index (client) */
+   uint32_t next;        /*!< The next free slot */
+   uint64_t bytes;       /*!< Bytes received (client) or sent (server) */
+   int64_t  t_start;     /*!< connect() or accept() time (ns) */
+   int64_t  t_est;       /*!< Connection established (ns) */
+   int64_t  t_first;     /*!< First byte received or sent (ns) */
+   int64_t  t_last;      /*!< Last activity (ns) */
+   uint32_t rtt;         /*!< Last smoothed RTT (us) */
+   uint32_t rtt_min;     /*!< Minimal smoothed RTT (us) */
+   uint32_t rttvar;      /*!< Last RTT variance (us) */
+   uint32_t cwnd;        /*!< Last congestion window (segments) */
+   uint32_t retrans;     /*!< Total retransmitted segments */
+   uint32_t samples;     /*!< TCP_INFO samples */
+   uint32_t job;         /*!< The short flow job + 1 (client), 0 if none */
+   uint64_t want;        /*!< Bytes requested (short client), owed (server) */
+   uint32_t req;         /*!< Partial request (server) */
+   uint8_t  req_len;     /*!< Received bytes of the partial request */
+   uint8_t  sending;     /*!< EPOLLOUT is registered (server) */
+};
+
+/**
+ * \struct flow_sizes
+ *	\brief An object size distribution: weighted classes, uniform sizes
+ *         within a class.
+ */
+struct flow_sizes {
+   uint32_t lo[FLOW_MAX_SIZES];  /*!< Minimal sizes */
+   uint32_t hi[FLOW_MAX_SIZES];  /*!< Maximal sizes */
+   uint32_t w[FLOW_MAX_SIZES];   /*!< Cumulated weights */
+   uint32_t len;                 /*!< The amount of classes */
+};
+
+/**
+ * \struct flow_job
+ *	\brief Short connections to a destination.
+ */
+struct flow_job {
+   struct sockaddr_storage sa;   /*!< The server address */
+   char    *addr;                /*!< The local address or NULL */
+   int      tun;                 /*!< Tunneled connections */
+   int      mss;                 /*!< The TCP_MAXSEG value if tun */
+   int      peer;                /*!< The destination index */
+   uint32_t left;                /*!< Connections not started yet */
+   uint32_t due;                 /*!< Connections to start now */
+};
+
+/**
+ * \struct flow_hist
+ *	\brief A log-linear histogram of durations (us).
+ */
+struct flow_hist {
+   uint64_t n;                   /*!< Samples */
+   uint64_t max;                 /*!< The maximal sample */
+   uint64_t b[FLOW_HIST_LEN];    /*!< Samples per bucket */
+};
+
+/**
+ * \struct flow_class
+ *	\brief The short connections of a path (direct or tunneled).
+ */
+struct flow_class {
+   uint64_t conns;               /*!< Completed connections */
+   uint64_t failed;              /*!< Failed connections */
+   uint32_t active;              /*!< Open connections */
+   int64_t  t_busy;              /*!< Since when connections are open (ns) */
+   int64_t  busy;                /*!< Time with open connections (ns) */
+   struct flow_hist ttfb;        /*!< connect() to first byte */
+   struct flow_hist fct;         /*!< connect() to last byte */
+};
+
+/**
+ * \struct flow_engine
+ *	\brief A set of flows run by one thread.
+ */
+struct flow_engine {
+   const char  *name;        /*!< The stats section name */
+   int          epfd;        /*!< The epoll instance */
+   int          timer;       /*!< The sampling & timeouts timerfd */
+   uint32_t     sample_ms;   /*!< TCP_INFO sampling period, 0 to disable */
+   int64_t      conn_timeout;/*!< connect() timeout (ns), 0 for none */
+   int64_t      idle_timeout;/*!< Inactivity timeout (ns), 0 for none */
+   int          sync;        /*!< Client flows wait for each other before reading,
+                                  reset once they are released */
+
+   struct flow *flows;       /*!< The flow table */
+   uint32_t     cap;         /*!< The table size */
+   uint32_t     max;         /*!< The maximal table size */
+   uint32_t     free_head;   /*!< The first free slot, cap if none */
+   uint32_t     active;      /*!< Open flows */
+   uint32_t     pending;     /*!< Client flows not done yet */
+   uint32_t     connecting;  /*!< Client flows not established yet */
+
+   int          listeners[FLOW_MAX_LISTENERS]; /*!< Listening sockets */
+   uint8_t      listen_tun[FLOW_MAX_LISTENERS];/*!< Tunneled listeners */
+   int          nlisten;     /*!< The amount of listening sockets */
+   int          file;        /*!< The file served, -1 if none */
+   uint64_t     file_size;   /*!< The size of the file served */
+
+   char        *buf;         /*!< The receive buffer, shared by flows */
+   FILE        *out;         /*!< The per-flow records or NULL */
+
+   uint64_t     started;     /*!< Flows started */
+   uint64_t     done;        /*!< Flows completed */
+   uint64_t     failed;      /*!< Flows closed on error or timeout */
+   uint64_t     rejected;    /*!< Connections refused, table full */
+   uint64_t     bytes;       /*!< Payload bytes of ended flows */
+   uint32_t     peak;        /*!< Maximal amount of open flows */
+   uint32_t     held;        /*!< Established flows at the last release (sync) */
+
+   struct flow_sizes *sizes; /*!< Short flows object sizes, NULL if disabled */
+   uint16_t     requests;    /*!< Pipelined requests per short connection */
+   uint8_t      answer;      /*!< Accepted flows answer requests (server) */
+   uint64_t     rnd;         /*!< Object size generator state */
+   struct flow_job *jobs;    /*!< Short flow jobs */
+   uint32_t     njobs;       /*!< The amount of jobs */
+   uint32_t     due;         /*!< Connections to start now, all jobs */
+   struct flow_class cls[2]; /*!< Short connections, direct and tunneled */
+};
+
+/**
+ * \fn struct flow_engine *flow_engine_init(const char *name, const char *csv,
+ *                           uint32_t sample_ms, uint16_t conn_timeout,
+ *                           uint16_t idle_timeout)
+ * \brief Create an engine and register its stats section. Raises the
+ *        fd soft limit to the hard limit, which bounds the flow table.
+ *
+ * \param name The stats section name
+ * \param csv The per-flow records file or NULL
+ * \param sample_ms TCP_INFO sampling period (ms), 0 to sample at
+ *        establishment and end only
+ * \param conn_timeout connect() timeout (sec), 0 for none
+ * \param idle_timeout Inactivity timeout (sec), 0 for none
+ * \return The engine
+ */
+struct flow_engine *flow_engine_init(const char *name, const char *csv,
+                                     uint32_t sample_ms, uint16_t conn_timeout,
+                                     uint16_t idle_timeout);
+
+/**
+ * \fn void flow_engine_free(struct flow_engine *e)
+ * \brief Close the flows and listeners of an engine. The engine itself
+ *        is kept for its stats section.
+ *
+ * \param e The engine
+ */
+void flow_engine_free(struct flow_engine *e);
+
+/**
+ * \fn int flow_connect(struct flow_engine *e, struct sockaddr *sa,
+ *                      char *addr, int tun, int mss, int peer)
+ * \brief Start a client flow that receives data until the server
+ *        closes the connection.
+ *
+ * \param e The engine
+ * \param sa The server address (AF_INET or AF_INET6)
+ * \param addr The local address to bind or NULL, the port is ephemeral
+ * \param tun Tunneled flow
+ * \param mss The TCP_MAXSEG value if tun
+ * \param peer The destination index, reported in records
+ * \return 0 if started, -1 on error (counted as failed)
+ */
+int flow_connect(struct flow_engine *e, struct sockaddr *sa,
+                 char *addr, int tun, int mss, int peer);
+
+/**
+ * \fn int flow_listen(struct flow_engine *e, char *addr, int port, int tun,
+ *                     int mss, sa_family_t sfam, int backlog)
+ * \brief Add a listening socket, accepted flows are sent the engine file.
+ *
+ * \param e The engine
+ * \param addr The address to bind or NULL
+ * \param port The port to bind, 0 for any
+ * \param tun Tunneled listener
+ * \param mss The TCP_MAXSEG value if tun
+ * \param sfam The address family
+ * \param backlog The listen() backlog
+ * \return The listening socket
+ */
+int flow_listen(struct flow_engine *e, char *addr, int port, int tun,
+                int mss, sa_family_t sfam, int backlog);
+
+/**
+ * \fn void flow_serve(struct flow_engine *e, const char *file)
+ * \brief Set the file sent to accepted flows.
+ *
+ * \param e The engine
+ * \param file The file location
+ */
+void flow_serve(struct flow_engine *e, const char *file);
+
+/**
+ * \fn void flow_short(struct flow_engine *e, const char *sizes, uint16_t requests)
+ * \brief Enable the short flow mode of a client engine.
+ *
+ * \param e The engine
+ * \param sizes The object sizes: N, LO-HI (uniform) or a list of
+ *        N:WEIGHT or LO-HI:WEIGHT classes separated by commas, NULL for 1000
+ * \param requests The pipelined requests per connection, 0 for 1
+ */
+void flow_short(struct flow_engine *e, const char *sizes, uint16_t requests);
+
+/**
+ * \fn void flow_start(struct flow_engine *e, struct sockaddr *sa, char *addr,
+ *                     int tun, int mss, int peer, uint32_t count,
+ *                     uint32_t concurrent)
+ * \brief Add a job of short connections, started by flow_run().
+ *
+ * \param e The engine, in short flow mode
+ * \param sa The server address (AF_INET or AF_INET6)
+ * \param addr The local address to bind or NULL, kept by the job
+ * \param tun Tunneled connections
+ * \param mss The TCP_MAXSEG value if tun
+ * \param peer The destination index, reported in records
+ * \param count The amount of connections
+ * \param concurrent The amount of connections open at a time
+ */
+void flow_start(struct flow_engine *e, struct sockaddr *sa, char *addr,
+                int tun, int mss, int peer, uint32_t count,
+                uint32_t concurrent);
+
+/**
+ * \fn void flow_answer(struct flow_engine *e)
+ * \brief Answer the requests of accepted flows instead of sending the
+ *        engine file.
+ *
+ * \param e The engine
+ */
+void flow_answer(struct flow_engine *e);
+
+/**
+ * \fn void flow_run(struct flow_engine *e)
+ * \brief Run the engine until all client flows and jobs are done, or
+ *        forever if it has listening sockets.
+ *
+ * \param e The engine
+ */
+void flow_run(struct flow_engine *e);
+
+#endif
@@ -0,0 +1,149 @@
+/**
+ * \file flowbench.c
+ * \brief Concurrent flows benchmark of the flow engine (make flowbench).
+ *
+ *    Runs a server engine in one thread and a client engine in the main
+ *    thread over the loopback. The client opens all flows at once and
+ *    holds them established until the last one connects, then every
+ *    flow downloads the server file. Reports the amount of flows held
+ *    concurrently, the elapsed time and the resident memory growth per
+ *    flow as JSON, and exits non-zero if some flow failed or was not
+ *    held.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "sock.h"
+#include "flow.h"
+#include "bench.h"
+
+/**
+ * \def BENCH_FLOWS
+ * \brief The default amount of concurrent flows.
+ */
+#define BENCH_FLOWS 10000
+
+/**
+ * \def BENCH_SIZE
+ * \brief The default file size (bytes).
+ */
+#define BENCH_SIZE 16384
+
+/**
+ * \def BENCH_FD_SLACK
+ * \brief fds kept aside for the engines, listeners and stdio.
+ */
+#define BENCH_FD_SLACK 32
+
+/**
+ * \fn static void *serv_loop(void *arg)
+ * \brief Run the server engine.
+ */
+static void *serv_loop(void *arg);
+
+/**
+ * \fn static void usage(const char *prog)
+ * \brief Print usage and exit.
+ */
+static void usage(const char *prog);
+
+void *serv_loop(void *arg) {
+   flow_run((struct flow_engine *)arg);
+   return NULL;
+}
+
+void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [-n flows] [-s file size] [-m sample ms] "
+                   "[-o records.csv]\n", prog);
+   exit(2);
+}
+
+int main(int argc, char **argv) {
+   uint32_t flows = BENCH_FLOWS, size = BENCH_SIZE, sample = 100;
+   char *csv = NULL;
+   int opt;
+   while ((opt = getopt(argc, argv, "n:s:m:o:")) != -1) {
+      switch (opt) {
+         case 'n': flows  = strtoul(optarg, NULL, 10); break;
+         case 's': size   = strtoul(optarg, NULL, 10); break;
+         case 'm': sample = strtoul(optarg, NULL, 10); break;
+         case 'o': csv    = optarg; break;
+         default:  usage(argv[0]);
+      }
+   }
+   if (!flows)
+      usage(argv[0]);
+
+   long rss_base = rss_kb("VmRSS");
+
+   /* server file, sparse */
+   char file[] = "/tmp/flowbench.XXXXXX";
+   int fd = mkstemp(file);
+   if (fd < 0 || ftruncate(fd, size) < 0)
+      die("server file");
+   close(fd);
+
+   struct flow_engine *serv = flow_engine_init("flows.serv", NULL, sample, 0, 30);
+   struct flow_engine *cli  = flow_engine_init("flows.cli", csv, sample, 30, 30);
+   /* both ends of each flow live in this process */
+   if (2 * flows + BENCH_FD_SLACK > cli->max) {
+      fprintf(stderr, "fd limit %u, running %u flows instead of %u\n",
+              cli->max, (cli->max - BENCH_FD_SLACK) / 2, flows);
+      flows = (cli->max - BENCH_FD_SLACK) / 2;
+   }
+
+   flow_serve(serv, file);
+   int ls = flow_listen(serv, "127.0.0.1", 0, 0, 0, AF_INET, flows);
+   struct sockaddr_in sa;
+   socklen_t salen = sizeof(sa);
+   if (getsockname(ls, (struct sockaddr *)&sa, &salen) < 0)
+      die("getsockname");
+   pthread_t tid;
+   if (pthread_create(&tid, NULL, serv_loop, serv))
+      die("pthread_create");
+
+   double t0 = now();
+   cli->sync = 1;
+   for (uint32_t i=0; i<flows; i++)
+      flow_connect(cli, (struct sockaddr *)&sa, "127.0.0.1", 0, 0, 0);
+   flow_run(cli);
+   double t1 = now();
+
+   long rss_peak = rss_kb("VmHWM");
+   double ms = (t1 - t0) / 1e6;
+   long per_flow = rss_base >= 0 && rss_peak >= 0 ?
+                     (rss_peak - rss_base) * 1024 / (2 * (long)flows) : -1;
+
+   printf("{\n");
+   printf("  \"flows\": %u,\n", flows);
+   printf("  \"file_bytes\": %u,\n", size);
+   printf("  \"held\": %u,\n", cli->held);
+   printf("  \"done\": %llu,\n", (unsigned long long)cli->done);
+   printf("  \"failed\": %llu,\n", (unsigned long long)cli->failed);
+   printf("  \"serv_peak\": %u,\n", serv->peak);
+   printf("  \"elapsed_ms\": %.1f,\n", ms);
+   printf("  \"flows_per_s\": %.0f,\n", flows / (ms / 1e3));
+   printf("  \"goodput_mbps\": %.1f,\n", cli->bytes * 8 / (ms * 1e3));
+   printf("  \"rss_base_kb\": %ld,\n", rss_base);
+   printf("  \"rss_peak_kb\": %ld,\n", rss_peak);
+   printf("  \"rss_bytes_per_flow\": %ld,\n", per_flow);
+   printf("  \"flow_struct_bytes\": %zu\n", sizeof(struct flow));
+   printf("}\n");
+
+   flow_engine_free(cli);
+   unlink(file);
+   return (cli->held == flows && !cli->failed && cli->done == flows) ? 0 : 1;
+}
@@ -0,0 +1,368 @@
+/**
+ * \file hh.c
+ * \brief Heavy-hitter detection for inner flows.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "hh.h"
+#include "debug.h"
+#include "sock.h"
+#include "stats.h"
+#include "lpm.h"
+#include "recs.h"
+
+volatile int hh_on;
+
+/**
+ * \struct hh_inner
+ *	\brief The fields of an inner packet.
+ */
+struct hh_inner {
+   uint64_t addr[4];    /*!< Source and destination addresses */
+   uint16_t ports[2];   /*!< Source and destination ports (network order) */
+   uint8_t  proto;      /*!< The transport protocol */
+   uint8_t  v6;         /*!< IPv6 packet */
+};
+
+/**
+ * \struct hh_cand
+ *	\brief A merged candidate.
+ */
+struct hh_cand {
+   uint64_t      hash;  /*!< The flow hash */
+   uint64_t      est;   /*!< The merged estimate */
+   struct hh_key key;   /*!< The flow */
+};
+
+/**
+ * \var static uint8_t k
+ * \brief The amount of candidates per thread and top talkers per peer.
+ */
+static uint8_t k;
+
+/**
+ * \var static struct hh_thread *threads[]
+ * \brief The counting threads.
+ */
+static struct hh_thread *threads[HH_MAX_THREADS];
+
+/**
+ * \var static int threads_len
+ * \brief The amount of counting threads.
+ */
+static int threads_len;
+
+/**
+ * \var static pthread_mutex_t lock
+ * \brief Protects threads and threads_len.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \var static __thread struct hh_thread *self
+ * \brief The sketch of the calling thread, NULL until its first packet.
+ */
+static __thread struct hh_thread *self;
+
+/**
+ * \var static __thread int denied
+ * \brief 1 if the calling thread found the thread table full.
+ */
+static __thread int denied;
+
+/**
+ * \fn static struct hh_thread *thread_new()
+ * \brief Allocate and register the sketch of the calling thread.
+ *
+ * \return The sketch, NULL if HH_MAX_THREADS threads already count
+ */
+static struct hh_thread *thread_new();
+
+/**
+ * \fn static inline int parse(const char *pkt, int len, struct hh_inner *in)
+ * \brief Extract the 5-tuple of an inner packet. The ports of non-first
+ *        fragments and of other protocols than TCP and UDP are 0.
+ *
+ * \return 0 for success, -1 if the packet is too short or not IP
+ */
+static inline int parse(const char *pkt, int len, struct hh_inner *in);
+
+/**
+ * \fn static inline uint64_t hash(const struct hh_inner *in, int peer, int dir)
+ * \brief The 64-bit hash of a flow, each row uses 16 bits of it.
+ */
+static inline uint64_t hash(const struct hh_inner *in, int peer, int dir);
+
+/**
+ * \fn static void find_min(struct hh_thread *t)
+ * \brief Update the index of the smallest candidate.
+ */
+static void find_min(struct hh_thread *t);
+
+/**
+ * \fn static int cmp_hash(const void *a, const void *b)
+ * \brief Order merged candidates by hash.
+ */
+static int cmp_hash(const void *a, const void *b);
+
+/**
+ * \fn static int cmp_peer(const void *a, const void *b)
+ * \brief Order merged candidates by peer, then by decreasing estimate.
+ */
+static int cmp_peer(const void *a, const void *b);
+
+/**
+ * \fn static void hh_stats(FILE *fp, void *arg)
+ * \brief Merge the threads and dump the top talkers of each peer.
+ */
+static void hh_stats(FILE *fp, void *arg);
+
+void init_hh(uint8_t top) {
+   if (!(k = top))
+      return;
+   if (k > HH_MAX_K) {
+      errno=EINVAL;
+      die("heavy-hitters");
+   }
+   hh_on = 1;
+   stats_register("hh", hh_stats, NULL);
+}
+
+struct hh_thread *thread_new() {
+   struct hh_thread *t = NULL;
+   pthread_mutex_lock(&lock);
+   if (threads_len < HH_MAX_THREADS) {
+      t = xmalloc(sizeof(struct hh_thread));
+      memset(t, 0, sizeof(struct hh_thread));
+      threads[threads_len++] = t;
+   }
+   pthread_mutex_unlock(&lock);
+   if (!t) {
+      debug_print("hh: thread table full\n");
+      denied = 1;
+   }
+   return (self = t);
+}
+
+int parse(const char *pkt, int len, struct hh_inner *in) {
+   int off, frag = 0;
+   in->addr[2] = in->addr[3] = 0;
+   in->ports[0] = in->ports[1] = 0;
+   if ((pkt[0] & 0xf0) == 0x40) {
+      if (len < 20)
+         return -1;
+      uint32_t a[2];
+      memcpy(a, pkt+12, 8);
+      in->addr[0] = a[0];
+      in->addr[1] = a[1];
+      in->proto = pkt[9];
+      in->v6    = 0;
+      off       = (pkt[0] & 0x0f) << 2;
+      frag      = pkt[6] & 0x1f || pkt[7];
+   } else if ((pkt[0] & 0xf0) == 0x60) {
+      if (len < 40)
+         return -1;
+      memcpy(in->addr, pkt+8, 32);
+      in->proto = pkt[6];
+      in->v6    = 1;
+      off       = 40;
+   } else
+      return -1;
+   if (!frag && len >= off + 4 &&
+         (in->proto == IPPROTO_TCP || in->proto == IPPROTO_UDP))
+      memcpy(in->ports, pkt+off, 4);
+   return 0;
+}
+
+uint64_t hash(const struct hh_inner *in, int peer, int dir) {
+   uint64_t h = in->ports[0] | (uint64_t)in->ports[1] << 16 |
+                (uint64_t)in->proto << 32 | (uint64_t)dir << 40 | (uint64_t)(peer & 0xffff) << 48;
+   h += in->addr[0] * 0x9e3779b97f4a7c15ULL;
+   h += in->addr[1] * 0xc2b2ae3d27d4eb4fULL;
+   h += in->addr[2] * 0x165667b19e3779f9ULL;
+   h += in->addr[3] * 0x27d4eb2f165667c5ULL;
+   /* murmur3 64-bit finalizer */
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return h;
+}
+
+void find_min(struct hh_thread *t) {
+   uint32_t min = 0;
+   for (uint32_t i=1; i<t->len; i++)
+      if (t->count[i] < t->count[min])
+         min = i;
+   t->min = min;
+}
+
+void hh_update(const char *pkt, int len, int peer, enum hh_dir dir) {
+   struct hh_thread *t = self;
+   struct hh_inner in;
+   if (!t && (denied || !(t = thread_new())))
+      return;
+   if (parse(pkt, len, &in) < 0)
+      return;
+   uint64_t h = hash(&in, peer, dir);
+   t->pkts++;
+   t->bytes += len;
+
+   /* conservative update: raise the counters to the new estimate only */
+   uint64_t *c[HH_DEPTH], est = UINT64_MAX;
+   for (int r=0; r<HH_DEPTH; r++) {
+      c[r] = &t->cm[r][(h >> (16 * r)) & (HH_WIDTH - 1)];
+      est  = *c[r] < est ? *c[r] : est;
+   }
+   est += len;
+   for (int r=0; r<HH_DEPTH; r++)
+      *c[r] = *c[r] < est ? est : *c[r];
+
+   /* the estimate of a candidate is always above the smallest one */
+   if (t->len == k && est <= t->count[t->min])
+      return;
+
+   uint32_t i, new = 0;
+   for (i=0; i<t->len; i++)
+      if (t->hash[i] == h)
+         break;
+   t->seq++;
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   if (i == t->len) {
+      /* new candidate, evict the smallest one if full */
+      new = 1;
+      if (t->len < k)
+         t->len++;
+      else
+         i = t->min;
+      struct hh_key *key = &t->key[i];
+      memset(key, 0, sizeof(struct hh_key));
+      if (in.v6) {
+         memcpy(key->src, in.addr, 16);
+         memcpy(key->dst, in.addr+2, 16);
+      } else {
+         uint32_t a[2] = { in.addr[0], in.addr[1] };
+         memcpy(key->src, &a[0], 4);
+         memcpy(key->dst, &a[1], 4);
+      }
+      key->sport = ntohs(in.ports[0]);
+      key->dport = ntohs(in.ports[1]);
+      key->peer  = peer;
+      key->proto = in.proto;
+      key->v6    = in.v6;
+      key->dir   = dir;
+      t->hash[i] = h;
+   }
+   t->count[i] = est;
+   if (new || i == t->min)
+      find_min(t);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   t->seq++;
+}
+
+int hh_peer(struct tun_state *state, const char *pkt) {
+   uint32_t id = 0;
+   if ((pkt[0] & 0xf0) == 0x40 && state->cli4) {
+      uint32_t src;
+      memcpy(&src, pkt+12, 4);
+      id = lpm4_lookup(state->cli4, ntohl(src));
+   } else if ((pkt[0] & 0xf0) == 0x60 && state->cli6)
+      id = lpm6_lookup(state->cli6, (const uint8_t *)pkt+8);
+   return id ? rec_get(state, id)->sport : 0;
+}
+
+int cmp_hash(const void *a, const void *b) {
+   const struct hh_cand *x = a, *y = b;
+   return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+int cmp_peer(const void *a, const void *b) {
+   const struct hh_cand *x = a, *y = b;
+   if (x->key.peer != y->key.peer)
+      return x->key.peer < y->key.peer ? -1 : 1;
+   return x->est > y->est ? -1 : x->est < y->est;
+}
+
+void hh_stats(FILE *fp, void *UNUSED(arg)) {
+   uint64_t pkts = 0, bytes = 0;
+   int n = 0, len;
+   pthread_mutex_lock(&lock);
+   len = threads_len;
+   pthread_mutex_unlock(&lock);
+   uint64_t (*cm)[HH_WIDTH] = xmalloc(sizeof(uint64_t) * HH_DEPTH * HH_WIDTH);
+   struct hh_cand *cand = xmalloc(sizeof(struct hh_cand) * HH_MAX_K * (len + 1));
+   memset(cm, 0, sizeof(uint64_t) * HH_DEPTH * HH_WIDTH);
+
+   /* sum the sketches and collect the candidates */
+   for (int i=0; i<len; i++) {
+      struct hh_thread *t = threads[i];
+      uint32_t seq, clen;
+      pkts  += t->pkts;
+      bytes += t->bytes;
+      for (int r=0; r<HH_DEPTH; r++)
+         for (int c=0; c<HH_WIDTH; c++)
+            cm[r][c] += t->cm[r][c];
+      do {
+         while ((seq = t->seq) & 1)
+            ;
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         clen = t->len;
+         for (uint32_t c=0; c<clen; c++) {
+            cand[n+c].hash = t->hash[c];
+            cand[n+c].key  = t->key[c];
+         }
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      } while (seq != t->seq);
+      n += clen;
+   }
+
+   /* remove duplicates, re-estimate from the merged sketch */
+   qsort(cand, n, sizeof(struct hh_cand), cmp_hash);
+   int m = 0;
+   for (int i=0; i<n; i++) {
+      if (m && cand[m-1].hash == cand[i].hash)
+         continue;
+      cand[m] = cand[i];
+      cand[m].est = UINT64_MAX;
+      for (int r=0; r<HH_DEPTH; r++) {
+         uint64_t c = cm[r][(cand[m].hash >> (16 * r)) & (HH_WIDTH - 1)];
+         if (c < cand[m].est)
+            cand[m].est = c;
+      }
+      m++;
+   }
+   qsort(cand, m, sizeof(struct hh_cand), cmp_peer);
+
+   fprintf(fp, "k %u\n", k);
+   fprintf(fp, "threads %d\n", len);
+   fprintf(fp, "pkts %llu\n", (unsigned long long)pkts);
+   fprintf(fp, "bytes %llu\n", (unsigned long long)bytes);
+   for (int i=0, rank=0; i<m; i++) {
+      struct hh_key *key = &cand[i].key;
+      char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+      rank = (i && cand[i-1].key.peer == key->peer) ? rank + 1 : 0;
+      if (rank >= k)
+         continue;
+      int af = key->v6 ? AF_INET6 : AF_INET;
+      inet_ntop(af, key->src, src, sizeof(src));
+      inet_ntop(af, key->dst, dst, sizeof(dst));
+      fprintf(fp, "peer.%u.%d %s %u %s%s%s:%u %s%s%s:%u %llu %.1f%%\n",
+              key->peer, rank, key->dir == HH_TX ? "tx" : "rx", key->proto,
+              key->v6 ? "[" : "", src, key->v6 ? "]" : "", key->sport,
+              key->v6 ? "[" : "", dst, key->v6 ? "]" : "", key->dport,
+              (unsigned long long)cand[i].est,
+              bytes ? 100.0 * cand[i].est / bytes : 0);
+   }
+   free(cand);
+   free(cm);
+}
@@ -0,0 +1,134 @@
+/**
+ * \file hh.h
+ * \brief Heavy-hitter detection for inner flows.
+ *
+ *    Each forwarding thread counts the bytes of the inner flows it
+ *    forwards in a count-min sketch (conservative update) and keeps
+ *    its heavy-hitters-K largest flows in a small candidate table. A
+ *    flow is keyed by its inner 5-tuple, its direction and its peer
+ *    (source port), and only a 64-bit hash of the key is computed per
+ *    packet: the candidates are scanned only if the estimate exceeds
+ *    the smallest candidate. On read, the sketches of all threads are
+ *    summed, the candidates merged and re-estimated, and the top
+ *    talkers of each peer are reported in the "hh" stats section.
+ *    Memory is bounded to HH_DEPTH * HH_WIDTH counters per thread.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_HH_H
+#define UDPTUN_HH_H
+
+#include <stdint.h>
+
+#include "state.h"
+
+/**
+ * \def HH_MAX_THREADS
+ * \brief The maximal amount of counting threads.
+ */
+#define HH_MAX_THREADS 32
+
+/**
+ * \def HH_MAX_K
+ * \brief The maximal amount of candidates per thread.
+ */
+#define HH_MAX_K 64
+
+/**
+ * \def HH_DEPTH
+ * \brief The amount of sketch rows.
+ */
+#define HH_DEPTH 4
+
+/**
+ * \def HH_WIDTH
+ * \brief The amount of counters per row (power of 2, at most 65536).
+ */
+#define HH_WIDTH 2048
+
+/**
+ * \enum hh_dir
+ * \brief The direction of a packet.
+ */
+enum hh_dir {
+   HH_TX = 0,  /*!< tun to network */
+   HH_RX,      /*!< network to tun */
+};
+
+/**
+ * \struct hh_key
+ *	\brief An inner flow.
+ */
+struct hh_key {
+   uint8_t  src[16];    /*!< The source address (v4 in the first 4 bytes) */
+   uint8_t  dst[16];    /*!< The destination address */
+   uint16_t sport;      /*!< The source port (host order), 0 if none */
+   uint16_t dport;      /*!< The destination port (host order), 0 if none */
+   uint16_t peer;       /*!< The peer (tunnel source port) */
+   uint8_t  proto;      /*!< The transport protocol */
+   uint8_t  v6:1;       /*!< IPv6 flow */
+   uint8_t  dir:1;      /*!< enum hh_dir */
+};
+
+/**
+ * \struct hh_thread
+ *	\brief The sketch and candidates of a thread.
+ */
+struct hh_thread {
+   uint64_t cm[HH_DEPTH][HH_WIDTH]; /*!< The count-min sketch (bytes) */
+   uint64_t hash[HH_MAX_K];         /*!< Candidate hashes */
+   uint64_t count[HH_MAX_K];        /*!< Candidate estimates at last update */
+   struct hh_key key[HH_MAX_K];     /*!< Candidate flows */
+   uint32_t len;                    /*!< The amount of candidates */
+   uint32_t min;                    /*!< The smallest candidate */
+   volatile uint32_t seq;           /*!< Candidates seqlock, odd while written */
+   uint64_t pkts;                   /*!< Counted packets */
+   uint64_t bytes;                  /*!< Counted bytes */
+};
+
+/**
+ * \var volatile int hh_on
+ * \brief 1 if counting, checked inline by HH_UPDATE.
+ */
+extern volatile int hh_on;
+
+/**
+ * \def HH_UPDATE
+ * \brief Count an inner packet, peer is only evaluated if enabled.
+ */
+#define HH_UPDATE(pkt, len, peer, dir) \
+   do { if (hh_on) hh_update(pkt, len, peer, dir); } while (0)
+
+/**
+ * \fn void init_hh(uint8_t k)
+ * \brief Enable the detection and register the stats section.
+ *
+ * \param k The amount of top talkers, 0 to disable
+ */
+void init_hh(uint8_t k);
+
+/**
+ * \fn void hh_update(const char *pkt, int len, int peer, enum hh_dir dir)
+ * \brief Count an inner packet in the sketch of the calling thread.
+ *
+ * \param pkt The inner IP packet
+ * \param len The packet length
+ * \param peer The peer (tunnel source port)
+ * \param dir The packet direction
+ */
+void hh_update(const char *pkt, int len, int peer, enum hh_dir dir);
+
+/**
+ * \fn int hh_peer(struct tun_state *state, const char *pkt)
+ * \brief The peer of an inner packet received by a client, from its
+ *        source address.
+ *
+ * \param state The program state
+ * \param pkt The inner IP packet
+ * \return The peer source port, 0 if unknown
+ */
+int hh_peer(struct tun_state *state, const char *pkt);
+
+#endif
@@ -55,18 +55,6 @@ struct ip_header {
 	uint32_t 	daddr;		   /*!< destination address */
 };
 
-/**
- * \fn unsigned short calcsum(unsigned short *buffer, int length)
- *
- * \brief used to calculate IP and ICMP header checksums using
- * one's compliment of the one's compliment sum of 16 bit words of the header
- * 
- * \param buffer the packet buffer
- * \param length the buffer length
- * \return checksum
- */ 
-static unsigned short calcsum(unsigned short *buffer, int length);
-
 #if defined(LINUX_OS)
 
 void print_icmp_type(uint8_t type, uint8_t code) {
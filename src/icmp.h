@@ -14,6 +14,18 @@
 
 #include "state.h"
 
+/**
+ * \fn unsigned short calcsum(unsigned short *buffer, int length)
+ *
+ * \brief used to calculate IP and ICMP header checksums using
+ * one's compliment of the one's compliment sum of 16 bit words of the header
+ * 
+ * \param buffer the packet buffer
+ * \param length the buffer length
+ * \return checksum
+ */ 
+unsigned short calcsum(unsigned short *buffer, int length);
+
 #  if defined(LINUX_OS)
 /**
  * \fn void print_icmp_type(uint8_t type, uint8_t code)
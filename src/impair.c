@@ -0,0 +1,511 @@
+/**
+ * \file impair.c
+ * \brief In-tunnel network impairments (delay, loss, reordering, rate).
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "impair.h"
+#include "queue.h"
+#include "debug.h"
+#include "timing.h"
+#include "sock.h"
+#include "stats.h"
+#include "txring.h"
+#include "batch.h"
+#include "udptun.h"
+
+/**
+ * \def IMPAIR_MAX_ARGS
+ * \brief The maximal amount of words on a profile line.
+ */
+#define IMPAIR_MAX_ARGS 32
+
+/**
+ * \fn static double rnd(struct impair *im)
+ * \brief A uniform draw in [0,1) (xorshift64*).
+ */
+static double rnd(struct impair *im);
+
+/**
+ * \fn static int64_t draw_delay(struct impair *im, struct impair_profile *pr)
+ * \brief Draw the delay of a packet from the profile distribution.
+ *
+ * \return The delay (us), >= 0
+ */
+static int64_t draw_delay(struct impair *im, struct impair_profile *pr);
+
+/**
+ * \fn static int parse_num(char **argv, int argc, int *i, double *val)
+ * \brief Parse the next word as a number if it is one.
+ *
+ * \return 1 if a number was parsed, 0 otherwise
+ */
+static int parse_num(char **argv, int argc, int *i, double *val);
+
+/**
+ * \fn static uint32_t next_busy(struct impair *im, uint32_t slot)
+ * \brief The distance from a slot to the next non-empty one.
+ *
+ * \return The distance, IMPAIR_SLOTS if the wheel is empty
+ */
+static uint32_t next_busy(struct impair *im, uint32_t slot);
+
+/**
+ * \fn static void run_slot(struct impair *im, uint32_t slot, int64_t tick)
+ * \brief Release the packets of a slot due at or before a tick.
+ */
+static void run_slot(struct impair *im, uint32_t slot, int64_t tick);
+
+/**
+ * \fn static void impair_run(struct impair *im, int64_t now)
+ * \brief Run the wheel up to the current tick.
+ */
+static void impair_run(struct impair *im, int64_t now);
+
+/**
+ * \fn static int64_t impair_next(struct impair *im, int64_t now)
+ * \brief The time until the next non-empty tick.
+ *
+ * \return The delay (us), -1 if the wheel is empty
+ */
+static int64_t impair_next(struct impair *im, int64_t now);
+
+/**
+ * \fn static void impair_stats(FILE *fp, void *arg)
+ * \brief Dump the profile counters.
+ */
+static void impair_stats(FILE *fp, void *arg);
+
+double rnd(struct impair *im) {
+   im->rng ^= im->rng >> 12;
+   im->rng ^= im->rng << 25;
+   im->rng ^= im->rng >> 27;
+   return ((im->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int64_t draw_delay(struct impair *im, struct impair_profile *pr) {
+   double d = pr->delay, x = 0;
+   if (pr->jitter) {
+      switch (pr->dist) {
+         case IMPAIR_NORMAL:
+            /* Irwin-Hall, mean 6 and variance 1 */
+            for (int i=0; i<12; i++)
+               x += rnd(im);
+            d += pr->jitter * (x - 6);
+            break;
+         case IMPAIR_PARETO:
+            /* 1/max(U1,U2,U3) is Pareto with shape 3 and mean 1.5 */
+            x = max(rnd(im), max(rnd(im), rnd(im)));
+            d += pr->jitter * (1 / max(x, 1e-6) - 1.5);
+            break;
+         default:
+            d += pr->jitter * (2 * rnd(im) - 1);
+            break;
+      }
+   }
+   return d > 0 ? (int64_t)d : 0;
+}
+
+int parse_num(char **argv, int argc, int *i, double *val) {
+   char *end;
+   if (*i + 1 >= argc)
+      return 0;
+   double v = strtod(argv[*i + 1], &end);
+   if (end == argv[*i + 1] || *end)
+      return 0;
+   *val = v;
+   (*i)++;
+   return 1;
+}
+
+int impair_add(struct tun_state *state, const char *dir, const char *line) {
+   struct impair **imp;
+   char buf[1024], *argv[IMPAIR_MAX_ARGS];
+   int argc = 0, off = 0, n = 0;
+
+   if (!strcmp(dir, "net"))
+      imp = &state->impair_net;
+   else if (!strcmp(dir, "tun"))
+      imp = &state->impair_tun;
+   else {
+      errno=EINVAL;
+      return -1;
+   }
+
+   /* split words */
+   strncpy(buf, line, sizeof(buf) - 1);
+   buf[sizeof(buf) - 1] = '\0';
+   while (argc < IMPAIR_MAX_ARGS) {
+      char *word = buf + off;
+      while (*word == ' ' || *word == '\t')
+         word++;
+      if (!*word || *word == '\n' || *word == '#')
+         break;
+      if (sscanf(word, "%*s%n", &n) < 0 || n <= 0)
+         break;
+      argv[argc++] = word;
+      off = word - buf + n;
+      if (!buf[off]) break;
+      buf[off++] = '\0';
+   }
+   if (!argc) {
+      errno=EINVAL;
+      return -1;
+   }
+
+   if (!*imp)
+      *imp = calloc(1, sizeof(struct impair));
+   struct impair *im = *imp;
+   if (im->nprof >= IMPAIR_MAX_PROFILES) {
+      errno=ENOMEM;
+      return -1;
+   }
+
+   /* peer */
+   struct impair_profile pr;
+   memset(&pr, 0, sizeof(pr));
+   pr.peer  = -1;
+   pr.limit = IMPAIR_DEFAULT_LIMIT * 1000LL;
+   if (strcmp(argv[0], "*")) {
+      char *end;
+      long port = strtol(argv[0], &end, 10);
+      if (*end || port <= 0 || port > 65535 || (im->map && im->map[port])) {
+         errno=EINVAL;
+         return -1;
+      }
+      pr.peer = port;
+   } else if (im->any) {
+      errno=EINVAL;
+      return -1;
+   }
+
+   /* impairments */
+   double v, w;
+   for (int i=1; i<argc; i++) {
+      if (!strcmp(argv[i], "delay") && parse_num(argv, argc, &i, &v)) {
+         pr.delay = v * 1000;
+         if (parse_num(argv, argc, &i, &v)) {
+            pr.jitter = v * 1000;
+            const char *dist = i + 1 < argc ? argv[i+1] : "";
+            if (!strcmp(dist, "normal"))
+               pr.dist = IMPAIR_NORMAL;
+            else if (!strcmp(dist, "pareto"))
+               pr.dist = IMPAIR_PARETO;
+            if (pr.dist || !strcmp(dist, "uniform"))
+               i++;
+         }
+      } else if (!strcmp(argv[i], "loss") && parse_num(argv, argc, &i, &v)) {
+         pr.loss_good = v / 100;
+      } else if (!strcmp(argv[i], "loss-ge") && parse_num(argv, argc, &i, &v) &&
+                 parse_num(argv, argc, &i, &w)) {
+         pr.p        = v / 100;
+         pr.r        = w / 100;
+         pr.loss_bad = 1;
+         if (parse_num(argv, argc, &i, &v)) {
+            pr.loss_bad = v / 100;
+            if (parse_num(argv, argc, &i, &v))
+               pr.loss_good = v / 100;
+         }
+      } else if (!strcmp(argv[i], "reorder") && parse_num(argv, argc, &i, &v)) {
+         pr.reorder = v / 100;
+      } else if (!strcmp(argv[i], "rate") && parse_num(argv, argc, &i, &v)) {
+         pr.rate = v * 1000 / 8;
+         if (parse_num(argv, argc, &i, &v))
+            pr.burst = v;
+      } else if (!strcmp(argv[i], "limit") && parse_num(argv, argc, &i, &v)) {
+         pr.limit = v * 1000;
+      } else {
+         errno=EINVAL;
+         return -1;
+      }
+   }
+   if (pr.delay < 0 || pr.jitter < 0 || pr.limit < 0) {
+      errno=EINVAL;
+      return -1;
+   }
+   if (pr.rate && !pr.burst)
+      pr.burst = max(pr.rate / 100, (uint64_t)BUFF_SIZE);
+
+   /* register */
+   im->prof[im->nprof++] = pr;
+   if (pr.peer < 0)
+      im->any = im->nprof;
+   else {
+      if (!im->map)
+         im->map = calloc(65536, sizeof(uint8_t));
+      im->map[pr.peer] = im->nprof;
+   }
+   debug_print("impair %s %s: delay %lldus jitter %lldus rate %lluB/s\n",
+               dir, argv[0], (long long)pr.delay, (long long)pr.jitter,
+               (unsigned long long)pr.rate);
+   return 0;
+}
+
+void init_impair(struct impair *im, struct pkt_queue *q, uint32_t pool,
+                 uint32_t seed, const char *name) {
+   if (!im)
+      return;
+   im->q        = q;
+   im->pool_len = pool ? pool : IMPAIR_DEFAULT_POOL;
+   im->pool     = xmalloc(im->pool_len * sizeof(struct impair_pkt));
+   im->slab     = xmalloc((size_t)im->pool_len * BUFF_SIZE);
+   for (uint32_t i=0; i<im->pool_len; i++) {
+      im->pool[i].data = im->slab + (size_t)i * BUFF_SIZE;
+      im->pool[i].next = i + 1 < im->pool_len ? i + 1 : IMPAIR_NIL;
+   }
+   im->free = 0;
+   for (int i=0; i<IMPAIR_SLOTS; i++)
+      im->head[i] = im->tail[i] = IMPAIR_NIL;
+   im->tick = monotonic_us() / IMPAIR_TICK_US;
+
+   /* splitmix64 of the seed, never 0 */
+   im->rng = (seed + 1) * 0x9E3779B97F4A7C15ULL;
+   im->rng = (im->rng ^ (im->rng >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   im->rng = (im->rng ^ (im->rng >> 27)) * 0x94D049BB133111EBULL;
+   im->rng ^= im->rng >> 31;
+   if (!im->rng)
+      im->rng = 1;
+
+   q->imp = im;
+   stats_register(name, impair_stats, im);
+}
+
+void free_impair(struct impair *im) {
+   free(im->pool);
+   free(im->slab);
+   free(im->map);
+   free(im);
+}
+
+int impair_push(struct impair *im, int fd, int peer, struct sockaddr *sa,
+                socklen_t salen, int tos, char *buf, int len) {
+   uint8_t idx = im->map ? im->map[(uint16_t)peer] : 0;
+   if (!idx)
+      idx = im->any;
+   if (!idx)
+      return 1;
+   struct impair_profile *pr = &im->prof[idx - 1];
+   pr->pkts++;
+
+   /* Gilbert-Elliott loss */
+   if (pr->bad ? rnd(im) < pr->r : (pr->p > 0 && rnd(im) < pr->p))
+      pr->bad ^= 1;
+   double loss = pr->bad ? pr->loss_bad : pr->loss_good;
+   if (loss > 0 && rnd(im) < loss) {
+      pr->lost++;
+      return -1;
+   }
+
+   /* token bucket, packets leave in order */
+   int64_t now = monotonic_us(), due = now;
+   if (pr->rate) {
+      int64_t t0 = max(now, pr->t_last);
+      double tokens = pr->tokens + (t0 - pr->t_last) * (pr->rate / 1e6);
+      if (tokens > pr->burst)
+         tokens = pr->burst;
+      if (tokens >= len) {
+         due     = t0;
+         tokens -= len;
+      } else {
+         due    = t0 + (int64_t)((len - tokens) * 1e6 / pr->rate) + 1;
+         tokens = 0;
+      }
+      if (due - now > pr->limit) {
+         pr->overlimit++;
+         return -1;
+      }
+      pr->tokens = tokens;
+      pr->t_last = due;
+   }
+
+   /* delay, unless reordered */
+   if (pr->reorder > 0 && rnd(im) < pr->reorder) {
+      pr->reordered++;
+      if (due <= now)
+         return 1;
+   } else {
+      if (pr->delay || pr->jitter)
+         due += draw_delay(im, pr);
+      if (due <= now && !pr->pending)
+         return 1;
+   }
+
+   /* schedule */
+   if (im->free == IMPAIR_NIL || len > BUFF_SIZE) {
+      im->exhausted++;
+      return -1;
+   }
+   if (!im->len)
+      im->tick = now / IMPAIR_TICK_US;
+   uint32_t i = im->free;
+   struct impair_pkt *p = &im->pool[i];
+   im->free = p->next;
+
+   p->next  = IMPAIR_NIL;
+   p->prof  = idx - 1;
+   p->tick  = max((due + IMPAIR_TICK_US - 1) / IMPAIR_TICK_US, im->tick);
+   p->fd    = fd;
+   p->peer  = peer;
+   p->len   = len;
+   p->salen = salen;
+   p->tos   = tos;
+   if (salen)
+      memcpy(&p->sa, sa, salen);
+   memcpy(p->data, buf, len);
+
+   uint32_t slot = p->tick & (IMPAIR_SLOTS - 1);
+   if (im->head[slot] == IMPAIR_NIL)
+      im->head[slot] = i;
+   else
+      im->pool[im->tail[slot]].next = i;
+   im->tail[slot] = i;
+   im->busy[slot / 64] |= 1ULL << (slot % 64);
+
+   pr->pending++;
+   pr->delayed++;
+   im->len++;
+   return 0;
+}
+
+uint32_t next_busy(struct impair *im, uint32_t slot) {
+   for (uint32_t d=0; d<IMPAIR_SLOTS; ) {
+      uint32_t s = (slot + d) & (IMPAIR_SLOTS - 1);
+      uint64_t word = im->busy[s / 64] >> (s % 64);
+      if (word)
+         return d + __builtin_ctzll(word);
+      d += 64 - s % 64;
+   }
+   return IMPAIR_SLOTS;
+}
+
+void run_slot(struct impair *im, uint32_t slot, int64_t tick) {
+   uint32_t i = im->head[slot], prev = IMPAIR_NIL;
+   while (i != IMPAIR_NIL) {
+      struct impair_pkt *p = &im->pool[i];
+      uint32_t next = p->next;
+      if (p->tick > tick) {
+         /* a later turn */
+         prev = i;
+         i = next;
+         continue;
+      }
+
+      /* unlink, release, free */
+      if (prev == IMPAIR_NIL)
+         im->head[slot] = next;
+      else
+         im->pool[prev].next = next;
+      if (im->tail[slot] == i)
+         im->tail[slot] = prev;
+      queue_send_now(im->q, p->fd, p->peer, (struct sockaddr *)&p->sa,
+                     p->salen, p->tos, p->data, p->len);
+      im->prof[p->prof].pending--;
+      im->len--;
+      im->released++;
+      p->next  = im->free;
+      im->free = i;
+      i = next;
+   }
+   if (im->head[slot] == IMPAIR_NIL)
+      im->busy[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+void impair_run(struct impair *im, int64_t now) {
+   int64_t target = now / IMPAIR_TICK_US;
+   while (im->len && im->tick <= target) {
+      uint32_t d = next_busy(im, im->tick & (IMPAIR_SLOTS - 1));
+      if (im->tick + d > target)
+         break;
+      im->tick += d;
+      run_slot(im, im->tick & (IMPAIR_SLOTS - 1), im->tick);
+      im->tick++;
+   }
+   if (im->tick <= target)
+      im->tick = target + 1;
+}
+
+int64_t impair_next(struct impair *im, int64_t now) {
+   if (!im->len)
+      return -1;
+   uint32_t d = next_busy(im, im->tick & (IMPAIR_SLOTS - 1));
+   int64_t wait = (im->tick + d) * IMPAIR_TICK_US - now;
+   return wait > 0 ? wait : 0;
+}
+
+int impair_select(struct tun_state *state, fd_set *input_set,
+                  fd_set *output_set, int fd_max, struct timeval *tv,
+                  int timeout) {
+   struct impair *ims[2] = { state->impair_tun, state->impair_net };
+   if (!ims[0] && !ims[1] && !state->batch)
+      return xselect(input_set, output_set, fd_max, tv, timeout);
+
+   fd_set input, output;
+   int64_t now = monotonic_us(), end = timeout < 0 ? -1 : now + timeout * 1000000LL;
+   input  = *input_set;
+   output = *output_set;
+
+   for (;;) {
+      /* release due packets, wake up for the next ones */
+      int64_t wait = end < 0 ? -1 : max(end - now, 0);
+      int fd_out = fd_max;
+      for (int i=0; i<2; i++) {
+         if (!ims[i]) continue;
+         impair_run(ims[i], now);
+         if (ims[i]->q->ring)
+            txring_kick(ims[i]->q->ring);
+         fd_out = max(fd_out, queue_fd_set(ims[i]->q, output_set));
+         int64_t next = impair_next(ims[i], now);
+         if (next >= 0 && (wait < 0 || next < wait))
+            wait = next;
+      }
+      /* flush the due tx-ring frames, poll or wake up for the others */
+      if (state->batch) {
+         batch_kick(state);
+         int64_t next = batch_wait(state, now);
+         if (next >= 0 && (wait < 0 || next < wait))
+            wait = next;
+      }
+      if (wait >= 0) {
+         tv->tv_sec  = wait / 1000000;
+         tv->tv_usec = wait % 1000000;
+      }
+      int sel = select(fd_out+1, input_set, output_set, NULL,
+                       wait < 0 ? NULL : tv);
+      if (sel < 0) die("select");
+      now = monotonic_us();
+      if (state->batch)
+         batch_woke(state->batch, sel, wait, now);
+      if (sel > 0)
+         return sel;
+      if (end >= 0 && now >= end)
+         return 0;
+      *input_set  = input;
+      *output_set = output;
+   }
+}
+
+void impair_stats(FILE *fp, void *arg) {
+   struct impair *im = arg;
+   fprintf(fp, "pool %u\n", im->pool_len);
+   fprintf(fp, "len %u\n", im->len);
+   fprintf(fp, "released %llu\n", (unsigned long long)im->released);
+   fprintf(fp, "exhausted %llu\n", (unsigned long long)im->exhausted);
+   for (int i=0; i<im->nprof; i++) {
+      struct impair_profile *pr = &im->prof[i];
+      char peer[12] = "any";
+      if (pr->peer >= 0)
+         snprintf(peer, sizeof(peer), "%d", pr->peer);
+      fprintf(fp, "%s.pkts %llu\n", peer, (unsigned long long)pr->pkts);
+      fprintf(fp, "%s.lost %llu\n", peer, (unsigned long long)pr->lost);
+      fprintf(fp, "%s.overlimit %llu\n", peer, (unsigned long long)pr->overlimit);
+      fprintf(fp, "%s.delayed %llu\n", peer, (unsigned long long)pr->delayed);
+      fprintf(fp, "%s.reordered %llu\n", peer, (unsigned long long)pr->reordered);
+   }
+}
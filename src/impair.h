@@ -0,0 +1,219 @@
+/**
+ * \file impair.h
+ * \brief In-tunnel network impairments (delay, loss, reordering, rate).
+ *
+ *    Each `impair` line of the configuration file adds a profile to the
+ *    net (tun->net) or tun (net->tun) direction, for one peer (its unique
+ *    source port) or for all the others (*). Packets pushed to the retry
+ *    queue of a direction first go through the profile of their peer:
+ *    Gilbert-Elliott loss, token bucket shaping, then a delay drawn from
+ *    a constant, uniform, normal or pareto distribution. A reordered
+ *    packet skips the delay. Delayed packets are copied to a
+ *    preallocated pool and scheduled on a hashed timer wheel of
+ *    IMPAIR_TICK_US ticks, which impair_select() runs around select().
+ *    Draws come from a seeded xorshift generator so that runs can be
+ *    reproduced.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_IMPAIR_H
+#define UDPTUN_IMPAIR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "state.h"
+
+struct pkt_queue;
+
+/**
+ * \def IMPAIR_TICK_US
+ * \brief The timer wheel resolution (us).
+ */
+#define IMPAIR_TICK_US 100
+
+/**
+ * \def IMPAIR_SLOTS
+ * \brief The timer wheel slots (power of 2), i.e. a 409.6ms horizon.
+ *        Longer delays wait for more than one turn.
+ */
+#define IMPAIR_SLOTS 4096
+
+/**
+ * \def IMPAIR_MAX_PROFILES
+ * \brief The maximal amount of profiles per direction.
+ */
+#define IMPAIR_MAX_PROFILES 32
+
+/**
+ * \def IMPAIR_DEFAULT_POOL
+ * \brief The default amount of delayed packets per direction.
+ */
+#define IMPAIR_DEFAULT_POOL 1024
+
+/**
+ * \def IMPAIR_DEFAULT_LIMIT
+ * \brief The default shaping backlog (ms).
+ */
+#define IMPAIR_DEFAULT_LIMIT 100
+
+/**
+ * \def IMPAIR_NIL
+ * \brief The end of a pool list.
+ */
+#define IMPAIR_NIL UINT32_MAX
+
+/**
+ * \enum impair_dist
+ * \brief The delay distribution.
+ */
+enum impair_dist {
+   IMPAIR_UNIFORM,  /*!< delay +/- jitter */
+   IMPAIR_NORMAL,   /*!< mean delay, standard deviation jitter */
+   IMPAIR_PARETO    /*!< mean delay, heavy tail (shape 3) scaled by jitter */
+};
+
+/**
+ * \struct impair_profile
+ *	\brief The impairments of a peer and their state.
+ */
+struct impair_profile {
+   int      peer;          /*!< The peer id, -1 for any */
+   /* delay */
+   int64_t  delay;         /*!< The mean delay (us) */
+   int64_t  jitter;        /*!< The delay jitter (us) */
+   uint8_t  dist;          /*!< The jitter distribution (enum impair_dist) */
+   double   reorder;       /*!< The probability to skip the delay */
+   /* Gilbert-Elliott loss */
+   double   p;             /*!< P(good -> bad) */
+   double   r;             /*!< P(bad -> good) */
+   double   loss_good;     /*!< Loss probability in the good state */
+   double   loss_bad;      /*!< Loss probability in the bad state */
+   uint8_t  bad;           /*!< 1 in the bad state */
+   /* token bucket */
+   uint64_t rate;          /*!< The rate (bytes/s), 0 for no limit */
+   uint32_t burst;         /*!< The bucket depth (bytes) */
+   int64_t  limit;         /*!< The maximal shaping backlog (us) */
+   double   tokens;        /*!< The tokens at t_last (bytes) */
+   int64_t  t_last;        /*!< The last departure (us) */
+   uint32_t pending;       /*!< Packets on the wheel */
+
+   uint64_t pkts;          /*!< Packets seen */
+   uint64_t lost;          /*!< Packets lost */
+   uint64_t overlimit;     /*!< Packets dropped over the shaping backlog */
+   uint64_t delayed;       /*!< Packets put on the wheel */
+   uint64_t reordered;     /*!< Packets that skipped the delay */
+};
+
+/**
+ * \struct impair_pkt
+ *	\brief A delayed packet.
+ */
+struct impair_pkt {
+   uint32_t next;                /*!< The next packet of the slot or free list */
+   uint32_t prof;                /*!< The profile index */
+   int64_t  tick;                /*!< The release tick */
+   int      fd;                  /*!< The destination fd */
+   uint16_t peer;                /*!< The peer id */
+   int      len;                 /*!< The packet length */
+   socklen_t salen;              /*!< The destination sockaddr length or 0 */
+   int      tos;                 /*!< The outer TOS/traffic class or -1 */
+   struct sockaddr_storage sa;   /*!< The destination sockaddr */
+   char    *data;                /*!< The packet */
+};
+
+/**
+ * \struct impair
+ *	\brief The impairments of a direction.
+ */
+struct impair {
+   struct pkt_queue *q;          /*!< The retry queue of the direction */
+   struct impair_profile prof[IMPAIR_MAX_PROFILES]; /*!< The profiles */
+   uint8_t  nprof;               /*!< The amount of profiles */
+   uint8_t  any;                 /*!< The default profile index + 1, 0 if none */
+   uint8_t *map;                 /*!< Peer id to profile index + 1, or NULL */
+   uint64_t rng;                 /*!< The xorshift state */
+
+   struct impair_pkt *pool;      /*!< The packets */
+   char    *slab;                /*!< The packet buffers */
+   uint32_t pool_len;            /*!< The amount of packets */
+   uint32_t free;                /*!< The free list */
+   uint32_t len;                 /*!< Packets on the wheel */
+   uint32_t head[IMPAIR_SLOTS];  /*!< Slot lists */
+   uint32_t tail[IMPAIR_SLOTS];  /*!< Slot lists tails */
+   uint64_t busy[IMPAIR_SLOTS / 64]; /*!< Non-empty slots */
+   int64_t  tick;                /*!< The next tick to run */
+
+   uint64_t released;            /*!< Packets released from the wheel */
+   uint64_t exhausted;           /*!< Packets dropped on an empty pool */
+};
+
+/**
+ * \fn int impair_add(struct tun_state *state, const char *dir, const char *line)
+ * \brief Parse an impairment profile:
+ *        <peer-port|*> [delay MS [JITTER [uniform|normal|pareto]]]
+ *        [loss PCT] [loss-ge P R [BAD [GOOD]]] [reorder PCT]
+ *        [rate KBIT [BURST]] [limit MS]
+ *
+ * \param state The program state
+ * \param dir net or tun
+ * \param line The rest of the configuration line
+ * \return 0 on success, -1 on error (errno is filled)
+ */
+int impair_add(struct tun_state *state, const char *dir, const char *line);
+
+/**
+ * \fn void init_impair(struct impair *im, struct pkt_queue *q, uint32_t pool, uint32_t seed, const char *name)
+ * \brief Allocate the packet pool of a direction, attach it to its retry
+ *        queue and register its stats section.
+ *
+ * \param im The impairments or NULL
+ * \param q The retry queue
+ * \param pool The amount of delayed packets, 0 for IMPAIR_DEFAULT_POOL
+ * \param seed The random seed of the direction
+ * \param name The stats section name
+ */
+void init_impair(struct impair *im, struct pkt_queue *q, uint32_t pool,
+                 uint32_t seed, const char *name);
+
+/**
+ * \fn void free_impair(struct impair *im)
+ * \brief Free the impairments of a direction, drop the delayed packets.
+ *
+ * \param im The impairments
+ */
+void free_impair(struct impair *im);
+
+/**
+ * \fn int impair_push(struct impair *im, int fd, int peer, struct sockaddr *sa, socklen_t salen, int tos, char *buf, int len)
+ * \brief Apply the profile of a peer to a packet.
+ *
+ * \return 1 if the packet should be sent now, 0 if delayed, -1 if dropped
+ */
+int impair_push(struct impair *im, int fd, int peer, struct sockaddr *sa,
+                socklen_t salen, int tos, char *buf, int len);
+
+/**
+ * \fn int impair_select(struct tun_state *state, fd_set *input_set, fd_set *output_set, int fd_max, struct timeval *tv, int timeout)
+ * \brief xselect() that releases the delayed packets when due, and
+ *        flushes the tx-ring and polls as decided by the batching
+ *        controller.
+ *
+ * \param state The program state
+ * \param input_set The input fd_set
+ * \param output_set The output fd_set
+ * \param fd_max The max fd value
+ * \param tv The timeval
+ * \param timeout The inactivity timeout (sec), -1 for none
+ * \return The select return value, 0 on inactivity
+ */
+int impair_select(struct tun_state *state, fd_set *input_set,
+                  fd_set *output_set, int fd_max, struct timeval *tv,
+                  int timeout);
+
+#endif
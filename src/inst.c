@@ -0,0 +1,243 @@
+/**
+ * \file inst.c
+ * \brief Additional tunnel instances served by a shared worker pool.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/select.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <sys/syscall.h>
+#endif
+
+#include "inst.h"
+#include "debug.h"
+#include "sock.h"
+#include "net.h"
+#include "queue.h"
+#include "stats.h"
+#include "thread.h"
+#include "perf.h"
+
+/**
+ * \fn static void pin(int cpu)
+ * \brief Pin the calling thread to a CPU.
+ *
+ * \param cpu The CPU, -1 not to pin
+ */
+static void pin(int cpu);
+
+/**
+ * \fn static void *inst_work(void *arg)
+ * \brief A worker loop.
+ *
+ * \param arg The worker
+ */
+static void *inst_work(void *arg);
+
+/**
+ * \fn static void inst_stats(FILE *fp, void *arg)
+ * \brief Dump the instances counters.
+ */
+static void inst_stats(FILE *fp, void *arg);
+
+int inst_add(struct tun_state *state, const char *name, const char *line) {
+   char cfg[256], hex[256];
+   int ret = sscanf(line, "%255s %255s", cfg, hex);
+   if (ret < 1) {
+      errno=EINVAL;
+      return -1;
+   }
+   if (!state->inst)
+      state->inst = calloc(1, sizeof(struct inst_pool));
+   struct inst_pool *pool = state->inst;
+   if (pool->len >= INST_MAX) {
+      errno=ENOMEM;
+      return -1;
+   }
+
+   struct inst *in = &pool->inst[pool->len++];
+   in->name             = strdup(name);
+   in->args             = *state->args;
+   in->args.config_file = strdup(cfg);
+   in->args.raw_header  = ret == 2 ? strdup(hex) : NULL;
+   in->args.raw_header_size = 0;
+   debug_print("instance %s: %s\n", name, cfg);
+   return 0;
+}
+
+void init_inst(struct tun_state *state, inst_in_t in, inst_out_t out) {
+   struct inst_pool *pool = state->inst;
+   if (!pool)
+      return;
+   pool->in          = in;
+   pool->out         = out;
+   pool->workers_len = state->inst_workers ? state->inst_workers : 1;
+   if (pool->workers_len > INST_MAX_WORKERS)
+      pool->workers_len = INST_MAX_WORKERS;
+   if (pool->workers_len > pool->len)
+      pool->workers_len = pool->len;
+
+   for (int i=0; i<pool->len; i++) {
+      struct inst *it = &pool->inst[i];
+      struct tun_state *st = init_tun_instance(state, &it->args);
+      it->state   = st;
+      it->worker  = i % pool->workers_len;
+      it->fd_net4 = -1;
+      it->fd_net6 = -1;
+
+      /* tun interface and sockets */
+      tun(st, &it->fd_tun);
+      if (!st->ipv6 || st->dual_stack)
+         it->fd_net4 = udp_sock4(st->public_port, 1, st->public_addr4);
+      if (st->ipv6 || st->dual_stack)
+         it->fd_net6 = udp_sock6(st->public_port, 1, st->public_addr6);
+
+      /* buffers, the raw header is prepended in place */
+      it->inbuf  = xmalloc(BUFF_SIZE + st->raw_header_size);
+      it->outbuf = xmalloc(BUFF_SIZE + 4);
+      if (st->raw_header)
+         memcpy(it->inbuf, st->raw_header, st->raw_header_size);
+      if (st->planetlab) {
+         it->outbuf[0]=0;it->outbuf[1]=0;
+         it->outbuf[2]=8;it->outbuf[3]=0;
+      }
+      debug_print("instance %s: %s, port %d, worker %d\n", it->name,
+                  st->tun_if, st->public_port, it->worker);
+   }
+   stats_register("inst", inst_stats, pool);
+
+   for (int i=0; i<pool->workers_len; i++) {
+      struct inst_worker *w = &pool->workers[i];
+      w->pool = pool;
+      w->cpu  = state->inst_cpu < 0 ? -1 : state->inst_cpu + i;
+      xthread_create(inst_work, (void *)w, 1);
+   }
+}
+
+void free_inst(struct inst_pool *pool) {
+   for (int i=0; i<pool->len; i++) {
+      struct inst *it = &pool->inst[i];
+      if (it->state)
+         free_tun_instance(it->state);
+      free(it->inbuf);
+      free(it->outbuf);
+      free(it->name);
+      free(it->args.config_file);
+      free(it->args.raw_header);
+   }
+   free(pool);
+}
+
+void pin(int cpu) {
+   if (cpu < 0)
+      return;
+#if defined(LINUX_OS)
+   unsigned long mask[16];
+   memset(mask, 0, sizeof(mask));
+   if (cpu >= (int)(sizeof(mask) * 8))
+      return;
+   mask[cpu / (8 * sizeof(long))] |= 1UL << (cpu % (8 * sizeof(long)));
+   if (syscall(__NR_sched_setaffinity, 0, sizeof(mask), mask) < 0) {
+      debug_print("inst: can't pin to cpu %d\n", cpu);
+   }
+#endif
+}
+
+void *inst_work(void *arg) {
+   struct inst_worker *w = arg;
+   struct inst_pool *pool = w->pool;
+   int id = w - pool->workers;
+   fd_set input_set, output_set;
+   struct timeval tv;
+
+   char name[16];
+   snprintf(name, sizeof(name), "inst.worker%d", id);
+   perf_thread(name);
+   pin(w->cpu);
+
+   while (1) {
+      int fd_max = 0;
+      FD_ZERO(&input_set);
+      FD_ZERO(&output_set);
+      for (int i=0; i<pool->len; i++) {
+         struct inst *it = &pool->inst[i];
+         if (it->worker != id)
+            continue;
+         struct tun_state *st = it->state;
+         if (!queue_full(st->txq_tun)) {
+            if (it->fd_net4 >= 0) FD_SET(it->fd_net4, &input_set);
+            if (it->fd_net6 >= 0) FD_SET(it->fd_net6, &input_set);
+         }
+         if (!queue_full(st->txq_net))
+            FD_SET(it->fd_tun, &input_set);
+         fd_max = max(fd_max, max(it->fd_tun, max(it->fd_net4, it->fd_net6)));
+         fd_max = max(fd_max, queue_fd_set(st->txq_tun, &output_set));
+         fd_max = max(fd_max, queue_fd_set(st->txq_net, &output_set));
+      }
+
+      xselect(&input_set, &output_set, fd_max, &tv, -1);
+      w->rounds++;
+
+      /* one packet per ready fd, from a different instance each round */
+      for (int k=0; k<pool->len; k++) {
+         struct inst *it = &pool->inst[(w->next + k) % pool->len];
+         if (it->worker != id)
+            continue;
+         struct tun_state *st = it->state;
+         queue_flush(st->txq_tun, &output_set);
+         queue_flush(st->txq_net, &output_set);
+         if (it->fd_net4 >= 0 && FD_ISSET(it->fd_net4, &input_set)) {
+            (*pool->out)(it->fd_net4, it->fd_tun, st, &ip_family4,
+                         it->outbuf + (st->planetlab ? 4 : 0));
+            it->net_reads++;
+         }
+         if (it->fd_net6 >= 0 && FD_ISSET(it->fd_net6, &input_set)) {
+            (*pool->out)(it->fd_net6, it->fd_tun, st, &ip_family6,
+                         it->outbuf + (st->planetlab ? 4 : 0));
+            it->net_reads++;
+         }
+         if (FD_ISSET(it->fd_tun, &input_set)) {
+            (*pool->in)(it->fd_tun, it->fd_net4, it->fd_net6, st,
+                        it->inbuf + st->raw_header_size);
+            it->tun_reads++;
+         }
+      }
+      w->next = (w->next + 1) % pool->len;
+   }
+   return 0;
+}
+
+void inst_stats(FILE *fp, void *arg) {
+   struct inst_pool *pool = arg;
+   for (int i=0; i<pool->workers_len; i++) {
+      struct inst_worker *w = &pool->workers[i];
+      fprintf(fp, "worker%d.cpu %d\n", i, w->cpu);
+      fprintf(fp, "worker%d.rounds %llu\n", i, (unsigned long long)w->rounds);
+   }
+   for (int i=0; i<pool->len; i++) {
+      struct inst *it = &pool->inst[i];
+      struct tun_state *st = it->state;
+      if (!st)
+         continue;
+      fprintf(fp, "%s.worker %d\n", it->name, it->worker);
+      fprintf(fp, "%s.tun_if %s\n", it->name, st->tun_if ? st->tun_if : "-");
+      fprintf(fp, "%s.port %d\n", it->name, st->public_port);
+      fprintf(fp, "%s.peers %u\n", it->name, g_hash_table_size(st->serv));
+      fprintf(fp, "%s.tun_reads %llu\n", it->name,
+              (unsigned long long)it->tun_reads);
+      fprintf(fp, "%s.net_reads %llu\n", it->name,
+              (unsigned long long)it->net_reads);
+      fprintf(fp, "%s.queue_dropped %llu\n", it->name,
+              (unsigned long long)(st->txq_tun->dropped + st->txq_net->dropped));
+      fprintf(fp, "%s.queue_errors %llu\n", it->name,
+              (unsigned long long)(st->txq_tun->errors + st->txq_net->errors));
+   }
+}
@@ -0,0 +1,134 @@
+/**
+ * \file inst.h
+ * \brief Additional tunnel instances served by a shared worker pool.
+ *
+ *    A server can run several tunnels in one process: each `instance`
+ *    line of the configuration file names a configuration file of its
+ *    own (tun-if, private addresses, public-server-port, queues, ...) and
+ *    optionally a raw header. An instance has its own tun interface, UDP
+ *    sockets, raw header, peer table and retry queues. The instances are
+ *    spread over instance-workers threads, optionally pinned to
+ *    consecutive CPUs from instance-cpu. A worker selects on the fds of
+ *    its instances and reads one packet per ready fd per round, starting
+ *    from the next instance each round, so that a busy instance can't
+ *    starve the others. The main tunnel keeps running on the main loop.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_INST_H
+#define UDPTUN_INST_H
+
+#include <stdint.h>
+
+#include "udptun.h"
+#include "state.h"
+#include "family.h"
+
+/**
+ * \def INST_MAX
+ * \brief The maximal amount of instances.
+ */
+#define INST_MAX 16
+
+/**
+ * \def INST_MAX_WORKERS
+ * \brief The maximal amount of worker threads.
+ */
+#define INST_MAX_WORKERS 16
+
+/**
+ * \typedef inst_in_t
+ * \brief Read a packet from tun and forward it in the tunnel
+ *        (e.g. tun_serv_in).
+ */
+typedef int (*inst_in_t)(int fd_tun, int fd_net4, int fd_net6,
+                          struct tun_state *state, char *buf);
+
+/**
+ * \typedef inst_out_t
+ * \brief Read a packet from the network and forward it out of the
+ *        tunnel (e.g. tun_serv_out).
+ */
+typedef int (*inst_out_t)(int fd_net, int fd_tun, struct tun_state *state,
+                           const struct ip_family *f, char *buf);
+
+/**
+ * \struct inst
+ *	\brief A tunnel instance.
+ */
+struct inst {
+   char     *name;               /*!< The instance name */
+   struct arguments args;        /*!< The program arguments, with the
+                                      instance cfg file and raw header */
+   struct tun_state *state;      /*!< The instance state */
+   int       fd_tun;             /*!< The tun fd */
+   int       fd_net4;            /*!< The v4 socket or -1 */
+   int       fd_net6;            /*!< The v6 socket or -1 */
+   char     *inbuf;              /*!< The tun buffer (raw header headroom) */
+   char     *outbuf;             /*!< The network buffer */
+   uint8_t   worker;             /*!< The worker index */
+
+   uint64_t  tun_reads;          /*!< Packets read from tun */
+   uint64_t  net_reads;          /*!< Datagrams read from the network */
+};
+
+struct inst_pool;
+
+/**
+ * \struct inst_worker
+ *	\brief A worker thread.
+ */
+struct inst_worker {
+   struct inst_pool *pool;       /*!< The pool */
+   int       cpu;                /*!< The pinned CPU or -1 */
+   uint8_t   next;               /*!< The first instance of the next round */
+   uint64_t  rounds;             /*!< select() rounds */
+};
+
+/**
+ * \struct inst_pool
+ *	\brief The instances and their workers.
+ */
+struct inst_pool {
+   struct inst inst[INST_MAX];   /*!< The instances */
+   uint8_t   len;                /*!< Amount of instances */
+   struct inst_worker workers[INST_MAX_WORKERS]; /*!< The workers */
+   uint8_t   workers_len;        /*!< Amount of workers */
+   inst_in_t  in;                /*!< The tun read function */
+   inst_out_t out;               /*!< The network read function */
+};
+
+/**
+ * \fn int inst_add(struct tun_state *state, const char *name, const char *line)
+ * \brief Register an instance from a cfg line:
+ *          instance <name> <config-file> [<raw-header-hex>]
+ *
+ * \param state The program state
+ * \param name The instance name
+ * \param line The rest of the cfg line
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+int inst_add(struct tun_state *state, const char *name, const char *line);
+
+/**
+ * \fn void init_inst(struct tun_state *state, inst_in_t in, inst_out_t out)
+ * \brief Create the instances states, tun interfaces and sockets, and
+ *        start the workers.
+ *
+ * \param state The program state
+ * \param in The tun read function
+ * \param out The network read function
+ */
+void init_inst(struct tun_state *state, inst_in_t in, inst_out_t out);
+
+/**
+ * \fn void free_inst(struct inst_pool *pool)
+ * \brief Free the instances, threads must be canceled.
+ *
+ * \param pool The instances
+ */
+void free_inst(struct inst_pool *pool);
+
+#endif
@@ -0,0 +1,447 @@
+/**
+ * \file load.c
+ * \brief Synthetic traffic generator and sink.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include "load.h"
+#include "debug.h"
+#include "timing.h"
+#include "sock.h"
+#include "stats.h"
+#include "recs.h"
+#include "destruct.h"
+#include "udptun.h"
+
+/**
+ * \struct load_size
+ *	\brief A packet size distribution.
+ */
+struct load_size {
+   uint16_t lo;         /*!< Minimal size */
+   uint16_t hi;         /*!< Maximal size, uniform in [lo, hi] */
+   uint8_t  imix;       /*!< 7:4:1 mix of minimal, 576 and 1500 bytes */
+};
+
+/**
+ * \struct load_gen
+ *	\brief The generator counters.
+ */
+struct load_gen {
+   uint64_t tx;         /*!< Packets sent */
+   uint64_t bytes;      /*!< Bytes sent (IP) */
+   uint64_t drops;      /*!< Packets refused by the kernel (ENOBUFS & co) */
+   int64_t  t_start;    /*!< Start time (ns) */
+   int64_t  t_end;      /*!< End time (ns), 0 while running */
+   uint32_t pps;        /*!< The target rate */
+};
+
+/**
+ * \struct load_flow
+ *	\brief A flow seen by the sink.
+ */
+struct load_flow {
+   uint32_t key;        /*!< generator << 16 | flow, 0 if free */
+   uint32_t pad;
+   uint64_t next;       /*!< Next expected sequence number */
+   uint64_t rx;         /*!< Packets received */
+};
+
+/**
+ * \struct load_sink
+ *	\brief The sink counters and flow table.
+ */
+struct load_sink {
+   uint64_t rx;         /*!< Valid packets */
+   uint64_t bytes;      /*!< Payload bytes of valid packets */
+   uint64_t bad;        /*!< Not a generated packet */
+   uint64_t corrupt;    /*!< Payload pattern mismatch */
+   uint64_t reordered;  /*!< Sequence number lower than expected */
+   uint64_t untracked;  /*!< Flow table full */
+   uint64_t lat_n;      /*!< Latency samples */
+   int64_t  lat_sum;    /*!< Sum of one-way latencies (ns) */
+   int64_t  lat_min;    /*!< Minimal one-way latency (ns) */
+   int64_t  lat_max;    /*!< Maximal one-way latency (ns) */
+   uint32_t flows;      /*!< Flows in the table */
+   struct load_flow table[LOAD_SINK_FLOWS]; /*!< The flow table */
+};
+
+/**
+ * \fn static int64_t realtime_ns()
+ * \brief The wall clock time (ns), stamped in the packets for the
+ *        one-way latency.
+ */
+static int64_t realtime_ns();
+
+/**
+ * \fn static void parse_size(const char *val, uint16_t min, struct load_size *sz)
+ * \brief Parse a load-size value: N, LO-HI or imix. Sizes are IP total
+ *        lengths, raised to the headers size.
+ */
+static void parse_size(const char *val, uint16_t min, struct load_size *sz);
+
+/**
+ * \fn static uint16_t pick_size(const struct load_size *sz, uint64_t *rnd)
+ * \brief Draw a packet size.
+ */
+static uint16_t pick_size(const struct load_size *sz, uint64_t *rnd);
+
+/**
+ * \fn static uint16_t udp6_sum(const struct ip6_hdr *ip6, const char *udp, int len)
+ * \brief The UDP checksum over the IPv6 pseudo-header.
+ */
+static uint16_t udp6_sum(const struct ip6_hdr *ip6, const char *udp, int len);
+
+/**
+ * \fn static void fill(char *buf, int len, uint64_t seq)
+ * \brief Write the payload pattern of a sequence number.
+ */
+static void fill(char *buf, int len, uint64_t seq);
+
+/**
+ * \fn static void sink_pkt(struct load_sink *s, const char *buf, int len)
+ * \brief Verify and count a received payload.
+ */
+static void sink_pkt(struct load_sink *s, const char *buf, int len);
+
+/**
+ * \fn static void gen_stats(FILE *fp, void *arg)
+ * \brief Dump the generator counters.
+ */
+static void gen_stats(FILE *fp, void *arg);
+
+/**
+ * \fn static void sink_stats(FILE *fp, void *arg)
+ * \brief Dump the sink counters.
+ */
+static void sink_stats(FILE *fp, void *arg);
+
+int64_t realtime_ns() {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void parse_size(const char *val, uint16_t min, struct load_size *sz) {
+   char *end;
+   memset(sz, 0, sizeof(struct load_size));
+   if (!val || !strcmp(val, "imix")) {
+      sz->imix = !!val;
+      sz->lo = sz->hi = val ? min : 512;
+   } else {
+      sz->lo = sz->hi = strtol(val, &end, 10);
+      if (*end == '-')
+         sz->hi = strtol(end + 1, &end, 10);
+      if (*end || sz->lo > sz->hi || sz->hi > LOAD_MAX_SIZE) {
+         errno=EINVAL;
+         die("load-size");
+      }
+   }
+   if (sz->lo < min) sz->lo = min;
+   if (sz->hi < min) sz->hi = min;
+}
+
+uint16_t pick_size(const struct load_size *sz, uint64_t *rnd) {
+   /* xorshift64 */
+   uint64_t x = *rnd;
+   x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+   *rnd = x;
+   if (sz->imix) {
+      int r = x % 12;
+      return r < 7 ? sz->lo : (r < 11 ? 576 : 1500);
+   }
+   return sz->lo + x % (sz->hi - sz->lo + 1);
+}
+
+uint16_t udp6_sum(const struct ip6_hdr *ip6, const char *udp, int len) {
+   uint32_t sum = 0;
+   const uint16_t *p = (const uint16_t *)&ip6->ip6_src;
+   for (int i=0; i<16; i++)
+      sum += p[i];
+   sum += htons(len) + htons(IPPROTO_UDP);
+   p = (const uint16_t *)udp;
+   for (; len > 1; len -= 2)
+      sum += *p++;
+   if (len)
+      sum += htons(*(const uint8_t *)p << 8);
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   uint16_t csum = ~sum;
+   return csum ? csum : 0xffff;
+}
+
+void fill(char *buf, int len, uint64_t seq) {
+   for (int i=0; i<len; i++)
+      buf[i] = (char)(seq + i);
+}
+
+void gen_stats(FILE *fp, void *arg) {
+   struct load_gen *g = arg;
+   int64_t end = g->t_end ? g->t_end : monotonic_ns();
+   double secs = g->t_start ? (end - g->t_start) / 1e9 : 0;
+   fprintf(fp, "target_pps %u\n", g->pps);
+   fprintf(fp, "tx %llu\n", (unsigned long long)g->tx);
+   fprintf(fp, "bytes %llu\n", (unsigned long long)g->bytes);
+   fprintf(fp, "drops %llu\n", (unsigned long long)g->drops);
+   fprintf(fp, "pps %.0f\n", secs > 0 ? g->tx / secs : 0);
+   fprintf(fp, "mbps %.1f\n", secs > 0 ? g->bytes * 8 / secs / 1e6 : 0);
+}
+
+void *load_gen_thread(void *st) {
+   struct tun_state *state = st;
+   struct load_gen *g = xmalloc(sizeof(struct load_gen));
+   memset(g, 0, sizeof(struct load_gen));
+   g->pps = state->load_pps;
+   stats_register("load.gen", gen_stats, g);
+
+   int v6 = state->ipv6;
+   int iplen = v6 ? sizeof(struct ip6_hdr) : sizeof(struct ip);
+   uint16_t min = iplen + sizeof(struct udphdr) + sizeof(struct load_hdr);
+   uint16_t nflows = state->load_flows ? state->load_flows : 1;
+   uint16_t burst = state->load_burst ? state->load_burst : 1;
+   struct load_size sz;
+   parse_size(state->load_size, min, &sz);
+   if (nflows > LOAD_MAX_FLOWS || !state->sa_len) {
+      errno=EINVAL;
+      die("load-flows");
+   }
+
+   /* raw socket, the kernel routes packets to tun */
+   int s;
+   if ((s=socket(v6 ? AF_INET6 : AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0)
+      die("socket");
+   set_fd(s);
+
+   struct in_addr src4;
+   struct in6_addr src6;
+   if ((v6 && inet_pton(AF_INET6, state->private_addr6, &src6) != 1) ||
+       (!v6 && inet_pton(AF_INET, state->private_addr4, &src4) != 1)) {
+      errno=EINVAL;
+      die("load private address");
+   }
+
+   uint64_t *seqs = calloc(nflows, sizeof(uint64_t));
+   if (!seqs)
+      die("calloc");
+   char buf[LOAD_MAX_SIZE];
+   memset(buf, 0, sizeof(buf));
+   struct ip *ip4        = (struct ip *)buf;
+   struct ip6_hdr *ip6   = (struct ip6_hdr *)buf;
+   struct udphdr *udp    = (struct udphdr *)(buf + iplen);
+   struct load_hdr *hdr  = (struct load_hdr *)(udp + 1);
+   char *payload         = (char *)(hdr + 1);
+   if (v6) {
+      ip6->ip6_flow = htonl(6 << 28);
+      ip6->ip6_nxt  = IPPROTO_UDP;
+      ip6->ip6_hlim = 64;
+      ip6->ip6_src  = src6;
+   } else {
+      /* the kernel fills the id and checksum */
+      ip4->ip_v   = 4;
+      ip4->ip_hl  = 5;
+      ip4->ip_ttl = 64;
+      ip4->ip_p   = IPPROTO_UDP;
+      ip4->ip_src = src4;
+   }
+   udp->uh_dport = htons(state->load_port);
+   hdr->magic = htonl(LOAD_MAGIC);
+   hdr->gen   = htons(state->port);
+
+   struct sockaddr_in  sa4;
+   struct sockaddr_in6 sa6;
+   memset(&sa4, 0, sizeof(sa4));
+   memset(&sa6, 0, sizeof(sa6));
+   sa4.sin_family  = AF_INET;
+   sa6.sin6_family = AF_INET6;
+
+   /* pace bursts on absolute deadlines */
+   int64_t period = (int64_t)burst * 1000000000LL / g->pps;
+   int64_t now    = monotonic_ns();
+   int64_t end    = now + state->load_duration * 1000000000LL;
+   int64_t next   = now;
+   uint64_t rnd   = 0x9e3779b97f4a7c15ULL ^ state->port;
+   uint32_t flow  = 0;
+   g->t_start = now;
+   debug_print("load: %u pps, %u flows, bursts of %u\n", g->pps, nflows, burst);
+
+   while (!state->load_duration || now < end) {
+      for (int b=0; b<burst; b++) {
+         struct rec_priv *rec = recs_priv(state->recs, 
+                                     state->cli_private[flow % state->sa_len]);
+         uint16_t len = pick_size(&sz, &rnd);
+         int plen = len - (payload - buf);
+         uint64_t seq = seqs[flow]++;
+
+         udp->uh_sport = htons(state->load_port + 1 + flow);
+         udp->uh_ulen  = htons(len - iplen);
+         udp->uh_sum   = 0;
+         hdr->flow = htons(flow);
+         hdr->seq  = seq;
+         fill(payload, plen, seq);
+         hdr->ts   = realtime_ns();
+
+         int sent;
+         if (v6) {
+            ip6->ip6_plen = htons(len - iplen);
+            memcpy(&ip6->ip6_dst, rec->addr6, 16);
+            udp->uh_sum = udp6_sum(ip6, (char *)udp, len - iplen);
+            memcpy(&sa6.sin6_addr, rec->addr6, 16);
+            sent = sendto(s, buf, len, 0, (struct sockaddr *)&sa6, sizeof(sa6));
+         } else {
+            ip4->ip_len = htons(len);
+            ip4->ip_dst.s_addr = rec->addr4;
+            sa4.sin_addr.s_addr = rec->addr4;
+            sent = sendto(s, buf, len, 0, (struct sockaddr *)&sa4, sizeof(sa4));
+         }
+         if (sent < 0) {
+            g->drops++;
+         } else {
+            g->tx++;
+            g->bytes += len;
+         }
+         if (++flow == nflows)
+            flow = 0;
+      }
+
+      next += period;
+      now = monotonic_ns();
+      if (next > now) {
+         struct timespec ts = {next / 1000000000LL, next % 1000000000LL};
+         clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+         now = next;
+      } else if (now - next > 1000000000LL) {
+         /* more than 1s late, do not catch up in one burst */
+         next = now;
+      }
+   }
+   g->t_end = monotonic_ns();
+   debug_print("load: sent %llu packets\n", (unsigned long long)g->tx);
+
+   close_fd(s);
+   free(seqs);
+   return 0;
+}
+
+void sink_stats(FILE *fp, void *arg) {
+   struct load_sink *s = arg;
+   uint64_t lost = 0;
+   for (int i=0; i<LOAD_SINK_FLOWS; i++) {
+      struct load_flow *f = &s->table[i];
+      if (f->key && f->next > f->rx)
+         lost += f->next - f->rx;
+   }
+   fprintf(fp, "rx %llu\n", (unsigned long long)s->rx);
+   fprintf(fp, "bytes %llu\n", (unsigned long long)s->bytes);
+   fprintf(fp, "flows %u\n", s->flows);
+   fprintf(fp, "lost %llu\n", (unsigned long long)lost);
+   fprintf(fp, "reordered %llu\n", (unsigned long long)s->reordered);
+   fprintf(fp, "corrupt %llu\n", (unsigned long long)s->corrupt);
+   fprintf(fp, "bad %llu\n", (unsigned long long)s->bad);
+   fprintf(fp, "untracked %llu\n", (unsigned long long)s->untracked);
+   if (s->lat_n) {
+      fprintf(fp, "latency_min_us %.1f\n", s->lat_min / 1e3);
+      fprintf(fp, "latency_avg_us %.1f\n", s->lat_sum / 1e3 / s->lat_n);
+      fprintf(fp, "latency_max_us %.1f\n", s->lat_max / 1e3);
+   }
+}
+
+void sink_pkt(struct load_sink *s, const char *buf, int len) {
+   const struct load_hdr *hdr = (const struct load_hdr *)buf;
+   if (len < (int)sizeof(struct load_hdr) || ntohl(hdr->magic) != LOAD_MAGIC) {
+      s->bad++;
+      return;
+   }
+   const char *payload = (const char *)(hdr + 1);
+   int plen = len - sizeof(struct load_hdr);
+   for (int i=0; i<plen; i++) {
+      if (payload[i] != (char)(hdr->seq + i)) {
+         s->corrupt++;
+         return;
+      }
+   }
+   s->rx++;
+   s->bytes += len;
+
+   /* one-way latency, meaningful with synchronized clocks */
+   int64_t lat = realtime_ns() - hdr->ts;
+   if (lat >= 0) {
+      if (!s->lat_n || lat < s->lat_min) s->lat_min = lat;
+      if (lat > s->lat_max) s->lat_max = lat;
+      s->lat_sum += lat;
+      s->lat_n++;
+   }
+
+   /* sequence tracking, linear probing */
+   uint32_t key = (uint32_t)ntohs(hdr->gen) << 16 | ntohs(hdr->flow);
+   uint32_t h = (key * 2654435761u) & (LOAD_SINK_FLOWS - 1);
+   for (int probe=0; probe<LOAD_SINK_FLOWS; probe++) {
+      struct load_flow *f = &s->table[(h + probe) & (LOAD_SINK_FLOWS - 1)];
+      if (!f->key) {
+         if (s->flows >= LOAD_SINK_FLOWS / 2)
+            break;
+         f->key = key;
+         s->flows++;
+      } else if (f->key != key) {
+         continue;
+      }
+      if (hdr->seq < f->next)
+         s->reordered++;
+      else
+         f->next = hdr->seq + 1;
+      f->rx++;
+      return;
+   }
+   s->untracked++;
+}
+
+void *load_sink_thread(void *st) {
+   struct tun_state *state = st;
+   struct load_sink *s = calloc(1, sizeof(struct load_sink));
+   if (!s)
+      die("calloc");
+   stats_register("load.sink", sink_stats, s);
+
+   int fds[2] = {-1, -1}, nfds = 0, fd_max = 0;
+   if (!state->ipv6 || state->dual_stack)
+      fds[nfds++] = udp_sock4(state->load_port, 1, state->private_addr4);
+   if (state->ipv6 || state->dual_stack)
+      fds[nfds++] = udp_sock6(state->load_port, 1, state->private_addr6);
+   for (int i=0; i<nfds; i++)
+      fd_max = max(fd_max, fds[i]);
+
+   char buf[BUFF_SIZE];
+   fd_set input_set;
+   while (1) {
+      FD_ZERO(&input_set);
+      for (int i=0; i<nfds; i++)
+         FD_SET(fds[i], &input_set);
+      if (select(fd_max+1, &input_set, NULL, NULL, NULL) < 0) {
+         if (errno == EINTR)
+            continue;
+         die("select");
+      }
+      for (int i=0; i<nfds; i++) {
+         if (!FD_ISSET(fds[i], &input_set))
+            continue;
+         int n;
+         while ((n = recv(fds[i], buf, BUFF_SIZE, 0)) >= 0)
+            sink_pkt(s, buf, n);
+      }
+   }
+   return 0;
+}
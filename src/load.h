@@ -0,0 +1,80 @@
+/**
+ * \file load.h
+ * \brief Synthetic traffic generator and sink.
+ *
+ *    The generator crafts UDP/IP packets from the private address of the
+ *    node to the private addresses of its peers and sends them on a raw
+ *    socket, so that the kernel routes them to the tun interface and they
+ *    cross the tunnel like measurement traffic. Packet sizes follow a
+ *    fixed, uniform or IMIX distribution, flows are distinct source ports
+ *    spread over the peers, and packets are paced in bursts at a fixed
+ *    rate. Each packet carries a sequence number, a timestamp and a
+ *    payload pattern that the sink, listening on the private addresses,
+ *    verifies to count losses, reordering, corruption and one-way latency.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_LOAD_H
+#define UDPTUN_LOAD_H
+
+#include <stdint.h>
+
+#include "state.h"
+
+/**
+ * \def LOAD_MAGIC
+ * \brief The load header magic.
+ */
+#define LOAD_MAGIC 0xc0ca7104
+
+/**
+ * \def LOAD_MAX_FLOWS
+ * \brief The maximal amount of flows per generator.
+ */
+#define LOAD_MAX_FLOWS 16384
+
+/**
+ * \def LOAD_SINK_FLOWS
+ * \brief The sink flow table size (power of 2), shared by all generators.
+ */
+#define LOAD_SINK_FLOWS 65536
+
+/**
+ * \def LOAD_MAX_SIZE
+ * \brief The maximal packet size (IP total length).
+ */
+#define LOAD_MAX_SIZE 1500
+
+/**
+ * \struct load_hdr
+ *	\brief The header of generated UDP payloads.
+ */
+struct load_hdr {
+   uint32_t magic;      /*!< LOAD_MAGIC */
+   uint16_t gen;        /*!< The generator unique port */
+   uint16_t flow;       /*!< The flow index */
+   uint64_t seq;        /*!< The flow sequence number (host order) */
+   int64_t  ts;         /*!< CLOCK_REALTIME send time (ns, host order) */
+} __attribute__((packed));
+
+/**
+ * \fn void *load_gen_thread(void *st)
+ * \brief Generate load-pps packets/s for load-duration seconds.
+ *
+ * \param st The program state
+ * \return 0
+ */
+void *load_gen_thread(void *st);
+
+/**
+ * \fn void *load_sink_thread(void *st)
+ * \brief Receive, verify and count generated packets on load-port.
+ *
+ * \param st The program state
+ * \return 0
+ */
+void *load_sink_thread(void *st);
+
+#endif
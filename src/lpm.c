@@ -0,0 +1,291 @@
+/**
+ * \file lpm.c
+ * \brief Longest-prefix-match routing tables.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lpm.h"
+
+/**
+ * \def LPM4_TBL24_LEN
+ * \brief The amount of tbl24 entries.
+ */
+#define LPM4_TBL24_LEN (1 << 24)
+
+/**
+ * \fn static int grow(void **array, uint32_t *size, uint32_t len, size_t elem)
+ * \brief Make room for one more element in a dynamic array.
+ *
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+static int grow(void **array, uint32_t *size, uint32_t len, size_t elem);
+
+/**
+ * \fn static void lpm4_set(uint32_t *e, uint32_t n, uint32_t entry)
+ * \brief Overwrite the entries set by shorter (or equal) prefixes.
+ */
+static void lpm4_set(uint32_t *e, uint32_t n, uint32_t entry);
+
+/**
+ * \fn static int lpm6_node(struct lpm6 *t, uint32_t node, struct lpm6_rule *r, uint32_t n, int depth, uint32_t def)
+ * \brief Compile a trie node.
+ *
+ * \param t The table
+ * \param node The (reserved) node index
+ * \param r The prefixes longer than 8*depth under this node, sorted
+ * \param n The amount of prefixes
+ * \param depth The node depth (bytes)
+ * \param def The inherited next hop
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+static int lpm6_node(struct lpm6 *t, uint32_t node, struct lpm6_rule *r,
+                     uint32_t n, int depth, uint32_t def);
+
+/**
+ * \fn static int rule_cmp(const void *a, const void *b)
+ * \brief Order IPv6 prefixes by address, then length.
+ */
+static int rule_cmp(const void *a, const void *b);
+
+int grow(void **array, uint32_t *size, uint32_t len, size_t elem) {
+   if (len < *size)
+      return 0;
+   uint32_t nsize = *size ? *size * 2 : 16;
+   void *narray = realloc(*array, nsize * elem);
+   if (!narray) {
+      errno=ENOMEM;
+      return -1;
+   }
+   *array = narray;
+   *size  = nsize;
+   return 0;
+}
+
+int lpm_prefix(char *str, int max_len) {
+   char *slash = strchr(str, '/'), *end;
+   if (!slash)
+      return max_len;
+   *slash = '\0';
+   long len = strtol(slash+1, &end, 10);
+   if (end == slash+1 || *end || len < 0 || len > max_len)
+      return -1;
+   return len;
+}
+
+struct lpm4 *lpm4_new() {
+   struct lpm4 *t = calloc(1, sizeof(struct lpm4));
+   if (!t)
+      return NULL;
+   t->tbl24 = calloc(LPM4_TBL24_LEN, sizeof(uint32_t));
+   if (!t->tbl24) {
+      lpm4_free(t);
+      errno=ENOMEM;
+      return NULL;
+   }
+   return t;
+}
+
+void lpm4_set(uint32_t *e, uint32_t n, uint32_t entry) {
+   uint32_t depth = entry & ~LPM_EXT & ~LPM_IDX;
+   for (uint32_t i=0; i<n; i++)
+      if ((e[i] & ~LPM_IDX) <= depth)
+         e[i] = entry;
+}
+
+int lpm4_add(struct lpm4 *t, uint32_t addr, uint8_t len, uint32_t nh) {
+   if (len > 32 || !nh || nh > LPM_IDX) {
+      errno=EINVAL;
+      return -1;
+   }
+   addr &= len ? ~0U << (32 - len) : 0;
+   uint32_t entry = ((uint32_t)len << 24) | nh;
+
+   if (len <= 24) {
+      uint32_t start = addr >> 8, n = 1 << (24 - len);
+      for (uint32_t i=start; i<start+n; i++) {
+         if (t->tbl24[i] & LPM_EXT)
+            lpm4_set(&t->tbl8[(t->tbl24[i] & LPM_IDX) << 8], 256, entry);
+         else
+            lpm4_set(&t->tbl24[i], 1, entry);
+      }
+      return 0;
+   }
+
+   /* extend with a tbl8 group */
+   uint32_t *e24 = &t->tbl24[addr >> 8];
+   if (!(*e24 & LPM_EXT)) {
+      if (t->tbl8_len > LPM_IDX)
+         return -1;
+      if (t->tbl8_len == t->tbl8_size) {
+         uint32_t nsize = t->tbl8_size ? t->tbl8_size * 2 : 64;
+         uint32_t *ntbl8 = realloc(t->tbl8, (size_t)nsize * 256 * sizeof(uint32_t));
+         if (!ntbl8) {
+            errno=ENOMEM;
+            return -1;
+         }
+         t->tbl8      = ntbl8;
+         t->tbl8_size = nsize;
+      }
+      uint32_t g = t->tbl8_len++;
+      for (int i=0; i<256; i++)
+         t->tbl8[(g << 8) + i] = *e24;
+      *e24 = LPM_EXT | g;
+   }
+   uint32_t *group = &t->tbl8[(*e24 & LPM_IDX) << 8];
+   lpm4_set(&group[addr & 0xff], 1 << (32 - len), entry);
+   return 0;
+}
+
+void lpm4_free(struct lpm4 *t) {
+   free(t->tbl24);
+   free(t->tbl8);
+   free(t);
+}
+
+struct lpm6 *lpm6_new() {
+   struct lpm6 *t = calloc(1, sizeof(struct lpm6));
+   if (!t)
+      errno=ENOMEM;
+   return t;
+}
+
+int lpm6_add(struct lpm6 *t, const uint8_t *addr, uint8_t len, uint32_t nh) {
+   if (len > 128 || !nh) {
+      errno=EINVAL;
+      return -1;
+   }
+   if (grow((void **)&t->rules, &t->rules_size, t->rules_len,
+            sizeof(struct lpm6_rule)))
+      return -1;
+
+   struct lpm6_rule *r = &t->rules[t->rules_len++];
+   memset(r->addr, 0, 16);
+   memcpy(r->addr, addr, (len + 7) / 8);
+   if (len % 8)
+      r->addr[len / 8] &= 0xff << (8 - len % 8);
+   r->len = len;
+   r->nh  = nh;
+   return 0;
+}
+
+int rule_cmp(const void *a, const void *b) {
+   const struct lpm6_rule *ra = a, *rb = b;
+   int c = memcmp(ra->addr, rb->addr, 16);
+   if (c)
+      return c;
+   return (int)ra->len - (int)rb->len;
+}
+
+int lpm6_build(struct lpm6 *t) {
+   t->nodes_len  = 0;
+   t->leaves_len = 0;
+   qsort(t->rules, t->rules_len, sizeof(struct lpm6_rule), rule_cmp);
+
+   /* rule order is stable from now on, work on a copy */
+   struct lpm6_rule *r = malloc((t->rules_len + 1) * sizeof(struct lpm6_rule));
+   if (!r || grow((void **)&t->nodes, &t->nodes_size, 0, sizeof(struct lpm6_node))) {
+      free(r);
+      errno=ENOMEM;
+      return -1;
+   }
+   memcpy(r, t->rules, t->rules_len * sizeof(struct lpm6_rule));
+   t->nodes_len = 1;
+   int ret = lpm6_node(t, 0, r, t->rules_len, 0, 0);
+   free(r);
+   return ret;
+}
+
+int lpm6_node(struct lpm6 *t, uint32_t node, struct lpm6_rule *r,
+              uint32_t n, int depth, uint32_t def) {
+   uint32_t leaf[256];
+   int bits = 8 * (depth + 1);
+   for (int i=0; i<256; i++)
+      leaf[i] = def;
+
+   /* expand the prefixes ending at this level, shortest first */
+   for (int len=8*depth; len<=bits; len++) {
+      for (uint32_t i=0; i<n; i++) {
+         if (r[i].len != len)
+            continue;
+         int span = 1 << (bits - len), start = r[i].addr[depth] & ~(span - 1);
+         for (int j=start; j<start+span; j++)
+            leaf[j] = r[i].nh;
+      }
+   }
+
+   /* move the longer prefixes (the children) at the end, keeping order */
+   uint32_t n_short = 0;
+   struct lpm6_rule *tmp = malloc((n + 1) * sizeof(struct lpm6_rule));
+   if (!tmp) {
+      errno=ENOMEM;
+      return -1;
+   }
+   uint32_t n_long = 0;
+   for (uint32_t i=0; i<n; i++) {
+      if (r[i].len <= bits)
+         r[n_short++] = r[i];
+      else
+         tmp[n_long++] = r[i];
+   }
+   memcpy(&r[n_short], tmp, n_long * sizeof(struct lpm6_rule));
+   free(tmp);
+   struct lpm6_rule *longs = &r[n_short];
+
+   /* children bitmap */
+   struct lpm6_node nd;
+   memset(&nd, 0, sizeof(nd));
+   uint32_t n_child = 0;
+   for (uint32_t i=0; i<n_long; i++) {
+      int v = longs[i].addr[depth];
+      if (!(nd.vec[v >> 6] & (1ULL << (v & 63)))) {
+         nd.vec[v >> 6] |= 1ULL << (v & 63);
+         n_child++;
+      }
+   }
+
+   /* leaves, run-length compressed */
+   for (int v=0; v<256; v++) {
+      if (v && leaf[v] == leaf[v-1])
+         continue;
+      if (grow((void **)&t->leaves, &t->leaves_size, t->leaves_len, sizeof(uint32_t)))
+         return -1;
+      if (!v)
+         nd.base_leaf = t->leaves_len;
+      nd.leafvec[v >> 6] |= 1ULL << (v & 63);
+      t->leaves[t->leaves_len++] = leaf[v];
+   }
+
+   /* reserve contiguous children */
+   nd.base_child = t->nodes_len;
+   while (t->nodes_size < t->nodes_len + n_child)
+      if (grow((void **)&t->nodes, &t->nodes_size, t->nodes_size,
+               sizeof(struct lpm6_node)))
+         return -1;
+   t->nodes_len += n_child;
+   t->nodes[node] = nd;
+
+   /* build children */
+   uint32_t child = nd.base_child, i = 0;
+   while (i < n_long) {
+      int v = longs[i].addr[depth];
+      uint32_t j = i;
+      while (j < n_long && longs[j].addr[depth] == v)
+         j++;
+      if (lpm6_node(t, child++, &longs[i], j - i, depth + 1, leaf[v]))
+         return -1;
+      i = j;
+   }
+   return 0;
+}
+
+void lpm6_free(struct lpm6 *t) {
+   free(t->rules);
+   free(t->nodes);
+   free(t->leaves);
+   free(t);
+}
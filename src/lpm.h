@@ -0,0 +1,219 @@
+/**
+ * \file lpm.h
+ * \brief Longest-prefix-match routing tables.
+ *
+ *    IPv4 uses DIR-24-8: a 2^24 entries table indexed by the first 24
+ *    bits of the address, extended by 256-entry groups for prefixes
+ *    longer than /24 (one or two memory accesses per lookup). Entries
+ *    keep the length of the prefix that set them, so prefixes can be
+ *    added in any order.
+ *
+ *    IPv6 uses a multibit trie with 8-bit strides compressed as in
+ *    Poptrie: each node holds a 256-bit children bitmap and a 256-bit
+ *    bitmap of leaf changes, children and leaves are found by popcount
+ *    in contiguous arrays. The trie is compiled from the added prefixes
+ *    by lpm6_build().
+ *
+ *    Next hops are stored in the table entries: they are peer ids
+ *    (indexes in the peer store, see recs.h) up to LPM_IDX, 0 if there
+ *    is no route.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_LPM_H
+#define UDPTUN_LPM_H
+
+#include <stdint.h>
+
+/**
+ * \def LPM_EXT
+ * \brief DIR-24-8 entry flag: the index is a tbl8 group.
+ */
+#define LPM_EXT 0x80000000
+
+/**
+ * \def LPM_IDX
+ * \brief DIR-24-8 entry mask of the next hop or group index.
+ */
+#define LPM_IDX 0x00ffffff
+
+/**
+ * \struct lpm4
+ *	\brief An IPv4 DIR-24-8 table.
+ */
+struct lpm4 {
+   uint32_t *tbl24;     /*!< 2^24 entries: ext | depth << 24 | index */
+   uint32_t *tbl8;      /*!< 256-entry groups */
+   uint32_t  tbl8_len;  /*!< Used groups */
+   uint32_t  tbl8_size; /*!< Allocated groups */
+};
+
+/**
+ * \struct lpm6_node
+ *	\brief A compressed IPv6 trie node (8-bit stride).
+ */
+struct lpm6_node {
+   uint64_t vec[4];     /*!< Children bitmap */
+   uint64_t leafvec[4]; /*!< Leaf value changes bitmap */
+   uint32_t base_child; /*!< Index of the first child */
+   uint32_t base_leaf;  /*!< Index of the first leaf */
+};
+
+/**
+ * \struct lpm6_rule
+ *	\brief An IPv6 prefix.
+ */
+struct lpm6_rule {
+   uint8_t  addr[16];   /*!< The masked prefix */
+   uint8_t  len;        /*!< The prefix length */
+   uint32_t nh;         /*!< The next hop */
+};
+
+/**
+ * \struct lpm6
+ *	\brief An IPv6 table.
+ */
+struct lpm6 {
+   struct lpm6_rule *rules;     /*!< The added prefixes */
+   uint32_t          rules_len; /*!< Amount of prefixes */
+   uint32_t          rules_size;/*!< Allocated prefixes */
+
+   struct lpm6_node *nodes;     /*!< The compiled trie, nodes[0] is the root */
+   uint32_t          nodes_len; /*!< Amount of nodes */
+   uint32_t          nodes_size;/*!< Allocated nodes */
+   uint32_t         *leaves;    /*!< Leaf next hops */
+   uint32_t          leaves_len; /*!< Amount of leaves */
+   uint32_t          leaves_size;/*!< Allocated leaves */
+};
+
+/**
+ * \fn int lpm_prefix(char *str, int max_len)
+ * \brief Split an "<addr>[/<len>]" string in place.
+ *
+ * \param str The string, terminated after the address on return
+ * \param max_len The address length (32 or 128), used if len is omitted
+ * \return The prefix length or -1 if invalid
+ */
+int lpm_prefix(char *str, int max_len);
+
+/**
+ * \fn struct lpm4 *lpm4_new()
+ * \brief Allocate an empty IPv4 table. tbl24 is 64MB of virtual
+ *        memory, only the pages of added prefixes are touched.
+ *
+ * \return The table or NULL (errno is filled)
+ */
+struct lpm4 *lpm4_new();
+
+/**
+ * \fn int lpm4_add(struct lpm4 *t, uint32_t addr, uint8_t len, uint32_t nh)
+ * \brief Add a prefix.
+ *
+ * \param t The table
+ * \param addr The prefix in host byte order
+ * \param len The prefix length
+ * \param nh The next hop, 1 to LPM_IDX
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+int lpm4_add(struct lpm4 *t, uint32_t addr, uint8_t len, uint32_t nh);
+
+/**
+ * \fn void lpm4_free(struct lpm4 *t)
+ * \brief Free a table.
+ *
+ * \param t The table
+ */
+void lpm4_free(struct lpm4 *t);
+
+/**
+ * \fn static inline uint32_t lpm4_lookup(struct lpm4 *t, uint32_t addr)
+ * \brief Longest-prefix match.
+ *
+ * \param t The table
+ * \param addr The address in host byte order
+ * \return The next hop or 0
+ */
+static inline uint32_t lpm4_lookup(struct lpm4 *t, uint32_t addr) {
+   uint32_t e = t->tbl24[addr >> 8];
+   if (e & LPM_EXT)
+      e = t->tbl8[((e & LPM_IDX) << 8) | (addr & 0xff)];
+   return e & LPM_IDX;
+}
+
+/**
+ * \fn struct lpm6 *lpm6_new()
+ * \brief Allocate an empty IPv6 table.
+ *
+ * \return The table or NULL (errno is filled)
+ */
+struct lpm6 *lpm6_new();
+
+/**
+ * \fn int lpm6_add(struct lpm6 *t, const uint8_t *addr, uint8_t len, uint32_t nh)
+ * \brief Add a prefix, effective after the next lpm6_build().
+ *
+ * \param t The table
+ * \param addr The prefix (16 bytes, network byte order)
+ * \param len The prefix length
+ * \param nh The next hop, not 0
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+int lpm6_add(struct lpm6 *t, const uint8_t *addr, uint8_t len, uint32_t nh);
+
+/**
+ * \fn int lpm6_build(struct lpm6 *t)
+ * \brief Compile the trie from the added prefixes.
+ *
+ * \param t The table
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+int lpm6_build(struct lpm6 *t);
+
+/**
+ * \fn void lpm6_free(struct lpm6 *t)
+ * \brief Free a table.
+ *
+ * \param t The table
+ */
+void lpm6_free(struct lpm6 *t);
+
+/**
+ * \fn static inline uint32_t lpm_rank(const uint64_t *bm, int v)
+ * \brief The amount of bits set below position v in a 256-bit bitmap.
+ */
+static inline uint32_t lpm_rank(const uint64_t *bm, int v) {
+   uint32_t r = 0;
+   int w = v >> 6;
+   for (int i=0; i<w; i++)
+      r += __builtin_popcountll(bm[i]);
+   if (v & 63)
+      r += __builtin_popcountll(bm[w] & ((1ULL << (v & 63)) - 1));
+   return r;
+}
+
+/**
+ * \fn static inline uint32_t lpm6_lookup(struct lpm6 *t, const uint8_t *addr)
+ * \brief Longest-prefix match.
+ *
+ * \param t The table
+ * \param addr The address (16 bytes, network byte order)
+ * \return The next hop or 0
+ */
+static inline uint32_t lpm6_lookup(struct lpm6 *t, const uint8_t *addr) {
+   if (!t->nodes_len)
+      return 0;
+   struct lpm6_node *n = t->nodes;
+   for (int d=0; d<16; d++) {
+      int v = addr[d];
+      if (n->vec[v >> 6] & (1ULL << (v & 63))) {
+         n = &t->nodes[n->base_child + lpm_rank(n->vec, v)];
+         continue;
+      }
+      return t->leaves[n->base_leaf + lpm_rank(n->leafvec, v+1) - 1];
+   }
+   return 0;
+}
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * \file lpmbench.c
+ * \brief Lookup benchmark of the routing tables (make bench).
+ *
+ *    Fills the IPv4 and IPv6 tables with random prefixes following a
+ *    BGP-like length distribution, checks a sample of lookups against
+ *    a linear scan and reports the lookup cost.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lpm.h"
+#include "bench.h"
+
+/**
+ * \def BENCH_PREFIXES
+ * \brief The default amount of prefixes per table.
+ */
+#define BENCH_PREFIXES 100000
+
+/**
+ * \def BENCH_LOOKUPS
+ * \brief The amount of timed lookups.
+ */
+#define BENCH_LOOKUPS 10000000
+
+/**
+ * \def BENCH_CHECKS
+ * \brief The amount of lookups verified against a linear scan.
+ */
+#define BENCH_CHECKS 1000
+
+/**
+ * \fn static int len4()
+ * \brief A random IPv4 prefix length (mostly /24, /16 to /22).
+ */
+static int len4();
+
+/**
+ * \fn static int len6()
+ * \brief A random IPv6 prefix length (mostly /48, /32 to /44).
+ */
+static int len6();
+
+/**
+ * \fn static int bench4(int n)
+ * \brief Build, verify and time an IPv4 table of n prefixes.
+ *
+ * \return 0 for success, -1 on mismatch
+ */
+static int bench4(int n);
+
+/**
+ * \fn static int bench6(int n)
+ * \brief Build, verify and time an IPv6 table of n prefixes.
+ *
+ * \return 0 for success, -1 on mismatch
+ */
+static int bench6(int n);
+
+int len4() {
+   int r = rnd() % 100;
+   if (r < 55) return 24;
+   if (r < 85) return 16 + rnd() % 8;
+   if (r < 95) return 8 + rnd() % 8;
+   return 25 + rnd() % 8;
+}
+
+int len6() {
+   int r = rnd() % 100;
+   if (r < 45) return 48;
+   if (r < 85) return 32 + rnd() % 16;
+   if (r < 95) return 20 + rnd() % 12;
+   return 49 + rnd() % 80;
+}
+
+int bench4(int n) {
+   uint32_t *addr = malloc(n * sizeof(uint32_t));
+   uint8_t  *len  = malloc(n);
+   struct lpm4 *t = lpm4_new();
+   if (!addr || !len || !t) {
+      perror("lpm4_new");
+      exit(EXIT_FAILURE);
+   }
+
+   double start = now();
+   for (long i=0; i<n; i++) {
+      len[i]  = len4();
+      addr[i] = (uint32_t)rnd() & (~0U << (32 - len[i]));
+      lpm4_add(t, addr[i], len[i], (uint32_t)(i + 1));
+   }
+   double build = now() - start;
+
+   /* lookups hit a random prefix */
+   uint32_t *keys = malloc(BENCH_LOOKUPS * sizeof(uint32_t));
+   for (int i=0; i<BENCH_LOOKUPS; i++) {
+      int p = rnd() % n;
+      keys[i] = addr[p] | ((uint32_t)rnd() & ~(~0U << (32 - len[p])));
+   }
+
+   int ret = 0;
+   for (int i=0; i<BENCH_CHECKS; i++) {
+      long best = -1;
+      for (long j=0; j<n; j++) {
+         uint32_t mask = len[j] ? ~0U << (32 - len[j]) : 0;
+         if ((keys[i] & mask) == addr[j] && (best < 0 || len[j] >= len[best]))
+            best = j;
+      }
+      uint32_t nh = lpm4_lookup(t, keys[i]);
+      if (best < 0 ? nh != 0 : len[nh - 1] != len[best]) {
+         fprintf(stderr, "ipv4 mismatch on %08x\n", keys[i]);
+         ret = -1;
+      }
+   }
+
+   uintptr_t sum = 0;
+   start = now();
+   for (int i=0; i<BENCH_LOOKUPS; i++)
+      sum += lpm4_lookup(t, keys[i]);
+   double elapsed = now() - start;
+
+   printf("ipv4 dir-24-8: %d prefixes, %u tbl8 groups, build %.1f ms, "
+          "%.2f ns/lookup (%lx)\n", n, t->tbl8_len, build / 1e6,
+          elapsed / BENCH_LOOKUPS, (unsigned long)sum);
+
+   lpm4_free(t);
+   free(keys);
+   free(addr);
+   free(len);
+   return ret;
+}
+
+int bench6(int n) {
+   uint8_t (*addr)[16] = malloc(n * 16);
+   uint8_t  *len  = malloc(n);
+   struct lpm6 *t = lpm6_new();
+   if (!addr || !len || !t) {
+      perror("lpm6_new");
+      exit(EXIT_FAILURE);
+   }
+
+   double start = now();
+   for (long i=0; i<n; i++) {
+      len[i] = len6();
+      /* global unicast 2000::/3 */
+      for (int b=0; b<16; b++)
+         addr[i][b] = rnd();
+      addr[i][0] = 0x20 | (addr[i][0] & 0x1f);
+      memset(addr[i] + (len[i] + 7) / 8, 0, 16 - (len[i] + 7) / 8);
+      if (len[i] % 8)
+         addr[i][len[i] / 8] &= 0xff << (8 - len[i] % 8);
+      lpm6_add(t, addr[i], len[i], (uint32_t)(i + 1));
+   }
+   if (lpm6_build(t) < 0) {
+      perror("lpm6_build");
+      exit(EXIT_FAILURE);
+   }
+   double build = now() - start;
+
+   uint8_t (*keys)[16] = malloc((size_t)BENCH_LOOKUPS * 16);
+   for (int i=0; i<BENCH_LOOKUPS; i++) {
+      int p = rnd() % n;
+      for (int b=0; b<16; b++)
+         keys[i][b] = rnd();
+      memcpy(keys[i], addr[p], len[p] / 8);
+      if (len[p] % 8) {
+         uint8_t mask = 0xff << (8 - len[p] % 8);
+         keys[i][len[p] / 8] = addr[p][len[p] / 8] | (keys[i][len[p] / 8] & ~mask);
+      }
+   }
+
+   int ret = 0;
+   for (int i=0; i<BENCH_CHECKS; i++) {
+      long best = -1;
+      for (long j=0; j<n; j++) {
+         int l = len[j], b = l / 8;
+         if (memcmp(keys[i], addr[j], b))
+            continue;
+         if (l % 8 && (keys[i][b] & (0xff << (8 - l % 8))) != addr[j][b])
+            continue;
+         if (best < 0 || l >= len[best])
+            best = j;
+      }
+      uint32_t nh = lpm6_lookup(t, keys[i]);
+      if (best < 0 ? nh != 0 : len[nh - 1] != len[best]) {
+         fprintf(stderr, "ipv6 mismatch on lookup %d\n", i);
+         ret = -1;
+      }
+   }
+
+   uintptr_t sum = 0;
+   start = now();
+   for (int i=0; i<BENCH_LOOKUPS; i++)
+      sum += lpm6_lookup(t, keys[i]);
+   double elapsed = now() - start;
+
+   printf("ipv6 poptrie: %d prefixes, %u nodes, %u leaves, build %.1f ms, "
+          "%.2f ns/lookup (%lx)\n", n, t->nodes_len, t->leaves_len,
+          build / 1e6, elapsed / BENCH_LOOKUPS, (unsigned long)sum);
+
+   lpm6_free(t);
+   free(keys);
+   free(addr);
+   free(len);
+   return ret;
+}
+
+int main(int argc, char *argv[]) {
+   int n = argc > 1 ? atoi(argv[1]) : BENCH_PREFIXES;
+   if (n <= 0) {
+      fprintf(stderr, "usage: %s [prefixes]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+   int ret = bench4(n);
+   ret |= bench6(n);
+   return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
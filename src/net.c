@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -35,6 +36,12 @@
 #include "debug.h"
 #include "cli.h"
 #include "destruct.h"
+#include "flow.h"
+#include "load.h"
+#include "pep.h"
+#include "recs.h"
+#include "series.h"
+#include "startup.h"
 #include "thread.h"
 #include "tunalloc.h"
 #include "udptun.h"
@@ -46,18 +53,42 @@
 struct cli_thread_parallel_args {
    struct tun_state *state;
    struct sockaddr  *sa;
+   sa_family_t sfam;
    char *addr;
    char *filename;
    int port;
    int set_maxseg;
 };
 
+/**
+ * \struct tun_job
+ *	\brief tun_async() arguments.
+ */
+struct tun_job {
+   struct tun_state *state;
+   int *fd_tun;
+};
+
 /**
  * \var char *serv_file
  * \brief The server file location for inter-thread communication.
  */
 static char *serv_file;
 
+/**
+ * \var struct flow_engine *cli_flows
+ * \brief The client flows engine, NULL if flows run in threads.
+ */
+static struct flow_engine *cli_flows;
+
+/**
+ * \fn static void *tun_thread(void *arg)
+ * \brief Run tun() and time it.
+ *
+ * \param arg A struct tun_job, freed on return
+ */
+static void *tun_thread(void *arg);
+
 /**
  * \fn static int tcp_cli4(struct tun_state *st, struct sockaddr *sa, char *filename)
  * \brief Receive an error msg from MSG_ERRQUEUE and print a description 
@@ -123,44 +154,103 @@ static void *serv_thread_public4(void *st);
 static void *serv_thread_public6(void *st);
 
 /**
- * \fn static void cli_thread_parallel4(struct tun_state *state, int index)
+ * \fn static void cli_thread_parallel(struct tun_state *state, int index)
  * \brief Run the TCP file clients in parallel.
  *
  * \param state The node state 
  * \param index The peer index (cli_private & cli_public)
  */
-static void cli_thread_parallel4(struct tun_state *state, int index);
-static void cli_thread_parallel6(struct tun_state *state, int index);
+static void cli_thread_parallel(struct tun_state *state, int index);
 static void cli_thread_parallel46(struct tun_state *state, int index);
 
-/**cli_thread_notun4
- * \fn static void cli_thread_notun4(struct tun_state *state, int index)
+/**
+ * \fn static void cli_thread_notun(struct tun_state *state, int index)
  * \brief Run the TCP file clients sequentially, NOTUN flow first.
  *
  * \param state The node state 
  * \param index The peer index (cli_private & cli_public)
  */
-static void cli_thread_notun4(struct tun_state *state,  int index);
-static void cli_thread_notun6(struct tun_state *state,  int index);
+static void cli_thread_notun(struct tun_state *state,  int index);
 
 /**
- * \fn static void cli_thread_tun4(struct tun_state *state, int index)
+ * \fn static void cli_thread_tun(struct tun_state *state, int index)
  * \brief Run the TCP file clients sequentially, TUN flow first.
  *
  * \param state The node state 
  * \param index The peer index (cli_private & cli_public)
  */
-static void cli_thread_tun4(struct tun_state *state, int index);
-static void cli_thread_tun6(struct tun_state *state, int index);
+static void cli_thread_tun(struct tun_state *state, int index);
 
 /**
- * \fn  void *forked_cli4(void *arg)
+ * \fn static void cli_thread_pep(struct tun_state *state, int index)
+ * \brief Run the TCP file client through the split-TCP proxy, i.e. to
+ *        the peer explicit listener on the loopback.
+ *
+ * \param state The node state 
+ * \param index The peer index (cli_private & cli_public)
+ */
+static void cli_thread_pep(struct tun_state *state, int index);
+
+/**
+ * \fn static void cli_args(struct tun_state *state, int index, int v6, int tun, struct cli_thread_parallel_args *args)
+ * \brief Fill the tcp_cli arguments of a flow to a peer.
+ *
+ * \param state The node state 
+ * \param index The peer index (cli_private & cli_public)
+ * \param v6 IPv6 flow
+ * \param tun Tunneled flow
+ * \param args Modified on return
+ */
+static void cli_args(struct tun_state *state, int index, int v6, int tun,
+                     struct cli_thread_parallel_args *args);
+
+/**
+ * \fn  void *forked_cli(void *arg)
  * \brief Stub for tcp_cli fork, used in parallel scheduling mode
  *
  * \aram arg A struct cli_thread_parallel_args specified tcp_cli's args.
  */
-static void *forked_cli4(void *arg);
-static void *forked_cli6(void *arg);
+static void *forked_cli(void *arg);
+
+/**
+ * \fn static void cli_thread_flows(struct tun_state *state, int index)
+ * \brief Run measure-flows TUN and NOTUN flows per address family
+ *        concurrently in the client flows engine, scheduled by cli_mode.
+ *
+ * \param state The node state 
+ * \param index The peer index (cli_private & cli_public)
+ */
+static void cli_thread_flows(struct tun_state *state, int index);
+
+/**
+ * \fn static void cli_flows_add(struct tun_state *state, int index, int tun)
+ * \brief Start measure-flows flows to a peer per address family, or
+ *        short-flows short connections, measure-flows at a time.
+ *
+ * \param state The node state 
+ * \param index The peer index (cli_private & cli_public)
+ * \param tun Tunneled flows
+ */
+static void cli_flows_add(struct tun_state *state, int index, int tun);
+
+/**
+ * \fn static void *serv_thread_flows(void *st)
+ * \brief Run all TCP file servers in the server flows engine.
+ *
+ * \param st The node state (struct tun_state *)
+ */
+static void *serv_thread_flows(void *st);
+
+/**
+ * \fn static char *flows_file(struct tun_state *state, const char *role)
+ * \brief The per-flow records location, 
+ *        <output-dir>flows.<role>[.<run-id>].csv
+ *
+ * \param state The node state 
+ * \param role cli or serv
+ * \return The location (malloc)
+ */
+static char *flows_file(struct tun_state *state, const char *role);
 
 void tun(struct tun_state *state, int *fd_tun) {
    struct arguments *args = state->args;
@@ -187,69 +277,64 @@ void tun(struct tun_state *state, int *fd_tun) {
          free(state->tun_if);
       state->tun_if = new_if;
    }
-   if (*fd_tun) set_fd(*fd_tun);
+   if (*fd_tun) {
+      set_fd(*fd_tun);
+      set_nonblock(*fd_tun);
+   }
 }
 
-void *forked_cli4(void *arg) {
-   struct cli_thread_parallel_args *args = (struct cli_thread_parallel_args*) arg;
-   tcp_cli(args->state, args->sa, 
-           args->addr, args->port,
-           args->set_maxseg, args->filename, AF_INET);
+void *tun_thread(void *arg) {
+   struct tun_job *job = arg;
+   int64_t t = startup_now();
+   tun(job->state, job->fd_tun);
+   startup_phase("tun", t);
+   free(job);
    return 0;
 }
 
-void *forked_cli6(void *arg) {
+pthread_t tun_async(struct tun_state *state, int *fd_tun) {
+   struct tun_job *job = xmalloc(sizeof(struct tun_job));
+   job->state  = state;
+   job->fd_tun = fd_tun;
+   return xthread_create(tun_thread, (void *)job, 0);
+}
+
+void cli_args(struct tun_state *state, int index, int v6, int tun,
+              struct cli_thread_parallel_args *args) {
+   struct tun_rec *rec = rec_get(state, tun ? state->cli_private[index] 
+                                            : state->cli_public[index]);
+   args->state      = state;
+   args->sa         = v6 ? (struct sockaddr *)&rec->sa6 
+                         : (struct sockaddr *)&rec->sa4;
+   args->sfam       = v6 ? AF_INET6 : AF_INET;
+   args->port       = state->port;
+   args->set_maxseg = tun ? state->max_segment_size : 0;
+   if (v6) {
+      args->addr     = tun ? state->private_addr6 : state->public_addr6;
+      args->filename = tun ? state->cli_file_tun6 : state->cli_file_notun6;
+   } else {
+      args->addr     = tun ? state->private_addr4 : state->public_addr4;
+      args->filename = tun ? state->cli_file_tun4 : state->cli_file_notun4;
+   }
+}
+
+void *forked_cli(void *arg) {
    struct cli_thread_parallel_args *args = (struct cli_thread_parallel_args*) arg;
    tcp_cli(args->state, args->sa, 
            args->addr, args->port,
-           args->set_maxseg, args->filename, AF_INET6);
+           args->set_maxseg, args->filename, args->sfam);
    return 0;
 }
 
-void cli_thread_parallel4(struct tun_state *state, int index) {
-   /* set thread arguments */
-
-   struct cli_thread_parallel_args args_tun = {state, 
-                         state->cli_private[index]->sa4, 
-                         state->private_addr4, 
-                         state->cli_file_tun4,
-                         state->port, state->max_segment_size
-                      };
-   struct cli_thread_parallel_args args_notun = {state, 
-                         state->cli_public[index]->sa4, 
-                         state->public_addr4, 
-                         state->cli_file_notun4,
-                         state->port, 0
-                      };
-
-   /* launch threads */
-   pthread_t tid_tun   = xthread_create(forked_cli4, (void*)&args_tun, 0);
-   pthread_t tid_notun = xthread_create(forked_cli4, (void*)&args_notun, 0);
-   
-   /* join threads */
-   pthread_join(tid_tun, NULL);
-   pthread_join(tid_notun, NULL);
-}
-
-void cli_thread_parallel6(struct tun_state *state, int index) {
+void cli_thread_parallel(struct tun_state *state, int index) {
    /* set thread arguments */
-
-   struct cli_thread_parallel_args args_tun = {state, 
-                         state->cli_private[index]->sa6, 
-                         state->private_addr6, 
-                         state->cli_file_tun6,
-                         state->port, state->max_segment_size
-                      };
-   struct cli_thread_parallel_args args_notun = {state, 
-                         state->cli_public[index]->sa6, 
-                         state->public_addr6, 
-                         state->cli_file_notun6,
-                         state->port, 0
-                      };
+   struct cli_thread_parallel_args args_tun, args_notun;
+   cli_args(state, index, state->ipv6, 1, &args_tun);
+   cli_args(state, index, state->ipv6, 0, &args_notun);
 
    /* launch threads */
-   pthread_t tid_tun   = xthread_create(forked_cli6, (void*)&args_tun, 0);
-   pthread_t tid_notun = xthread_create(forked_cli6, (void*)&args_notun, 0);
+   pthread_t tid_tun   = xthread_create(forked_cli, (void*)&args_tun, 0);
+   pthread_t tid_notun = xthread_create(forked_cli, (void*)&args_notun, 0);
    
    /* join threads */
    pthread_join(tid_tun, NULL);
@@ -257,118 +342,115 @@ void cli_thread_parallel6(struct tun_state *state, int index) {
 }
 
 void cli_thread_parallel46(struct tun_state *state, int index) {
-   struct cli_thread_parallel_args args_tun4 = {state, 
-                         state->cli_private[index]->sa4, 
-                         state->private_addr4, 
-                         state->cli_file_tun4,
-                         state->port, state->max_segment_size,
-                      };
-   struct cli_thread_parallel_args args_notun4 = {state, 
-                         state->cli_public[index]->sa4, 
-                         state->public_addr4, 
-                         state->cli_file_notun4,
-                         state->port, 0
-                      };
-   struct cli_thread_parallel_args args_tun6 = {state, 
-                         state->cli_private[index]->sa6, 
-                         state->private_addr6, 
-                         state->cli_file_tun6,
-                         state->port, state->max_segment_size
-                      };
-   struct cli_thread_parallel_args args_notun6 = {state, 
-                         state->cli_public[index]->sa6, 
-                         state->public_addr6, 
-                         state->cli_file_notun6,
-                         state->port, 0
-                      };
-
-   /* launch IPv4 cli */
-   pthread_t tid4 = xthread_create(forked_cli4, (void*)&args_notun4, 0);
-   pthread_t tid6 = xthread_create(forked_cli6, (void*)&args_notun6, 0);
+   struct cli_thread_parallel_args args4, args6;
+
+   /* launch NOTUN cli */
+   cli_args(state, index, 0, 0, &args4);
+   cli_args(state, index, 1, 0, &args6);
+   pthread_t tid4 = xthread_create(forked_cli, (void*)&args4, 0);
+   pthread_t tid6 = xthread_create(forked_cli, (void*)&args6, 0);
    
    /* join threads */
    pthread_join(tid4, NULL);
    pthread_join(tid6, NULL);
 
-   /* launch IPv6 cli */
-   tid4 = xthread_create(forked_cli4, (void*)&args_tun4, 0);
-   tid6 = xthread_create(forked_cli6, (void*)&args_tun6, 0);
+   /* launch TUN cli */
+   cli_args(state, index, 0, 1, &args4);
+   cli_args(state, index, 1, 1, &args6);
+   tid4 = xthread_create(forked_cli, (void*)&args4, 0);
+   tid6 = xthread_create(forked_cli, (void*)&args6, 0);
    
    /* join threads */
    pthread_join(tid4, NULL);
    pthread_join(tid6, NULL);
 }
 
-void cli_thread_tun4(struct tun_state *state, int index) {
-   /* run tunneled flow */
-   tcp_cli(state, state->cli_private[index]->sa4,
-           state->private_addr4, state->port, state->max_segment_size, 
-            state->cli_file_tun4, AF_INET);
-   /* run notun flow */
-   tcp_cli(state, state->cli_public[index]->sa4, 
-           NULL, state->port, 0, state->cli_file_notun4, AF_INET);
-}
-
-void cli_thread_tun6(struct tun_state *state, int index) {
+void cli_thread_tun(struct tun_state *state, int index) {
+   struct cli_thread_parallel_args args;
    /* run tunneled flow */
-   tcp_cli(state, state->cli_private[index]->sa6,
-           state->private_addr6, state->port, state->max_segment_size, 
-           state->cli_file_tun6, AF_INET6);
+   cli_args(state, index, state->ipv6, 1, &args);
+   forked_cli(&args);
    /* run notun flow */
-   tcp_cli(state, state->cli_public[index]->sa6, 
-           NULL, state->port, 0, state->cli_file_notun6, AF_INET6);
+   cli_args(state, index, state->ipv6, 0, &args);
+   args.addr = NULL;
+   forked_cli(&args);
 }
 
-void cli_thread_notun4(struct tun_state *state, int index) {
+void cli_thread_notun(struct tun_state *state, int index) {
+   struct cli_thread_parallel_args args;
    /* run notun flow */
-   tcp_cli(state, state->cli_public[index]->sa4, 
-           NULL, state->port, 0, state->cli_file_notun4, AF_INET);
+   cli_args(state, index, state->ipv6, 0, &args);
+   args.addr = NULL;
+   forked_cli(&args);
    /* run tunneled flow */
-   tcp_cli(state, state->cli_private[index]->sa4, 
-           state->private_addr4, state->port, state->max_segment_size, 
-           state->cli_file_tun4, AF_INET);
+   cli_args(state, index, state->ipv6, 1, &args);
+   forked_cli(&args);
 }
 
-void cli_thread_notun6(struct tun_state *state, int index) {
-   /* run notun flow */
-   tcp_cli(state, state->cli_public[index]->sa6, 
-           NULL, state->port, 0, state->cli_file_notun6, AF_INET6);
-   /* run tunneled flow */
-   tcp_cli(state, state->cli_private[index]->sa6, 
-           state->private_addr6, state->port, state->max_segment_size, 
-           state->cli_file_tun6, AF_INET6);
+void cli_thread_pep(struct tun_state *state, int index) {
+   struct cli_thread_parallel_args args;
+   struct sockaddr_storage sa;
+   cli_args(state, index, state->ipv6, 0, &args);
+   args.sa         = (struct sockaddr *)&sa;
+   args.addr       = state->ipv6 ? "::1" : "127.0.0.1";
+   args.filename   = state->cli_file_pep;
+   if (state->ipv6) {
+      struct sockaddr_in6 *sa6 = get_addr6(args.addr, pep_local_port(state, index));
+      memcpy(&sa, sa6, sizeof(struct sockaddr_in6));
+      free(sa6);
+   } else {
+      struct sockaddr_in *sa4 = get_addr4(args.addr, pep_local_port(state, index));
+      memcpy(&sa, sa4, sizeof(struct sockaddr_in));
+      free(sa4);
+   }
+   forked_cli(&args);
 }
 
 void *cli_thread(void *st) {
    struct tun_state *state = st;
    struct arguments *args = state->args;
+   init_pep(state);
+
+   /* synthetic load instead of TCP flows */
+   if (state->load_pps) {
+      int64_t t = startup_now();
+      sleep(state->initial_sleep);
+      startup_phase("initial-sleep", t);
+      load_gen_thread(st);
+      if (args->mode == CLI_MODE)
+         cli_shutdown(0);
+      return 0;
+   }
 
    /* pick functions */
    void (*cli_thread)(struct tun_state*, int);
-   switch (args->cli_mode) {
+   if (state->measure_flows || state->short_flows) {
+      char *csv  = flows_file(state, "cli");
+      cli_flows  = flow_engine_init("flows.cli", csv, state->measure_sample,
+                                    state->tcp_snd_timeout, 
+                                    state->tcp_rcv_timeout);
+      if (state->short_flows)
+         flow_short(cli_flows, state->short_size, state->short_requests);
+      cli_thread = &cli_thread_flows;
+      free(csv);
+   } else switch (args->cli_mode) {
       case PARALLEL_MODE:
          if (state->dual_stack)
             cli_thread = &cli_thread_parallel46;
-         else if (state->ipv6)
-            cli_thread = &cli_thread_parallel6;
          else
-            cli_thread = &cli_thread_parallel4;
+            cli_thread = &cli_thread_parallel;
          break;
       case TUN_FIRST_MODE:
          if (state->dual_stack)
             cli_thread = &cli_thread_parallel46;
-         else if (state->ipv6)
-            cli_thread = &cli_thread_tun6;
          else
-            cli_thread = &cli_thread_tun4;
+            cli_thread = &cli_thread_tun;
          break;
       case NOTUN_FIRST_MODE:
          if (state->dual_stack)
             cli_thread = &cli_thread_parallel46;
-         else if (state->ipv6)
-            cli_thread =  &cli_thread_notun6;
          else
-            cli_thread =  &cli_thread_notun4;
+            cli_thread =  &cli_thread_notun;
          break;
       default:
          errno=EINVAL;
@@ -377,11 +459,18 @@ void *cli_thread(void *st) {
       
 
    /* initial sleep */
+   int64_t t = startup_now();
    sleep(state->initial_sleep);
+   startup_phase("initial-sleep", t);
 
    /* Client loop */
-   for (int i=0; i<state->sa_len; i++) 
+   for (int i=0; i<state->sa_len; i++) {
       (*cli_thread)(state, i);
+      if (state->pep_port && !state->measure_flows && !state->short_flows)
+         cli_thread_pep(state, i);
+   }
+   if (cli_flows)
+      flow_engine_free(cli_flows);
 
    /* Shutdown client, not peer */
    if (args->mode == CLI_MODE)
@@ -393,9 +482,16 @@ void *cli_thread(void *st) {
 void *serv_thread(void *st) {
    struct tun_state *state = st;
    serv_file = state->serv_file;
+   init_pep(state);
+
+   /* count synthetic load */
+   if (state->load_port)
+      xthread_create(load_sink_thread, st, 1);
 
    /* fork servers */
-   if (state->dual_stack) {
+   if (state->measure_flows || state->short_flows) 
+      xthread_create(serv_thread_flows, st, 1);
+   else if (state->dual_stack) {
       xthread_create(serv_thread_private4, st, 1);
       xthread_create(serv_thread_public4,  st, 1);
       xthread_create(serv_thread_private6, st, 1);
@@ -411,6 +507,97 @@ void *serv_thread(void *st) {
    return 0;
 }
 
+void cli_flows_add(struct tun_state *state, int index, int tun) {
+   struct tun_rec *rec = rec_get(state, tun ? state->cli_private[index] : 
+                                              state->cli_public[index]);
+   int mss = state->max_segment_size;
+   if (state->short_flows) {
+      uint32_t concurrent = state->measure_flows ? state->measure_flows : 1;
+      if (!state->ipv6 || state->dual_stack)
+         flow_start(cli_flows, (struct sockaddr *)&rec->sa4, 
+                    tun ? state->private_addr4 : state->public_addr4, 
+                    tun, mss, index, state->short_flows, concurrent);
+      if (state->ipv6 || state->dual_stack)
+         flow_start(cli_flows, (struct sockaddr *)&rec->sa6, 
+                    tun ? state->private_addr6 : state->public_addr6, 
+                    tun, mss, index, state->short_flows, concurrent);
+      return;
+   }
+   for (uint32_t i=0; i<state->measure_flows; i++) {
+      if (!state->ipv6 || state->dual_stack)
+         flow_connect(cli_flows, (struct sockaddr *)&rec->sa4, 
+                      tun ? state->private_addr4 : state->public_addr4, 
+                      tun, mss, index);
+      if (state->ipv6 || state->dual_stack)
+         flow_connect(cli_flows, (struct sockaddr *)&rec->sa6, 
+                      tun ? state->private_addr6 : state->public_addr6, 
+                      tun, mss, index);
+   }
+}
+
+void cli_thread_flows(struct tun_state *state, int index) {
+   switch (state->args->cli_mode) {
+      case TUN_FIRST_MODE:
+         cli_flows_add(state, index, 1);
+         flow_run(cli_flows);
+         cli_flows_add(state, index, 0);
+         flow_run(cli_flows);
+         break;
+      case NOTUN_FIRST_MODE:
+         cli_flows_add(state, index, 0);
+         flow_run(cli_flows);
+         cli_flows_add(state, index, 1);
+         flow_run(cli_flows);
+         break;
+      default:
+         cli_flows_add(state, index, 1);
+         cli_flows_add(state, index, 0);
+         flow_run(cli_flows);
+   }
+}
+
+void *serv_thread_flows(void *st) {
+   struct tun_state *state = st;
+   char *csv = flows_file(state, "serv");
+   struct flow_engine *e = flow_engine_init("flows.serv", csv, 
+                                            state->measure_sample, 0, 
+                                            state->tcp_snd_timeout);
+   free(csv);
+   if (state->short_flows)
+      flow_answer(e);
+   else
+      flow_serve(e, serv_file);
+
+   int mss = state->max_segment_size;
+   if (!state->ipv6 || state->dual_stack) {
+      flow_listen(e, state->private_addr4, state->private_port, mss != 0,
+                  mss, AF_INET, state->backlog_size);
+      flow_listen(e, state->public_addr4, state->public_port, 0,
+                  0, AF_INET, state->backlog_size);
+   }
+   if (state->ipv6 || state->dual_stack) {
+      flow_listen(e, state->private_addr6, state->private_port, mss != 0,
+                  mss, AF_INET6, state->backlog_size);
+      flow_listen(e, state->public_addr6, state->public_port, 0,
+                  0, AF_INET6, state->backlog_size);
+   }
+
+   /* serve until canceled */
+   flow_run(e);
+   return 0;
+}
+
+char *flows_file(struct tun_state *state, const char *role) {
+   char *file_loc = xmalloc(STR_SIZE);
+   memset(file_loc, 0, STR_SIZE);
+   if (state->out_dir)
+      strncpy(file_loc, state->out_dir, STR_SIZE-1);
+   snprintf(file_loc + strlen(file_loc), STR_SIZE - strlen(file_loc), 
+            "flows.%s%s%s.csv", role, state->args->run_id ? "." : "", 
+            state->args->run_id ? state->args->run_id : "");
+   return file_loc;
+}
+
 void *serv_thread_private4(void *st) {
    struct tun_state *state = st;
    tcp_serv(state->private_addr4, state->private_port, state, 
@@ -499,10 +686,11 @@ int tcp_serv(char *addr, int port, struct tun_state *state,
 
 
       /* Fork worker thread */
-      xthread_create(serv_worker_thread, (void*) &ws, 1);
+      set_fd(ws);
+      xthread_create(serv_worker_thread, (void*)(intptr_t)ws, 1);
    }
 
-   close(s);
+   close_fd(s);
    free(sout);free(sin);
    return 0;
 }
@@ -512,7 +700,7 @@ void *serv_worker_thread(void *socket_desc) {
    if(fp == NULL) 
       die("file note found");
 
-   int s = *(int*)socket_desc, err;
+   int s = (int)(intptr_t)socket_desc, err;
    int bsize = 0, wsize = 0;
    char buf[BUFF_SIZE];
    memset(buf, 0, BUFF_SIZE);
@@ -535,12 +723,14 @@ void *serv_worker_thread(void *socket_desc) {
       goto err;
    }
 
-   fclose(fp);close(s);
+   fclose(fp);close_fd(s);
    debug_print("socket %d successfuly closed.\n", s);
+   xthread_detach();
    return 0;
 err:
-   fclose(fp);close(s);
+   fclose(fp);close_fd(s);
    debug_print("socket %d closed on error: %s\n", s, strerror(err));
+   xthread_detach();
    return 0;
 }
 
@@ -549,6 +739,7 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
    struct tun_state *state = st;
    int s, err = 0; 
    FILE *fp = NULL;
+   struct series *ts = NULL;
    /* TCP socket */
    if ((s=socket(sfam, SOCK_STREAM, IPPROTO_TCP)) == -1) 
       die("socket");
@@ -590,6 +781,10 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
       die("bind tcp cli");
    debug_print("TCP cli bound to %s:%d\n", addr, port);
 
+   /* received bytes time series */
+   if (state->series_bin)
+      ts = series_new(state->series_bin, state->series_max);
+
    /* connect peer */
    debug_print("connecting socket %d\n", s);
    if (connect(s, sa, salen) < 0) {     
@@ -603,10 +798,23 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
    char buf[BUFF_SIZE];
    memset(buf, 0, BUFF_SIZE);
    int bsize = 0;
+   if (ts)
+      series_start(ts);
    while((bsize = xrecv(s, buf, BUFF_SIZE)) > 0) {
+       if (ts)
+          series_add(ts, bsize);
        xfwrite(fp, buf, sizeof(char), bsize);
        memset(buf, 0, BUFF_SIZE);
    } 
+   if (ts) {
+      char tsfile[STR_SIZE];
+      snprintf(tsfile, STR_SIZE, "%s%s", filename, SERIES_SUFFIX);
+      if (series_write(ts, tsfile) < 0) {
+         debug_print("series_write %s failed\n", tsfile);
+      }
+      series_free(ts);
+      ts = NULL;
+   }
 
    /* shutdown connection */
    if (shutdown(s, SHUT_RDWR) < 0) {
@@ -620,7 +828,7 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
    }
 
    /* close & set file permission */
-   fclose(fp);close(s);free(sout);
+   fclose(fp);close_fd(s);free(sout);
    mode_t m = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
    if (chmod(filename, m) < 0)
       die("chmod");
@@ -629,7 +837,8 @@ int tcp_cli(struct tun_state *st, struct sockaddr *sa,
    return 0;
 err:
    if (fp) fclose(fp); 
-   close(s);free(sout);
+   if (ts) series_free(ts);
+   close_fd(s);free(sout);
    debug_print("socket %d closed on error: %s\n", s, strerror(err));
    return -1;
 }
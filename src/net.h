@@ -11,6 +11,7 @@
 #define UDPTUN_NET_H
 
 #include <netinet/in.h>
+#include <pthread.h>
 
 #include "state.h"
 
@@ -24,6 +25,19 @@
  */ 
 void tun(struct tun_state *state, int *fd_tun);
 
+/**
+ * \fn pthread_t tun_async(struct tun_state *state, int *fd_tun)
+ * \brief Run tun() in a thread, so that the interface is configured
+ *        while the sockets are created. Join the thread before using
+ *        fd_tun or state->tun_if.
+ *
+ * \param state udptun state
+ * \param fd_tun a pointer to the memory where the tun fd will
+ *               be written
+ * \return The thread to join
+ */
+pthread_t tun_async(struct tun_state *state, int *fd_tun);
+
 /**
  * \fn void *cli_thread(void *st);
  * \brief the TCP cli thread
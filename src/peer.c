@@ -23,6 +23,16 @@
 #include "sock.h"
 #include "net.h"
 #include "xpcap.h"
+#include "queue.h"
+#include "impair.h"
+#include "startup.h"
+#include "batch.h"
+#include "lpm.h"
+#include "ecn.h"
+#include "shm.h"
+#include "hh.h"
+#include "acct.h"
+#include "family.h"
 
 /**
  * \var static volatile int loop
@@ -39,51 +49,63 @@ static volatile int loop;
 static void peer_shutdown(int sig);
 
 /**
- * \fn static void tun_serv_in4(int fd_udp, int fd_tun, struct tun_state *state, char *buf)
- * \brief Forward a packet in the tunnel.
+ * \fn static int tun_peer_in(int fd_tun, int fd_cli4, int fd_serv4, int fd_cli6, int fd_serv6, struct tun_state *state, char *buf)
+ * \brief Read a packet from tun and forward it in the tunnel.
  *
- * \param fd_udp The udp socket fd.
  * \param fd_tun The tun interface fd.
- * \param state The state of the server.
+ * \param fd_cli4 The v4 client udp socket fd or -1.
+ * \param fd_serv4 The v4 server udp socket fd or -1.
+ * \param fd_cli6 The v6 client udp socket fd or -1.
+ * \param fd_serv6 The v6 server udp socket fd or -1.
+ * \param state The state of the peer.
  * \param buf The buffer.
+ * \return 1 if a packet was read, 0 otherwise
  */ 
-static void tun_peer_in4(int fd_tun, int fd_cli, int fd_serv, 
-                         struct tun_state *state, char *buf);
-static void tun_peer_in6(int fd_tun, int fd_cli, int fd_serv, 
-                         struct tun_state *state, char *buf);
-static void tun_peer_in4_aux(int fd_cli, int fd_serv, 
-                             struct tun_state *state, char *buf, int recvd);
-static void tun_peer_in6_aux(int fd_cli, int fd_serv, 
-                             struct tun_state *state, char *buf, int recvd);
-static void tun_peer_in(int fd_tun, int fd_cli4, int fd_serv4, 
+static int tun_peer_in(int fd_tun, int fd_cli4, int fd_serv4, 
                  int fd_cli6, int fd_serv6, 
                  struct tun_state *state, char *buf);
 
 /**
- * \fn static void tun_peer_out_cli4(int fd_udp, int fd_tun, struct tun_state *state, char *buf)
- * \brief Forward a packet out of the tunnel.
+ * \fn static void tun_peer_in_aux(int fd_cli, int fd_serv, struct tun_state *state, const struct ip_family *f, char *buf, int recvd)
+ * \brief Forward a packet in the tunnel, to a server or a client.
+ *
+ * \param fd_cli The client udp socket fd of the packet family.
+ * \param fd_serv The server udp socket fd of the packet family.
+ * \param state The state of the peer.
+ * \param f The packet family.
+ * \param buf The packet.
+ * \param recvd The packet length.
+ */ 
+static void tun_peer_in_aux(int fd_cli, int fd_serv, struct tun_state *state, 
+                            const struct ip_family *f, char *buf, int recvd);
+
+/**
+ * \fn static int tun_peer_out_cli(int fd_udp, int fd_tun, struct tun_state *state, const struct ip_family *f, char *buf)
+ * \brief Forward a packet from a server out of the tunnel.
  *
  * \param fd_udp The udp socket fd.
  * \param fd_tun The tun interface fd.
- * \param state The state of the server.
+ * \param state The state of the peer.
+ * \param f The socket family.
  * \param buf The buffer.
+ * \return 1 if a datagram was read, 0 otherwise
  */ 
-static void tun_peer_out_cli4(int fd_udp, int fd_tun, struct tun_state *state, char *buf);
-static void tun_peer_out_cli6(int fd_udp, int fd_tun, struct tun_state *state, char *buf);
+static int tun_peer_out_cli(int fd_udp, int fd_tun, struct tun_state *state, 
+                            const struct ip_family *f, char *buf);
 
 /**
- * \fn static void tun_serv_out4(int fd_udp, int fd_tun, struct tun_state *state, char *buf)
- * \brief Forward a packet out of the tunnel.
+ * \fn static int tun_peer_out_serv(int fd_udp, int fd_tun, struct tun_state *state, const struct ip_family *f, char *buf)
+ * \brief Forward a packet from a client out of the tunnel.
  *
  * \param fd_udp The udp socket fd.
  * \param fd_tun The tun interface fd.
- * \param state The state of the server.
+ * \param state The state of the peer.
+ * \param f The socket family.
  * \param buf The buffer.
+ * \return 1 if a datagram was read, 0 otherwise
  */ 
-static void tun_peer_out_serv4(int fd_udp, int fd_tun, 
-                               struct tun_state *state, char *buf);
-static void tun_peer_out_serv6(int fd_udp, int fd_tun, 
-                               struct tun_state *state, char *buf);
+static int tun_peer_out_serv(int fd_udp, int fd_tun, struct tun_state *state, 
+                             const struct ip_family *f, char *buf);
 
 static void tun_peer_single(struct arguments *args);
 static void tun_peer_dual(struct arguments *args);
@@ -103,41 +125,27 @@ void tun_peer(struct arguments *args) {
       tun_peer_single(args);
 }
 
-void tun_peer_in(int fd_tun, int fd_cli4, int fd_serv4, 
-                 int fd_cli6, int fd_serv6, 
-                 struct tun_state *state, char *buf) {
+int tun_peer_in(int fd_tun, int fd_cli4, int fd_serv4, 
+                int fd_cli6, int fd_serv6, 
+                struct tun_state *state, char *buf) {
    int recvd=xread(fd_tun, buf, BUFF_SIZE);
    debug_print("recvd %db from tun\n", recvd);
-
-   switch (buf[0] & 0xf0) {
-      case 0x40:
-         tun_peer_in4_aux(fd_cli4, fd_serv4, state, buf, recvd);
-         break;
-      case 0x60:
-         tun_peer_in6_aux(fd_cli6, fd_serv6, state, buf, recvd);
-         break;
-      default:
-         debug_print("non-ip proto:%d\n", buf[0]);
-         break;
+   if (recvd <= 0)
+      return 0;
+
+   const struct ip_family *f = ip_family_of(state, buf);
+   int fd_cli = !f ? -1 : f->v6 ? fd_cli6 : fd_cli4;
+   if (fd_cli >= 0) {
+      tun_peer_in_aux(fd_cli, f->v6 ? fd_serv6 : fd_serv4, state, f, 
+                      buf, recvd);
+   } else {
+      debug_print("non-ip proto:%d\n", buf[0]);
    }
+   return 1;
 }
 
-void tun_peer_in6(int fd_tun, int fd_cli, int fd_serv, 
-                 struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
-   debug_print("recvd %db from tun\n", recvd);
-   tun_peer_in6_aux(fd_cli, fd_serv, state, buf, recvd);
-}
-
-void tun_peer_in4(int fd_tun, int fd_cli, int fd_serv, 
-                 struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
-   debug_print("recvd %db from tun\n", recvd);
-   tun_peer_in4_aux(fd_cli, fd_serv, state, buf, recvd);
-}
-
-void tun_peer_in4_aux(int fd_cli, int fd_serv, 
-                 struct tun_state *state, char *buf, int recvd) {
+void tun_peer_in_aux(int fd_cli, int fd_serv, struct tun_state *state, 
+                     const struct ip_family *f, char *buf, int recvd) {
    if (recvd > MIN_PKT_SIZE) {
 
       /* Remove PlanetLab TUN PPI header */
@@ -145,147 +153,54 @@ void tun_peer_in4_aux(int fd_cli, int fd_serv,
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      int tos = ecn_encap(state, buf);
 
       struct tun_rec *rec = NULL; 
+      int fd_net = fd_serv;
       /* read sport for clients mapping */
-      int dport = (int)ntohs( *((uint16_t *)(buf+22)) );
+      int dport = ip_port(f, buf, 1);
 
       /* cli */
       if (dport == state->private_port) {
-
-         /* lookup initial server database from file */
-         in_addr_t priv_addr = (int)*((uint32_t *)(buf+16));
-         debug_print("%s\n", inet_ntoa((struct in_addr){priv_addr}));
-
-         /* lookup private addr */
-         if ( (rec = g_hash_table_lookup(state->cli4, &priv_addr)) ) {
-            debug_print("priv addr lookup: OK\n");
-
-            /* Add layer 4.5 header */
-            if (state->raw_header) {
-               buf -= state->raw_header_size;
-               recvd += state->raw_header_size;
-            }
-
-            int sent = xsendto4(fd_cli, rec->sa4, buf, recvd);
-            debug_print("wrote %db to internet\n",sent);
-
-         } else {
+         /* lookup private prefix */
+         if (!(rec = cli_lookup(state, f, buf))) {
             errno=EFAULT;
             die("cli lookup");
          }
+         debug_print("priv addr lookup: OK\n");
+         fd_net = fd_cli;
 
       /* serv */
-      } else if ((rec = g_hash_table_lookup(state->serv, &dport))) {   
-
-         /* Add layer 4.5 header */
-         if (state->raw_header) {
-            buf -= state->raw_header_size;
-            recvd += state->raw_header_size;
-         }
-
-         int sent = xsendto4(fd_serv, rec->sa4, buf, recvd);
-         debug_print("wrote %db to internet\n",sent);
-      } else {
+      } else if (!(rec = serv_lookup(state, dport))) {
          debug_print("serv lookup failed proto:%d sport:%d dport:%d\n", 
-                      (int) *((uint8_t *)(buf+9)), 
-                      (int) ntohs( *((uint16_t *)(buf+20)) ), 
-                      dport);
+                      (int) *((uint8_t *)(buf+f->proto)), 
+                      ip_port(f, buf, 0), dport);
+         return;
       }
-   } 
-}
 
-void tun_peer_in6_aux(int fd_cli, int fd_serv, 
-                      struct tun_state *state, char *buf, int recvd) {
-   if (recvd > MIN_PKT_SIZE) {
+      HH_UPDATE(buf, recvd, rec->sport, HH_TX);
+      ACCT_UPDATE(state, buf, recvd, rec->sport, ACCT_TX);
+      /* Co-located peer */
+      if (!shm_send(rec->sport, buf, recvd))
+         return;
 
-      /* Remove PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         recvd-=4;
-         memmove(buf, buf+4, recvd);
-      }
-
-      struct tun_rec *rec = NULL; 
-      /* read sport for clients mapping */
-      int dport = (int)ntohs( *((uint16_t *)(buf+42)) );
-
-      /* cli */
-      if (dport == state->private_port) { 
-
-         /* lookup initial server database from file */
-         char priv_addr6[16], str_addr6[INET6_ADDRSTRLEN];
-         memcpy(priv_addr6, buf+24, 16);
-         debug_print("%s\n", inet_ntop(AF_INET6, priv_addr6, 
-                               str_addr6, INET6_ADDRSTRLEN));
-         
-         /* lookup private addr */
-         if ( (rec = g_hash_table_lookup(state->cli6, priv_addr6)) ) {
-            debug_print("priv addr lookup: OK\n");
-
-            /* Add layer 4.5 header */
-            if (state->raw_header) {
-               buf -= state->raw_header_size;
-               recvd += state->raw_header_size;
-            }
-            int sent = xsendto6(fd_cli, rec->sa6, buf, recvd);
-            debug_print("wrote %db to internet\n",sent);
-            if (sent <0) debug_perror();
-         } else {
-            errno=EFAULT;
-            die("cli lookup");
-         }
-
-      /* serv */
-      } else if ((rec = g_hash_table_lookup(state->serv, &dport))) {   
-
-         /* Add layer 4.5 header */
-         if (state->raw_header) {
-            buf -= state->raw_header_size;
-            recvd += state->raw_header_size;
-         }
-
-         int sent = xsendto6(fd_serv, rec->sa6, buf, recvd);
-         debug_print("wrote %db to internet\n",sent);
-      } else {
-         debug_print("serv lookup failed proto:%d sport:%d dport:%d\n", 
-                      (int) *((uint8_t *)(buf+6)), 
-                      (int) ntohs( *((uint16_t *)(buf+40)) ), 
-                      dport);
-      }
-   } 
-}
-
-void tun_peer_out_cli4(int fd_udp, int fd_tun, struct tun_state *state, char *buf) {
-   int recvd = xrecv(fd_udp, buf, BUFF_SIZE);
-
-   if (recvd > MIN_PKT_SIZE) {
-      debug_print("cli: recvd %dB from internet\n", recvd);
-
-      /* Remove layer 4.5 header */
+      /* Add layer 4.5 header */
       if (state->raw_header) {
-         if (!state->udp)
-            recvd -= 20; 
-         recvd -= state->raw_header_size;
-         memmove(buf, buf+state->raw_header_size, recvd);
-      }
-      /* Add PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         buf-=4; recvd+=4;
+         buf -= state->raw_header_size;
+         recvd += state->raw_header_size;
       }
 
-      int sent = xwrite(fd_tun, buf, recvd);
-      debug_print("cli: wrote %dB to tun\n", sent);
-   } else if (recvd < 0) {
-      /* recvd ICMP msg */
-      xrecverr(fd_udp, buf, BUFF_SIZE, 0, NULL);
-   } else {
-      /* recvd unknown packet */
-      debug_print("cli: recvd empty pkt\n");
-   }   
+      int sent = queue_sendto(state->txq_net, fd_net, rec->sport, 
+                              rec_sa(rec, f), f->salen, tos, buf, recvd);
+      debug_print("wrote %db to internet\n",sent);
+      if (sent <0) debug_perror();
+   } 
 }
 
-void tun_peer_out_cli6(int fd_udp, int fd_tun, struct tun_state *state, char *buf) {
-   int recvd = xrecv(fd_udp, buf, BUFF_SIZE);
+int tun_peer_out_cli(int fd_udp, int fd_tun, struct tun_state *state, 
+                     const struct ip_family *f, char *buf) {
+   int tos, recvd = xrecvtos(fd_udp, NULL, NULL, buf, BUFF_SIZE, &tos);
+   int ret = recvd > 0;
 
    if (recvd > MIN_PKT_SIZE) {
       debug_print("cli: recvd %dB from internet\n", recvd);
@@ -293,16 +208,26 @@ void tun_peer_out_cli6(int fd_udp, int fd_tun, struct tun_state *state, char *bu
       /* Remove layer 4.5 header */
       if (state->raw_header) {
          if (!state->udp)
-            recvd -= 40; 
+            recvd -= f->hdr_len; 
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
+      /* Combine the outer ECN field */
+      if (ecn_decap(tos, buf, recvd) < 0)
+         return ret;
+      /* The server port the packet came from, only looked up when
+       * counted or matched against a per-peer tun impairment */
+      int from = 0;
+      if (hh_on || state->acct || (state->impair_tun && state->impair_tun->map))
+         from = hh_peer(state, buf);
+      HH_UPDATE(buf, recvd, from, HH_RX);
+      ACCT_UPDATE(state, buf, recvd, from, ACCT_RX);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
-      int sent = xwrite(fd_tun, buf, recvd);
+      int sent = queue_write(state->txq_tun, fd_tun, from, buf, recvd);
       debug_print("cli: wrote %dB to tun\n", sent);
    } else if (recvd < 0) {
       /* recvd ICMP msg */
@@ -311,12 +236,16 @@ void tun_peer_out_cli6(int fd_udp, int fd_tun, struct tun_state *state, char *bu
       /* recvd unknown packet */
       debug_print("cli: recvd empty pkt\n");
    }   
+   return ret;
 }
 
-void tun_peer_out_serv4(int fd_udp, int fd_tun, struct tun_state *state, char *buf) {
-   struct tun_rec *nrec = init_tun_rec(state);
-   int recvd = xrecvfrom(fd_udp, (struct sockaddr *)nrec->sa4, 
-                         &nrec->slen4, buf, BUFF_SIZE);
+int tun_peer_out_serv(int fd_udp, int fd_tun, struct tun_state *state, 
+                      const struct ip_family *f, char *buf) {
+   struct sockaddr_storage from;
+   unsigned int slen = f->salen;
+   int tos, recvd = xrecvtos(fd_udp, (struct sockaddr *)&from, &slen, 
+                              buf, BUFF_SIZE, &tos);
+   int ret = recvd > 0;
 
    if (recvd > MIN_PKT_SIZE) {
       debug_print("serv: recvd %dB from internet\n", recvd);
@@ -324,82 +253,30 @@ void tun_peer_out_serv4(int fd_udp, int fd_tun, struct tun_state *state, char *b
       /* Remove layer 4.5 header */
       if (state->raw_header) {
          if (!state->udp)
-            recvd -= 20; 
+            recvd -= f->hdr_len; 
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
-      /* Add PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         buf-=4; recvd+=4;
-      }
-
-      struct tun_rec *rec = NULL;
-      int sport           = ntohs(((struct sockaddr_in *)nrec->sa4)->sin_port);
+      /* Combine the outer ECN field */
+      if (ecn_decap(tos, buf, recvd) < 0)
+         return ret;
+      int sport           = sa_port((struct sockaddr *)&from);
       int sent            = 0;
-      if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
-
-         sent = xwrite(fd_tun, buf, recvd);
-         debug_print("serv: wrote %dB to internet\n", sent); 
-      } 
-#if !defined(LOCKED)
-      else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
-         
-         sent = xwrite(fd_tun, buf, recvd);
-
-         //add new record to lookup tables  
-         nrec->sport = sport;
-         g_hash_table_insert(state->serv, &nrec->sport, nrec);
-         debug_print("serv: added new entry: %d\n", sport);
-      } 
-#endif
-      else {
-         debug_print("dropping unknown UDP dgram (NAT ?)\n");
-      }
-          
-   } else if (recvd < 0) {
-       /* recvd ICMP msg */
-      xrecverr(fd_udp, buf,  BUFF_SIZE, 0, NULL);
-   } else {
-      /* recvd unknown packet */
-      debug_print("serv: recvd empty pkt\n");
-   }
-   free_tun_rec(nrec);
-}
-
-void tun_peer_out_serv6(int fd_udp, int fd_tun, struct tun_state *state, char *buf) {
-   struct tun_rec *nrec = init_tun_rec(state);
-   int recvd = xrecvfrom(fd_udp, (struct sockaddr *)nrec->sa6, 
-                         &nrec->slen6, buf, BUFF_SIZE);
-
-   if (recvd > MIN_PKT_SIZE) {
-      debug_print("serv: recvd %dB from internet\n", recvd);
-
-      /* Remove layer 4.5 header */
-      if (state->raw_header) {
-         if (!state->udp)
-            recvd -= 40; 
-         recvd -= state->raw_header_size;
-         memmove(buf, buf+state->raw_header_size, recvd);
-      }
+      HH_UPDATE(buf, recvd, sport, HH_RX);
+      ACCT_UPDATE(state, buf, recvd, sport, ACCT_RX);
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
 
-      struct tun_rec *rec = NULL;
-      int sport           = ntohs(((struct sockaddr_in *)nrec->sa6)->sin_port);
-      int sent            = 0;
-      if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
-         sent = xwrite(fd_tun, buf, recvd);
+      if (serv_lookup(state, sport)) {
+         sent = queue_write(state->txq_tun, fd_tun, sport, buf, recvd);
          debug_print("serv: wrote %dB to tun\n", sent); 
       } 
 #if !defined(LOCKED)
-      else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
-         sent = xwrite(fd_tun, buf, recvd);
-
-         /* add new record to lookup tables */
-         nrec->sport = sport;
-         g_hash_table_insert(state->serv, &nrec->sport, nrec);
+      else if (g_hash_table_size(state->serv) <= state->fd_lim &&
+               serv_learn(state, f, &from, sport)) { 
+         sent = queue_write(state->txq_tun, fd_tun, sport, buf, recvd);
          debug_print("serv: added new entry: %d\n", sport);
       } 
 #endif
@@ -414,20 +291,21 @@ void tun_peer_out_serv6(int fd_udp, int fd_tun, struct tun_state *state, char *b
       /* recvd unknown packet */
       debug_print("serv: recvd empty pkt\n");
    }
-   free_tun_rec(nrec);
+   return ret;
 }
 
 void tun_peer_single(struct arguments *args) {
    int fd_tun = 0, fd_serv = 0, fd_cli = 0;
-   void (*tun_peer_in_func)(int,int,int,struct tun_state*,char*);
-   void (*tun_peer_out_cli)(int,int,struct tun_state*,char*);
-   void (*tun_peer_out_serv)(int,int,struct tun_state*,char*);
    
    /* init state */ 
    struct tun_state *state = init_tun_state(args);
+   const struct ip_family *f = state->ipv6 ? &ip_family6 : &ip_family4;
 
-   /* create tun if and sockets */
-   tun(state, &fd_tun);   
+   /* configure the tun if and set up the capture while the sockets
+      are created */
+   pthread_t tun_th = tun_async(state, &fd_tun);
+   xthread_create(capture_notun, (void *) state, 1);
+   int64_t t = startup_now();
    if (state->ipv6) {
       if (state->udp) {
          fd_serv = udp_sock6(state->public_port, 1, state->public_addr6);
@@ -444,9 +322,6 @@ void tun_peer_single(struct arguments *args) {
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       }
-      tun_peer_out_cli = &tun_peer_out_cli6;
-      tun_peer_out_serv = &tun_peer_out_serv6;
-      tun_peer_in_func = &tun_peer_in6;
    } else {
       if (state->udp) {
          fd_serv = udp_sock4(state->public_port, 1, state->public_addr4);
@@ -463,14 +338,17 @@ void tun_peer_single(struct arguments *args) {
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
       }
-
-      tun_peer_out_cli = &tun_peer_out_cli4;
-      tun_peer_out_serv = &tun_peer_out_serv4;
-      tun_peer_in_func = &tun_peer_in4;
    }
+   int fd_cli4  = f->v6 ? -1 : fd_cli,  fd_cli6  = f->v6 ? fd_cli : -1;
+   int fd_serv4 = f->v6 ? -1 : fd_serv, fd_serv6 = f->v6 ? fd_serv : -1;
 
-   /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
+   if (state->shm_dir)
+      init_shm(state);
+
+   startup_phase("sockets", t);
+   pthread_join(tun_th, NULL);
+
+   /* wait for the capture threads */
    synchronize();
 
    /* run server */
@@ -482,9 +360,9 @@ void tun_peer_single(struct arguments *args) {
    xthread_create(cli_thread, (void*) state, 1);
 
    /* init select main loop */
-   fd_set input_set;
+   fd_set input_set, output_set;
    struct timeval tv;
-   int sel = 0, fd_max = 0;
+   int sel = 0, fd_max = 0, fd_out = 0, fd_shm = -1;
    char inbuf[BUFF_SIZE], outbuf[BUFF_SIZE];
    char *inbuffer, *outbuffer;
    inbuffer = inbuf;
@@ -505,24 +383,43 @@ void tun_peer_single(struct arguments *args) {
    signal(SIGINT,  peer_shutdown);
    signal(SIGTERM, peer_shutdown);
 
+   startup_mark("forwarding");
    while (loop) {
       FD_ZERO(&input_set);
-      FD_SET(fd_cli,  &input_set);
-      FD_SET(fd_serv, &input_set);
-      FD_SET(fd_tun,  &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_cli,  &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_serv, &input_set);
+      if (!queue_full(state->txq_net))
+         FD_SET(fd_tun,  &input_set);
 
-      sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
+      fd_shm = shm_fd_set(&input_set, queue_full(state->txq_tun));
+
+      FD_ZERO(&output_set);
+      fd_out = queues_fd_set(state, &output_set);
+
+      sel = impair_select(state, &input_set, &output_set,
+                          max(max(fd_max, fd_out), fd_shm), &tv,
+                          state->inactivity_timeout);
 
       if (sel == 0) {
          debug_print("timeout\n"); 
          break;
       } else if (sel > 0) {
+         queues_flush(state, &output_set);
+         uint32_t pkts = 0;
+         shm_recv(&input_set, fd_tun, state);
          if (FD_ISSET(fd_tun, &input_set))      
-            (*tun_peer_in_func)(fd_tun, fd_cli, fd_serv, state, inbuffer); 
+            BATCH_READ(state, state->txq_net, pkts,
+                       tun_peer_in(fd_tun, fd_cli4, fd_serv4, fd_cli6, 
+                                   fd_serv6, state, inbuffer)); 
          if (FD_ISSET(fd_cli, &input_set)) 
-            (*tun_peer_out_cli)(fd_cli, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_peer_out_cli(fd_cli, fd_tun, state, f, outbuffer));
          if (FD_ISSET(fd_serv, &input_set)) 
-            (*tun_peer_out_serv)(fd_serv, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_peer_out_serv(fd_serv, fd_tun, state, f, outbuffer));
+         batch_round(state, pkts);
       }
    }
 }
@@ -533,8 +430,11 @@ void tun_peer_dual(struct arguments *args) {
    /* init state */ 
    struct tun_state *state = init_tun_state(args);
 
-   /* create tun if and sockets */
-   tun(state, &fd_tun);   
+   /* configure the tun if and set up the capture while the sockets
+      are created */
+   pthread_t tun_th = tun_async(state, &fd_tun);
+   xthread_create(capture_notun, (void *) state, 1);
+   int64_t t = startup_now();
    if (state->udp) {
       fd_serv4 = udp_sock4(state->public_port, 1, state->public_addr4);
       fd_cli4  = udp_sock4(state->port, 1, state->public_addr4);
@@ -563,8 +463,13 @@ void tun_peer_dual(struct arguments *args) {
                             1, state->planetlab);
    }
 
-   /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
+   if (state->shm_dir)
+      init_shm(state);
+
+   startup_phase("sockets", t);
+   pthread_join(tun_th, NULL);
+
+   /* wait for the capture threads */
    synchronize();
 
    /* run server */
@@ -576,9 +481,9 @@ void tun_peer_dual(struct arguments *args) {
    xthread_create(cli_thread, (void*) state, 1);
 
    /* init select main loop */
-   fd_set input_set;
+   fd_set input_set, output_set;
    struct timeval tv;
-   int sel = 0, fd_max = 0;
+   int sel = 0, fd_max = 0, fd_out = 0, fd_shm = -1;
    char inbuf[BUFF_SIZE], outbuf[BUFF_SIZE];
    char *inbuffer, *outbuffer;
    inbuffer = inbuf;
@@ -599,31 +504,57 @@ void tun_peer_dual(struct arguments *args) {
    signal(SIGINT,  peer_shutdown);
    signal(SIGTERM, peer_shutdown);
 
+   startup_mark("forwarding");
    while (loop) {
       FD_ZERO(&input_set);
-      FD_SET(fd_tun,  &input_set);
-      FD_SET(fd_cli4,  &input_set);
-      FD_SET(fd_serv4, &input_set);
-      FD_SET(fd_cli6,  &input_set);
-      FD_SET(fd_serv6, &input_set);
-
-      sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
+      if (!queue_full(state->txq_net))
+         FD_SET(fd_tun,  &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_cli4,  &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_serv4, &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_cli6,  &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_serv6, &input_set);
+
+      fd_shm = shm_fd_set(&input_set, queue_full(state->txq_tun));
+
+      FD_ZERO(&output_set);
+      fd_out = queues_fd_set(state, &output_set);
+
+      sel = impair_select(state, &input_set, &output_set,
+                          max(max(fd_max, fd_out), fd_shm), &tv,
+                          state->inactivity_timeout);
 
       if (sel == 0) {
          debug_print("timeout\n"); 
          break;
       } else if (sel > 0) {
+         queues_flush(state, &output_set);
+         uint32_t pkts = 0;
+         shm_recv(&input_set, fd_tun, state);
          if (FD_ISSET(fd_cli4, &input_set)) 
-            tun_peer_out_cli4(fd_cli4, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_peer_out_cli(fd_cli4, fd_tun, state, &ip_family4, 
+                                        outbuffer));
          if (FD_ISSET(fd_cli6, &input_set)) 
-            tun_peer_out_cli6(fd_cli6, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_peer_out_cli(fd_cli6, fd_tun, state, &ip_family6, 
+                                        outbuffer));
          if (FD_ISSET(fd_tun, &input_set))      
-            tun_peer_in(fd_tun, fd_cli4, fd_serv4, fd_cli6, fd_serv6, 
-                        state, inbuffer); 
+            BATCH_READ(state, state->txq_net, pkts,
+                       tun_peer_in(fd_tun, fd_cli4, fd_serv4, fd_cli6, 
+                                   fd_serv6, state, inbuffer)); 
          if (FD_ISSET(fd_serv4, &input_set)) 
-            tun_peer_out_serv4(fd_serv4, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_peer_out_serv(fd_serv4, fd_tun, state, &ip_family4, 
+                                         outbuffer));
          if (FD_ISSET(fd_serv6, &input_set)) 
-            tun_peer_out_serv6(fd_serv6, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_peer_out_serv(fd_serv6, fd_tun, state, &ip_family6, 
+                                         outbuffer));
+         batch_round(state, pkts);
       }
    }
 }
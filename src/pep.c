@@ -0,0 +1,1200 @@
+/**
+ * \file pep.c
+ * \brief Split-TCP performance-enhancing proxy (epoll).
+ *
+ *    Streams are kept in a table indexed by slot, the epoll data of a
+ *    stream holds its slot and generation so that events of a stream
+ *    freed in the same epoll_wait() batch are ignored. The frames read
+ *    by the terminated connections are appended to the trunk buffer and
+ *    all trunks are flushed once per batch, which aggregates the frames
+ *    of the streams into large writes.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <sys/epoll.h>
+#endif
+
+#include "pep.h"
+#include "debug.h"
+#include "sock.h"
+#include "lpm.h"
+#include "recs.h"
+#include "stats.h"
+#include "destruct.h"
+#include "startup.h"
+#include "thread.h"
+#include "perf.h"
+#include "udptun.h"
+
+#if defined(LINUX_OS)
+
+/**
+ * \def PEP_EV_LISTEN
+ * \brief epoll data flag of listening sockets, the low bits hold the index.
+ */
+#define PEP_EV_LISTEN (1ULL << 62)
+
+/**
+ * \def PEP_EV_TRUNK
+ * \brief epoll data flag of trunks, the low bits hold the generation
+ *        and the index. Streams hold their key.
+ */
+#define PEP_EV_TRUNK (1ULL << 61)
+
+/**
+ * \def PEP_LISTEN_TPROXY
+ * \brief Listener kind of the TPROXY listener.
+ */
+#define PEP_LISTEN_TPROXY -1
+
+/**
+ * \def PEP_LISTEN_TRUNK
+ * \brief Listener kind of the trunk listeners.
+ */
+#define PEP_LISTEN_TRUNK -2
+
+/**
+ * \enum pep_flags
+ * \brief The stream flags.
+ */
+enum pep_flags {
+   PEP_S_CONNECTING = 0x01,  /*!< Re-origination in progress */
+   PEP_S_RD_EOF     = 0x02,  /*!< Socket EOF read, FIN sent */
+   PEP_S_WR_EOF     = 0x04,  /*!< FIN received */
+   PEP_S_SHUT       = 0x08,  /*!< Socket write side shut down */
+   PEP_S_PAUSED     = 0x10,  /*!< Reading paused on the full trunk buffer */
+};
+
+/**
+ * \var static pthread_once_t pep_once
+ * \brief init_pep() runs from the server and client threads of a peer.
+ */
+static pthread_once_t pep_once = PTHREAD_ONCE_INIT;
+
+/**
+ * \var static struct tun_state *pep_state
+ * \brief The state passed to pep_start().
+ */
+static struct tun_state *pep_state;
+
+/**
+ * \fn static void pep_start()
+ * \brief Create the proxy, bind its listeners and start its thread.
+ */
+static void pep_start();
+
+/**
+ * \fn static void *pep_thread(void *arg)
+ * \brief The proxy event loop.
+ *
+ * \param arg The proxy
+ */
+static void *pep_thread(void *arg);
+
+/**
+ * \fn static void pep_ctl(struct pep *pep, int op, int fd, uint32_t events, uint64_t data)
+ * \brief epoll_ctl() or die.
+ */
+static void pep_ctl(struct pep *pep, int op, int fd, uint32_t events,
+                    uint64_t data);
+
+/**
+ * \fn static void pep_listen(struct pep *pep, sa_family_t sfam, char *addr, int port, int kind, int transparent)
+ * \brief Bind a listener.
+ *
+ * \param kind The peer index, PEP_LISTEN_TPROXY or PEP_LISTEN_TRUNK
+ * \param transparent 1 to set IP_TRANSPARENT
+ */
+static void pep_listen(struct pep *pep, sa_family_t sfam, char *addr,
+                       int port, int kind, int transparent);
+
+/**
+ * \fn static void pep_accept(struct pep *pep, int l)
+ * \brief Accept the pending connections of a listener.
+ */
+static void pep_accept(struct pep *pep, int l);
+
+/**
+ * \fn static int pep_route(struct pep *pep, struct sockaddr *sa)
+ * \brief The peer owning a destination.
+ *
+ * \return The peer index, -1 if none
+ */
+static int pep_route(struct pep *pep, struct sockaddr *sa);
+
+/**
+ * \fn static void pep_sweep(struct pep *pep)
+ * \brief Resume the stalled trunks, flush the trunks and update their
+ *        events, once per epoll_wait() batch.
+ */
+static void pep_sweep(struct pep *pep);
+
+/**
+ * \fn static void pep_stats(FILE *fp, void *arg)
+ * \brief Dump the proxy counters.
+ */
+static void pep_stats(FILE *fp, void *arg);
+
+/**
+ * \fn static void buf_reserve(struct pep_buf *b, uint32_t n)
+ * \brief Make room for n bytes after the data.
+ */
+static void buf_reserve(struct pep_buf *b, uint32_t n);
+
+/**
+ * \fn static void buf_consume(struct pep_buf *b, uint32_t n)
+ * \brief Drop n bytes from the head of the data.
+ */
+static void buf_consume(struct pep_buf *b, uint32_t n);
+
+/**
+ * \fn static void put_hdr(char *p, uint32_t id, uint16_t len, uint8_t type)
+ * \brief Write a frame header.
+ */
+static void put_hdr(char *p, uint32_t id, uint16_t len, uint8_t type);
+
+/**
+ * \fn static void put_frame(struct pep_buf *b, uint32_t id, uint8_t type, const char *payload, uint16_t len)
+ * \brief Append a frame.
+ */
+static void put_frame(struct pep_buf *b, uint32_t id, uint8_t type,
+                      const char *payload, uint16_t len);
+
+/**
+ * \fn static uint16_t put_addr(char *p, struct sockaddr_storage *sa)
+ * \brief Encode a destination: family (4 or 6), pad, port, address.
+ *
+ * \return The encoded length
+ */
+static uint16_t put_addr(char *p, struct sockaddr_storage *sa);
+
+/**
+ * \fn static int get_addr(const char *p, uint16_t len, struct sockaddr_storage *sa, socklen_t *salen)
+ * \brief Decode a destination.
+ *
+ * \return 0, -1 if malformed
+ */
+static int get_addr(const char *p, uint16_t len, struct sockaddr_storage *sa,
+                    socklen_t *salen);
+
+/**
+ * \fn static void trunk_opts(struct pep *pep, int s)
+ * \brief Set the trunk socket options (nodelay, mss, congestion control).
+ */
+static void trunk_opts(struct pep *pep, int s);
+
+/**
+ * \fn static int trunk_add(struct pep *pep, int fd, int peer, int connected)
+ * \brief Register a trunk.
+ *
+ * \return The trunk index, -1 if the table is full
+ */
+static int trunk_add(struct pep *pep, int fd, int peer, int connected);
+
+/**
+ * \fn static int trunk_get(struct pep *pep, int peer)
+ * \brief The trunk to a peer, connected if needed.
+ *
+ * \return The trunk index, -1 on error
+ */
+static int trunk_get(struct pep *pep, int peer);
+
+/**
+ * \fn static void trunk_close(struct pep *pep, struct pep_trunk *t, int err)
+ * \brief Close a trunk and abort its streams.
+ */
+static void trunk_close(struct pep *pep, struct pep_trunk *t, int err);
+
+/**
+ * \fn static uint32_t trunk_events(struct pep_trunk *t)
+ * \brief The epoll events wanted by a trunk.
+ */
+static uint32_t trunk_events(struct pep_trunk *t);
+
+/**
+ * \fn static void trunk_update(struct pep *pep, struct pep_trunk *t)
+ * \brief Update the registered events of a trunk.
+ */
+static void trunk_update(struct pep *pep, struct pep_trunk *t);
+
+/**
+ * \fn static void trunk_event(struct pep *pep, struct pep_trunk *t, uint32_t ev)
+ * \brief Handle the events of a trunk.
+ */
+static void trunk_event(struct pep *pep, struct pep_trunk *t, uint32_t ev);
+
+/**
+ * \fn static void trunk_read(struct pep *pep, struct pep_trunk *t)
+ * \brief Read and dispatch frames.
+ */
+static void trunk_read(struct pep *pep, struct pep_trunk *t);
+
+/**
+ * \fn static void trunk_parse(struct pep *pep, struct pep_trunk *t)
+ * \brief Dispatch the received frames until a stream stalls.
+ */
+static void trunk_parse(struct pep *pep, struct pep_trunk *t);
+
+/**
+ * \fn static int trunk_frame(struct pep *pep, struct pep_trunk *t, uint32_t id, uint8_t type, const char *payload, uint16_t len)
+ * \brief Dispatch a frame.
+ *
+ * \return 1 if consumed, 0 if the stream can't take the data yet
+ */
+static int trunk_frame(struct pep *pep, struct pep_trunk *t, uint32_t id,
+                       uint8_t type, const char *payload, uint16_t len);
+
+/**
+ * \fn static void trunk_flush(struct pep *pep, struct pep_trunk *t)
+ * \brief Send the buffered frames, resume the paused streams once half
+ *        the buffer is free.
+ */
+static void trunk_flush(struct pep *pep, struct pep_trunk *t);
+
+/**
+ * \fn static uint32_t stream_alloc(struct pep *pep)
+ * \brief Take a free stream slot and bump its generation.
+ *
+ * \return The slot, PEP_MAX_STREAMS if none
+ */
+static uint32_t stream_alloc(struct pep *pep);
+
+/**
+ * \fn static struct pep_stream *stream_lookup(struct pep *pep, struct pep_trunk *t, uint32_t id)
+ * \brief The stream of a frame.
+ *
+ * \return The stream, NULL if closed
+ */
+static struct pep_stream *stream_lookup(struct pep *pep, struct pep_trunk *t,
+                                        uint32_t id);
+
+/**
+ * \fn static void stream_local(struct pep *pep, int c, int peer)
+ * \brief Open a stream for a terminated connection.
+ *
+ * \param c The accepted socket
+ * \param peer The peer index, PEP_LISTEN_TPROXY to route the original
+ *        destination
+ */
+static void stream_local(struct pep *pep, int c, int peer);
+
+/**
+ * \fn static void stream_open(struct pep *pep, struct pep_trunk *t, uint32_t id, const char *payload, uint16_t len)
+ * \brief Re-originate a connection opened by the peer.
+ */
+static void stream_open(struct pep *pep, struct pep_trunk *t, uint32_t id,
+                        const char *payload, uint16_t len);
+
+/**
+ * \fn static uint32_t stream_events(struct pep_stream *s)
+ * \brief The epoll events wanted by a stream.
+ */
+static uint32_t stream_events(struct pep_stream *s);
+
+/**
+ * \fn static void stream_update(struct pep *pep, struct pep_stream *s)
+ * \brief Update the registered events of a stream.
+ */
+static void stream_update(struct pep *pep, struct pep_stream *s);
+
+/**
+ * \fn static void stream_event(struct pep *pep, struct pep_stream *s, uint32_t ev)
+ * \brief Handle the events of a stream.
+ */
+static void stream_event(struct pep *pep, struct pep_stream *s, uint32_t ev);
+
+/**
+ * \fn static int stream_read(struct pep *pep, struct pep_stream *s)
+ * \brief Frame the socket data into the trunk buffer.
+ *
+ * \return 0, -1 if the stream was aborted
+ */
+static int stream_read(struct pep *pep, struct pep_stream *s);
+
+/**
+ * \fn static int stream_flush(struct pep *pep, struct pep_stream *s)
+ * \brief Write the buffered data to the socket, then forward the FIN.
+ *
+ * \return 0, -1 if the stream was aborted
+ */
+static int stream_flush(struct pep *pep, struct pep_stream *s);
+
+/**
+ * \fn static int stream_done(struct pep *pep, struct pep_stream *s)
+ * \brief Free a stream closed in both directions.
+ *
+ * \return 1 if freed
+ */
+static int stream_done(struct pep *pep, struct pep_stream *s);
+
+/**
+ * \fn static void stream_reset(struct pep *pep, struct pep_stream *s)
+ * \brief Abort a stream and notify the peer.
+ */
+static void stream_reset(struct pep *pep, struct pep_stream *s);
+
+/**
+ * \fn static void stream_free(struct pep *pep, struct pep_stream *s, int abort)
+ * \brief Close the socket of a stream (with a RST if abort) and free its slot.
+ */
+static void stream_free(struct pep *pep, struct pep_stream *s, int abort);
+
+void init_pep(struct tun_state *state) {
+   if (!state->pep_port)
+      return;
+   pep_state = state;
+   pthread_once(&pep_once, pep_start);
+}
+
+void pep_start() {
+   struct tun_state *state = pep_state;
+   struct pep *pep = calloc(1, sizeof(struct pep));
+   int64_t t = startup_now();
+
+   pep->state  = state;
+   pep->v6     = state->ipv6;
+   pep->buffer = state->pep_buffer ? state->pep_buffer : PEP_DEFAULT_BUFFER;
+   if ((pep->ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      die("epoll_create1");
+   set_fd(pep->ep);
+
+   pep->streams = calloc(PEP_MAX_STREAMS, sizeof(struct pep_stream));
+   for (uint32_t i=0; i<PEP_MAX_STREAMS; i++) {
+      pep->streams[i].fd   = -1;
+      pep->streams[i].key  = i;
+      pep->streams[i].next = i + 1;
+   }
+   for (int i=0; i<PEP_MAX_TRUNKS; i++)
+      pep->trunks[i].fd = -1;
+
+   /* servers have no peer table */
+   int n = state->cli_private ? state->sa_len : 0;
+   pep->listen_fd   = xmalloc((n + 3) * sizeof(int));
+   pep->listen_peer = xmalloc((n + 3) * sizeof(int));
+   pep->peer_trunk  = xmalloc((n + 1) * sizeof(int));
+   for (int i=0; i<n; i++)
+      pep->peer_trunk[i] = -1;
+
+   /* trunks from the peers, through the tunnel */
+   if (state->private_addr4 && (!state->ipv6 || state->dual_stack))
+      pep_listen(pep, AF_INET, state->private_addr4, state->pep_port,
+                 PEP_LISTEN_TRUNK, 0);
+   if (state->private_addr6 && (state->ipv6 || state->dual_stack))
+      pep_listen(pep, AF_INET6, state->private_addr6, state->pep_port,
+                 PEP_LISTEN_TRUNK, 0);
+
+   /* connections to the peers */
+   sa_family_t sfam = pep->v6 ? AF_INET6 : AF_INET;
+   if (n && state->pep_tproxy)
+      pep_listen(pep, sfam, NULL, pep_local_port(state, -1),
+                 PEP_LISTEN_TPROXY, 1);
+   for (int i=0; i<n; i++)
+      pep_listen(pep, sfam, pep->v6 ? "::1" : "127.0.0.1",
+                 pep_local_port(state, i), i, 0);
+
+   state->pep = pep;
+   stats_register("pep", pep_stats, pep);
+   xthread_create(pep_thread, (void *)pep, 1);
+   startup_phase("pep", t);
+}
+
+void free_pep(struct pep *pep) {
+   for (uint32_t i=0; i<PEP_MAX_STREAMS; i++)
+      free(pep->streams[i].out.data);
+   for (int i=0; i<PEP_MAX_TRUNKS; i++) {
+      free(pep->trunks[i].in.data);
+      free(pep->trunks[i].out.data);
+      free(pep->trunks[i].map);
+   }
+   free(pep->streams);
+   free(pep->listen_fd);
+   free(pep->listen_peer);
+   free(pep->peer_trunk);
+   free(pep);
+}
+
+void *pep_thread(void *arg) {
+   struct pep *pep = arg;
+   struct epoll_event events[PEP_EVENTS];
+   perf_thread("pep");
+
+   while (1) {
+      int n = epoll_wait(pep->ep, events, PEP_EVENTS, -1);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         die("epoll_wait");
+      }
+      for (int k=0; k<n; k++) {
+         uint64_t data = events[k].data.u64;
+         uint32_t ev   = events[k].events;
+         if (data & PEP_EV_LISTEN) {
+            pep_accept(pep, (int)(uint32_t)data);
+         } else if (data & PEP_EV_TRUNK) {
+            struct pep_trunk *t = &pep->trunks[(uint16_t)data];
+            if (t->fd >= 0 && t->gen == (uint16_t)(data >> 16))
+               trunk_event(pep, t, ev);
+         } else {
+            /* stale event of a stream freed earlier in this batch */
+            struct pep_stream *s = &pep->streams[data & 0xffff];
+            if (s->fd >= 0 && s->key == (uint32_t)data)
+               stream_event(pep, s, ev);
+         }
+      }
+      pep_sweep(pep);
+   }
+   return 0;
+}
+
+void pep_ctl(struct pep *pep, int op, int fd, uint32_t events, uint64_t data) {
+   struct epoll_event ev = {events, {.u64 = data}};
+   if (epoll_ctl(pep->ep, op, fd, &ev) < 0)
+      die("epoll_ctl");
+}
+
+void pep_listen(struct pep *pep, sa_family_t sfam, char *addr, int port,
+                int kind, int transparent) {
+   int s, on = 1;
+   if ((s=socket(sfam, SOCK_STREAM, IPPROTO_TCP)) < 0)
+      die("socket");
+   set_fd(s);
+   if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) < 0)
+      die("setsockopt failed");
+   if (transparent) {
+#if defined(IP_TRANSPARENT) && defined(IPV6_TRANSPARENT)
+      if (setsockopt(s, sfam == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP,
+                     sfam == AF_INET6 ? IPV6_TRANSPARENT : IP_TRANSPARENT,
+                     &on, sizeof(on)) < 0)
+         die("setsockopt transparent");
+#else
+      errno=ENOSYS;
+      die("pep-tproxy requires IP_TRANSPARENT");
+#endif
+   }
+   /* inherited by the accepted trunks */
+   if (kind == PEP_LISTEN_TRUNK)
+      trunk_opts(pep, s);
+
+   size_t salen;
+   struct sockaddr *sout;
+   if (sfam == AF_INET6) {
+      sout  = (struct sockaddr *)get_addr6(addr, port);
+      salen = sizeof(struct sockaddr_in6);
+   } else {
+      sout  = (struct sockaddr *)get_addr4(addr, port);
+      salen = sizeof(struct sockaddr_in);
+   }
+   if (bind(s, sout, salen) < 0) {
+      debug_print("pep: died binding %s:%d ...\n", addr ? addr : "*", port);
+      die("bind pep");
+   }
+   free(sout);
+   if (listen(s, pep->state->backlog_size) < 0)
+      die("listen");
+   set_nonblock(s);
+
+   int l = pep->listen_len++;
+   pep->listen_fd[l]   = s;
+   pep->listen_peer[l] = kind;
+   pep_ctl(pep, EPOLL_CTL_ADD, s, EPOLLIN, PEP_EV_LISTEN | l);
+   debug_print("pep: listening at %s:%d (%d)\n", addr ? addr : "*", port, kind);
+}
+
+void pep_accept(struct pep *pep, int l) {
+   int c;
+   while ((c = accept(pep->listen_fd[l], NULL, NULL)) >= 0) {
+      set_fd(c);
+      set_nonblock(c);
+      if (pep->listen_peer[l] != PEP_LISTEN_TRUNK) {
+         stream_local(pep, c, pep->listen_peer[l]);
+      } else if (trunk_add(pep, c, -1, 1) < 0) {
+         pep->trunks_failed++;
+         close_fd(c);
+      } else {
+         pep->trunks_accepted++;
+         debug_print("pep: trunk accepted\n");
+      }
+   }
+}
+
+int pep_route(struct pep *pep, struct sockaddr *sa) {
+   struct tun_state *state = pep->state;
+   uint32_t id = 0;
+   if (sa->sa_family == AF_INET && state->cli4)
+      id = lpm4_lookup(state->cli4,
+                       ntohl(((struct sockaddr_in *)sa)->sin_addr.s_addr));
+   else if (sa->sa_family == AF_INET6 && state->cli6)
+      id = lpm6_lookup(state->cli6,
+                       ((struct sockaddr_in6 *)sa)->sin6_addr.s6_addr);
+   if (!id)
+      return -1;
+   int sport = rec_get(state, id)->sport;
+   for (int i=0; i<state->sa_len; i++)
+      if (rec_get(state, state->cli_private[i])->sport == sport)
+         return i;
+   return -1;
+}
+
+void pep_sweep(struct pep *pep) {
+   for (int i=0; i<PEP_MAX_TRUNKS; i++) {
+      struct pep_trunk *t = &pep->trunks[i];
+      if (t->fd < 0)
+         continue;
+
+      /* resume reading once the stalled stream drained or closed */
+      if (t->stall) {
+         struct pep_stream *s = &pep->streams[t->stall & 0xffff];
+         if (s->fd < 0 || s->key != t->stall ||
+               s->out.len + t->stall_len <= PEP_STREAM_BUFFER) {
+            t->stall = 0;
+            trunk_parse(pep, t);
+            if (t->fd < 0)
+               continue;
+         }
+      }
+      if (t->connected && t->out.len)
+         trunk_flush(pep, t);
+      if (t->fd >= 0)
+         trunk_update(pep, t);
+   }
+}
+
+void buf_reserve(struct pep_buf *b, uint32_t n) {
+   if (b->off + b->len + n <= b->size)
+      return;
+   if (b->off) {
+      memmove(b->data, b->data + b->off, b->len);
+      b->off = 0;
+   }
+   if (b->len + n <= b->size)
+      return;
+   uint32_t size = 2 * b->size > b->len + n ? 2 * b->size : b->len + n;
+   if (!(b->data = realloc(b->data, size)))
+      die("realloc");
+   b->size = size;
+}
+
+void buf_consume(struct pep_buf *b, uint32_t n) {
+   b->off += n;
+   b->len -= n;
+   if (!b->len)
+      b->off = 0;
+}
+
+void put_hdr(char *p, uint32_t id, uint16_t len, uint8_t type) {
+   uint32_t nid  = htonl(id);
+   uint16_t nlen = htons(len);
+   memcpy(p, &nid, 4);
+   memcpy(p + 4, &nlen, 2);
+   p[6] = type;
+   p[7] = 0;
+}
+
+void put_frame(struct pep_buf *b, uint32_t id, uint8_t type,
+               const char *payload, uint16_t len) {
+   buf_reserve(b, PEP_HDR + len);
+   char *p = b->data + b->off + b->len;
+   put_hdr(p, id, len, type);
+   if (len)
+      memcpy(p + PEP_HDR, payload, len);
+   b->len += PEP_HDR + len;
+}
+
+uint16_t put_addr(char *p, struct sockaddr_storage *sa) {
+   p[1] = 0;
+   if (sa->ss_family == AF_INET6) {
+      struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)sa;
+      p[0] = 6;
+      memcpy(p + 2, &sa6->sin6_port, 2);
+      memcpy(p + 4, &sa6->sin6_addr, 16);
+      return 20;
+   }
+   struct sockaddr_in *sa4 = (struct sockaddr_in *)sa;
+   p[0] = 4;
+   memcpy(p + 2, &sa4->sin_port, 2);
+   memcpy(p + 4, &sa4->sin_addr, 4);
+   return 8;
+}
+
+int get_addr(const char *p, uint16_t len, struct sockaddr_storage *sa,
+             socklen_t *salen) {
+   memset(sa, 0, sizeof(struct sockaddr_storage));
+   if (len == 20 && p[0] == 6) {
+      struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)sa;
+      sa6->sin6_family = AF_INET6;
+      memcpy(&sa6->sin6_port, p + 2, 2);
+      memcpy(&sa6->sin6_addr, p + 4, 16);
+      *salen = sizeof(struct sockaddr_in6);
+      return 0;
+   }
+   if (len == 8 && p[0] == 4) {
+      struct sockaddr_in *sa4 = (struct sockaddr_in *)sa;
+      sa4->sin_family = AF_INET;
+      memcpy(&sa4->sin_port, p + 2, 2);
+      memcpy(&sa4->sin_addr, p + 4, 4);
+      *salen = sizeof(struct sockaddr_in);
+      return 0;
+   }
+   return -1;
+}
+
+void trunk_opts(struct pep *pep, int s) {
+   struct tun_state *state = pep->state;
+   int on = 1;
+   if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+      debug_print("pep: setsockopt nodelay\n");
+   }
+   /* the trunk runs through the tunnel */
+   if (state->max_segment_size) {
+      int mss = state->max_segment_size;
+      if (setsockopt(s, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)) < 0)
+         die("setsockopt maxseg");
+   }
+#if defined(TCP_CONGESTION)
+   if (state->pep_cc && setsockopt(s, IPPROTO_TCP, TCP_CONGESTION,
+                                   state->pep_cc, strlen(state->pep_cc)) < 0) {
+      debug_print("pep: congestion control %s unavailable\n", state->pep_cc);
+   }
+#endif
+}
+
+int trunk_add(struct pep *pep, int fd, int peer, int connected) {
+   for (int i=0; i<PEP_MAX_TRUNKS; i++) {
+      struct pep_trunk *t = &pep->trunks[i];
+      if (t->fd >= 0)
+         continue;
+      t->fd        = fd;
+      t->gen++;
+      t->peer      = peer;
+      t->connected = connected;
+      t->stall     = 0;
+      t->paused    = 0;
+      if (peer < 0 && !t->map)
+         t->map = calloc(PEP_MAX_STREAMS, sizeof(uint16_t));
+      t->events    = trunk_events(t);
+      pep_ctl(pep, EPOLL_CTL_ADD, fd, t->events,
+              PEP_EV_TRUNK | (uint64_t)t->gen << 16 | i);
+      return i;
+   }
+   return -1;
+}
+
+int trunk_get(struct pep *pep, int peer) {
+   if (pep->peer_trunk[peer] >= 0)
+      return pep->peer_trunk[peer];
+
+   /* the peer private address at pep-port */
+   struct tun_state *state = pep->state;
+   struct tun_rec *rec = rec_get(state, state->cli_private[peer]);
+   struct sockaddr_storage sa;
+   socklen_t salen;
+   if (pep->v6) {
+      salen = sizeof(struct sockaddr_in6);
+      memcpy(&sa, &rec->sa6, salen);
+      ((struct sockaddr_in6 *)&sa)->sin6_port = htons(state->pep_port);
+   } else {
+      salen = sizeof(struct sockaddr_in);
+      memcpy(&sa, &rec->sa4, salen);
+      ((struct sockaddr_in *)&sa)->sin_port = htons(state->pep_port);
+   }
+
+   int s, i;
+   if ((s=socket(sa.ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+      pep->trunks_failed++;
+      return -1;
+   }
+   set_fd(s);
+   set_nonblock(s);
+   trunk_opts(pep, s);
+   if ((connect(s, (struct sockaddr *)&sa, salen) < 0 && errno != EINPROGRESS)
+         || (i = trunk_add(pep, s, peer, 0)) < 0) {
+      pep->trunks_failed++;
+      close_fd(s);
+      return -1;
+   }
+   pep->peer_trunk[peer] = i;
+   pep->trunks_opened++;
+   debug_print("pep: trunk %d to peer %d\n", i, peer);
+   return i;
+}
+
+void trunk_close(struct pep *pep, struct pep_trunk *t, int err) {
+   int ti = t - pep->trunks;
+   for (uint32_t i=0; i<PEP_MAX_STREAMS; i++) {
+      struct pep_stream *s = &pep->streams[i];
+      if (s->fd >= 0 && s->trunk == ti) {
+         pep->resets++;
+         stream_free(pep, s, 1);
+      }
+   }
+   close_fd(t->fd);
+   t->fd = -1;
+   if (t->peer >= 0 && pep->peer_trunk[t->peer] == ti)
+      pep->peer_trunk[t->peer] = -1;
+   t->in.off  = t->in.len  = 0;
+   t->out.off = t->out.len = 0;
+   if (t->map)
+      memset(t->map, 0, PEP_MAX_STREAMS * sizeof(uint16_t));
+   t->stall  = 0;
+   t->paused = 0;
+   if (err)
+      pep->trunks_failed++;
+   debug_print("pep: trunk %d closed (%d)\n", ti, err);
+}
+
+uint32_t trunk_events(struct pep_trunk *t) {
+   if (!t->connected)
+      return EPOLLOUT;
+   return (t->stall ? 0 : EPOLLIN) | (t->out.len ? EPOLLOUT : 0);
+}
+
+void trunk_update(struct pep *pep, struct pep_trunk *t) {
+   uint32_t ev = trunk_events(t);
+   if (ev == t->events)
+      return;
+   pep_ctl(pep, EPOLL_CTL_MOD, t->fd, ev,
+           PEP_EV_TRUNK | (uint64_t)t->gen << 16 | (t - pep->trunks));
+   t->events = ev;
+}
+
+void trunk_event(struct pep *pep, struct pep_trunk *t, uint32_t ev) {
+   if (!t->connected) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+         err = errno;
+      if (err) {
+         trunk_close(pep, t, 1);
+         return;
+      }
+      t->connected = 1;
+   }
+   /* a stalled trunk only reports errors and hang-ups */
+   if (t->stall && (ev & (EPOLLERR | EPOLLHUP)))
+      trunk_close(pep, t, 1);
+   else if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))
+      trunk_read(pep, t);
+}
+
+void trunk_read(struct pep *pep, struct pep_trunk *t) {
+   for (int i=0; i<16 && t->fd >= 0 && !t->stall; i++) {
+      buf_reserve(&t->in, PEP_HDR + PEP_FRAME);
+      uint32_t tail = t->in.off + t->in.len;
+      ssize_t n = recv(t->fd, t->in.data + tail, t->in.size - tail, 0);
+      if (n == 0) {
+         trunk_close(pep, t, 0);
+         return;
+      }
+      if (n < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+         trunk_close(pep, t, 1);
+         return;
+      }
+      t->in.len   += n;
+      t->bytes_in += n;
+      trunk_parse(pep, t);
+   }
+}
+
+void trunk_parse(struct pep *pep, struct pep_trunk *t) {
+   while (t->fd >= 0 && !t->stall && t->in.len >= PEP_HDR) {
+      const char *p = t->in.data + t->in.off;
+      uint32_t id;
+      uint16_t len;
+      memcpy(&id, p, 4);
+      memcpy(&len, p + 4, 2);
+      id  = ntohl(id);
+      len = ntohs(len);
+      if (len > PEP_FRAME) {
+         debug_print("pep: bad frame length %u\n", len);
+         trunk_close(pep, t, 1);
+         return;
+      }
+      if (t->in.len < PEP_HDR + (uint32_t)len)
+         return;
+      if (!trunk_frame(pep, t, id, p[6], p + PEP_HDR, len)) {
+         t->stalls++;
+         return;
+      }
+      buf_consume(&t->in, PEP_HDR + len);
+   }
+}
+
+int trunk_frame(struct pep *pep, struct pep_trunk *t, uint32_t id,
+                uint8_t type, const char *payload, uint16_t len) {
+   if (type == PEP_OPEN) {
+      stream_open(pep, t, id, payload, len);
+      return 1;
+   }
+   /* frames of a closed stream are dropped */
+   struct pep_stream *s = stream_lookup(pep, t, id);
+   if (!s)
+      return 1;
+
+   switch (type) {
+      case PEP_DATA:
+         if (s->flags & PEP_S_WR_EOF)
+            return 1;
+         if (s->out.len + len > PEP_STREAM_BUFFER) {
+            if (stream_flush(pep, s) < 0)
+               return 1;
+            if (s->out.len + len > PEP_STREAM_BUFFER) {
+               t->stall     = s->key;
+               t->stall_len = len;
+               return 0;
+            }
+         }
+         buf_reserve(&s->out, len);
+         memcpy(s->out.data + s->out.off + s->out.len, payload, len);
+         s->out.len += len;
+         if (stream_flush(pep, s) == 0)
+            stream_update(pep, s);
+         return 1;
+      case PEP_FIN:
+         s->flags |= PEP_S_WR_EOF;
+         if (stream_flush(pep, s) == 0 && !stream_done(pep, s))
+            stream_update(pep, s);
+         return 1;
+      case PEP_RST:
+         pep->resets++;
+         stream_free(pep, s, 1);
+         return 1;
+   }
+   return 1;
+}
+
+void trunk_flush(struct pep *pep, struct pep_trunk *t) {
+   while (t->out.len) {
+      ssize_t n = send(t->fd, t->out.data + t->out.off, t->out.len,
+                       MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+         trunk_close(pep, t, 1);
+         return;
+      }
+      buf_consume(&t->out, n);
+      t->bytes_out += n;
+   }
+
+   /* resume the streams paused on the full buffer */
+   if (t->paused && t->out.len < pep->buffer / 2) {
+      int ti = t - pep->trunks;
+      for (uint32_t i=0; i<PEP_MAX_STREAMS; i++) {
+         struct pep_stream *s = &pep->streams[i];
+         if (s->fd >= 0 && s->trunk == ti && (s->flags & PEP_S_PAUSED)) {
+            s->flags &= ~PEP_S_PAUSED;
+            stream_update(pep, s);
+         }
+      }
+      t->paused = 0;
+   }
+}
+
+uint32_t stream_alloc(struct pep *pep) {
+   uint32_t slot = pep->free_head;
+   if (slot == PEP_MAX_STREAMS)
+      return slot;
+   struct pep_stream *s = &pep->streams[slot];
+   pep->free_head = s->next;
+
+   /* keys are never 0, the trunks use 0 for no stall */
+   uint16_t gen = (s->key >> 16) + 1;
+   if (!gen)
+      gen = 1;
+   s->key    = slot | (uint32_t)gen << 16;
+   s->flags  = 0;
+   s->events = 0;
+   return slot;
+}
+
+struct pep_stream *stream_lookup(struct pep *pep, struct pep_trunk *t,
+                                 uint32_t id) {
+   uint32_t lo = id & 0xffff, slot = lo;
+   if (lo >= PEP_MAX_STREAMS)
+      return NULL;
+   if (t->peer < 0) {
+      if (!t->map[lo])
+         return NULL;
+      slot = t->map[lo] - 1;
+   }
+   struct pep_stream *s = &pep->streams[slot];
+   if (s->fd < 0 || s->id != id || &pep->trunks[s->trunk] != t)
+      return NULL;
+   return s;
+}
+
+void stream_local(struct pep *pep, int c, int peer) {
+   struct sockaddr_storage dst;
+   socklen_t len = sizeof(dst);
+   if (peer == PEP_LISTEN_TPROXY) {
+      /* TPROXY: the local address is the original destination */
+      if (getsockname(c, (struct sockaddr *)&dst, &len) < 0 ||
+            (peer = pep_route(pep, (struct sockaddr *)&dst)) < 0)
+         goto refuse;
+   } else {
+      struct tun_rec *rec = rec_get(pep->state, pep->state->cli_private[peer]);
+      if (pep->v6)
+         memcpy(&dst, &rec->sa6, sizeof(struct sockaddr_in6));
+      else
+         memcpy(&dst, &rec->sa4, sizeof(struct sockaddr_in));
+   }
+
+   int ti = trunk_get(pep, peer);
+   uint32_t slot = ti < 0 ? PEP_MAX_STREAMS : stream_alloc(pep);
+   if (slot == PEP_MAX_STREAMS)
+      goto refuse;
+
+   struct pep_stream *s = &pep->streams[slot];
+   char open[20];
+   s->fd     = c;
+   s->id     = s->key;
+   s->trunk  = ti;
+   s->events = stream_events(s);
+   put_frame(&pep->trunks[ti].out, s->id, PEP_OPEN, open, put_addr(open, &dst));
+   pep_ctl(pep, EPOLL_CTL_ADD, c, s->events, s->key);
+   pep->opened++;
+   return;
+
+refuse:
+   pep->refused++;
+   close_fd(c);
+}
+
+void stream_open(struct pep *pep, struct pep_trunk *t, uint32_t id,
+                 const char *payload, uint16_t len) {
+   struct sockaddr_storage dst;
+   socklen_t salen;
+   int c = -1;
+
+   /* streams are opened by the side that terminated the connection */
+   if (t->peer >= 0 || (id & 0xffff) >= PEP_MAX_STREAMS ||
+         pep->free_head == PEP_MAX_STREAMS ||
+         get_addr(payload, len, &dst, &salen) < 0)
+      goto refuse;
+   if ((c=socket(dst.ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0)
+      goto refuse;
+   set_fd(c);
+   set_nonblock(c);
+   if (connect(c, (struct sockaddr *)&dst, salen) < 0 && errno != EINPROGRESS) {
+      pep->connect_failed++;
+      close_fd(c);
+      goto refuse;
+   }
+
+   uint32_t slot = stream_alloc(pep);
+   struct pep_stream *s = &pep->streams[slot];
+   s->fd     = c;
+   s->id     = id;
+   s->trunk  = t - pep->trunks;
+   s->flags  = PEP_S_CONNECTING;
+   s->events = stream_events(s);
+   t->map[id & 0xffff] = slot + 1;
+   pep_ctl(pep, EPOLL_CTL_ADD, c, s->events, s->key);
+   pep->accepted++;
+   return;
+
+refuse:
+   pep->refused++;
+   put_frame(&t->out, id, PEP_RST, NULL, 0);
+}
+
+uint32_t stream_events(struct pep_stream *s) {
+   uint32_t ev = 0;
+   if (s->flags & PEP_S_CONNECTING)
+      return EPOLLOUT;
+   if (!(s->flags & (PEP_S_RD_EOF | PEP_S_PAUSED)))
+      ev |= EPOLLIN;
+   if (s->out.len)
+      ev |= EPOLLOUT;
+   return ev;
+}
+
+void stream_update(struct pep *pep, struct pep_stream *s) {
+   uint32_t ev = stream_events(s);
+   if (ev == s->events)
+      return;
+   pep_ctl(pep, EPOLL_CTL_MOD, s->fd, ev, s->key);
+   s->events = ev;
+}
+
+void stream_event(struct pep *pep, struct pep_stream *s, uint32_t ev) {
+   if (s->flags & PEP_S_CONNECTING) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+         err = errno;
+      if (err) {
+         pep->connect_failed++;
+         stream_reset(pep, s);
+         return;
+      }
+      s->flags &= ~PEP_S_CONNECTING;
+   } else if (ev & EPOLLERR) {
+      stream_reset(pep, s);
+      return;
+   }
+
+   if (stream_flush(pep, s) < 0)
+      return;
+   if ((ev & (EPOLLIN | EPOLLHUP)) &&
+         !(s->flags & (PEP_S_RD_EOF | PEP_S_PAUSED)) && stream_read(pep, s) < 0)
+      return;
+   if (!stream_done(pep, s))
+      stream_update(pep, s);
+}
+
+int stream_read(struct pep *pep, struct pep_stream *s) {
+   struct pep_trunk *t = &pep->trunks[s->trunk];
+   for (int i=0; i<4; i++) {
+      if (t->out.len >= pep->buffer) {
+         s->flags |= PEP_S_PAUSED;
+         t->paused++;
+         pep->pauses++;
+         return 0;
+      }
+      uint32_t room = pep->buffer - t->out.len;
+      if (room > PEP_FRAME)
+         room = PEP_FRAME;
+
+      /* read in place, after the frame header */
+      buf_reserve(&t->out, PEP_HDR + room);
+      char *p = t->out.data + t->out.off + t->out.len;
+      ssize_t n = recv(s->fd, p + PEP_HDR, room, 0);
+      if (n > 0) {
+         put_hdr(p, s->id, n, PEP_DATA);
+         t->out.len += PEP_HDR + n;
+         if ((uint32_t)n < room)
+            return 0;
+      } else if (n == 0) {
+         put_frame(&t->out, s->id, PEP_FIN, NULL, 0);
+         s->flags |= PEP_S_RD_EOF;
+         return 0;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+         return 0;
+      } else {
+         stream_reset(pep, s);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+int stream_flush(struct pep *pep, struct pep_stream *s) {
+   if (s->flags & PEP_S_CONNECTING)
+      return 0;
+   while (s->out.len) {
+      ssize_t n = send(s->fd, s->out.data + s->out.off, s->out.len,
+                       MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         stream_reset(pep, s);
+         return -1;
+      }
+      buf_consume(&s->out, n);
+   }
+   if ((s->flags & (PEP_S_WR_EOF | PEP_S_SHUT)) == PEP_S_WR_EOF) {
+      shutdown(s->fd, SHUT_WR);
+      s->flags |= PEP_S_SHUT;
+   }
+   return 0;
+}
+
+int stream_done(struct pep *pep, struct pep_stream *s) {
+   if ((s->flags & (PEP_S_RD_EOF | PEP_S_SHUT)) != (PEP_S_RD_EOF | PEP_S_SHUT)
+         || s->out.len)
+      return 0;
+   pep->closed++;
+   stream_free(pep, s, 0);
+   return 1;
+}
+
+void stream_reset(struct pep *pep, struct pep_stream *s) {
+   struct pep_trunk *t = &pep->trunks[s->trunk];
+   if (t->fd >= 0)
+      put_frame(&t->out, s->id, PEP_RST, NULL, 0);
+   pep->resets++;
+   stream_free(pep, s, 1);
+}
+
+void stream_free(struct pep *pep, struct pep_stream *s, int abort) {
+   struct pep_trunk *t = &pep->trunks[s->trunk];
+   uint32_t slot = s - pep->streams;
+   if (abort) {
+      struct linger l = {1, 0};
+      setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+   }
+   close_fd(s->fd);
+   s->fd = -1;
+   if (t->peer < 0 && t->map && t->map[s->id & 0xffff] == slot + 1)
+      t->map[s->id & 0xffff] = 0;
+   s->out.off = s->out.len = 0;
+   s->flags   = 0;
+   s->next    = pep->free_head;
+   pep->free_head = slot;
+}
+
+void pep_stats(FILE *fp, void *arg) {
+   struct pep *pep = arg;
+   uint32_t active = 0;
+   for (uint32_t i=0; i<PEP_MAX_STREAMS; i++)
+      if (pep->streams[i].fd >= 0)
+         active++;
+   fprintf(fp, "streams.active %u\n", active);
+   fprintf(fp, "streams.opened %llu\n", (unsigned long long)pep->opened);
+   fprintf(fp, "streams.accepted %llu\n", (unsigned long long)pep->accepted);
+   fprintf(fp, "streams.closed %llu\n", (unsigned long long)pep->closed);
+   fprintf(fp, "streams.resets %llu\n", (unsigned long long)pep->resets);
+   fprintf(fp, "streams.refused %llu\n", (unsigned long long)pep->refused);
+   fprintf(fp, "streams.connect_failed %llu\n",
+           (unsigned long long)pep->connect_failed);
+   fprintf(fp, "streams.pauses %llu\n", (unsigned long long)pep->pauses);
+   fprintf(fp, "trunks.opened %llu\n", (unsigned long long)pep->trunks_opened);
+   fprintf(fp, "trunks.accepted %llu\n",
+           (unsigned long long)pep->trunks_accepted);
+   fprintf(fp, "trunks.failed %llu\n", (unsigned long long)pep->trunks_failed);
+   for (int i=0; i<PEP_MAX_TRUNKS; i++) {
+      struct pep_trunk *t = &pep->trunks[i];
+      if (t->fd < 0)
+         continue;
+      fprintf(fp, "trunk%d.peer %d\n", i, t->peer);
+      fprintf(fp, "trunk%d.bytes_in %llu\n", i, (unsigned long long)t->bytes_in);
+      fprintf(fp, "trunk%d.bytes_out %llu\n", i, (unsigned long long)t->bytes_out);
+      fprintf(fp, "trunk%d.stalls %llu\n", i, (unsigned long long)t->stalls);
+   }
+}
+
+#else
+
+void init_pep(struct tun_state *state) {
+   if (!state->pep_port)
+      return;
+   errno=ENOSYS;
+   die("pep requires epoll");
+}
+
+void free_pep(struct pep *UNUSED(pep)) {}
+
+#endif
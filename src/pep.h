@@ -0,0 +1,196 @@
+/**
+ * \file pep.h
+ * \brief Split-TCP performance-enhancing proxy.
+ *
+ *    With pep-port set, the endpoints terminate inner TCP connections
+ *    locally and carry their byte streams to the peer over a trunk, a
+ *    single TCP connection per peer opened through the tunnel to the
+ *    peer private address and pep-port. The far side re-originates each
+ *    connection to its original destination, so that each half runs its
+ *    own loss recovery over part of the path while the trunk is the one
+ *    congestion-controlled transport of the streams (pep-cc).
+ *
+ *    Connections are terminated either on explicit loopback listeners,
+ *    one per peer at pep-local-port + 1 + index, forwarded to that peer
+ *    private address and server port, or, with pep-tproxy, on an
+ *    IP_TRANSPARENT listener at pep-local-port fed by TPROXY rules and
+ *    forwarded to the original destination through the peer owning it.
+ *
+ *    Streams are multiplexed in frames (stream id, length, type) and are
+ *    opened by the side that terminated the connection only. The trunk
+ *    is read while the destination stream takes its data, a stream that
+ *    does not drain stalls the others (head-of-line blocking). Reading
+ *    of the terminated connections pauses while the trunk buffer holds
+ *    pep-buffer bytes. The proxy runs in one epoll thread and reports in
+ *    the "pep" stats section.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_PEP_H
+#define UDPTUN_PEP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "state.h"
+
+/**
+ * \def PEP_MAX_STREAMS
+ * \brief The maximal amount of concurrent streams.
+ */
+#define PEP_MAX_STREAMS 1024
+
+/**
+ * \def PEP_MAX_TRUNKS
+ * \brief The maximal amount of trunks (opened and accepted).
+ */
+#define PEP_MAX_TRUNKS 64
+
+/**
+ * \def PEP_FRAME
+ * \brief The maximal frame payload (bytes).
+ */
+#define PEP_FRAME 16384
+
+/**
+ * \def PEP_HDR
+ * \brief The frame header length: stream id (4), length (2), type (1), pad (1).
+ */
+#define PEP_HDR 8
+
+/**
+ * \def PEP_STREAM_BUFFER
+ * \brief The trunk to socket buffer of a stream (bytes).
+ */
+#define PEP_STREAM_BUFFER (4 * PEP_FRAME)
+
+/**
+ * \def PEP_DEFAULT_BUFFER
+ * \brief The default socket to trunk buffer of a trunk (bytes).
+ */
+#define PEP_DEFAULT_BUFFER (1 << 20)
+
+/**
+ * \def PEP_EVENTS
+ * \brief The amount of events handled per epoll_wait() call.
+ */
+#define PEP_EVENTS 64
+
+/**
+ * \enum pep_type
+ * \brief The frame types.
+ */
+enum pep_type {
+   PEP_OPEN = 1,  /*!< Open a stream, the payload is the destination */
+   PEP_DATA,      /*!< Stream data */
+   PEP_FIN,       /*!< End of the stream data */
+   PEP_RST,       /*!< Abort the stream */
+};
+
+/**
+ * \struct pep_buf
+ *	\brief A byte buffer, the data is [off, off+len).
+ */
+struct pep_buf {
+   char    *data;
+   uint32_t off;
+   uint32_t len;
+   uint32_t size;
+};
+
+/**
+ * \struct pep_stream
+ *	\brief A proxied connection.
+ */
+struct pep_stream {
+   int      fd;          /*!< The terminated or re-originated socket, -1 if free */
+   uint32_t key;         /*!< Slot and generation, filters stale events */
+   uint32_t id;          /*!< The stream id on the trunk */
+   int16_t  trunk;       /*!< The trunk index */
+   uint8_t  flags;       /*!< PEP_S_* */
+   uint32_t events;      /*!< The registered epoll events */
+   struct pep_buf out;   /*!< Trunk to socket data */
+   uint32_t next;        /*!< The next free slot */
+};
+
+/**
+ * \struct pep_trunk
+ *	\brief A multiplexed connection to a peer.
+ */
+struct pep_trunk {
+   int       fd;         /*!< The socket, -1 if unused */
+   uint16_t  gen;        /*!< Generation, filters stale events */
+   int16_t   peer;       /*!< The peer index (opened), -1 if accepted */
+   uint8_t   connected;  /*!< connect() completed */
+   uint32_t  events;     /*!< The registered epoll events */
+   uint32_t  stall;      /*!< Key of the stream reading is stalled on, 0 if none */
+   uint32_t  stall_len;  /*!< The room the stalled frame needs */
+   uint32_t  paused;     /*!< Streams paused on the full buffer */
+   uint16_t *map;        /*!< Accepted: low 16 bits of the stream id -> slot+1 */
+   struct pep_buf in;    /*!< Received frames */
+   struct pep_buf out;   /*!< Frames to send */
+   uint64_t  bytes_in;   /*!< Bytes received */
+   uint64_t  bytes_out;  /*!< Bytes sent */
+   uint64_t  stalls;     /*!< Reading stalls on a stream (head-of-line) */
+};
+
+/**
+ * \struct pep
+ *	\brief The proxy.
+ */
+struct pep {
+   struct tun_state  *state;
+   int                ep;            /*!< The epoll fd */
+   int                v6;            /*!< Trunks and explicit listeners over IPv6 */
+   uint32_t           buffer;        /*!< The trunk buffer limit (bytes) */
+   int               *listen_fd;     /*!< Listening sockets */
+   int               *listen_peer;   /*!< Listener kind: peer index, -1 TPROXY, -2 trunk */
+   int                listen_len;
+   int               *peer_trunk;    /*!< Opened trunk per peer, -1 if none */
+   struct pep_stream *streams;
+   uint32_t           free_head;
+   struct pep_trunk   trunks[PEP_MAX_TRUNKS];
+
+   uint64_t           opened;        /*!< Connections terminated here */
+   uint64_t           accepted;      /*!< Connections re-originated here */
+   uint64_t           closed;        /*!< Streams closed cleanly */
+   uint64_t           resets;        /*!< Streams aborted */
+   uint64_t           refused;       /*!< Connections refused (no route, slot or trunk) */
+   uint64_t           connect_failed;/*!< Re-originations that failed */
+   uint64_t           trunks_opened;
+   uint64_t           trunks_accepted;
+   uint64_t           trunks_failed; /*!< Trunks closed on an error */
+   uint64_t           pauses;        /*!< Streams paused on a full trunk buffer */
+};
+
+/**
+ * \fn static inline int pep_local_port(struct tun_state *state, int index)
+ * \brief The local listener port of a peer, -1 for the TPROXY listener.
+ */
+static inline int pep_local_port(struct tun_state *state, int index) {
+   int port = state->pep_local_port ? state->pep_local_port
+                                    : state->pep_port + 1;
+   return port + 1 + index;
+}
+
+/**
+ * \fn void init_pep(struct tun_state *state)
+ * \brief Bind the proxy listeners and start its thread, once, if
+ *        pep-port is set. Call after the tun interface is up.
+ *
+ * \param state The program state
+ */
+void init_pep(struct tun_state *state);
+
+/**
+ * \fn void free_pep(struct pep *pep)
+ * \brief Free the proxy, its thread must be canceled and its fds
+ *        closed (garbage collector).
+ *
+ * \param pep The proxy
+ */
+void free_pep(struct pep *pep);
+
+#endif
@@ -0,0 +1,248 @@
+/**
+ * \file perf.c
+ * \brief Per-stage hardware counters (perf_event_open).
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <sys/syscall.h>
+#  include <linux/perf_event.h>
+#endif
+
+#include "perf.h"
+#include "debug.h"
+#include "stats.h"
+#include "destruct.h"
+
+/**
+ * \def PERF_CALIBRATION
+ * \brief The amount of empty measurements at thread start.
+ */
+#define PERF_CALIBRATION 64
+
+volatile int perf_on;
+
+/**
+ * \var static uint32_t sample
+ * \brief Measure one call out of sample per stage, 0 if disabled.
+ */
+static uint32_t sample;
+
+/**
+ * \var static struct perf_thread threads[]
+ * \brief The profiled threads.
+ */
+static struct perf_thread threads[PERF_MAX_THREADS];
+
+/**
+ * \var static int threads_len
+ * \brief The amount of profiled threads.
+ */
+static int threads_len;
+
+/**
+ * \var static pthread_mutex_t lock
+ * \brief Protects threads and threads_len.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \var static __thread struct perf_thread *self
+ * \brief The counters of the calling thread, NULL if not profiled.
+ */
+static __thread struct perf_thread *self;
+
+/**
+ * \var static const char *stage_names[]
+ * \brief The stage names in stats.
+ */
+static const char *stage_names[PERF_STAGES] = {
+   "tun_read", "classify", "lookup", "encap",
+   "send", "recv", "decap", "tun_write",
+};
+
+/**
+ * \fn static int open_group(struct perf_thread *t, int user_only)
+ * \brief Open the counter group of the calling thread.
+ *
+ * \return 0 for success, -1 if the leader could not be opened
+ */
+static int open_group(struct perf_thread *t, int user_only);
+
+/**
+ * \fn static int read_group(struct perf_thread *t, uint64_t *val)
+ * \brief Read the counter values, 0 for missing events.
+ *
+ * \return 0 for success, -1 on error
+ */
+static int read_group(struct perf_thread *t, uint64_t *val);
+
+/**
+ * \fn static void toggle(int sig)
+ * \brief SIGUSR2 handler, start or stop sampling.
+ */
+static void toggle(int sig);
+
+/**
+ * \fn static void perf_stats(FILE *fp, void *arg)
+ * \brief Dump the per packet counters of each thread and stage.
+ */
+static void perf_stats(FILE *fp, void *arg);
+
+void init_perf(uint32_t period) {
+   if (!(sample = period))
+      return;
+   perf_on = 1;
+   signal(SIGUSR2, toggle);
+   stats_register("perf", perf_stats, NULL);
+}
+
+void toggle(int UNUSED(sig)) {
+   perf_on = !perf_on;
+}
+
+int open_group(struct perf_thread *t, int user_only) {
+#if defined(LINUX_OS)
+   static const struct { uint32_t type; uint64_t config; } events[PERF_EVENTS] = {
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+   };
+
+   t->fd = -1;
+   t->nr = 0;
+   for (int e=0; e<PERF_EVENTS; e++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size           = sizeof(attr);
+      attr.type           = events[e].type;
+      attr.config         = events[e].config;
+      attr.read_format    = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = user_only;
+      attr.exclude_hv     = 1;
+
+      int fd = syscall(__NR_perf_event_open, &attr, 0, -1, t->fd, 0);
+      if (fd < 0) {
+         /* the leader is mandatory, members are optional */
+         if (t->fd < 0)
+            return -1;
+         t->idx[e] = -1;
+         continue;
+      }
+      set_fd(fd);
+      if (t->fd < 0)
+         t->fd = fd;
+      t->idx[e] = t->nr++;
+   }
+   return 0;
+#else
+   errno=ENOSYS;
+   return -1;
+#endif
+}
+
+int read_group(struct perf_thread *t, uint64_t *val) {
+   uint64_t buf[1 + PERF_EVENTS];
+   if (read(t->fd, buf, sizeof(buf)) < (ssize_t)(sizeof(uint64_t) * (1 + t->nr)))
+      return -1;
+   for (int e=0; e<PERF_EVENTS; e++)
+      val[e] = t->idx[e] >= 0 ? buf[1 + t->idx[e]] : 0;
+   return 0;
+}
+
+void perf_thread(const char *name) {
+   struct perf_thread t;
+   if (!sample)
+      return;
+   memset(&t, 0, sizeof(struct perf_thread));
+   strncpy(t.name, name, sizeof(t.name) - 1);
+
+   /* kernel time counts (send, recv), unless not permitted */
+   if (open_group(&t, 0) < 0 && open_group(&t, 1) < 0) {
+      debug_print("perf: %s: perf_event_open: %s\n", name, strerror(errno));
+      return;
+   }
+
+   /* cost of a measurement, subtracted from each sample */
+   uint64_t a[PERF_EVENTS], b[PERF_EVENTS];
+   for (int e=0; e<PERF_EVENTS; e++)
+      t.base[e] = UINT64_MAX;
+   for (int i=0; i<PERF_CALIBRATION; i++) {
+      if (read_group(&t, a) < 0 || read_group(&t, b) < 0)
+         return;
+      for (int e=0; e<PERF_EVENTS; e++)
+         if (b[e] - a[e] < t.base[e])
+            t.base[e] = b[e] - a[e];
+   }
+
+   pthread_mutex_lock(&lock);
+   if (threads_len < PERF_MAX_THREADS) {
+      threads[threads_len] = t;
+      self = &threads[threads_len++];
+   }
+   pthread_mutex_unlock(&lock);
+   debug_print("perf: profiling %s (%d events)\n", name, t.nr);
+}
+
+void perf_begin(enum perf_stage stage) {
+   struct perf_thread *t = self;
+   if (!t || t->tick[stage]++ % sample)
+      return;
+   if (!read_group(t, t->start))
+      t->active = stage + 1;
+}
+
+void perf_end(enum perf_stage stage, int pkts) {
+   struct perf_thread *t = self;
+   uint64_t now[PERF_EVENTS];
+   if (!t || t->active != stage + 1)
+      return;
+   t->active = 0;
+   if (read_group(t, now) < 0)
+      return;
+
+   struct perf_acc *acc = &t->acc[stage];
+   for (int e=0; e<PERF_EVENTS; e++) {
+      uint64_t d = now[e] - t->start[e];
+      acc->val[e] += d > t->base[e] ? d - t->base[e] : 0;
+   }
+   acc->samples++;
+   acc->pkts += pkts;
+}
+
+void perf_stats(FILE *fp, void *UNUSED(arg)) {
+   fprintf(fp, "sample %u\n", sample);
+   fprintf(fp, "enabled %d\n", perf_on);
+   for (int i=0; i<threads_len; i++) {
+      struct perf_thread *t = &threads[i];
+      for (int s=0; s<PERF_STAGES; s++) {
+         struct perf_acc *acc = &t->acc[s];
+         if (!acc->pkts)
+            continue;
+         const char *n = stage_names[s];
+         double pkts = acc->pkts;
+         fprintf(fp, "%s.%s.samples %llu\n", t->name, n,
+                 (unsigned long long)acc->samples);
+         fprintf(fp, "%s.%s.pkts %llu\n", t->name, n,
+                 (unsigned long long)acc->pkts);
+         fprintf(fp, "%s.%s.cycles %.1f\n", t->name, n, acc->val[0] / pkts);
+         fprintf(fp, "%s.%s.instructions %.1f\n", t->name, n, acc->val[1] / pkts);
+         fprintf(fp, "%s.%s.ipc %.2f\n", t->name, n, acc->val[0] ?
+                 (double)acc->val[1] / acc->val[0] : 0);
+         fprintf(fp, "%s.%s.l1d_misses %.2f\n", t->name, n, acc->val[2] / pkts);
+         fprintf(fp, "%s.%s.llc_misses %.2f\n", t->name, n, acc->val[3] / pkts);
+      }
+   }
+}
@@ -0,0 +1,123 @@
+/**
+ * \file perf.h
+ * \brief Per-stage hardware counters (perf_event_open).
+ *
+ *    Each forwarding thread opens one counter group (cycles,
+ *    instructions, L1D read misses, LLC misses) on itself. The
+ *    forwarding stages are bracketed by PERF_BEGIN/PERF_END; one call
+ *    out of perf-sample per stage reads the group before and after the
+ *    stage and accumulates the difference, minus the calibrated cost
+ *    of an empty measurement. Counters are reported per packet in the
+ *    "perf" stats section. Sampling is toggled at runtime with SIGUSR2.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_PERF_H
+#define UDPTUN_PERF_H
+
+#include <stdint.h>
+
+/**
+ * \def PERF_MAX_THREADS
+ * \brief The maximal amount of profiled threads.
+ */
+#define PERF_MAX_THREADS 32
+
+/**
+ * \def PERF_EVENTS
+ * \brief The amount of counters per group.
+ */
+#define PERF_EVENTS 4
+
+/**
+ * \enum perf_stage
+ * \brief The forwarding stages.
+ */
+enum perf_stage {
+   PERF_TUN_READ = 0, /*!< read from tun */
+   PERF_CLASSIFY,     /*!< IP version, layer 4.5 header */
+   PERF_LOOKUP,       /*!< peer lookup */
+   PERF_ENCAP,        /*!< outer header and source port */
+   PERF_SEND,         /*!< socket send */
+   PERF_RECV,         /*!< socket receive */
+   PERF_DECAP,        /*!< outer header removal, ECN */
+   PERF_TUN_WRITE,    /*!< write to tun */
+   PERF_STAGES,
+};
+
+/**
+ * \struct perf_acc
+ *	\brief The accumulated counters of a stage.
+ */
+struct perf_acc {
+   uint64_t samples;             /*!< Sampled stage executions */
+   uint64_t pkts;                /*!< Packets in the samples */
+   uint64_t val[PERF_EVENTS];    /*!< Counter sums */
+};
+
+/**
+ * \struct perf_thread
+ *	\brief The counters of a thread.
+ */
+struct perf_thread {
+   char     name[16];                 /*!< The thread name */
+   int      fd;                       /*!< The group leader fd */
+   int      idx[PERF_EVENTS];         /*!< Read position of each event, -1 if absent */
+   int      nr;                       /*!< Amount of opened events */
+   uint64_t base[PERF_EVENTS];        /*!< Cost of an empty measurement */
+   uint64_t start[PERF_EVENTS];       /*!< Values at PERF_BEGIN */
+   uint32_t tick[PERF_STAGES];        /*!< Calls per stage */
+   uint8_t  active;                   /*!< The stage being sampled + 1, 0 if none */
+   struct perf_acc acc[PERF_STAGES];  /*!< The accumulated counters */
+};
+
+/**
+ * \var volatile int perf_on
+ * \brief 1 if sampling, checked inline by PERF_BEGIN/PERF_END.
+ */
+extern volatile int perf_on;
+
+/**
+ * \def PERF_BEGIN
+ * \brief Start measuring a stage.
+ */
+#define PERF_BEGIN(stage) do { if (perf_on) perf_begin(stage); } while (0)
+
+/**
+ * \def PERF_END
+ * \brief Stop measuring a stage of pkts packets.
+ */
+#define PERF_END(stage, pkts) do { if (perf_on) perf_end(stage, pkts); } while (0)
+
+/**
+ * \fn void init_perf(uint32_t sample)
+ * \brief Set the sampling period, install the SIGUSR2 toggle and
+ *        register the stats section.
+ *
+ * \param sample Measure one call out of sample per stage, 0 to disable
+ */
+void init_perf(uint32_t sample);
+
+/**
+ * \fn void perf_thread(const char *name)
+ * \brief Open and calibrate the counters of the calling thread.
+ *
+ * \param name The thread name in stats
+ */
+void perf_thread(const char *name);
+
+/**
+ * \fn void perf_begin(enum perf_stage stage)
+ * \brief Read the counters if this call of the stage is sampled.
+ */
+void perf_begin(enum perf_stage stage);
+
+/**
+ * \fn void perf_end(enum perf_stage stage, int pkts)
+ * \brief Read the counters and accumulate the stage cost.
+ */
+void perf_end(enum perf_stage stage, int pkts);
+
+#endif
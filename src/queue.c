@@ -0,0 +1,265 @@
+/**
+ * \file queue.c
+ * \brief Bounded retry queues for non-blocking writes.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "queue.h"
+#include "debug.h"
+#include "sock.h"
+#include "stats.h"
+#include "sockbuf.h"
+#include "txring.h"
+#include "impair.h"
+#include "batch.h"
+#include "udptun.h"
+
+/**
+ * \fn static int xmit(int fd, struct sockaddr *sa, socklen_t salen, int tos, char *buf, int len)
+ * \brief write or sendto, depending on salen. A TOS is passed as a
+ *        IP_TOS/IPV6_TCLASS control message.
+ *
+ * \return The amount of bytes written, -1 on error (errno is filled)
+ */
+static int xmit(int fd, struct sockaddr *sa, socklen_t salen, int tos,
+                char *buf, int len);
+
+/**
+ * \fn static int would_block(int err)
+ * \brief Check if a write error is transient.
+ *
+ * \param err The errno value
+ * \return 1 if the packet should be retried, 0 otherwise
+ */
+static int would_block(int err);
+
+/**
+ * \fn static int enqueue(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa, socklen_t salen, int tos, char *buf, int len)
+ * \brief Copy a packet at the tail of the queue, or drop it.
+ *
+ * \return 0 if queued, -1 if dropped
+ */
+static int enqueue(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa,
+                   socklen_t salen, int tos, char *buf, int len);
+
+/**
+ * \fn static int queue_push(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa, socklen_t salen, int tos, char *buf, int len)
+ * \brief Impair a packet, then write it or queue it.
+ *
+ * \return The amount of bytes written, 0 if queued, -1 if dropped
+ */
+static int queue_push(struct pkt_queue *q, int fd, int peer,
+                      struct sockaddr *sa, socklen_t salen, int tos,
+                      char *buf, int len);
+
+/**
+ * \fn static void queue_stats(FILE *fp, void *arg)
+ * \brief Dump the queue counters.
+ */
+static void queue_stats(FILE *fp, void *arg);
+
+struct pkt_queue *init_queue(uint32_t size, enum queue_policy policy,
+                             const char *name) {
+   struct pkt_queue *q = calloc(1, sizeof(struct pkt_queue));
+   q->size     = size ? size : QUEUE_DEFAULT_LEN;
+   q->policy   = policy;
+   q->slots    = calloc(q->size, sizeof(struct pkt_slot));
+   q->peer_len = calloc(QUEUE_MAX_PEER, sizeof(uint16_t));
+   for (uint32_t i=0; i<q->size; i++)
+      q->slots[i].data = xmalloc(BUFF_SIZE);
+
+   if (name)
+      stats_register(name, queue_stats, q);
+   return q;
+}
+
+void free_queue(struct pkt_queue *q) {
+   for (uint32_t i=0; i<q->size; i++)
+      free(q->slots[i].data);
+   free(q->slots);
+   free(q->peer_len);
+   free(q);
+}
+
+int xmit(int fd, struct sockaddr *sa, socklen_t salen, int tos,
+         char *buf, int len) {
+   if (!salen)
+      return write(fd, buf, len);
+   if (tos < 0)
+      return sendto(fd, buf, len, 0, sa, salen);
+
+   char control[CMSG_SPACE(sizeof(int))];
+   struct iovec iov = { .iov_base = buf, .iov_len = len };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_name       = sa;
+   msg.msg_namelen    = salen;
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_control    = control;
+   msg.msg_controllen = sizeof(control);
+
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+   if (sa->sa_family == AF_INET6) {
+      cmsg->cmsg_level = IPPROTO_IPV6;
+      cmsg->cmsg_type  = IPV6_TCLASS;
+   } else {
+      cmsg->cmsg_level = IPPROTO_IP;
+      cmsg->cmsg_type  = IP_TOS;
+   }
+   memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+   return sendmsg(fd, &msg, 0);
+}
+
+int would_block(int err) {
+   return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+int enqueue(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa,
+            socklen_t salen, int tos, char *buf, int len) {
+   uint16_t id = peer;
+
+   /* drop policy */
+   if (q->len == q->size || len > BUFF_SIZE) {
+      q->dropped++;
+      return -1;
+   }
+   if (q->policy == QUEUE_FAIR_DROP) {
+      uint32_t peers = q->peers + (q->peer_len[id] ? 0 : 1);
+      if (q->peer_len[id] >= q->size / peers) {
+         q->dropped++;
+         return -1;
+      }
+   }
+
+   /* copy packet */
+   struct pkt_slot *slot = &q->slots[(q->head + q->len) % q->size];
+   slot->fd    = fd;
+   slot->peer  = id;
+   slot->len   = len;
+   slot->salen = salen;
+   slot->tos   = tos;
+   if (salen)
+      memcpy(&slot->sa, sa, salen);
+   memcpy(slot->data, buf, len);
+
+   if (!q->peer_len[id]++)
+      q->peers++;
+   q->len++;
+   q->enqueued++;
+   q->max_len = max(q->max_len, q->len);
+   return 0;
+}
+
+int queue_push(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa,
+               socklen_t salen, int tos, char *buf, int len) {
+   if (q->imp) {
+      int ret = impair_push(q->imp, fd, peer, sa, salen, tos, buf, len);
+      if (ret <= 0)
+         return ret;
+   }
+   return queue_send_now(q, fd, peer, sa, salen, tos, buf, len);
+}
+
+int queue_send_now(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa,
+                   socklen_t salen, int tos, char *buf, int len) {
+   /* keep ordering behind queued packets */
+   if (!q->len) {
+      if (q->ring && salen && txring_send(q->ring, sa, tos, buf, len) >= 0) {
+         q->direct++;
+         return len;
+      }
+      int sent = xmit(fd, sa, salen, tos, buf, len);
+      if (sent >= 0) {
+         q->direct++;
+         return sent;
+      }
+      if (!would_block(errno)) {
+         debug_print("write: %s\n", strerror(errno));
+         q->errors++;
+         return -1;
+      }
+      if (salen)
+         sockbuf_tx_blocked(fd, errno);
+   }
+   return enqueue(q, fd, peer, sa, salen, tos, buf, len);
+}
+
+int queue_write(struct pkt_queue *q, int fd, int peer, char *buf, int len) {
+   return queue_push(q, fd, peer, NULL, 0, -1, buf, len);
+}
+
+int queue_sendto(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa,
+                 socklen_t salen, int tos, char *buf, int len) {
+   return queue_push(q, fd, peer, sa, salen, tos, buf, len);
+}
+
+void queue_flush(struct pkt_queue *q, fd_set *output_set) {
+   while (q->len) {
+      struct pkt_slot *slot = &q->slots[q->head];
+      if (!FD_ISSET(slot->fd, output_set))
+         break;
+
+      int sent = xmit(slot->fd, (struct sockaddr *)&slot->sa, slot->salen,
+                      slot->tos, slot->data, slot->len);
+      if (sent < 0 && would_block(errno)) {
+         if (slot->salen)
+            sockbuf_tx_blocked(slot->fd, errno);
+         break;
+      }
+      if (sent < 0) {
+         debug_print("write: %s\n", strerror(errno));
+         q->errors++;
+      } else
+         q->flushed++;
+
+      /* pop */
+      if (!--q->peer_len[slot->peer])
+         q->peers--;
+      q->head = (q->head + 1) % q->size;
+      q->len--;
+   }
+}
+
+int queue_fd_set(struct pkt_queue *q, fd_set *output_set) {
+   if (!q->len)
+      return 0;
+   int fd = q->slots[q->head].fd;
+   FD_SET(fd, output_set);
+   return fd;
+}
+
+int queues_fd_set(struct tun_state *state, fd_set *output_set) {
+   /* send the frames filled since the last select, if due */
+   batch_kick(state);
+   return max(queue_fd_set(state->txq_tun, output_set),
+              queue_fd_set(state->txq_net, output_set));
+}
+
+void queues_flush(struct tun_state *state, fd_set *output_set) {
+   queue_flush(state->txq_tun, output_set);
+   queue_flush(state->txq_net, output_set);
+}
+
+void queue_stats(FILE *fp, void *arg) {
+   struct pkt_queue *q = arg;
+   fprintf(fp, "policy %s\n", q->policy == QUEUE_FAIR_DROP ? "fair" : "tail");
+   fprintf(fp, "size %u\n", q->size);
+   fprintf(fp, "len %u\n", q->len);
+   fprintf(fp, "max_len %u\n", q->max_len);
+   fprintf(fp, "direct %llu\n", (unsigned long long)q->direct);
+   fprintf(fp, "enqueued %llu\n", (unsigned long long)q->enqueued);
+   fprintf(fp, "flushed %llu\n", (unsigned long long)q->flushed);
+   fprintf(fp, "dropped %llu\n", (unsigned long long)q->dropped);
+   fprintf(fp, "errors %llu\n", (unsigned long long)q->errors);
+}
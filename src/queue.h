@@ -0,0 +1,203 @@
+/**
+ * \file queue.h
+ * \brief Bounded retry queues for non-blocking tun writes and
+ *        socket sends.
+ *
+ *    Packets that can't be written right away (EAGAIN, ENOBUFS) are
+ *    copied to a per-direction FIFO, which is drained when the fds
+ *    become writable. When the queue is full (or the peer exceeds its
+ *    fair share with QUEUE_FAIR_DROP), packets are dropped.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_QUEUE_H
+#define UDPTUN_QUEUE_H
+
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "state.h"
+
+struct txring;
+struct impair;
+
+/**
+ * \def QUEUE_DEFAULT_LEN
+ * \brief The default queue length (packets).
+ */
+#define QUEUE_DEFAULT_LEN 64
+
+/**
+ * \def QUEUE_MAX_PEER
+ * \brief Peers are identified by their 16-bit port.
+ */
+#define QUEUE_MAX_PEER 65536
+
+/**
+ * \enum queue_policy
+ * \brief The drop policy of a full queue.
+ */
+enum queue_policy {
+   QUEUE_TAIL_DROP, /*!< drop when the queue is full */
+   QUEUE_FAIR_DROP  /*!< drop when the peer holds more than its share */
+};
+
+/**
+ * \struct pkt_slot
+ *	\brief A queued packet.
+ */
+struct pkt_slot {
+   int      fd;                  /*!< The destination fd */
+   uint16_t peer;                /*!< The peer id */
+   int      len;                 /*!< The packet length */
+   socklen_t salen;              /*!< The destination sockaddr length or 0 */
+   struct sockaddr_storage sa;   /*!< The destination sockaddr */
+   int      tos;                 /*!< The outer TOS/traffic class or -1 */
+   char    *data;                /*!< The packet */
+};
+
+/**
+ * \struct pkt_queue
+ *	\brief A bounded FIFO of packets.
+ */
+struct pkt_queue {
+   struct pkt_slot *slots;       /*!< The ring */
+   uint32_t size;                /*!< The ring size */
+   uint32_t head;                /*!< The oldest packet */
+   uint32_t len;                 /*!< The amount of queued packets */
+   uint32_t peers;               /*!< The amount of peers with queued packets */
+   uint16_t *peer_len;           /*!< Per-peer queued packets (fair drop) */
+   enum queue_policy policy;     /*!< The drop policy */
+
+   uint64_t direct;              /*!< Packets written without queuing */
+   uint64_t enqueued;            /*!< Packets queued */
+   uint64_t flushed;             /*!< Queued packets written */
+   uint64_t dropped;             /*!< Packets dropped by policy */
+   uint64_t errors;              /*!< Packets dropped on write errors */
+   uint32_t max_len;             /*!< Queue length high watermark */
+   struct txring *ring;          /*!< The raw mode TX ring or NULL */
+   struct impair *imp;           /*!< The impairments or NULL */
+};
+
+/**
+ * \fn struct pkt_queue *init_queue(uint32_t size, enum queue_policy policy, const char *name)
+ * \brief Allocate a queue and register its stats section.
+ *
+ * \param size The queue length
+ * \param policy The drop policy
+ * \param name The stats section name or NULL
+ * \return The queue
+ */
+struct pkt_queue *init_queue(uint32_t size, enum queue_policy policy,
+                             const char *name);
+
+/**
+ * \fn void free_queue(struct pkt_queue *q)
+ * \brief Free a queue.
+ *
+ * \param q The queue
+ */
+void free_queue(struct pkt_queue *q);
+
+/**
+ * \fn int queue_write(struct pkt_queue *q, int fd, int peer, char *buf, int len)
+ * \brief Write a packet to a (tun) fd, queue it if the fd would block.
+ *
+ * \param q The queue
+ * \param fd The fd
+ * \param peer The peer id
+ * \param buf The packet
+ * \param len The packet length
+ * \return The amount of bytes written, 0 if queued, -1 if dropped
+ */
+int queue_write(struct pkt_queue *q, int fd, int peer, char *buf, int len);
+
+/**
+ * \fn int queue_sendto(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa, socklen_t salen, int tos, char *buf, int len)
+ * \brief Send a datagram, queue it if the socket would block.
+ *
+ * \param q The queue
+ * \param fd The socket fd
+ * \param peer The peer id
+ * \param sa The destination
+ * \param salen The destination length
+ * \param tos The outer TOS/traffic class (see ecn_encap()), -1 for the
+ *            socket default
+ * \param buf The datagram
+ * \param len The datagram length
+ * \return The amount of bytes sent, 0 if queued, -1 if dropped
+ */
+int queue_sendto(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa,
+                 socklen_t salen, int tos, char *buf, int len);
+
+/**
+ * \fn int queue_send_now(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa, socklen_t salen, int tos, char *buf, int len)
+ * \brief Write or send a packet, queue it if the fd would block, without
+ *        going through the impairments (i.e. a released delayed packet).
+ *
+ * \param q The queue
+ * \param fd The fd
+ * \param peer The peer id
+ * \param sa The destination or NULL
+ * \param salen The destination length, 0 for a write
+ * \param tos The outer TOS/traffic class or -1
+ * \param buf The packet
+ * \param len The packet length
+ * \return The amount of bytes written, 0 if queued, -1 if dropped
+ */
+int queue_send_now(struct pkt_queue *q, int fd, int peer, struct sockaddr *sa,
+                   socklen_t salen, int tos, char *buf, int len);
+
+/**
+ * \fn static inline int queue_full(struct pkt_queue *q)
+ * \brief Check if a queue is full, i.e. if its producer should be paused.
+ *
+ * \param q The queue
+ * \return 1 if full, 0 otherwise
+ */
+static inline int queue_full(struct pkt_queue *q) {
+   return q->len == q->size;
+}
+
+/**
+ * \fn int queue_fd_set(struct pkt_queue *q, fd_set *output_set)
+ * \brief Add the fd of the oldest queued packet to a select output set.
+ *
+ * \param q The queue
+ * \param output_set The output fd_set
+ * \return The fd or 0 if the queue is empty
+ */
+int queue_fd_set(struct pkt_queue *q, fd_set *output_set);
+
+/**
+ * \fn void queue_flush(struct pkt_queue *q, fd_set *output_set)
+ * \brief Write queued packets until the head fd blocks.
+ *
+ * \param q The queue
+ * \param output_set The writable fds
+ */
+void queue_flush(struct pkt_queue *q, fd_set *output_set);
+
+/**
+ * \fn int queues_fd_set(struct tun_state *state, fd_set *output_set)
+ * \brief Add the fds with queued packets to a select output set.
+ *
+ * \param state The program state
+ * \param output_set The output fd_set
+ * \return The max fd value
+ */
+int queues_fd_set(struct tun_state *state, fd_set *output_set);
+
+/**
+ * \fn void queues_flush(struct tun_state *state, fd_set *output_set)
+ * \brief Write queued packets to writable fds.
+ *
+ * \param state The program state
+ * \param output_set The writable fds
+ */
+void queues_flush(struct tun_state *state, fd_set *output_set);
+
+#endif
@@ -0,0 +1,275 @@
+/**
+ * \file recbench.c
+ * \brief Peer record layout benchmark (make bench-recs).
+ *
+ *    Routes packets to randomly chosen peers and reads what the send
+ *    path reads from the peer record (source port, address, experiment)
+ *    with two layouts: the previous one, where the routing table next
+ *    hops index an array of pointers to records allocated one by one,
+ *    each pointing to separately allocated sockaddrs, and the peer
+ *    store, where the next hop is the peer id in a contiguous array of
+ *    one cache line records with embedded addresses. Reports the cost
+ *    and, when perf_event_open is permitted, the L1D and LLC misses per
+ *    lookup as JSON.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "sysconfig.h"
+
+#if defined(LINUX_OS)
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <linux/perf_event.h>
+#endif
+
+#include "lpm.h"
+#include "recs.h"
+#include "bench.h"
+
+/**
+ * \def BENCH_PEERS
+ * \brief The default amount of peers.
+ */
+#define BENCH_PEERS 65536
+
+/**
+ * \def BENCH_LOOKUPS
+ * \brief The default amount of timed lookups per layout.
+ */
+#define BENCH_LOOKUPS 10000000
+
+/**
+ * \struct old_rec
+ *	\brief The previous peer record.
+ */
+struct old_rec {
+   struct sockaddr *sa4;
+   unsigned int     slen4;
+   in_addr_t        priv_addr4;
+   struct sockaddr *sa6;
+   unsigned int     slen6;
+   unsigned char    priv_addr6[16];
+   int              sport;
+   void            *exp;
+};
+
+/**
+ * \struct counters
+ *	\brief The cache misses of a run, -1 if not counted.
+ */
+struct counters {
+   long long l1d;
+   long long llc;
+};
+
+/**
+ * \fn static int counter_open(uint32_t type, uint64_t config)
+ * \brief Open a user-space hardware counter of this thread, disabled.
+ *
+ * \return The counter fd, -1 if not permitted or not supported
+ */
+static int counter_open(uint32_t type, uint64_t config);
+
+/**
+ * \fn static void counters_start(int *fds)
+ * \brief Reset and enable the counters.
+ */
+static void counters_start(int *fds);
+
+/**
+ * \fn static void counters_stop(int *fds, struct counters *c)
+ * \brief Disable and read the counters.
+ */
+static void counters_stop(int *fds, struct counters *c);
+
+/**
+ * \fn static void usage(const char *prog)
+ * \brief Print the usage and exit.
+ */
+static void usage(const char *prog);
+
+/**
+ * \var static volatile uint64_t sink
+ * \brief Keeps the compiler from dropping the loops.
+ */
+static volatile uint64_t sink;
+
+int counter_open(uint32_t type, uint64_t config) {
+#if defined(LINUX_OS)
+   struct perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size           = sizeof(attr);
+   attr.type           = type;
+   attr.config         = config;
+   attr.disabled       = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv     = 1;
+   return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+   return -1;
+#endif
+}
+
+void counters_start(int *fds) {
+#if defined(LINUX_OS)
+   for (int i=0; i<2; i++) {
+      if (fds[i] >= 0) {
+         ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+         ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+   }
+#endif
+}
+
+void counters_stop(int *fds, struct counters *c) {
+   long long v[2] = {-1, -1};
+#if defined(LINUX_OS)
+   for (int i=0; i<2; i++) {
+      if (fds[i] < 0)
+         continue;
+      ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fds[i], &v[i], sizeof(v[i])) != sizeof(v[i]))
+         v[i] = -1;
+   }
+#endif
+   c->l1d = v[0];
+   c->llc = v[1];
+}
+
+void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [-n peers] [-l lookups]\n", prog);
+   exit(2);
+}
+
+int main(int argc, char **argv) {
+   uint32_t peers = BENCH_PEERS, lookups = BENCH_LOOKUPS;
+   int opt;
+   while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+      switch (opt) {
+         case 'n': peers   = strtoul(optarg, NULL, 10); break;
+         case 'l': lookups = strtoul(optarg, NULL, 10); break;
+         default:  usage(argv[0]);
+      }
+   }
+   if (!peers || peers >= RECS_MAX || !lookups)
+      usage(argv[0]);
+
+   /* one /32 per peer, both layouts share the routing table */
+   struct lpm4 *t = lpm4_new();
+   struct recs *s = recs_new(peers + 1);
+   struct old_rec **old = calloc(peers + 1, sizeof(struct old_rec *));
+   uint32_t *addr = malloc(peers * sizeof(uint32_t));
+   uint32_t *keys = malloc(lookups * sizeof(uint32_t));
+   void **other = malloc(peers * sizeof(void *));
+   if (!t || !s || !old || !addr || !keys || !other) {
+      perror("init");
+      exit(EXIT_FAILURE);
+   }
+   for (uint32_t i=0; i<peers; i++) {
+      addr[i] = 0x0a000000 | (i << 1);
+      uint32_t id = recs_add(s);
+      if (lpm4_add(t, addr[i], 32, id) < 0) {
+         perror("lpm4_add");
+         exit(EXIT_FAILURE);
+      }
+
+      /* the previous layout, allocated as the destination file was
+       * parsed: records and addresses interleaved with other data */
+      struct old_rec *o = calloc(1, sizeof(struct old_rec));
+      o->sa4   = malloc(sizeof(struct sockaddr_in));
+      o->sa6   = malloc(sizeof(struct sockaddr_in6));
+      o->slen4 = sizeof(struct sockaddr_in);
+      o->slen6 = sizeof(struct sockaddr_in6);
+      o->sport = 20000 + i;
+      other[i] = malloc(64 + rnd() % 512);
+      memset(o->sa4, 0, sizeof(struct sockaddr_in));
+      ((struct sockaddr_in *)o->sa4)->sin_addr.s_addr = htonl(addr[i]);
+      ((struct sockaddr_in *)o->sa4)->sin_port = htons(o->sport);
+      old[id] = o;
+
+      struct tun_rec *rec = recs_get(s, id);
+      rec->sa4.sin_addr.s_addr = htonl(addr[i]);
+      rec->sa4.sin_port = htons(20000 + i);
+      rec->sport = 20000 + i;
+   }
+   for (uint32_t i=0; i<lookups; i++)
+      keys[i] = addr[rnd() % peers];
+
+   int fds[2] = {
+#if defined(LINUX_OS)
+      counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)),
+      counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+#else
+      -1, -1
+#endif
+   };
+
+   /* the send path: route, then read port, address and experiment */
+   struct counters c_old, c_new;
+   uint64_t sum_old = 0, sum_new = 0;
+   counters_start(fds);
+   double t0 = now();
+   for (uint32_t i=0; i<lookups; i++) {
+      struct old_rec *o = old[lpm4_lookup(t, keys[i])];
+      struct sockaddr_in *sa = (struct sockaddr_in *)o->sa4;
+      sum_old += o->sport + sa->sin_addr.s_addr + sa->sin_port +
+                 (uintptr_t)o->exp;
+   }
+   double t1 = now();
+   counters_stop(fds, &c_old);
+
+   counters_start(fds);
+   double t2 = now();
+   for (uint32_t i=0; i<lookups; i++) {
+      struct tun_rec *rec = recs_get(s, lpm4_lookup(t, keys[i]));
+      sum_new += rec->sport + rec->sa4.sin_addr.s_addr + rec->sa4.sin_port +
+                 (uintptr_t)rec->exp;
+   }
+   double t3 = now();
+   counters_stop(fds, &c_new);
+   sink = sum_old + sum_new;
+
+   printf("{\n");
+   printf("  \"peers\": %u,\n", peers);
+   printf("  \"lookups\": %u,\n", lookups);
+   printf("  \"rec_bytes\": %zu,\n", sizeof(struct tun_rec));
+   printf("  \"old_rec_bytes\": %zu,\n", sizeof(struct old_rec) +
+          sizeof(struct sockaddr_in) + sizeof(struct sockaddr_in6));
+   printf("  \"old_ns\": %.2f,\n", (t1 - t0) / lookups);
+   printf("  \"store_ns\": %.2f,\n", (t3 - t2) / lookups);
+   if (c_old.l1d >= 0 && c_new.l1d >= 0) {
+      printf("  \"old_l1d_misses\": %.3f,\n", (double)c_old.l1d / lookups);
+      printf("  \"store_l1d_misses\": %.3f,\n", (double)c_new.l1d / lookups);
+   }
+   if (c_old.llc >= 0 && c_new.llc >= 0) {
+      printf("  \"old_llc_misses\": %.3f,\n", (double)c_old.llc / lookups);
+      printf("  \"store_llc_misses\": %.3f,\n", (double)c_new.llc / lookups);
+   }
+   printf("  \"ok\": %s\n", sum_old == sum_new ? "true" : "false");
+   printf("}\n");
+
+   for (uint32_t i=1; i<=peers; i++) {
+      free(old[i]->sa4);
+      free(old[i]->sa6);
+      free(old[i]);
+      free(other[i - 1]);
+   }
+   free(other);
+   free(old);
+   free(addr);
+   free(keys);
+   recs_free(s);
+   lpm4_free(t);
+   return sum_old == sum_new ? EXIT_SUCCESS : EXIT_FAILURE;
+}
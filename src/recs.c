@@ -0,0 +1,87 @@
+/**
+ * \file recs.c
+ * \brief The peer store.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "recs.h"
+
+/**
+ * \fn static int recs_grow(struct recs *s)
+ * \brief Double the capacity of a store.
+ *
+ * \param s The store
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+static int recs_grow(struct recs *s);
+
+struct recs *recs_new(uint32_t max) {
+   struct recs *s = calloc(1, sizeof(struct recs));
+   if (!s)
+      return NULL;
+   s->max = max ? (max < RECS_MAX ? max : RECS_MAX) : RECS_INIT;
+   s->len = 1;
+
+   if (posix_memalign((void **)&s->hot, 64,
+                      (size_t)s->max * sizeof(struct tun_rec))) {
+      free(s);
+      errno = ENOMEM;
+      return NULL;
+   }
+   s->priv = calloc(s->max, sizeof(struct rec_priv));
+   if (!s->priv) {
+      free(s->hot);
+      free(s);
+      return NULL;
+   }
+   return s;
+}
+
+uint32_t recs_add(struct recs *s) {
+   if (s->len >= s->max) {
+      if (s->max >= RECS_MAX) {
+         errno = ENOSPC;
+         return 0;
+      }
+      if (recs_grow(s) < 0)
+         return 0;
+   }
+   uint32_t id = s->len;
+   memset(&s->hot[id], 0, sizeof(struct tun_rec));
+   s->len++;
+   return id;
+}
+
+int recs_grow(struct recs *s) {
+   uint32_t max = s->max > RECS_MAX / 2 ? RECS_MAX : s->max * 2;
+
+   /* the hot records keep their cache line alignment */
+   struct tun_rec *hot;
+   if (posix_memalign((void **)&hot, 64, (size_t)max * sizeof(struct tun_rec))) {
+      errno = ENOMEM;
+      return -1;
+   }
+   struct rec_priv *priv = realloc(s->priv, (size_t)max * sizeof(struct rec_priv));
+   if (!priv) {
+      free(hot);
+      return -1;
+   }
+   memset(priv + s->max, 0, (size_t)(max - s->max) * sizeof(struct rec_priv));
+   memcpy(hot, s->hot, (size_t)s->len * sizeof(struct tun_rec));
+   free(s->hot);
+   s->hot  = hot;
+   s->priv = priv;
+   s->max  = max;
+   return 0;
+}
+
+void recs_free(struct recs *s) {
+   free(s->hot);
+   free(s->priv);
+   free(s);
+}
@@ -0,0 +1,132 @@
+/**
+ * \file recs.h
+ * \brief The peer store.
+ *
+ *    The peer records (struct tun_rec) live in one contiguous array
+ *    indexed by a 32-bit peer id, and the routing tables (lpm next hops,
+ *    the server source port table, the destination lists) reference
+ *    peers by id. A record holds the fields the forwarding loops touch
+ *    per packet, the peer addresses embedded, in one cache line, and
+ *    the fields read on setup only (the private addresses) are kept in
+ *    a parallel array.
+ *
+ *    Both arrays start with room for RECS_INIT records and double when
+ *    full. Records are only added while the destination file is parsed,
+ *    before the forwarding threads start, so that records never move
+ *    afterwards and the forwarding threads read them without locking.
+ *    Id 0 is reserved for "no peer".
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_RECS_H
+#define UDPTUN_RECS_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#include "state.h"
+
+/**
+ * \def RECS_INIT
+ * \brief The initial capacity of a store.
+ */
+#define RECS_INIT 64
+
+/**
+ * \def RECS_MAX
+ * \brief The maximal capacity of a store, ids stay below 2^31.
+ */
+#define RECS_MAX (1U << 31)
+
+/**
+ * \struct rec_priv
+ *	\brief The cold fields of a peer record.
+ */
+struct rec_priv {
+   in_addr_t addr4;     /*!< The private v4 prefix in network byte order */
+   uint8_t   addr6[16]; /*!< The private v6 prefix */
+};
+
+/**
+ * \struct recs
+ *	\brief A peer store.
+ */
+struct recs {
+   struct tun_rec  *hot;  /*!< The records, hot[0] is unused */
+   struct rec_priv *priv; /*!< The cold fields, by id */
+   uint32_t         len;  /*!< The next id */
+   uint32_t         max;  /*!< The capacity */
+};
+
+/**
+ * \fn struct recs *recs_new(uint32_t max)
+ * \brief Allocate a store.
+ *
+ * \param max The initial capacity, 0 for RECS_INIT
+ * \return The store, NULL on error (errno is filled)
+ */
+struct recs *recs_new(uint32_t max);
+
+/**
+ * \fn uint32_t recs_add(struct recs *s)
+ * \brief Add a zeroed record, growing the store if needed. The records
+ *        may move, ids remain valid.
+ *
+ * \param s The store
+ * \return The record id, 0 if the store is full (errno is ENOSPC) or
+ *         cannot grow (errno is ENOMEM)
+ */
+uint32_t recs_add(struct recs *s);
+
+/**
+ * \fn void recs_free(struct recs *s)
+ * \brief Free a store and its records.
+ *
+ * \param s The store
+ */
+void recs_free(struct recs *s);
+
+/**
+ * \fn static inline struct tun_rec *recs_get(struct recs *s, uint32_t id)
+ * \brief The record of an id, NULL for 0.
+ */
+static inline struct tun_rec *recs_get(struct recs *s, uint32_t id) {
+   return id ? &s->hot[id] : NULL;
+}
+
+/**
+ * \fn static inline struct rec_priv *recs_priv(struct recs *s, uint32_t id)
+ * \brief The cold fields of an id.
+ */
+static inline struct rec_priv *recs_priv(struct recs *s, uint32_t id) {
+   return &s->priv[id];
+}
+
+/**
+ * \fn static inline struct tun_rec *rec_get(struct tun_state *state, uint32_t id)
+ * \brief The record of a peer id of the program state, NULL for 0.
+ */
+static inline struct tun_rec *rec_get(struct tun_state *state, uint32_t id) {
+   return recs_get(state->recs, id);
+}
+
+/**
+ * \fn static inline struct tun_rec *serv_lookup(struct tun_state *state, int sport)
+ * \brief The peer of a source port in the server table, NULL if none.
+ */
+static inline struct tun_rec *serv_lookup(struct tun_state *state, int sport) {
+   return rec_get(state, GPOINTER_TO_UINT(
+                  g_hash_table_lookup(state->serv, GINT_TO_POINTER(sport))));
+}
+
+/**
+ * \fn static inline void serv_insert(struct tun_state *state, int sport, uint32_t id)
+ * \brief Map a source port to a peer in the server table.
+ */
+static inline void serv_insert(struct tun_state *state, int sport, uint32_t id) {
+   g_hash_table_insert(state->serv, GINT_TO_POINTER(sport), GUINT_TO_POINTER(id));
+}
+
+#endif
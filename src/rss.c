@@ -0,0 +1,266 @@
+/**
+ * \file rss.c
+ * \brief Software receive-side scaling of the tun interface.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "rss.h"
+#include "debug.h"
+#include "sock.h"
+#include "queue.h"
+#include "spread.h"
+#include "stats.h"
+#include "thread.h"
+#include "destruct.h"
+#include "perf.h"
+
+/**
+ * \fn static void *rss_dispatch(void *arg)
+ * \brief The dispatcher thread: read tun, hash and push to the rings.
+ *
+ * \param arg The dispatcher (struct rss *)
+ */
+static void *rss_dispatch(void *arg);
+
+/**
+ * \fn static void *rss_work(void *arg)
+ * \brief The worker thread: pop from the ring, encapsulate and send.
+ *
+ * \param arg The worker (struct rss_worker *)
+ */
+static void *rss_work(void *arg);
+
+/**
+ * \fn static int rss_push(struct rss_worker *w, char *buf, int len)
+ * \brief Copy a packet to a worker ring.
+ *
+ * \return 0 if pushed, -1 if the ring is full
+ */
+static int rss_push(struct rss_worker *w, char *buf, int len);
+
+/**
+ * \fn static void rss_pop(struct rss_worker *w)
+ * \brief Send the packets of a worker ring until it is empty or its
+ *        retry queue is full.
+ */
+static void rss_pop(struct rss_worker *w);
+
+/**
+ * \fn static int sock_port(int fd)
+ * \brief The bound port of a socket.
+ */
+static int sock_port(int fd);
+
+/**
+ * \fn static void rss_stats(FILE *fp, void *arg)
+ * \brief Dump the dispatcher and workers counters.
+ */
+static void rss_stats(FILE *fp, void *arg);
+
+struct rss *init_rss(struct tun_state *state, int fd_tun, int fd_net4,
+                     int fd_net6, rss_send_t send) {
+   struct rss *rss = calloc(1, sizeof(struct rss));
+   rss->state    = state;
+   rss->fd_tun   = fd_tun;
+   rss->send     = send;
+   rss->headroom = state->raw_header_size;
+   rss->len      = state->rss_workers;
+
+   int port4 = fd_net4 >= 0 ? sock_port(fd_net4) : 0;
+   int port6 = fd_net6 >= 0 ? sock_port(fd_net6) : 0;
+   int slot_size = rss->headroom + BUFF_SIZE;
+
+   for (int i=0; i<rss->len; i++) {
+      struct rss_worker *w = &rss->workers[i];
+      w->rss = rss;
+
+      /* ring, with the raw header in each slot headroom */
+      w->ring.data = xmalloc(RSS_RING_SIZE * slot_size);
+      w->ring.len  = calloc(RSS_RING_SIZE, sizeof(int));
+      if (state->raw_header)
+         for (int j=0; j<RSS_RING_SIZE; j++)
+            memcpy(w->ring.data + j*slot_size, state->raw_header, rss->headroom);
+
+      /* doorbell */
+      if (pipe(w->bell))
+         die("pipe");
+      set_fd(w->bell[0]); set_fd(w->bell[1]);
+      set_nonblock(w->bell[0]); set_nonblock(w->bell[1]);
+
+      /* sockets */
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+      w->fd_net4 = fd_net4 >= 0 ? udp_reuse_sock4(port4, state->public_addr4, 0) : -1;
+      w->fd_net6 = fd_net6 >= 0 ? udp_reuse_sock6(port6, state->public_addr6, 0) : -1;
+#else
+      /* members would steal incoming datagrams, share the leader */
+      w->fd_net4 = fd_net4;
+      w->fd_net6 = fd_net6;
+#endif
+      w->txq = init_queue(state->queue_len, state->queue_policy, NULL);
+   }
+   stats_register("rss", rss_stats, rss);
+
+   for (int i=0; i<rss->len; i++)
+      xthread_create(rss_work, (void *)&rss->workers[i], 1);
+   xthread_create(rss_dispatch, (void *)rss, 1);
+
+   debug_print("rss: dispatching tun to %d workers (ports %d %d)\n",
+               rss->len, port4, port6);
+   return rss;
+}
+
+void free_rss(struct rss *rss) {
+   for (int i=0; i<rss->len; i++) {
+      struct rss_worker *w = &rss->workers[i];
+      free(w->ring.data);
+      free(w->ring.len);
+      free_queue(w->txq);
+   }
+   free(rss);
+}
+
+int rss_push(struct rss_worker *w, char *buf, int len) {
+   struct rss_ring *ring = &w->ring;
+   uint32_t tail = ring->tail;
+   if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RSS_RING_SIZE) {
+      w->ring_drops++;
+      return -1;
+   }
+
+   uint32_t idx = tail & (RSS_RING_SIZE - 1);
+   memcpy(ring->data + idx*(w->rss->headroom + BUFF_SIZE) + w->rss->headroom,
+          buf, len);
+   ring->len[idx] = len;
+   __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+   return 0;
+}
+
+void rss_pop(struct rss_worker *w) {
+   struct rss *rss = w->rss;
+   struct rss_ring *ring = &w->ring;
+   uint32_t head = ring->head;
+   uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+   while (head != tail && !queue_full(w->txq)) {
+      uint32_t idx = head & (RSS_RING_SIZE - 1);
+      char *buf = ring->data + idx*(rss->headroom + BUFF_SIZE) + rss->headroom;
+      int len   = ring->len[idx];
+      const struct ip_family *f = ip_family_of(rss->state, buf);
+      int fd_net = !f ? -1 : f->v6 ? w->fd_net6 : w->fd_net4;
+
+      if (fd_net >= 0) {
+         (*rss->send)(fd_net, w->txq, rss->state, f, buf, len);
+      } else {
+         debug_print("rss: non-ip proto:%d\n", buf[0]);
+      }
+      w->pkts++;
+      w->bytes += len;
+
+      __atomic_store_n(&ring->head, ++head, __ATOMIC_RELEASE);
+   }
+}
+
+void *rss_work(void *arg) {
+   struct rss_worker *w = arg;
+   fd_set input_set, output_set;
+   struct timeval tv;
+   char bell[64];
+
+   char name[16];
+   snprintf(name, sizeof(name), "rss.worker%d", (int)(w - w->rss->workers));
+   perf_thread(name);
+
+   while (1) {
+      rss_pop(w);
+
+      FD_ZERO(&input_set);
+      FD_SET(w->bell[0], &input_set);
+      FD_ZERO(&output_set);
+      int fd_out = queue_fd_set(w->txq, &output_set);
+
+      xselect(&input_set, &output_set, max(w->bell[0], fd_out), &tv, -1);
+      queue_flush(w->txq, &output_set);
+      if (FD_ISSET(w->bell[0], &input_set)) {
+         while (read(w->bell[0], bell, sizeof(bell)) > 0);
+         w->wakeups++;
+      }
+   }
+   return 0;
+}
+
+void *rss_dispatch(void *arg) {
+   struct rss *rss = arg;
+   fd_set input_set;
+   struct timeval tv;
+   char buf[BUFF_SIZE];
+
+   perf_thread("rss.dispatch");
+
+   while (1) {
+      FD_ZERO(&input_set);
+      FD_SET(rss->fd_tun, &input_set);
+      xselect(&input_set, NULL, rss->fd_tun, &tv, -1);
+
+      /* read a batch */
+      uint32_t touched = 0;
+      for (int i=0; i<RSS_BATCH; i++) {
+         PERF_BEGIN(PERF_TUN_READ);
+         int recvd = xread(rss->fd_tun, buf, BUFF_SIZE);
+         PERF_END(PERF_TUN_READ, 1);
+         if (recvd <= 0)
+            break;
+         rss->pkts++;
+
+         PERF_BEGIN(PERF_CLASSIFY);
+         char *pkt = rss->state->planetlab ? buf+4 : buf;
+         int id = spread_hash(pkt) % rss->len;
+         if (!rss_push(&rss->workers[id], buf, recvd))
+            touched |= 1 << id;
+         PERF_END(PERF_CLASSIFY, 1);
+      }
+      if (!touched)
+         continue;
+      rss->batches++;
+
+      /* one doorbell per worker and batch */
+      for (int id=0; id<rss->len; id++)
+         if (touched & (1 << id) && write(rss->workers[id].bell[1], "", 1) < 0
+               && errno != EAGAIN)
+            die("doorbell");
+   }
+   return 0;
+}
+
+int sock_port(int fd) {
+   struct sockaddr_storage sa;
+   socklen_t len = sizeof(sa);
+   if (getsockname(fd, (struct sockaddr *)&sa, &len))
+      die("getsockname");
+   if (sa.ss_family == AF_INET6)
+      return ntohs(((struct sockaddr_in6 *)&sa)->sin6_port);
+   return ntohs(((struct sockaddr_in *)&sa)->sin_port);
+}
+
+void rss_stats(FILE *fp, void *arg) {
+   struct rss *rss = arg;
+   fprintf(fp, "workers %u\n", rss->len);
+   fprintf(fp, "pkts %llu\n", (unsigned long long)rss->pkts);
+   fprintf(fp, "batches %llu\n", (unsigned long long)rss->batches);
+   for (int i=0; i<rss->len; i++) {
+      struct rss_worker *w = &rss->workers[i];
+      fprintf(fp, "worker%d.pkts %llu\n", i, (unsigned long long)w->pkts);
+      fprintf(fp, "worker%d.bytes %llu\n", i, (unsigned long long)w->bytes);
+      fprintf(fp, "worker%d.ring_drops %llu\n", i, (unsigned long long)w->ring_drops);
+      fprintf(fp, "worker%d.wakeups %llu\n", i, (unsigned long long)w->wakeups);
+      fprintf(fp, "worker%d.queue_dropped %llu\n", i, (unsigned long long)w->txq->dropped);
+   }
+}
@@ -0,0 +1,125 @@
+/**
+ * \file rss.h
+ * \brief Software receive-side scaling of the tun interface.
+ *
+ *    When the tun interface has a single queue (e.g. PlanetLab, BSD),
+ *    one dispatcher thread reads the tun fd in batches, hashes the
+ *    inner 5-tuple (spread_hash(), symmetric) and copies each packet
+ *    to the ring of a worker thread. A flow always maps to the same
+ *    worker, which preserves its ordering. Workers are woken up by
+ *    a pipe doorbell once per batch, encapsulate the packets and send
+ *    them on their own socket, bound to the same port (SO_REUSEPORT).
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_RSS_H
+#define UDPTUN_RSS_H
+
+#include <stdint.h>
+
+#include "state.h"
+#include "family.h"
+
+/**
+ * \def RSS_MAX_WORKERS
+ * \brief The maximal amount of worker threads.
+ */
+#define RSS_MAX_WORKERS 16
+
+/**
+ * \def RSS_RING_SIZE
+ * \brief The worker ring size (packets), a power of 2.
+ */
+#define RSS_RING_SIZE 1024
+
+/**
+ * \def RSS_BATCH
+ * \brief The maximal amount of tun reads per dispatcher wake-up.
+ */
+#define RSS_BATCH 32
+
+/**
+ * \typedef rss_send_t
+ * \brief Encapsulate and send a tun packet (e.g. tun_cli_in_aux).
+ *
+ *    The buffer has raw_header_size bytes of headroom holding the raw
+ *    header.
+ */
+typedef void (*rss_send_t)(int fd_net, struct pkt_queue *txq,
+                           struct tun_state *state, const struct ip_family *f,
+                           char *buf, int recvd);
+
+/**
+ * \struct rss_ring
+ *	\brief A single-producer single-consumer packet ring.
+ */
+struct rss_ring {
+   char     *data;           /*!< The slots (headroom + BUFF_SIZE each) */
+   int      *len;            /*!< The packet lengths */
+   uint32_t  head __attribute__((aligned(64))); /*!< Consumer index */
+   uint32_t  tail __attribute__((aligned(64))); /*!< Producer index */
+};
+
+struct rss;
+
+/**
+ * \struct rss_worker
+ *	\brief A worker thread.
+ */
+struct rss_worker {
+   struct rss      *rss;      /*!< The dispatcher */
+   struct rss_ring  ring;     /*!< The packets to send */
+   int              bell[2];  /*!< The doorbell pipe */
+   int              fd_net4;  /*!< The v4 socket or -1 */
+   int              fd_net6;  /*!< The v6 socket or -1 */
+   struct pkt_queue *txq;     /*!< The retry queue */
+
+   uint64_t pkts;             /*!< Packets sent */
+   uint64_t bytes;            /*!< Bytes sent */
+   uint64_t ring_drops;       /*!< Packets dropped on full ring */
+   uint64_t wakeups;          /*!< Doorbell wake-ups */
+};
+
+/**
+ * \struct rss
+ *	\brief The dispatcher and its workers.
+ */
+struct rss {
+   struct tun_state  *state;  /*!< The program state */
+   int                fd_tun; /*!< The tun fd */
+   rss_send_t         send;   /*!< The send function */
+   uint16_t           headroom;  /*!< Slot headroom (raw header) */
+   uint8_t            len;       /*!< Amount of workers */
+   struct rss_worker  workers[RSS_MAX_WORKERS]; /*!< The workers */
+
+   uint64_t           pkts;      /*!< Packets read from tun */
+   uint64_t           batches;   /*!< Non-empty tun batches */
+};
+
+/**
+ * \fn struct rss *init_rss(struct tun_state *state, int fd_tun, int fd_net4, int fd_net6, rss_send_t send)
+ * \brief Create the workers sockets and rings, and start the dispatcher
+ *        and worker threads. fd_net4 and fd_net6 must have been created
+ *        with udp_reuse_sock4/6() as group leaders.
+ *
+ * \param state The program state
+ * \param fd_tun The tun fd
+ * \param fd_net4 The v4 socket or -1
+ * \param fd_net6 The v6 socket or -1
+ * \param send The send function
+ * \return The dispatcher
+ */
+struct rss *init_rss(struct tun_state *state, int fd_tun, int fd_net4,
+                     int fd_net6, rss_send_t send);
+
+/**
+ * \fn void free_rss(struct rss *rss)
+ * \brief Free the rings and queues, threads must be canceled.
+ *
+ * \param rss The dispatcher
+ */
+void free_rss(struct rss *rss);
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * \file series.c
+ * \brief Received bytes time series of the measurement flows.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "series.h"
+#include "debug.h"
+#include "sock.h"
+
+/**
+ * \def SERIES_LINE
+ * \brief The maximal length of an output line.
+ */
+#define SERIES_LINE 32
+
+struct series *series_new(uint32_t bin_ms, uint16_t max) {
+   struct series *s = xmalloc(sizeof(struct series));
+   if (!max)
+      max = SERIES_MAX;
+   if (!bin_ms)
+      bin_ms = 1;
+   s->bin      = bin_ms * 1000000LL;
+   s->len      = (max * 1000ULL + bin_ms - 1) / bin_ms;
+   s->last     = 0;
+   s->overflow = 0;
+   s->bins     = xmalloc(s->len * sizeof(uint32_t));
+   /* fault the pages in before the flow starts */
+   memset(s->bins, 0, s->len * sizeof(uint32_t));
+   series_start(s);
+   return s;
+}
+
+void series_free(struct series *s) {
+   free(s->bins);
+   free(s);
+}
+
+int series_write(struct series *s, const char *file) {
+   uint32_t bin_ms = s->bin / 1000000;
+   size_t size = (s->last + 2) * SERIES_LINE + 64, len = 0;
+   char *buf = xmalloc(size);
+
+   len += snprintf(buf, size, "# bin_ms %u overflow %llu\n",
+                   bin_ms, (unsigned long long)s->overflow);
+   for (uint32_t i=0; i<=s->last; i++)
+      len += snprintf(buf+len, size-len, "%llu %u\n",
+                      (unsigned long long)i * bin_ms, s->bins[i]);
+
+   FILE *fp = fopen(file, "w");
+   if (!fp) {
+      debug_print("fopen %s\n", file);
+      free(buf);
+      return -1;
+   }
+   int ret = fwrite(buf, 1, len, fp) == len ? 0 : -1;
+   if (fclose(fp))
+      ret = -1;
+   free(buf);
+
+   mode_t m = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+   if (chmod(file, m) < 0)
+      ret = -1;
+   return ret;
+}
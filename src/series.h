@@ -0,0 +1,104 @@
+/**
+ * \file series.h
+ * \brief Received bytes time series of the measurement flows.
+ *
+ *    A client flow counts the bytes it receives in fixed-width time bins
+ *    (series-bin ms) of an array allocated and touched before connect(),
+ *    so that the receive loop does not allocate nor write to disk. Bytes
+ *    received after series-max seconds are counted in the last bin. The
+ *    array is written in one piece when the flow ends, next to the
+ *    received file, as "<offset ms> <bytes>" lines.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SERIES_H
+#define UDPTUN_SERIES_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "timing.h"
+
+/**
+ * \def SERIES_MAX
+ * \brief The default recorded duration (sec).
+ */
+#define SERIES_MAX 60
+
+/**
+ * \def SERIES_SUFFIX
+ * \brief The suffix of a series file, appended to the received file name.
+ */
+#define SERIES_SUFFIX ".ts"
+
+/**
+ * \struct series
+ *	\brief The time series of a flow.
+ */
+struct series {
+   int64_t   start;     /*!< The first bin start (ns, CLOCK_MONOTONIC) */
+   int64_t   bin;       /*!< The bin width (ns) */
+   uint32_t  len;       /*!< The amount of bins */
+   uint32_t  last;      /*!< The last non-empty bin */
+   uint64_t  overflow;  /*!< Bytes received after the last bin end */
+   uint32_t *bins;      /*!< Received bytes per bin */
+};
+
+/**
+ * \fn struct series *series_new(uint32_t bin_ms, uint16_t max)
+ * \brief Allocate and pre-fault a series.
+ *
+ * \param bin_ms The bin width (ms)
+ * \param max The recorded duration (sec), 0 for SERIES_MAX
+ * \return The series
+ */
+struct series *series_new(uint32_t bin_ms, uint16_t max);
+
+/**
+ * \fn void series_free(struct series *s)
+ * \brief Free a series.
+ *
+ * \param s The series
+ */
+void series_free(struct series *s);
+
+/**
+ * \fn static inline void series_start(struct series *s)
+ * \brief Start the first bin now.
+ *
+ * \param s The series
+ */
+static inline void series_start(struct series *s) {
+   s->start = monotonic_ns();
+}
+
+/**
+ * \fn static inline void series_add(struct series *s, int bytes)
+ * \brief Count received bytes in the current bin.
+ *
+ * \param s The series
+ * \param bytes The amount of received bytes
+ */
+static inline void series_add(struct series *s, int bytes) {
+   uint64_t i = (uint64_t)(monotonic_ns() - s->start) / s->bin;
+   if (i >= s->len) {
+      s->overflow += bytes;
+      i = s->len - 1;
+   }
+   s->bins[i] += bytes;
+   s->last = i;
+}
+
+/**
+ * \fn int series_write(struct series *s, const char *file)
+ * \brief Write the bins up to the last non-empty one.
+ *
+ * \param s The series
+ * \param file The series file
+ * \return 0 on success, -1 on error
+ */
+int series_write(struct series *s, const char *file);
+
+#endif
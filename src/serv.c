@@ -24,6 +24,18 @@
 #include "thread.h"
 #include "net.h"
 #include "xpcap.h"
+#include "queue.h"
+#include "impair.h"
+#include "startup.h"
+#include "batch.h"
+#include "inst.h"
+#include "demux.h"
+#include "spread.h"
+#include "ecn.h"
+#include "perf.h"
+#include "hh.h"
+#include "acct.h"
+#include "family.h"
 
 /**
  * \var static volatile int loop
@@ -40,36 +52,62 @@ static volatile int loop;
 static void serv_shutdown(int sig);
 
 /**
- * \fn static void tun_serv_in(int fd_net, int fd_tun, struct tun_state *state, char *buf)
- * \brief Forward a packet in the tunnel.
+ * \fn static int tun_serv_in(int fd_tun, int fd_net4, int fd_net6, struct tun_state *state, char *buf)
+ * \brief Read a packet from tun and forward it in the tunnel.
  *
- * \param fd_net The udp socket fd.
  * \param fd_tun The tun interface fd.
+ * \param fd_net4 The IPv4 udp socket fd or -1.
+ * \param fd_net6 The IPv6 udp socket fd or -1.
+ * \param state The state of the server.
+ * \param buf The buffer.
+ * \return 1 if a packet was read, 0 otherwise
+ */ 
+static int tun_serv_in(int fd_tun, int fd_net4, 
+                 int fd_net6, struct tun_state *state, char *buf);
+
+/**
+ * \fn static void tun_serv_in_aux(int fd_net, struct tun_state *state, const struct ip_family *f, struct demux_exp *exp, char *buf, int recvd)
+ * \brief Forward a packet in the tunnel.
+ *
+ * \param fd_net The udp socket fd of the packet family.
+ * \param state The state of the server.
+ * \param f The packet family.
+ * \param exp The experiment of the packet or NULL.
+ * \param buf The packet.
+ * \param recvd The packet length.
+ */ 
+static void tun_serv_in_aux(int fd_net, struct tun_state *state, 
+                            const struct ip_family *f, struct demux_exp *exp, 
+                            char *buf, int recvd);
+
+/**
+ * \fn static void tun_serv_in_demux(fd_set *input_set, int fd_tun, int fd_net4, int fd_net6, struct tun_state *state, char *buf)
+ * \brief Forward the packets of the experiments dedicated tun interfaces 
+ *        in the tunnel.
+ *
+ * \param input_set The select fd_set.
+ * \param fd_tun The default tun interface fd.
+ * \param fd_net4 The IPv4 udp socket fd or -1.
+ * \param fd_net6 The IPv6 udp socket fd or -1.
  * \param state The state of the server.
  * \param buf The buffer.
  */ 
-static void tun_serv_in4(int fd_tun, int fd_net, 
-                         struct tun_state *state, char *buf);
-static void tun_serv_in6(int fd_tun, int fd_net, 
-                         struct tun_state *state, char *buf);
-static void tun_serv_in4_aux(int fd_net, 
-                             struct tun_state *state, char *buf, int recvd);
-static void tun_serv_in6_aux(int fd_net, 
-                             struct tun_state *state, char *buf, int recvd);
-static void tun_serv_in(int fd_tun, int fd_net4, 
+static void tun_serv_in_demux(fd_set *input_set, int fd_tun, int fd_net4, 
                  int fd_net6, struct tun_state *state, char *buf);
 
 /**
- * \fn static void tun_serv_out(int fd_net, int fd_tun, struct tun_state *state, char *buf)
+ * \fn static int tun_serv_out(int fd_net, int fd_tun, struct tun_state *state, const struct ip_family *f, char *buf)
  * \brief Forward a packet out of the tunnel.
  *
  * \param fd_net The udp socket fd.
  * \param fd_tun The tun interface fd.
  * \param state The state of the server.
+ * \param f The socket family.
  * \param buf The buffer.
+ * \return 1 if a datagram was read, 0 otherwise
  */ 
-static void tun_serv_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf);
-static void tun_serv_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf);
+static int tun_serv_out(int fd_net, int fd_tun, struct tun_state *state, 
+                        const struct ip_family *f, char *buf);
 
 static void tun_serv_single(struct arguments *args);
 static void tun_serv_dual(struct arguments *args);
@@ -83,57 +121,52 @@ void tun_serv(struct arguments *args) {
       tun_serv_single(args);
 }
 
-void tun_serv_in(int fd_tun, int fd_net4, 
-                 int fd_net6, struct tun_state *state, char *buf) {
+int tun_serv_in(int fd_tun, int fd_net4, 
+                int fd_net6, struct tun_state *state, char *buf) {
+   PERF_BEGIN(PERF_TUN_READ);
    int recvd=xread(fd_tun, buf, BUFF_SIZE);
+   PERF_END(PERF_TUN_READ, 1);
    debug_print("recvd %db from tun\n", recvd);
+   if (recvd <= 0)
+      return 0;
 
-   switch (buf[0] & 0xf0) {
-      case 0x40:
-         tun_serv_in4_aux(fd_net4, state, buf, recvd);
-         break;
-      case 0x60:
-         tun_serv_in6_aux(fd_net6, state, buf, recvd);
-         break;
-      default:
-         debug_print("non-ip proto:%d\n", buf[0]);
-         break;
+   const struct ip_family *f = ip_family_of(state, buf);
+   int fd_net = !f ? -1 : f->v6 ? fd_net6 : fd_net4;
+   if (fd_net >= 0) {
+      tun_serv_in_aux(fd_net, state, f, NULL, buf, recvd);
+   } else {
+      debug_print("non-ip proto:%d\n", buf[0]);
    }
+   return 1;
 }
 
-void tun_serv_in4_aux(int fd_net, struct tun_state *state, char *buf, int recvd) {
-
-   if (recvd > MIN_PKT_SIZE) {
-
-      /* Remove PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         recvd-=4;
-         memmove(buf, buf+4, recvd);
-      }
-
-      struct tun_rec *rec = NULL; 
-      /* read sport for clients mapping */
-      int sport = (int) ntohs( *((uint16_t *)(buf+22)) ); 
-
-      /* Add layer 4.5 header */
-      if (state->raw_header) {
-         buf -= state->raw_header_size;
-         recvd += state->raw_header_size;
-      }
-
-      if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {   
-
-         int sent = xsendto4(fd_net, rec->sa4, buf, recvd);
-         debug_print("serv: wrote %dB to internet\n",sent);
+void tun_serv_in_demux(fd_set *input_set, int fd_tun, int fd_net4, 
+                 int fd_net6, struct tun_state *state, char *buf) {
+   struct demux *d = state->demux;
+   for (int i=0; i<d->len; i++) {
+      struct demux_exp *exp = &d->exp[i];
+      if (exp->fd_tun == fd_tun || !FD_ISSET(exp->fd_tun, input_set))
+         continue;
+
+      int recvd=xread(exp->fd_tun, buf, BUFF_SIZE);
+      debug_print("recvd %db from %s tun\n", recvd, exp->name);
+      if (recvd <= 0)
+         continue;
+
+      const struct ip_family *f = ip_family_of(state, buf);
+      int fd_net = !f ? -1 : f->v6 ? fd_net6 : fd_net4;
+      if (fd_net >= 0) {
+         tun_serv_in_aux(fd_net, state, f, exp, buf, recvd);
       } else {
-         errno=EFAULT;
-         die("lookup");
+         debug_print("non-ip proto:%d\n", buf[0]);
       }
    }
 }
 
-void tun_serv_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd) {
- 
+void tun_serv_in_aux(int fd_net, struct tun_state *state, 
+                     const struct ip_family *f, struct demux_exp *exp, 
+                     char *buf, int recvd) {
+
    if (recvd > MIN_PKT_SIZE) {
 
       /* Remove PlanetLab TUN PPI header */
@@ -141,20 +174,46 @@ void tun_serv_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
          recvd-=4;
          memmove(buf, buf+4, recvd);
       }
+      int tos = ecn_encap(state, buf);
 
       struct tun_rec *rec = NULL; 
       /* read sport for clients mapping */
-      int sport = (int) ntohs( *((uint16_t *)(buf+42)) ); 
-
-      /* Add layer 4.5 header */
-      if (state->raw_header) {
-         buf -= state->raw_header_size;
-         recvd += state->raw_header_size;
-      }
-
-      if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {   
-
-         int sent = xsendto6(fd_net, rec->sa6, buf, recvd);
+      int sport = ip_port(f, buf, 1); 
+
+      PERF_BEGIN(PERF_LOOKUP);
+      rec = serv_lookup(state, sport);
+      PERF_END(PERF_LOOKUP, 1);
+      if (rec) {   
+         HH_UPDATE(buf, recvd, sport, HH_TX);
+         ACCT_UPDATE(state, buf, recvd, sport, ACCT_TX);
+
+         PERF_BEGIN(PERF_ENCAP);
+         /* Reply on the source port of this flow */
+         struct sockaddr *sa = rec_sa(rec, f);
+         struct sockaddr_storage ss;
+         if (state->port_range > 1) {
+            memcpy(&ss, sa, f->salen);
+            sa = (struct sockaddr *)&ss;
+            sa_set_port(sa, sport + spread_offset(state, buf));
+         }
+
+         /* Add layer 4.5 header */
+         if (state->demux) {
+            if (!exp && !(exp = rec->exp)) {
+               debug_print("serv: no experiment for %d yet\n", sport);
+               return;
+            }
+            recvd = demux_encap(exp, &buf, recvd);
+         } else if (state->raw_header) {
+            buf -= state->raw_header_size;
+            recvd += state->raw_header_size;
+         }
+         PERF_END(PERF_ENCAP, 1);
+
+         PERF_BEGIN(PERF_SEND);
+         int sent = queue_sendto(state->txq_net, fd_net, rec->sport, sa, 
+                                  f->salen, tos, buf, recvd);
+         PERF_END(PERF_SEND, 1);
          debug_print("serv: wrote %dB to internet\n",sent);
       } else {
          errno=EFAULT;
@@ -163,105 +222,70 @@ void tun_serv_in6_aux(int fd_net, struct tun_state *state, char *buf, int recvd)
    }
 }
 
-void tun_serv_in6(int fd_tun, int fd_net, 
-                 struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
-   debug_print("recvd %db from tun\n", recvd);
-   tun_serv_in6_aux(fd_net, state, buf, recvd);
-}
-
-void tun_serv_in4(int fd_tun, int fd_net, 
-                 struct tun_state *state, char *buf) {
-   int recvd=xread(fd_tun, buf, BUFF_SIZE);
-   debug_print("recvd %db from tun\n", recvd);
-   tun_serv_in4_aux(fd_net, state, buf, recvd);
-}
-
-void tun_serv_out4(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
-   struct tun_rec *nrec = init_tun_rec(state);
-   int recvd = xrecvfrom(fd_net, (struct sockaddr *)nrec->sa4, 
-                         &nrec->slen4, buf, BUFF_SIZE);
-
-   if (recvd > MIN_PKT_SIZE) {
+int tun_serv_out(int fd_net, int fd_tun, struct tun_state *state, 
+                 const struct ip_family *f, char *buf) {
+   struct sockaddr_storage from;
+   unsigned int slen = f->salen;
+   PERF_BEGIN(PERF_RECV);
+   int tos, recvd = xrecvtos(fd_net, (struct sockaddr *)&from, &slen, 
+                              buf, BUFF_SIZE, &tos);
+   PERF_END(PERF_RECV, 1);
+   int ret = recvd > 0;
+
+   struct demux_exp *exp = NULL;
+
+   PERF_BEGIN(PERF_CLASSIFY);
+   if (recvd > MIN_PKT_SIZE && state->demux)
+      exp = demux_classify(state->demux, buf, recvd);
+   PERF_END(PERF_CLASSIFY, 1);
+
+   if (recvd > MIN_PKT_SIZE && state->demux && !exp) {
+      debug_print("serv: dropping unclassified dgram\n");
+   } else if (recvd > MIN_PKT_SIZE) {
       debug_print("serv: recvd %dB from internet\n", recvd);
 
+      PERF_BEGIN(PERF_DECAP);
       /* Remove layer 4.5 header */
-      if (state->raw_header) {
+      if (exp) {
+         recvd = demux_decap(exp, buf, recvd);
+         fd_tun = exp->fd_tun;
+      } else if (state->raw_header) {
          if (!state->udp)
-            recvd -= 20; 
+            recvd -= f->hdr_len; 
          recvd -= state->raw_header_size;
          memmove(buf, buf+state->raw_header_size, recvd);
       }
-      /* Add PlanetLab TUN PPI header */
-      if (state->planetlab) {
-         buf-=4; recvd+=4;
-      }
-
+      /* Combine the outer ECN field */
+      if (ecn_decap(tos, buf, recvd) < 0)
+         return ret;
+      /* Map the source port back to the peer base port */
       struct tun_rec *rec = NULL;
-      int sport           = ntohs(((struct sockaddr_in *)nrec->sa4)->sin_port);
+      int sport           = sa_port((struct sockaddr *)&from) - spread_offset(state, buf);
       int sent            = 0;
-      if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
-         sent = xwrite(fd_tun, buf, recvd);
-         debug_print("serv: wrote %dB to tun\n", sent); 
-      } 
-#if !defined(LOCKED)
-      else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
-         sent = xwrite(fd_tun, buf, recvd);
-
-         /* add new record to lookup tables */
-         nrec->sport = sport;
-         g_hash_table_insert(state->serv, &nrec->sport, nrec);
-         debug_print("serv: added new entry: %d\n", sport);
-      } 
-#endif
-      else {
-         debug_print("dropping unknown UDP dgram (NAT ?)\n");
-      }
-          
-   } else if (recvd < 0) {
-       /* recvd ICMP msg */
-      xrecverr(fd_net, buf,  BUFF_SIZE, 0, NULL);
-   } else {
-      /* recvd unknown packet */
-      debug_print("serv: recvd empty pkt\n");
-   }
-   free_tun_rec(nrec);
-}
+      HH_UPDATE(buf, recvd, sport, HH_RX);
+      ACCT_UPDATE(state, buf, recvd, sport, ACCT_RX);
 
-void tun_serv_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
-   struct tun_rec *nrec = init_tun_rec(state);
-   int recvd = xrecvfrom(fd_net, (struct sockaddr *)nrec->sa6, 
-                         &nrec->slen6, buf, BUFF_SIZE);
-
-   if (recvd > MIN_PKT_SIZE) {
-      debug_print("serv: recvd %dB from internet\n", recvd);
-
-      /* Remove layer 4.5 header */
-      if (state->raw_header) {
-         if (!state->udp)
-            recvd -= 40; 
-         recvd -= state->raw_header_size;
-         memmove(buf, buf+state->raw_header_size, recvd);
-      }
       /* Add PlanetLab TUN PPI header */
       if (state->planetlab) {
          buf-=4; recvd+=4;
       }
-
-      struct tun_rec *rec = NULL;
-      int sport           = ntohs(((struct sockaddr_in *)nrec->sa6)->sin_port);
-      int sent            = 0;
-      if ( (rec = g_hash_table_lookup(state->serv, &sport)) ) {
-         sent = xwrite(fd_tun, buf, recvd);
+      PERF_END(PERF_DECAP, 1);
+
+      PERF_BEGIN(PERF_LOOKUP);
+      rec = serv_lookup(state, sport);
+      PERF_END(PERF_LOOKUP, 1);
+      if (rec) {
+         rec->exp = exp;
+         PERF_BEGIN(PERF_TUN_WRITE);
+         sent = queue_write(state->txq_tun, fd_tun, sport, buf, recvd);
+         PERF_END(PERF_TUN_WRITE, 1);
          debug_print("serv: wrote %dB to tun\n", sent); 
       } 
 #if !defined(LOCKED)
-      else if (g_hash_table_size(state->serv) <= state->fd_lim) { 
-         sent = xwrite(fd_tun, buf, recvd);
-
-         /* add new record to lookup tables */
-         nrec->sport = sport;
-         g_hash_table_insert(state->serv, &nrec->sport, nrec);
+      else if (g_hash_table_size(state->serv) <= state->fd_lim &&
+               (rec = serv_learn(state, f, &from, sport))) { 
+         sent = queue_write(state->txq_tun, fd_tun, sport, buf, recvd);
+         rec->exp = exp;
          debug_print("serv: added new entry: %d\n", sport);
       } 
 #endif
@@ -276,19 +300,22 @@ void tun_serv_out6(int fd_net, int fd_tun, struct tun_state *state, char *buf) {
       /* recvd unknown packet */
       debug_print("serv: recvd empty pkt\n");
    }
-   free_tun_rec(nrec);
+   return ret;
 }
 
 void tun_serv_single(struct arguments *args) {
    int fd_net = 0, fd_tun = 0;
-   void (*tun_serv_in_func)(int,int,struct tun_state*,char*);
-   void (*tun_serv_out)(int,int,struct tun_state*,char*);
 
    /* init server state */
    struct tun_state *state = init_tun_state(args);
+   const struct ip_family *f = state->ipv6 ? &ip_family6 : &ip_family4;
+   int fd_net4 = -1, fd_net6 = -1;
 
-   /* create tun if and sockets */
-   tun(state, &fd_tun); 
+   /* configure the tun if and set up the capture while the sockets
+      are created */
+   pthread_t tun_th = tun_async(state, &fd_tun);
+   xthread_create(capture_notun, (void *) state, 1);
+   int64_t t = startup_now();
    if (state->ipv6) {
       if (state->udp)
          fd_net = udp_sock6(state->public_port, 1, state->public_addr6);
@@ -298,8 +325,7 @@ void tun_serv_single(struct arguments *args) {
                                     state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
-      tun_serv_in_func = &tun_serv_in6;
-      tun_serv_out     = &tun_serv_out6;
+      fd_net6 = fd_net;
    } else {
       if (state->udp)
          fd_net = udp_sock4(state->public_port, 1, state->public_addr4);
@@ -309,28 +335,33 @@ void tun_serv_single(struct arguments *args) {
                                     state->public_port, 0), 
                             state->default_if, state->protocol_num, 
                             1, state->planetlab);
-      tun_serv_in_func = &tun_serv_in4;
-      tun_serv_out     = &tun_serv_out4;
+      fd_net4 = fd_net;
    }
 
-   /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
+   startup_phase("sockets", t);
+   pthread_join(tun_th, NULL);
+   demux_tun(state, fd_tun);
+
+   /* wait for the capture threads */
    synchronize();
 
    /* run server */
    debug_print("running serv ...\n");  
    xthread_create(serv_thread, (void*) state, 1);
+   init_inst(state, tun_serv_in, tun_serv_out);
 
    /* init select loop */
-   fd_set input_set;
+   fd_set input_set, output_set;
    struct timeval tv;
-   int sel = 0, fd_max = 0;
+   int sel = 0, fd_max = 0, fd_out = 0;
    char inbuf[BUFF_SIZE], outbuf[BUFF_SIZE];
    char *inbuffer, *outbuffer;
    inbuffer = inbuf;
    outbuffer = outbuf;
 
-   if (state->raw_header) {
+   if (state->demux) {
+      inbuffer += state->demux->max_header_size;
+   } else if (state->raw_header) {
       memcpy(inbuffer, state->raw_header, state->raw_header_size);
       inbuffer += state->raw_header_size;
    }
@@ -344,22 +375,40 @@ void tun_serv_single(struct arguments *args) {
    loop=1;
    signal(SIGINT, serv_shutdown);
    signal(SIGTERM, serv_shutdown);
+   perf_thread("main");
+   startup_mark("forwarding");
 
    while (loop) {
       FD_ZERO(&input_set);
-      FD_SET(fd_net, &input_set);
-      FD_SET(fd_tun, &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_net, &input_set);
+      if (!queue_full(state->txq_net))
+         FD_SET(fd_tun, &input_set);
+      if (state->demux && !queue_full(state->txq_net))
+         fd_max = max(fd_max, demux_fd_set(state->demux, fd_tun, &input_set));
   
-      sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
+      FD_ZERO(&output_set);
+      fd_out = queues_fd_set(state, &output_set);
+
+      sel = impair_select(state, &input_set, &output_set,
+                          max(fd_max, fd_out), &tv, state->inactivity_timeout);
 
       if (sel == 0) {
          debug_print("timeout\n"); 
          break;
       } else if (sel > 0) {
+         uint32_t pkts = 0;
+         queues_flush(state, &output_set);
          if (FD_ISSET(fd_net, &input_set)) 
-            (*tun_serv_out)(fd_net, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_serv_out(fd_net, fd_tun, state, f, outbuffer));
          if (FD_ISSET(fd_tun, &input_set)) 
-            (*tun_serv_in_func)(fd_net, fd_tun, state, inbuffer);
+            BATCH_READ(state, state->txq_net, pkts,
+                       tun_serv_in(fd_tun, fd_net4, fd_net6, state, inbuffer));
+         if (state->demux)
+            tun_serv_in_demux(&input_set, fd_tun, fd_net4, fd_net6, 
+                              state, inbuffer);
+         batch_round(state, pkts);
       }
    }
 }
@@ -370,8 +419,11 @@ void tun_serv_dual(struct arguments *args) {
    /* init server state */
    struct tun_state *state = init_tun_state(args);
 
-   /* create tun if and sockets */
-   tun(state, &fd_tun); 
+   /* configure the tun if and set up the capture while the sockets
+      are created */
+   pthread_t tun_th = tun_async(state, &fd_tun);
+   xthread_create(capture_notun, (void *) state, 1);
+   int64_t t = startup_now();
    if (state->udp) {
       fd_net4 = udp_sock4(state->public_port, 1, state->public_addr4);
       fd_net6 = udp_sock6(state->public_port, 1, state->public_addr6);
@@ -388,24 +440,30 @@ void tun_serv_dual(struct arguments *args) {
                          1, state->planetlab);
    }
 
-   /* run capture threads */
-   xthread_create(capture_notun, (void *) state, 1);
+   startup_phase("sockets", t);
+   pthread_join(tun_th, NULL);
+   demux_tun(state, fd_tun);
+
+   /* wait for the capture threads */
    synchronize();
 
    /* run server */
    debug_print("running serv ...\n");  
    xthread_create(serv_thread, (void*) state, 1);
+   init_inst(state, tun_serv_in, tun_serv_out);
 
    /* init select loop */
-   fd_set input_set;
+   fd_set input_set, output_set;
    struct timeval tv;
-   int sel = 0, fd_max = 0;
+   int sel = 0, fd_max = 0, fd_out = 0;
    char inbuf[BUFF_SIZE], outbuf[BUFF_SIZE];
    char *inbuffer, *outbuffer;
    inbuffer = inbuf;
    outbuffer = outbuf;
 
-   if (state->raw_header) {
+   if (state->demux) {
+      inbuffer += state->demux->max_header_size;
+   } else if (state->raw_header) {
       memcpy(inbuffer, state->raw_header, state->raw_header_size);
       inbuffer += state->raw_header_size;
    }
@@ -419,25 +477,47 @@ void tun_serv_dual(struct arguments *args) {
    loop=1;
    signal(SIGINT, serv_shutdown);
    signal(SIGTERM, serv_shutdown);
+   perf_thread("main");
+   startup_mark("forwarding");
 
    while (loop) {
       FD_ZERO(&input_set);
-      FD_SET(fd_net4, &input_set);
-      FD_SET(fd_net6, &input_set);
-      FD_SET(fd_tun, &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_net4, &input_set);
+      if (!queue_full(state->txq_tun))
+         FD_SET(fd_net6, &input_set);
+      if (!queue_full(state->txq_net))
+         FD_SET(fd_tun, &input_set);
+      if (state->demux && !queue_full(state->txq_net))
+         fd_max = max(fd_max, demux_fd_set(state->demux, fd_tun, &input_set));
   
-      sel = xselect(&input_set, fd_max, &tv, state->inactivity_timeout);
+      FD_ZERO(&output_set);
+      fd_out = queues_fd_set(state, &output_set);
+
+      sel = impair_select(state, &input_set, &output_set,
+                          max(fd_max, fd_out), &tv, state->inactivity_timeout);
 
       if (sel == 0) {
          debug_print("timeout\n"); 
          break;
       } else if (sel > 0) {
+         uint32_t pkts = 0;
+         queues_flush(state, &output_set);
          if (FD_ISSET(fd_net4, &input_set)) 
-            tun_serv_out4(fd_net4, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_serv_out(fd_net4, fd_tun, state, &ip_family4, 
+                                    outbuffer));
          if (FD_ISSET(fd_net6, &input_set)) 
-            tun_serv_out6(fd_net6, fd_tun, state, outbuffer);
+            BATCH_READ(state, state->txq_tun, pkts,
+                       tun_serv_out(fd_net6, fd_tun, state, &ip_family6, 
+                                    outbuffer));
          if (FD_ISSET(fd_tun, &input_set)) 
-            tun_serv_in(fd_tun, fd_net4, fd_net6, state, inbuffer);
+            BATCH_READ(state, state->txq_net, pkts,
+                       tun_serv_in(fd_tun, fd_net4, fd_net6, state, inbuffer));
+         if (state->demux)
+            tun_serv_in_demux(&input_set, fd_tun, fd_net4, fd_net6, 
+                              state, inbuffer);
+         batch_round(state, pkts);
       }
    }
 }
@@ -0,0 +1,504 @@
+/**
+ * \file shm.c
+ * \brief Shared-memory channels between peers on the same host.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sysconfig.h"
+#if defined(LINUX_OS)
+#  include <sys/eventfd.h>
+#  include <sys/syscall.h>
+#  include <linux/memfd.h>
+#endif
+
+#include "shm.h"
+#include "debug.h"
+#include "timing.h"
+#include "destruct.h"
+#include "queue.h"
+#include "sock.h"
+#include "stats.h"
+
+/**
+ * \def SHM_MAGIC
+ * \brief Identifies a ring and a hello message.
+ */
+#define SHM_MAGIC 0x63637368
+
+/**
+ * \def SHM_MAP_SIZE
+ * \brief The size of a mapped ring and its slots.
+ */
+#define SHM_MAP_SIZE (sizeof(struct shm_ring) + SHM_RING_SIZE * SHM_SLOT_SIZE)
+
+/**
+ * \def SHM_PORTS
+ * \brief The amount of unique ports.
+ */
+#define SHM_PORTS 65536
+
+/**
+ * \struct shm_hello
+ *	\brief The message passing a ring and its doorbell.
+ */
+struct shm_hello {
+   uint32_t magic;   /*!< SHM_MAGIC */
+   int32_t  peer;    /*!< The sender unique port */
+   uint32_t size;    /*!< The ring size */
+};
+
+/**
+ * \var static int lfd
+ * \brief The listening socket, -1 if disabled.
+ */
+static int lfd = -1;
+
+/**
+ * \var static int self
+ * \brief The local unique port.
+ */
+static int self;
+
+/**
+ * \var static char *dir
+ * \brief The directory of the listening sockets.
+ */
+static char *dir;
+
+/**
+ * \var static char path[]
+ * \brief The listening socket path.
+ */
+static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/**
+ * \var static struct shm_chan out[]
+ * \brief The outbound channels (producer side).
+ */
+static struct shm_chan out[SHM_MAX_CHANNELS];
+
+/**
+ * \var static struct shm_chan in[]
+ * \brief The inbound channels (consumer side), ring is NULL until
+ *        the hello message is received.
+ */
+static struct shm_chan in[SHM_MAX_CHANNELS];
+
+/**
+ * \var static int out_len
+ * \brief The amount of outbound channels.
+ */
+static int out_len;
+
+/**
+ * \var static int in_len
+ * \brief The amount of inbound channels.
+ */
+static int in_len;
+
+/**
+ * \var static uint8_t by_peer[]
+ * \brief Outbound channel index + 1 per peer unique port, 0 if none.
+ */
+static uint8_t by_peer[SHM_PORTS];
+
+/**
+ * \var static uint32_t next_try[]
+ * \brief Time of the next connection attempt per peer unique port.
+ */
+static uint32_t next_try[SHM_PORTS];
+
+static uint64_t pkts_out;     /*!< Packets sent over channels */
+static uint64_t pkts_in;      /*!< Packets received over channels */
+static uint64_t ring_drops;   /*!< Packets dropped on full ring */
+static uint64_t wakeups;      /*!< Doorbells rung */
+static uint64_t attached;     /*!< Channels set up */
+static uint64_t detached;     /*!< Channels torn down */
+
+/**
+ * \fn static int sock_path(char *dst, int port)
+ * \brief Build the socket path of a peer.
+ *
+ * \return 0 for success, -1 if too long
+ */
+static int sock_path(char *dst, int port);
+
+/**
+ * \fn static struct shm_chan *shm_connect(int peer)
+ * \brief Set up an outbound channel if the peer listens in dir.
+ *
+ * \return The channel or NULL
+ */
+static struct shm_chan *shm_connect(int peer);
+
+/**
+ * \fn static int shm_accept(struct shm_chan *c)
+ * \brief Map the ring of an inbound channel from its hello message.
+ *
+ * \return 0 for success, -1 to tear the channel down
+ */
+static int shm_accept(struct shm_chan *c);
+
+/**
+ * \fn static void shm_drain(struct shm_chan *c, int fd_tun, struct tun_state *state)
+ * \brief Write the packets of an inbound ring to tun.
+ */
+static void shm_drain(struct shm_chan *c, int fd_tun, struct tun_state *state);
+
+/**
+ * \fn static void shm_close(struct shm_chan *chans, int *len, int i)
+ * \brief Tear a channel down, the last channel takes its place.
+ */
+static void shm_close(struct shm_chan *chans, int *len, int i);
+
+/**
+ * \fn static void shm_cleanup()
+ * \brief Remove the listening socket at exit.
+ */
+static void shm_cleanup();
+
+/**
+ * \fn static void shm_stats(FILE *fp, void *arg)
+ * \brief Dump the channel counters.
+ */
+static void shm_stats(FILE *fp, void *arg);
+
+int sock_path(char *dst, int port) {
+   int len = snprintf(dst, sizeof(path), "%s/copycat-%d.sock", dir, port);
+   return len < 0 || len >= (int)sizeof(path) ? -1 : 0;
+}
+
+void init_shm(struct tun_state *state) {
+#if defined(LINUX_OS)
+   dir  = state->shm_dir;
+   self = state->port;
+   if (sock_path(path, self) < 0) {
+      errno=ENAMETOOLONG;
+      die("shm-dir");
+   }
+
+   struct sockaddr_un sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sun_family = AF_UNIX;
+   strcpy(sa.sun_path, path);
+
+   /* a previous instance may have left its socket */
+   unlink(path);
+   if ((lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)) < 0)
+      die("shm socket");
+   set_fd(lfd);
+   if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+      die("shm bind");
+   if (listen(lfd, SHM_MAX_CHANNELS) < 0)
+      die("shm listen");
+   atexit(shm_cleanup);
+
+   stats_register("shm", shm_stats, NULL);
+   debug_print("shm: listening at %s\n", path);
+#else
+   errno=ENOTSUP;
+   die("shm-dir");
+#endif
+}
+
+void shm_cleanup() {
+   unlink(path);
+}
+
+struct shm_chan *shm_connect(int peer) {
+#if defined(LINUX_OS)
+   uint32_t t = monotonic_ns() / 1000000000;
+   if (next_try[peer] > t || out_len == SHM_MAX_CHANNELS)
+      return NULL;
+   next_try[peer] = t + SHM_RETRY;
+
+   /* the peer is co-located if its socket is reachable */
+   struct sockaddr_un sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sun_family = AF_UNIX;
+   if (sock_path(sa.sun_path, peer) < 0)
+      return NULL;
+   int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+   if (s < 0)
+      return NULL;
+   if (connect(s, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+      close(s);
+      return NULL;
+   }
+
+   /* ring and doorbell */
+   int mfd = syscall(__NR_memfd_create, "copycat-shm", MFD_CLOEXEC);
+   int bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   struct shm_ring *ring = MAP_FAILED;
+   if (mfd < 0 || bell < 0 || ftruncate(mfd, SHM_MAP_SIZE) < 0 ||
+       (ring = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, mfd, 0)) == MAP_FAILED)
+      goto err;
+   ring->magic = SHM_MAGIC;
+
+   /* pass them to the peer */
+   struct shm_hello hello = { SHM_MAGIC, self, SHM_MAP_SIZE };
+   struct iovec iov = { &hello, sizeof(hello) };
+   char ctl[CMSG_SPACE(2 * sizeof(int))];
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   memset(ctl, 0, sizeof(ctl));
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_control    = ctl;
+   msg.msg_controllen = sizeof(ctl);
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type  = SCM_RIGHTS;
+   cmsg->cmsg_len   = CMSG_LEN(2 * sizeof(int));
+   int fds[2] = { mfd, bell };
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+   if (sendmsg(s, &msg, MSG_NOSIGNAL) != sizeof(hello))
+      goto err;
+   close(mfd);
+
+   struct shm_chan *c = &out[out_len++];
+   c->peer  = peer;
+   c->ctl   = s;
+   c->bell  = bell;
+   c->ring  = ring;
+   c->slots = (char *)(ring + 1);
+   set_fd(s); set_fd(bell);
+   by_peer[peer] = out_len;
+   attached++;
+   debug_print("shm: peer %d is co-located\n", peer);
+   return c;
+
+err:
+   debug_print("shm: peer %d: %s\n", peer, strerror(errno));
+   if (ring != MAP_FAILED)
+      munmap(ring, SHM_MAP_SIZE);
+   if (mfd >= 0)
+      close(mfd);
+   if (bell >= 0)
+      close(bell);
+   close(s);
+   return NULL;
+#else
+   return NULL;
+#endif
+}
+
+int shm_send(int peer, const char *buf, int len) {
+   if (lfd < 0 || peer == self || peer <= 0 || peer >= SHM_PORTS ||
+       len > SHM_SLOT_SIZE - 4)
+      return -1;
+
+   struct shm_chan *c;
+   if (by_peer[peer])
+      c = &out[by_peer[peer] - 1];
+   else if (!(c = shm_connect(peer)))
+      return -1;
+
+   struct shm_ring *r = c->ring;
+   uint32_t tail = r->tail;
+   if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == SHM_RING_SIZE) {
+      ring_drops++;
+      return 0;
+   }
+   uint32_t i = tail & (SHM_RING_SIZE - 1);
+   memcpy(c->slots + i * SHM_SLOT_SIZE + 4, buf, len);
+   r->len[i] = len;
+   __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+   pkts_out++;
+
+   /* ring if the consumer had emptied the ring, it may be asleep */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+      uint64_t one = 1;
+      if (write(c->bell, &one, sizeof(one)) < 0) {
+         debug_print("shm: doorbell: %s\n", strerror(errno));
+      }
+      wakeups++;
+   }
+   return 0;
+}
+
+int shm_fd_set(fd_set *input_set, int tun_full) {
+   if (lfd < 0)
+      return -1;
+   int fd_max = lfd;
+   FD_SET(lfd, input_set);
+   for (int i=0; i<out_len; i++) {
+      FD_SET(out[i].ctl, input_set);
+      fd_max = max(fd_max, out[i].ctl);
+   }
+   for (int i=0; i<in_len; i++) {
+      FD_SET(in[i].ctl, input_set);
+      fd_max = max(fd_max, in[i].ctl);
+      if (in[i].ring && !tun_full) {
+         FD_SET(in[i].bell, input_set);
+         fd_max = max(fd_max, in[i].bell);
+      }
+   }
+   return fd_max;
+}
+
+int shm_accept(struct shm_chan *c) {
+   struct shm_hello hello;
+   struct iovec iov = { &hello, sizeof(hello) };
+   char ctl[CMSG_SPACE(2 * sizeof(int))];
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_control    = ctl;
+   msg.msg_controllen = sizeof(ctl);
+
+   ssize_t len = recvmsg(c->ctl, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+   if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+       cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+      return -1;
+   int fds[2];
+   memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+   struct stat st;
+   if (len != sizeof(hello) || hello.magic != SHM_MAGIC ||
+       hello.size != SHM_MAP_SIZE || fstat(fds[0], &st) < 0 ||
+       st.st_size < (off_t)SHM_MAP_SIZE ||
+       (c->ring = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+      c->ring = NULL;
+      close(fds[0]); close(fds[1]);
+      return -1;
+   }
+   close(fds[0]);
+   c->peer  = hello.peer;
+   c->bell  = fds[1];
+   c->slots = (char *)(c->ring + 1);
+   set_fd(c->bell);
+   attached++;
+   debug_print("shm: accepted peer %d\n", c->peer);
+   return 0;
+}
+
+void shm_drain(struct shm_chan *c, int fd_tun, struct tun_state *state) {
+   struct shm_ring *r = c->ring;
+   uint64_t cnt;
+   if (read(c->bell, &cnt, sizeof(cnt)) < 0 && !(errno == EAGAIN || errno == EWOULDBLOCK)) {
+      debug_print("shm: doorbell: %s\n", strerror(errno));
+   }
+
+   uint32_t head = r->head;
+   for (;;) {
+      uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+         /* publish head then check again, see shm_send */
+         __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+         __atomic_thread_fence(__ATOMIC_SEQ_CST);
+         if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+            break;
+         continue;
+      }
+      for (; head != tail && !queue_full(state->txq_tun); head++) {
+         uint32_t i = head & (SHM_RING_SIZE - 1);
+         char *pkt = c->slots + i * SHM_SLOT_SIZE + 4;
+         int len = r->len[i];
+         if (len > SHM_SLOT_SIZE - 4)
+            continue;
+
+         /* Add PlanetLab TUN PPI header */
+         if (state->planetlab) {
+            pkt -= 4; len += 4;
+            pkt[0]=0; pkt[1]=0;
+            pkt[2]=8; pkt[3]=0;
+         }
+         queue_write(state->txq_tun, fd_tun, c->peer, pkt, len);
+         pkts_in++;
+      }
+      __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+      if (queue_full(state->txq_tun)) {
+         /* ring again, the doorbell is polled once tun is flushed */
+         uint64_t one = 1;
+         if (write(c->bell, &one, sizeof(one)) < 0) {
+            debug_print("shm: doorbell: %s\n", strerror(errno));
+         }
+         break;
+      }
+   }
+}
+
+void shm_close(struct shm_chan *chans, int *len, int i) {
+   struct shm_chan *c = &chans[i];
+   debug_print("shm: closing channel with peer %d\n", c->peer);
+   if (c->ring) {
+      munmap(c->ring, SHM_MAP_SIZE);
+      close_fd(c->bell);
+      detached++;
+   }
+   close_fd(c->ctl);
+   if (chans == out) {
+      by_peer[c->peer] = 0;
+      next_try[c->peer] = monotonic_ns() / 1000000000 + SHM_RETRY;
+   }
+
+   *c = chans[--*len];
+   if (chans == out && i < *len)
+      by_peer[c->peer] = i + 1;
+}
+
+void shm_recv(fd_set *input_set, int fd_tun, struct tun_state *state) {
+   if (lfd < 0)
+      return;
+
+   /* new channels */
+   if (FD_ISSET(lfd, input_set)) {
+      int s;
+      while (in_len < SHM_MAX_CHANNELS && (s = accept(lfd, NULL, NULL)) >= 0) {
+         set_fd(s);
+         memset(&in[in_len], 0, sizeof(struct shm_chan));
+         in[in_len].ctl = s;
+         in[in_len++].bell = -1;
+      }
+   }
+
+   for (int i=in_len-1; i>=0; i--) {
+      struct shm_chan *c = &in[i];
+      if (FD_ISSET(c->ctl, input_set)) {
+         /* hello, then only hang-ups */
+         char b;
+         if ((c->ring ? recv(c->ctl, &b, 1, MSG_DONTWAIT) != -1 || !(errno == EAGAIN || errno == EWOULDBLOCK)
+                      : shm_accept(c) < 0)) {
+            shm_close(in, &in_len, i);
+            continue;
+         }
+      }
+      if (c->ring && FD_ISSET(c->bell, input_set) && !queue_full(state->txq_tun))
+         shm_drain(c, fd_tun, state);
+   }
+
+   for (int i=out_len-1; i>=0; i--)
+      if (FD_ISSET(out[i].ctl, input_set))
+         shm_close(out, &out_len, i);
+}
+
+void shm_stats(FILE *fp, void *UNUSED(arg)) {
+   fprintf(fp, "channels_out %d\n", out_len);
+   fprintf(fp, "channels_in %d\n", in_len);
+   fprintf(fp, "attached %llu\n", (unsigned long long)attached);
+   fprintf(fp, "detached %llu\n", (unsigned long long)detached);
+   fprintf(fp, "pkts_out %llu\n", (unsigned long long)pkts_out);
+   fprintf(fp, "pkts_in %llu\n", (unsigned long long)pkts_in);
+   fprintf(fp, "ring_drops %llu\n", (unsigned long long)ring_drops);
+   fprintf(fp, "wakeups %llu\n", (unsigned long long)wakeups);
+}
@@ -0,0 +1,118 @@
+/**
+ * \file shm.h
+ * \brief Shared-memory channels between peers on the same host.
+ *
+ *    Each peer listens on a unix socket named after its unique port in
+ *    shm-dir (e.g. /dev/shm, or a volume shared by containers), which
+ *    advertises it to co-located peers. Before sending to a peer over
+ *    UDP, a peer tries to connect to its socket; when this succeeds,
+ *    the peers are on the same host and the sender passes a memfd
+ *    ring and an eventfd doorbell (SCM_RIGHTS). Inner packets are then
+ *    copied to the single-producer single-consumer ring and the
+ *    receiver writes them to its tun interface, bypassing the network
+ *    stack. The doorbell is rung only when the ring was empty. A closed
+ *    control socket tears the channel down and the sender falls back
+ *    to UDP.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SHM_H
+#define UDPTUN_SHM_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "state.h"
+
+/**
+ * \def SHM_RING_SIZE
+ * \brief The ring size (packets), a power of 2.
+ */
+#define SHM_RING_SIZE 512
+
+/**
+ * \def SHM_SLOT_SIZE
+ * \brief The slot size, 4 bytes of headroom (PlanetLab PPI) and a packet.
+ */
+#define SHM_SLOT_SIZE 2048
+
+/**
+ * \def SHM_MAX_CHANNELS
+ * \brief The maximal amount of inbound and outbound channels.
+ */
+#define SHM_MAX_CHANNELS 64
+
+/**
+ * \def SHM_RETRY
+ * \brief Seconds between two connection attempts to a peer.
+ */
+#define SHM_RETRY 5
+
+/**
+ * \struct shm_ring
+ *	\brief The shared ring, followed by SHM_RING_SIZE slots.
+ */
+struct shm_ring {
+   uint32_t magic;                               /*!< SHM_MAGIC */
+   uint32_t head __attribute__((aligned(64)));   /*!< Consumer index */
+   uint32_t tail __attribute__((aligned(64)));   /*!< Producer index */
+   uint16_t len[SHM_RING_SIZE] __attribute__((aligned(64))); /*!< Packet lengths */
+};
+
+/**
+ * \struct shm_chan
+ *	\brief A channel with a co-located peer.
+ */
+struct shm_chan {
+   int              peer;      /*!< The peer unique port */
+   int              ctl;       /*!< The control socket */
+   int              bell;      /*!< The eventfd doorbell */
+   struct shm_ring *ring;      /*!< The mapped ring */
+   char            *slots;     /*!< The mapped slots */
+};
+
+/**
+ * \fn void init_shm(struct tun_state *state)
+ * \brief Listen for co-located peers in state->shm_dir.
+ *
+ * \param state The program state
+ */
+void init_shm(struct tun_state *state);
+
+/**
+ * \fn int shm_send(int peer, const char *buf, int len)
+ * \brief Copy a tun packet to the channel of a peer, connecting
+ *        to the peer first if it may be co-located.
+ *
+ * \param peer The peer unique port
+ * \param buf The inner packet
+ * \param len The packet length
+ * \return 0 if the packet was handled (sent or dropped on full ring),
+ *         -1 to send it over the network
+ */
+int shm_send(int peer, const char *buf, int len);
+
+/**
+ * \fn int shm_fd_set(fd_set *input_set, int tun_full)
+ * \brief Add the listening, control and doorbell fds to a set.
+ *
+ * \param input_set The select() input set
+ * \param tun_full 1 if the tun queue is full, doorbells are then left out
+ * \return The highest fd set, -1 if none
+ */
+int shm_fd_set(fd_set *input_set, int tun_full);
+
+/**
+ * \fn void shm_recv(fd_set *input_set, int fd_tun, struct tun_state *state)
+ * \brief Accept channels, tear closed ones down and write the
+ *        packets of the rung channels to tun.
+ *
+ * \param input_set The select() result
+ * \param fd_tun The tun fd
+ * \param state The program state
+ */
+void shm_recv(fd_set *input_set, int fd_tun, struct tun_state *state);
+
+#endif
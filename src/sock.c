@@ -17,6 +17,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -46,6 +47,8 @@
 #include "net.h"
 #include "xpcap.h"
 #include "destruct.h"
+#include "sockbuf.h"
+#include "ecn.h"
 
 /**
  * \fn static build_sel(fd_set *input_set, int *fds_raw, int len, int *max_fd_raw)
@@ -59,8 +62,50 @@
  */ 
 static void build_sel(fd_set *input_set, int *fds_raw, int len, int *max_fd_raw);
 
+/**
+ * \fn static int recv_ovfl(int fd, struct sockaddr *sa, socklen_t *salen, void *buf, size_t buflen, int *tos)
+ * \brief recvfrom() that also reads the SO_RXQ_OVFL drop counter and
+ *        the IP_TOS/IPV6_TCLASS control message.
+ *
+ * \param fd The socket fd.
+ * \param sa The source address or NULL.
+ * \param salen The source address length, modified on return, or NULL.
+ * \param buf The buffer.
+ * \param buflen The buffer length.
+ * \param tos The TOS/traffic class, -1 if absent, or NULL.
+ * \return The amount of bytes received, -1 on error (errno is filled)
+ */ 
+static int recv_ovfl(int fd, struct sockaddr *sa, socklen_t *salen,
+                     void *buf, size_t buflen, int *tos);
+
+/**
+ * \fn static void set_reuseport(int fd, int reuse)
+ * \brief Set SO_REUSEPORT before bind. The group leader steers all
+ *        incoming datagrams to itself (the first socket of the group).
+ *
+ * \param fd The socket fd.
+ * \param reuse 0 to do nothing, 1 for a group member, 2 for the leader.
+ */ 
+static void set_reuseport(int fd, int reuse);
+
+/**
+ * \fn static int udp_sock4_aux(int port, uint8_t register_gc, char *addr, int reuse)
+ * \brief Create and bind an IPv4 UDP DGRAM socket.
+ *
+ * \param reuse See set_reuseport().
+ */ 
+static int udp_sock4_aux(int port, uint8_t register_gc, char *addr, int reuse);
+
+/**
+ * \fn static int udp_sock6_aux(int port, uint8_t register_gc, char *addr, int reuse)
+ * \brief Create and bind an IPv6 UDP DGRAM socket.
+ *
+ * \param reuse See set_reuseport().
+ */ 
+static int udp_sock6_aux(int port, uint8_t register_gc, char *addr, int reuse);
+
 struct sockaddr_in *get_addr4(const char *addr, int port) {
-   struct sockaddr_in *ret = calloc(0, sizeof(struct sockaddr_in));
+   struct sockaddr_in *ret = calloc(1, sizeof(struct sockaddr_in));
    if (addr) {
       if (!inet_pton(AF_INET, addr, &ret->sin_addr))
          die("inet_pton");
@@ -73,7 +118,7 @@ struct sockaddr_in *get_addr4(const char *addr, int port) {
    return ret;
 }
 struct sockaddr_in6 *get_addr6(const char *addr, int port) {
-   struct sockaddr_in6 *ret = calloc(0, sizeof(struct sockaddr_in6));
+   struct sockaddr_in6 *ret = calloc(1, sizeof(struct sockaddr_in6));
    if (addr) {
       if (!inet_pton(AF_INET6, addr, &ret->sin6_addr))
          die("inet_pton");
@@ -87,12 +132,21 @@ struct sockaddr_in6 *get_addr6(const char *addr, int port) {
 }
 
 int udp_sock6(int port, uint8_t register_gc, char *addr) {
+   return udp_sock6_aux(port, register_gc, addr, 0);
+}
+
+int udp_reuse_sock6(int port, char *addr, int leader) {
+   return udp_sock6_aux(port, 1, addr, leader ? 2 : 1);
+}
+
+int udp_sock6_aux(int port, uint8_t register_gc, char *addr, int reuse) {
    int s;
    /* UDP socket */
    if ((s=socket(AF_INET6, SOCK_DGRAM, 0)) == -1)
       die("socket");
    if (register_gc)
       set_fd(s);
+   set_reuseport(s, reuse);
 
    /* sockaddr */
    struct sockaddr_in6 sin;
@@ -105,11 +159,9 @@ int udp_sock6(int port, uint8_t register_gc, char *addr) {
    if( bind(s, (struct sockaddr*)&sin, sizeof(sin) ) == -1)
       die("bind udp socket");
 
-   int sndbuf = 1024*1024, rcvbuf = 1024*1024;
-   if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)))
-      die("SNDBUF");
-   if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
-      die("RCVBUF");
+   sockbuf_register(s, 1, port);
+   ecn_sock(s, 1);
+   set_nonblock(s);
 
 #if defined(IPV6_RECVERR)
    /* enable icmp catching */
@@ -122,12 +174,21 @@ int udp_sock6(int port, uint8_t register_gc, char *addr) {
 }
 
 int udp_sock4(int port, uint8_t register_gc, char *addr) {
+   return udp_sock4_aux(port, register_gc, addr, 0);
+}
+
+int udp_reuse_sock4(int port, char *addr, int leader) {
+   return udp_sock4_aux(port, 1, addr, leader ? 2 : 1);
+}
+
+int udp_sock4_aux(int port, uint8_t register_gc, char *addr, int reuse) {
    int s;
    /* UDP socket */
    if ((s=socket(AF_INET, SOCK_DGRAM, 0)) == -1)
       die("socket");
    if (register_gc)
       set_fd(s);
+   set_reuseport(s, reuse);
 
    /* sockaddr */
    struct sockaddr_in sin;
@@ -140,11 +201,9 @@ int udp_sock4(int port, uint8_t register_gc, char *addr) {
    if( bind(s, (struct sockaddr*)&sin, sizeof(sin) ) == -1)
       die("bind udp socket");
 
-   int sndbuf = 1024*1024, rcvbuf = 1024*1024;
-   if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)))
-      die("SNDBUF");
-   if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
-      die("RCVBUF");
+   sockbuf_register(s, 0, port);
+   ecn_sock(s, 0);
+   set_nonblock(s);
 
 #if defined(IP_RECVERR)
    /* enable icmp catching */
@@ -156,6 +215,24 @@ int udp_sock4(int port, uint8_t register_gc, char *addr) {
    return s;
 }
 
+void set_reuseport(int fd, int reuse) {
+   if (!reuse)
+      return;
+#if defined(SO_REUSEPORT)
+   int on = 1;
+   if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+      die("SO_REUSEPORT");
+#endif
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+   /* always select socket 0 of the group, i.e. the leader */
+   struct sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+   struct sock_fprog prog = { .len = 1, .filter = code };
+   if (reuse == 2 && 
+         setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+      die("SO_ATTACH_REUSEPORT_CBPF");
+#endif
+}
+
 #if defined(LINUX_OS)
 int raw_tcp_sock4(int port, char *addr, const struct sock_fprog * bpf, const char *dev,
                  int planetlab) {
@@ -190,6 +267,8 @@ int raw_sock4(int port, char *addr, const struct sock_fprog * bpf, const char *d
    /* bind socket to port (PL-specific) */
    if(port && bind(s, (struct sockaddr*)&sin, sizeof(sin) ) == -1) 
      die("bind");
+   ecn_sock(s, 0);
+   set_nonblock(s);
 
    debug_print("raw socket created on %s port %d\n", dev, port);
    return s;
@@ -223,39 +302,39 @@ int raw_sock6(int port, char *addr, const struct sock_fprog * bpf, const char *d
    /* bind socket to port (PL-specific) */
    if(port && bind(s, (struct sockaddr*)&sin, sizeof(sin) ) == -1) 
      die("bind");
+   set_nonblock(s);
 
    debug_print("raw socket created on %s port %d\n", dev, port);
    return s;
 }
 #endif
 
-int xselect(fd_set *input_set, int fd_max, struct timeval *tv, int timeout) {
+int xselect(fd_set *input_set, fd_set *output_set, int fd_max, 
+            struct timeval *tv, int timeout) {
    int sel;
    if (timeout != -1) {
       tv->tv_sec  = timeout;
       tv->tv_usec = 0;
-      sel = select(fd_max+1, input_set, NULL, NULL, tv);
+      sel = select(fd_max+1, input_set, output_set, NULL, tv);
    } else {
-      sel = select(fd_max+1, input_set, NULL, NULL, NULL);
+      sel = select(fd_max+1, input_set, output_set, NULL, NULL);
    }
    if (sel < 0) die("select");
    return sel;
 }
 
-int xsendto4(int fd, struct sockaddr *sa, const void *buf, 
-            size_t buflen) {
-   int sent = 0;
-   if ((sent = sendto(fd, buf, buflen, 0, sa, sizeof(struct sockaddr_in))) < 0) {
-       //die("sendto");
-      return sent;
-    }
-   return sent;
+void set_nonblock(int fd) {
+   int flags = fcntl(fd, F_GETFL, 0);
+   if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      die("O_NONBLOCK");
 }
 
-int xsendto6(int fd, struct sockaddr *sa, const void *buf, 
+int xsendto(int fd, struct sockaddr *sa, const void *buf, 
             size_t buflen) {
+   socklen_t salen = sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                               : sizeof(struct sockaddr_in);
    int sent = 0;
-   if ((sent = sendto(fd, buf, buflen, 0, sa, sizeof(struct sockaddr_in6))) < 0) {
+   if ((sent = sendto(fd, buf, buflen, 0, sa, salen)) < 0) {
        //die("sendto");
       return sent;
     }
@@ -283,8 +362,11 @@ int xrecverr(int fd, void *buf, size_t buflen, int fd_out, struct tun_state *sta
    msg.msg_controllen = buflen;
 
    /* recv msg */
-   if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+   if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+         return -1;
       die("recvmsg");
+   }
 
    /* parse msg */
    for (cmsg = CMSG_FIRSTHDR(&msg);cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
@@ -311,9 +393,56 @@ int xrecverr(int fd, void *buf, size_t buflen, int fd_out, struct tun_state *sta
    return 0;
 }
 
+int recv_ovfl(int fd, struct sockaddr *sa, socklen_t *salen,
+              void *buf, size_t buflen, int *tos) {
+   char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int))];
+   struct iovec iov;
+   struct msghdr msg;
+
+   iov.iov_base       = buf;
+   iov.iov_len        = buflen;
+   msg.msg_name       = sa;
+   msg.msg_namelen    = salen ? *salen : 0;
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_flags      = 0;
+   msg.msg_control    = control;
+   msg.msg_controllen = sizeof(control);
+
+   int recvd = recvmsg(fd, &msg, 0);
+   if (recvd < 0)
+      return -1;
+   if (salen)
+      *salen = msg.msg_namelen;
+   if (tos)
+      *tos = -1;
+
+   struct cmsghdr *cmsg;
+   for (cmsg = CMSG_FIRSTHDR(&msg);cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#if defined(SO_RXQ_OVFL)
+      /* only present once the socket dropped something */
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+         uint32_t ovfl;
+         memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+         sockbuf_rx_ovfl(fd, ovfl);
+      }
+#endif
+#if defined(IP_RECVTOS)
+      /* IP_TOS is a byte, IPV6_TCLASS an int */
+      if (tos && cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS)
+         *tos = *(uint8_t *)CMSG_DATA(cmsg);
+#endif
+#if defined(IPV6_RECVTCLASS)
+      if (tos && cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_TCLASS)
+         memcpy(tos, CMSG_DATA(cmsg), sizeof(int));
+#endif
+   }
+   return recvd;
+}
+
 int xrecv(int fd, void *buf, size_t buflen) {
    int recvd = 0;
-   if ((recvd = recvfrom(fd, buf, buflen, 0, NULL, 0)) < 0) {
+   if ((recvd = recv_ovfl(fd, NULL, NULL, buf, buflen, NULL)) < 0) {
       debug_print("%s\n",strerror(errno));
       return -1;
    }
@@ -324,7 +453,17 @@ int xrecvfrom(int fd, struct sockaddr *sa,
               unsigned int *salen, 
               void *buf, size_t buflen) {
    int recvd = 0;
-   if ((recvd = recvfrom(fd, buf, buflen, 0, sa, salen)) < 0) {
+   if ((recvd = recv_ovfl(fd, sa, salen, buf, buflen, NULL)) < 0) {
+      debug_print("%s\n",strerror(errno));
+      return -1;
+   }
+   return recvd;
+}
+
+int xrecvtos(int fd, struct sockaddr *sa, unsigned int *salen, 
+             void *buf, size_t buflen, int *tos) {
+   int recvd = 0;
+   if ((recvd = recv_ovfl(fd, sa, salen, buf, buflen, tos)) < 0) {
       debug_print("%s\n",strerror(errno));
       return -1;
    }
@@ -333,8 +472,11 @@ int xrecvfrom(int fd, struct sockaddr *sa,
 
 int xread(int fd, char *buf, int buflen) {
    int nread;
-   if((nread=read(fd, buf, buflen)) < 0) 
+   if((nread=read(fd, buf, buflen)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+         return 0;
       die("read");
+   }
    return nread;
 }
 
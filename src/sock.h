@@ -93,6 +93,32 @@ int udp_sock4(int port, uint8_t register_gc, char *addr);
  */ 
 int udp_sock6(int port, uint8_t register_gc, char *addr);
 
+/**
+ * \fn int udp_reuse_sock4(int port, char *addr, int leader)
+ * \brief Create and bind an IPv4 UDP DGRAM socket sharing its port
+ *        (SO_REUSEPORT) with other sockets. Where supported, the 
+ *        group leader receives all datagrams and the members are
+ *        only used to send. The leader must be created first.
+ *
+ * \param port The port for the bind call.
+ * \param addr The address for the bind call.
+ * \param leader 1 for the group leader, 0 for a member.
+ * \return The socket fd.
+ */ 
+int udp_reuse_sock4(int port, char *addr, int leader);
+
+/**
+ * \fn int udp_reuse_sock6(int port, char *addr, int leader)
+ * \brief Create and bind an IPv6 UDP DGRAM socket sharing its port.
+ *        See udp_reuse_sock4().
+ *
+ * \param port The port for the bind call.
+ * \param addr The address for the bind call.
+ * \param leader 1 for the group leader, 0 for a member.
+ * \return The socket fd.
+ */ 
+int udp_reuse_sock6(int port, char *addr, int leader);
+
 #if defined(LINUX_OS)
 /**
  * \fn int raw_tcp_sock4(const char *addr, int port, const struct sock_fprog * bpf, const char *dev)
@@ -135,13 +161,12 @@ int raw_sock6(int port, char *addr, const struct sock_fprog * bpf, const char *d
  * \brief sendto syscall wrapper that dies with failure.
  *
  * \param fd The file descriptor of the sending socket. 
- * \param sa The address of the target.
+ * \param sa The v4 or v6 address of the target.
  * \param buf A pointer to the buffer.
  * \param buflen The size of the buffer.
  * \return The amount of bytes sent.
  */ 
-int xsendto4(int fd, struct sockaddr *sa, const void *buf, size_t buflen);
-int xsendto6(int fd, struct sockaddr *sa, const void *buf, size_t buflen);
+int xsendto(int fd, struct sockaddr *sa, const void *buf, size_t buflen);
 
 /**
  * \fn int xrecv(int fd, void *buf, size_t buflen)
@@ -155,16 +180,26 @@ int xsendto6(int fd, struct sockaddr *sa, const void *buf, size_t buflen);
 int xrecv(int fd, void *buf, size_t buflen);
 
 /**
- * \fn int xselect(fd_set *input_set, int fd_max, struct timeval *tv, int timeout)
+ * \fn int xselect(fd_set *input_set, fd_set *output_set, int fd_max, struct timeval *tv, int timeout)
  * \brief select wrapper
  *
  * \param input_set fd set
+ * \param output_set write fd set or NULL
  * \param fd_max max fd value
  * \param tv a pointer to a struct timeval
  * \param timeout The timeout value, -1 for infinite
  * \return The amount of bytes received.
  */ 
-int xselect(fd_set *input_set, int fd_max, struct timeval *tv, int timeout);
+int xselect(fd_set *input_set, fd_set *output_set, int fd_max, 
+            struct timeval *tv, int timeout);
+
+/**
+ * \fn void set_nonblock(int fd)
+ * \brief Set O_NONBLOCK on a fd, dies with failure.
+ *
+ * \param fd The fd
+ */ 
+void set_nonblock(int fd);
 
 /**
  * \fn int xrecvfrom(int fd, struct sockaddr *sa, unsigned int *salen, void *buf, size_t buflen)
@@ -179,6 +214,21 @@ int xselect(fd_set *input_set, int fd_max, struct timeval *tv, int timeout);
  */ 
 int xrecvfrom(int fd, struct sockaddr *sa, unsigned int *salen, void *buf, size_t buflen);
 
+/**
+ * \fn int xrecvtos(int fd, struct sockaddr *sa, unsigned int *salen, void *buf, size_t buflen, int *tos)
+ * \brief xrecvfrom that also returns the outer TOS/traffic class (see ecn_sock()).
+ *
+ * \param fd The file descriptor of the receiving socket. 
+ * \param sa modified on return to indicate the source address, or NULL.
+ * \param salen modified on return to indicate the actual size of the source address, or NULL.
+ * \param buf A pointer to the buffer.
+ * \param buflen The size of the buffer.
+ * \param tos modified on return to indicate the TOS/traffic class, -1 if unknown.
+ * \return The amount of bytes received.
+ */ 
+int xrecvtos(int fd, struct sockaddr *sa, unsigned int *salen, 
+             void *buf, size_t buflen, int *tos);
+
 /**
  * \fn int xrecverr(int fd, void *buf, size_t buflen)
  * \brief Receive an error msg from MSG_ERRQUEUE and print a description 
@@ -191,7 +241,7 @@ int xrecvfrom(int fd, struct sockaddr *sa, unsigned int *salen, void *buf, size_
  * \param state udptun state to forward or NULL
  * 
  * \return 0 if an error msg was received, 
- *         a negative value if an error happened
+ *         a negative value if the error queue was empty
  */ 
 int xrecverr(int fd, void *buf, size_t buflen, int fd_out, struct tun_state *state);
 
@@ -202,7 +252,7 @@ int xrecverr(int fd, void *buf, size_t buflen, int fd_out, struct tun_state *sta
  * \param fd The file descriptor of the receiving socket. 
  * \param buf A pointer to the buffer.
  * \param buflen The size of the buffer.
- * \return The amount of bytes read.
+ * \return The amount of bytes read, 0 if a non-blocking fd had no data.
  */ 
 int xread(int fd, char *buf, int buflen);
 
@@ -0,0 +1,231 @@
+/**
+ * \file sockbuf.c
+ * \brief Adaptive UDP socket buffers.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "sockbuf.h"
+#include "debug.h"
+#include "sock.h"
+#include "stats.h"
+
+/**
+ * \var static struct sockbuf socks[]
+ * \brief The tracked sockets.
+ */
+static struct sockbuf socks[SOCKBUF_MAX];
+
+/**
+ * \var static int socks_len
+ * \brief The amount of tracked sockets.
+ */
+static int socks_len;
+
+/**
+ * \var static int ceiling
+ * \brief The maximal buffer size.
+ */
+static int ceiling = SOCKBUF_DEFAULT_MAX;
+
+/**
+ * \var static pthread_mutex_t lock
+ * \brief Protects socks and socks_len, the rss workers share the sockets.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \fn static struct sockbuf *lookup(int fd)
+ * \brief Find a tracked socket, lock held.
+ *
+ * \param fd The socket fd
+ * \return The socket or NULL
+ */
+static struct sockbuf *lookup(int fd);
+
+/**
+ * \fn static int set_buf(int fd, int force, int opt, int size)
+ * \brief Set a buffer size, with the privileged option if possible.
+ *
+ * \param fd The socket fd
+ * \param force SO_RCVBUFFORCE or SO_SNDBUFFORCE, 0 if unavailable
+ * \param opt SO_RCVBUF or SO_SNDBUF
+ * \param size The buffer size
+ * \return 0 for success, -1 on error (errno is filled)
+ */
+static int set_buf(int fd, int force, int opt, int size);
+
+/**
+ * \fn static int grow(int fd, int force, int opt, int *size, int *kernel, time_t *last)
+ * \brief Double a buffer size up to the ceiling, rate-limited.
+ *
+ * \param fd The socket fd
+ * \param force The privileged option or 0
+ * \param opt The option
+ * \param size The current size, modified on return
+ * \param kernel The kernel size, modified on return
+ * \param last The last resize time, modified on return
+ * \return 1 if the buffer was resized, 0 otherwise
+ */
+static int grow(int fd, int force, int opt, int *size, int *kernel,
+                time_t *last);
+
+/**
+ * \fn static int get_buf(int fd, int opt)
+ * \brief Read back the kernel buffer size.
+ */
+static int get_buf(int fd, int opt);
+
+/**
+ * \fn static void sockbuf_stats(FILE *fp, void *arg)
+ * \brief Dump the per-socket buffer sizes and drop counters.
+ */
+static void sockbuf_stats(FILE *fp, void *arg);
+
+#if defined(SO_RCVBUFFORCE)
+#  define RCVBUF_FORCE SO_RCVBUFFORCE
+#  define SNDBUF_FORCE SO_SNDBUFFORCE
+#else
+#  define RCVBUF_FORCE 0
+#  define SNDBUF_FORCE 0
+#endif
+
+void init_sockbuf(uint32_t max_size) {
+   if (max_size)
+      ceiling = max_size;
+   stats_register("sockets", sockbuf_stats, NULL);
+}
+
+void sockbuf_register(int fd, int ipv6, int port) {
+   if (set_buf(fd, 0, SO_SNDBUF, SOCKBUF_INIT))
+      die("SNDBUF");
+   if (set_buf(fd, 0, SO_RCVBUF, SOCKBUF_INIT))
+      die("RCVBUF");
+#if defined(SO_RXQ_OVFL)
+   int on = 1;
+   if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)))
+      die("SO_RXQ_OVFL");
+#endif
+
+   pthread_mutex_lock(&lock);
+   if (socks_len >= SOCKBUF_MAX) {
+      pthread_mutex_unlock(&lock);
+      debug_print("too many sockets, not tracking fd %d\n", fd);
+      return;
+   }
+   struct sockbuf *sb = &socks[socks_len];
+   memset(sb, 0, sizeof(struct sockbuf));
+   sb->fd     = fd;
+   sb->ipv6   = ipv6;
+   sb->port   = port;
+   sb->rcvbuf = SOCKBUF_INIT;
+   sb->sndbuf = SOCKBUF_INIT;
+   sb->rcvbuf_kernel = get_buf(fd, SO_RCVBUF);
+   sb->sndbuf_kernel = get_buf(fd, SO_SNDBUF);
+   socks_len++;
+   pthread_mutex_unlock(&lock);
+}
+
+void sockbuf_rx_ovfl(int fd, uint32_t ovfl) {
+   pthread_mutex_lock(&lock);
+   struct sockbuf *sb = lookup(fd);
+   if (!sb || ovfl == sb->rx_ovfl) {
+      pthread_mutex_unlock(&lock);
+      return;
+   }
+
+   /* the kernel counter is cumulative and wraps */
+   sb->rx_drops += (uint32_t)(ovfl - sb->rx_ovfl);
+   sb->rx_ovfl   = ovfl;
+   if (grow(fd, RCVBUF_FORCE, SO_RCVBUF, &sb->rcvbuf,
+            &sb->rcvbuf_kernel, &sb->rcv_grown))
+      sb->rcv_grows++;
+   pthread_mutex_unlock(&lock);
+}
+
+void sockbuf_tx_blocked(int fd, int err) {
+   pthread_mutex_lock(&lock);
+   struct sockbuf *sb = lookup(fd);
+   if (!sb) {
+      pthread_mutex_unlock(&lock);
+      return;
+   }
+
+   if (err == ENOBUFS)
+      sb->tx_nobufs++;
+   else
+      sb->tx_again++;
+   if (grow(fd, SNDBUF_FORCE, SO_SNDBUF, &sb->sndbuf,
+            &sb->sndbuf_kernel, &sb->snd_grown))
+      sb->snd_grows++;
+   pthread_mutex_unlock(&lock);
+}
+
+struct sockbuf *lookup(int fd) {
+   for (int i=0; i<socks_len; i++)
+      if (socks[i].fd == fd)
+         return &socks[i];
+   return NULL;
+}
+
+int set_buf(int fd, int force, int opt, int size) {
+   if (force && !setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)))
+      return 0;
+   return setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size));
+}
+
+int grow(int fd, int force, int opt, int *size, int *kernel, time_t *last) {
+   if (*size >= ceiling)
+      return 0;
+   time_t now = time(NULL);
+   if (now - *last < SOCKBUF_GROW_INTERVAL)
+      return 0;
+   *last = now;
+
+   int new_size = *size > ceiling / 2 ? ceiling : *size * 2;
+   if (set_buf(fd, force, opt, new_size)) {
+      debug_print("resize fd %d buffer: %s\n", fd, strerror(errno));
+      return 0;
+   }
+   debug_print("fd %d %s grown to %d\n", fd,
+               opt == SO_RCVBUF ? "rcvbuf" : "sndbuf", new_size);
+   *size   = new_size;
+   *kernel = get_buf(fd, opt);
+   return 1;
+}
+
+int get_buf(int fd, int opt) {
+   int size = 0;
+   socklen_t len = sizeof(size);
+   if (getsockopt(fd, SOL_SOCKET, opt, &size, &len))
+      return -1;
+   return size;
+}
+
+void sockbuf_stats(FILE *fp, void *UNUSED(arg)) {
+   fprintf(fp, "ceiling %d\n", ceiling);
+   pthread_mutex_lock(&lock);
+   for (int i=0; i<socks_len; i++) {
+      struct sockbuf *sb = &socks[i];
+      char name[16];
+      snprintf(name, sizeof(name), "udp%c.%u", sb->ipv6 ? '6' : '4', sb->port);
+      fprintf(fp, "%s.rcvbuf %d\n", name, sb->rcvbuf);
+      fprintf(fp, "%s.sndbuf %d\n", name, sb->sndbuf);
+      /* the kernel doubles the requested size for bookkeeping */
+      fprintf(fp, "%s.rcvbuf_kernel %d\n", name, sb->rcvbuf_kernel);
+      fprintf(fp, "%s.sndbuf_kernel %d\n", name, sb->sndbuf_kernel);
+      fprintf(fp, "%s.rcvbuf_grows %u\n", name, sb->rcv_grows);
+      fprintf(fp, "%s.sndbuf_grows %u\n", name, sb->snd_grows);
+      fprintf(fp, "%s.rx_drops %llu\n", name, (unsigned long long)sb->rx_drops);
+      fprintf(fp, "%s.tx_nobufs %llu\n", name, (unsigned long long)sb->tx_nobufs);
+      fprintf(fp, "%s.tx_again %llu\n", name, (unsigned long long)sb->tx_again);
+   }
+   pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,109 @@
+/**
+ * \file sockbuf.h
+ * \brief Adaptive UDP socket buffers.
+ *
+ *    UDP sockets start with SOCKBUF_INIT bytes of send and receive
+ *    buffer. The kernel drop counter (SO_RXQ_OVFL) and send-side
+ *    ENOBUFS/EAGAIN are tracked per socket, and the matching buffer
+ *    is doubled, at most once per SOCKBUF_GROW_INTERVAL, up to the
+ *    socket-buffer-max ceiling. SO_RCVBUFFORCE/SO_SNDBUFFORCE are
+ *    used when privileged to go past net.core.[rw]mem_max.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SOCKBUF_H
+#define UDPTUN_SOCKBUF_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * \def SOCKBUF_INIT
+ * \brief The initial buffer size (bytes).
+ */
+#define SOCKBUF_INIT (1024*1024)
+
+/**
+ * \def SOCKBUF_DEFAULT_MAX
+ * \brief The default buffer size ceiling (bytes).
+ */
+#define SOCKBUF_DEFAULT_MAX (16*1024*1024)
+
+/**
+ * \def SOCKBUF_GROW_INTERVAL
+ * \brief The minimal interval between two resizes of a buffer (sec).
+ */
+#define SOCKBUF_GROW_INTERVAL 1
+
+/**
+ * \def SOCKBUF_MAX
+ * \brief The maximal amount of tracked sockets.
+ */
+#define SOCKBUF_MAX 16
+
+/**
+ * \struct sockbuf
+ *	\brief The buffers and drop counters of a UDP socket.
+ */
+struct sockbuf {
+   int      fd;              /*!< The socket fd */
+   uint16_t port;            /*!< The bound port */
+   uint8_t  ipv6;            /*!< 1 if AF_INET6 */
+
+   int      rcvbuf;          /*!< The requested receive buffer size */
+   int      sndbuf;          /*!< The requested send buffer size */
+   int      rcvbuf_kernel;   /*!< The kernel receive buffer size */
+   int      sndbuf_kernel;   /*!< The kernel send buffer size */
+   time_t   rcv_grown;       /*!< Last receive buffer resize */
+   time_t   snd_grown;       /*!< Last send buffer resize */
+
+   uint32_t rx_ovfl;         /*!< Last SO_RXQ_OVFL value (cumulative) */
+   uint64_t rx_drops;        /*!< Datagrams dropped on receive */
+   uint64_t tx_nobufs;       /*!< Sends failed with ENOBUFS */
+   uint64_t tx_again;        /*!< Sends failed with EAGAIN */
+   uint32_t rcv_grows;       /*!< Receive buffer resizes */
+   uint32_t snd_grows;       /*!< Send buffer resizes */
+};
+
+/**
+ * \fn void init_sockbuf(uint32_t ceiling)
+ * \brief Set the buffer size ceiling and register the stats section.
+ *
+ * \param ceiling The maximal buffer size (bytes), 0 for the default
+ */
+void init_sockbuf(uint32_t ceiling);
+
+/**
+ * \fn void sockbuf_register(int fd, int ipv6, int port)
+ * \brief Set the initial buffer sizes of a UDP socket, enable
+ *        SO_RXQ_OVFL and start tracking it.
+ *
+ * \param fd The socket fd
+ * \param ipv6 1 if AF_INET6
+ * \param port The bound port
+ */
+void sockbuf_register(int fd, int ipv6, int port);
+
+/**
+ * \fn void sockbuf_rx_ovfl(int fd, uint32_t ovfl)
+ * \brief Account the SO_RXQ_OVFL value of a received datagram and
+ *        grow the receive buffer on new drops.
+ *
+ * \param fd The socket fd
+ * \param ovfl The cumulative drop counter
+ */
+void sockbuf_rx_ovfl(int fd, uint32_t ovfl);
+
+/**
+ * \fn void sockbuf_tx_blocked(int fd, int err)
+ * \brief Account a send that failed with ENOBUFS or EAGAIN and grow
+ *        the send buffer.
+ *
+ * \param fd The socket fd
+ * \param err The errno value
+ */
+void sockbuf_tx_blocked(int fd, int err);
+
+#endif
@@ -0,0 +1,32 @@
+/**
+ * \file spread.c
+ * \brief Outer UDP source-port spreading.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdlib.h>
+
+#include "spread.h"
+#include "debug.h"
+#include "sock.h"
+
+int *spread_socks(struct tun_state *state, int fd_net, int ipv6, int port,
+                  char *addr) {
+   int *fds = xmalloc(state->port_range * sizeof(int));
+   fds[0] = fd_net;
+   for (int i=1; i<state->port_range; i++)
+      fds[i] = ipv6 ? udp_sock6(port+i, 1, addr) : udp_sock4(port+i, 1, addr);
+
+   debug_print("spreading over ports %d-%d\n", port, port+state->port_range-1);
+   return fds;
+}
+
+int spread_fd_set(struct tun_state *state, int *fds, fd_set *input_set) {
+   int fd_max = 0;
+   for (int i=0; i<state->port_range; i++) {
+      FD_SET(fds[i], input_set);
+      fd_max = max(fd_max, fds[i]);
+   }
+   return fd_max;
+}
@@ -0,0 +1,116 @@
+/**
+ * \file spread.h
+ * \brief Outer UDP source-port spreading.
+ *
+ *    With source-port-range N, the client sends from the ports
+ *    [port, port+N) instead of port alone, so that ECMP and NIC RSS
+ *    hashing spread the tunnel over several paths and queues. The port
+ *    of a packet is chosen by a symmetric hash of the inner 5-tuple,
+ *    keeping each inner flow on one port (i.e. in order). The server
+ *    computes the same hash to map a datagram back to the base port
+ *    of its peer, and to send the replies of a flow to the client
+ *    port it came from.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_SPREAD_H
+#define UDPTUN_SPREAD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "state.h"
+
+/**
+ * \def SPREAD_MAX_RANGE
+ * \brief The maximal source port range.
+ */
+#define SPREAD_MAX_RANGE 256
+
+/**
+ * \fn int *spread_socks(struct tun_state *state, int fd_net, int ipv6, int port, char *addr)
+ * \brief Create the UDP sockets bound to port+1 .. port+range-1.
+ *
+ * \param state The program state
+ * \param fd_net The socket bound to port
+ * \param ipv6 1 for AF_INET6 sockets
+ * \param port The base port
+ * \param addr The bind address
+ * \return The sockets (malloc), indexed by port offset
+ */
+int *spread_socks(struct tun_state *state, int fd_net, int ipv6, int port,
+                  char *addr);
+
+/**
+ * \fn int spread_fd_set(struct tun_state *state, int *fds, fd_set *input_set)
+ * \brief Add the spread sockets to a fd_set.
+ *
+ * \param state The program state
+ * \param fds The sockets
+ * \param input_set The fd_set
+ * \return The max fd value
+ */
+int spread_fd_set(struct tun_state *state, int *fds, fd_set *input_set);
+
+/**
+ * \fn static inline uint32_t spread_hash(const char *pkt)
+ * \brief Symmetric hash of the inner 5-tuple, i.e. both directions
+ *        of a flow have the same hash.
+ *
+ * \param pkt The inner IP packet
+ * \return The hash
+ */
+static inline uint32_t spread_hash(const char *pkt) {
+   uint32_t addr = 0, ports = 0, w[8];
+   uint8_t proto;
+   int off;
+
+   if ((pkt[0] & 0xf0) == 0x40) {
+      memcpy(w, pkt+12, 8);
+      addr  = w[0] ^ w[1];
+      proto = pkt[9];
+      off   = (pkt[0] & 0x0f) << 2;
+      /* non-first fragments carry no ports */
+      if (pkt[6] & 0x1f || pkt[7])
+         proto = 0;
+   } else {
+      memcpy(w, pkt+8, 32);
+      for (int i=0; i<8; i++)
+         addr ^= w[i];
+      proto = pkt[6];
+      off   = 40;
+   }
+   if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+      uint16_t p[2];
+      memcpy(p, pkt+off, 4);
+      ports = p[0] ^ p[1];
+   }
+
+   /* murmur3 finalizer */
+   uint32_t h = addr ^ (ports << 8) ^ proto;
+   h ^= h >> 16;
+   h *= 0x85ebca6b;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35;
+   h ^= h >> 16;
+   return h;
+}
+
+/**
+ * \fn static inline int spread_offset(struct tun_state *state, const char *pkt)
+ * \brief The port offset of an inner packet.
+ *
+ * \param state The program state
+ * \param pkt The inner IP packet
+ * \return The offset in [0, source-port-range)
+ */
+static inline int spread_offset(struct tun_state *state, const char *pkt) {
+   if (state->port_range <= 1)
+      return 0;
+   return spread_hash(pkt) % state->port_range;
+}
+
+#endif
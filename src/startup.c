@@ -0,0 +1,106 @@
+/**
+ * \file startup.c
+ * \brief Startup phases timeline.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "startup.h"
+#include "debug.h"
+#include "timing.h"
+#include "stats.h"
+
+/**
+ * \var static int64_t t0
+ * \brief CLOCK_MONOTONIC at init_startup() (us).
+ */
+static int64_t t0;
+
+/**
+ * \var static struct startup_phase phases[]
+ * \brief The phases, in order of first end.
+ */
+static struct startup_phase phases[STARTUP_MAX_PHASES];
+
+/**
+ * \var static int phases_len
+ * \brief The amount of phases.
+ */
+static int phases_len;
+
+/**
+ * \var static pthread_mutex_t lock
+ * \brief Protects phases.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \fn static void startup_stats(FILE *fp, void *arg)
+ * \brief Dump the timeline.
+ */
+static void startup_stats(FILE *fp, void *arg);
+
+void init_startup() {
+   t0 = monotonic_us();
+   stats_register("startup", startup_stats, NULL);
+}
+
+int64_t startup_now() {
+   return monotonic_us() - t0;
+}
+
+void startup_phase(const char *name, int64_t start) {
+   int64_t end = startup_now();
+   struct startup_phase *p = NULL;
+
+   pthread_mutex_lock(&lock);
+   for (int i=0; i<phases_len; i++) {
+      if (!strcmp(phases[i].name, name)) {
+         p = &phases[i];
+         break;
+      }
+   }
+   if (!p && phases_len < STARTUP_MAX_PHASES) {
+      p = &phases[phases_len++];
+      p->name  = name;
+      p->start = start;
+   }
+   if (p) {
+      if (start < p->start)
+         p->start = start;
+      if (end > p->end)
+         p->end = end;
+      p->busy += end - start;
+      p->count++;
+   }
+   pthread_mutex_unlock(&lock);
+
+   debug_print("startup: %s %.3fms -> %.3fms\n", name,
+               start / 1000.0, end / 1000.0);
+}
+
+void startup_mark(const char *name) {
+   startup_phase(name, startup_now());
+}
+
+void startup_stats(FILE *fp, void *UNUSED(arg)) {
+   pthread_mutex_lock(&lock);
+   for (int i=0; i<phases_len; i++) {
+      struct startup_phase *p = &phases[i];
+      if (p->end == p->start) {
+         fprintf(fp, "%s.at_ms %.3f\n", p->name, p->start / 1000.0);
+      } else {
+         fprintf(fp, "%s.start_ms %.3f\n", p->name, p->start / 1000.0);
+         fprintf(fp, "%s.end_ms %.3f\n", p->name, p->end / 1000.0);
+         fprintf(fp, "%s.busy_ms %.3f\n", p->name, p->busy / 1000.0);
+      }
+      if (p->count > 1)
+         fprintf(fp, "%s.count %u\n", p->name, p->count);
+   }
+   pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,72 @@
+/**
+ * \file startup.h
+ * \brief Startup phases timeline.
+ *
+ *    The startup phases (configuration, peer table, interface
+ *    configuration, sockets and BPF compilation, capture setup, ...)
+ *    are timed on CLOCK_MONOTONIC from the start of main(). A phase
+ *    entered more than once (e.g. one BPF per socket) keeps its first
+ *    start, its last end and the sum of its durations. Phases running
+ *    concurrently overlap on the timeline. The "forwarding" mark is
+ *    the time-to-forwarding, i.e. when the main loop first selects.
+ *    The timeline is logged as phases end and reported in the
+ *    "startup" stats section.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_STARTUP_H
+#define UDPTUN_STARTUP_H
+
+#include <stdint.h>
+
+/**
+ * \def STARTUP_MAX_PHASES
+ * \brief The maximal amount of phases.
+ */
+#define STARTUP_MAX_PHASES 24
+
+/**
+ * \struct startup_phase
+ *	\brief A phase of the timeline.
+ */
+struct startup_phase {
+   const char *name;    /*!< The phase name */
+   int64_t     start;   /*!< The first start (us since main) */
+   int64_t     end;     /*!< The last end (us since main) */
+   int64_t     busy;    /*!< The sum of the durations (us) */
+   uint32_t    count;   /*!< Amount of times the phase ran */
+};
+
+/**
+ * \fn void init_startup()
+ * \brief Start the timeline and register the stats section, call
+ *        first in main().
+ */
+void init_startup();
+
+/**
+ * \fn int64_t startup_now()
+ * \brief The time since init_startup() (us).
+ */
+int64_t startup_now();
+
+/**
+ * \fn void startup_phase(const char *name, int64_t start)
+ * \brief Record the end of a phase, thread-safe.
+ *
+ * \param name The phase name (a string constant)
+ * \param start The phase start, from startup_now()
+ */
+void startup_phase(const char *name, int64_t start);
+
+/**
+ * \fn void startup_mark(const char *name)
+ * \brief Record an instant on the timeline.
+ *
+ * \param name The mark name (a string constant)
+ */
+void startup_mark(const char *name);
+
+#endif
@@ -21,6 +21,24 @@
 #include "net.h"
 #include "xpcap.h"
 #include "thread.h"
+#include "demux.h"
+#include "stats.h"
+#include "queue.h"
+#include "txring.h"
+#include "impair.h"
+#include "batch.h"
+#include "pep.h"
+#include "inst.h"
+#include "sockbuf.h"
+#include "spread.h"
+#include "rss.h"
+#include "lpm.h"
+#include "recs.h"
+#include "ecn.h"
+#include "perf.h"
+#include "hh.h"
+#include "acct.h"
+#include "startup.h"
 
 /**
  * \fn static int parse_dest_file4(struct arguments *args, struct tun_state *state)
@@ -52,30 +70,37 @@ static int parse_dest_file(struct arguments *args, struct tun_state *state);
 static int parse_cfg_file(struct tun_state *state);
 
 /**
- * \fn static void free_tun_rec_aux(gpointer key,
- *                                  gpointer value,
- *                                  gpointer user_data)
- * \brief A stub for GLIB2 auto free
+ * \fn static void *build_peers(void *arg)
+ * \brief Build the client lookup tables from the destination file, runs
+ *        concurrently with the rest of init_tun_state().
  *
- * \param key unused
- * \param value A pointer to a valid struct free_tun_rec
- * \param user_data unused
+ * \param arg The program state
  */
-static void free_tun_rec_aux(gpointer key,
-                      gpointer value,
-                      gpointer user_data);
+static void *build_peers(void *arg);
+
+/**
+ * \fn static uint32_t add_rec(struct tun_state *state, int sport, const char *addr4, const char *addr6, int port)
+ * \brief Add a peer record.
+ *
+ * \param state The program state
+ * \param sport The peer source port
+ * \param addr4 The peer v4 address
+ * \param addr6 The peer v6 address or NULL
+ * \param port The peer port
+ * \return The peer id
+ */
+static uint32_t add_rec(struct tun_state *state, int sport, const char *addr4,
+                        const char *addr6, int port);
 
 static GHashTable *init_table(int v);
 
 GHashTable *init_table(int v) {
    GHashTable *htable = NULL;
+   /* source ports are keys and peer ids values, both stored in the pointers */
 #if defined(GLIB2)
-   //htable = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, 
-   //                              (GDestroyNotify) free_tun_rec);
-   //XXX: g_hash_table_new_full does not work with duplicated data
-   htable = g_hash_table_new((v==4) ? g_int_hash : g_str_hash, (v==4) ? g_int_equal : g_str_equal);
+   htable = g_hash_table_new((v==4) ? g_direct_hash : g_str_hash, (v==4) ? g_direct_equal : g_str_equal);
 #elif defined(GLIB1)
-   htable = g_hash_table_new((v==4) ? g_int_hash : g_str_hash, (v==4) ? g_int_equal : g_str_equal);
+   htable = g_hash_table_new((v==4) ? g_direct_hash : g_str_hash, (v==4) ? g_direct_equal : g_str_equal);
 #endif
    return htable;
 }
@@ -83,24 +108,29 @@ GHashTable *init_table(int v) {
 struct tun_state *init_tun_state(struct arguments *args) {
    struct tun_state *state = calloc(1, sizeof(struct tun_state));
    state->args = args;   
+   state->inst_cpu = -1;
+   int64_t t = startup_now();
    if (parse_cfg_file(state) < 0)
       die("configuration file");
-
-   /* create htables */
+   startup_phase("cfg", t);
+
+   /* create htables, the peers are added while the rest is set up:
+    * build_peers() only reads args, public_port, private_port (final
+    * once the cfg is parsed), recs, cli4, cli6 and serv (set below before
+    * the thread starts) and only writes recs, the tables, cli_private,
+    * cli_public and sa_len, which nothing else touches until the join */
+   pthread_t peers = 0;
+   if (!(state->recs = recs_new(0)))
+      die("recs_new");
    if (args->mode == SERV_MODE || args->mode == FULLMESH_MODE) {
       state->serv = init_table(4);
    }
    if (args->mode == CLI_MODE || args->mode == FULLMESH_MODE) {
-       state->cli4 = init_table(4);
-
-      if (args->ipv6 || args->dual_stack) {
-         state->cli6 = init_table(6);
-         if (parse_dest_file(args, state) < 0)
-            die("destination file");
-      } else {
-         if (parse_dest_file4(args, state) < 0)
-            die("destination file");
-      }
+      if (!(state->cli4 = lpm4_new()))
+         die("lpm4_new");
+      if ((args->ipv6 || args->dual_stack) && !(state->cli6 = lpm6_new()))
+         die("lpm6_new");
+      peers = xthread_create(build_peers, (void *)state, 0);
    }
 
    /* Replace cfg value with args */
@@ -120,18 +150,54 @@ struct tun_state *init_tun_state(struct arguments *args) {
 
    if (args->raw_header) {
       /* overwrite with observed size */
-      state->raw_header_size = strlen(args->raw_header)/2;
-      state->raw_header = xmalloc(state->raw_header_size);
-
-      char *pos = args->raw_header;
-      size_t count = 0;
-      /* WARNING: no sanitization */
-      for(count = 0; count < state->raw_header_size; count++) {
-         char buf[3] = {pos[0], pos[1], 0};
-         state->raw_header[count] = strtol(buf, NULL, 16);
-         pos += 2;
-      }
+      state->raw_header = parse_raw_header(args->raw_header, 
+                                           &state->raw_header_size);
+   }
+   if (state->demux && (args->mode != SERV_MODE || !state->udp)) {
+      errno=EINVAL;
+      die("experiments require UDP server mode");
+   }
+   if (!state->port_range)
+      state->port_range = 1;
+   if (state->port_range > SPREAD_MAX_RANGE || (state->port_range > 1 && 
+         (!state->udp || (args->mode != CLI_MODE && args->mode != SERV_MODE)))) {
+      errno=EINVAL;
+      die("source-port-range requires UDP client or server mode");
    }
+   if (state->rss_workers && (state->rss_workers > RSS_MAX_WORKERS || 
+         !state->udp || args->mode != CLI_MODE || state->port_range > 1)) {
+      errno=EINVAL;
+      die("rss-workers requires UDP client mode without source-port-range");
+   }
+   if (state->shm_dir && args->mode != FULLMESH_MODE) {
+      errno=EINVAL;
+      die("shm-dir requires peer mode");
+   }
+   if (state->load_pps && (!state->load_port || args->mode == SERV_MODE)) {
+      errno=EINVAL;
+      die("load-pps requires load-port and client or peer mode");
+   }
+   if (state->impair_net && state->rss_workers) {
+      errno=EINVAL;
+      die("impair net requires rss-workers 0");
+   }
+   if (state->inst && (args->mode != SERV_MODE || !state->udp)) {
+      errno=EINVAL;
+      die("instance requires UDP server mode");
+   }
+
+   /* retry queues */
+   state->txq_tun = init_queue(state->queue_len, state->queue_policy, "queue.tun");
+   state->txq_net = init_queue(state->queue_len, state->queue_policy, "queue.net");
+   init_impair(state->impair_tun, state->txq_tun, state->impair_pool,
+               state->impair_seed, "impair.tun");
+   init_impair(state->impair_net, state->txq_net, state->impair_pool,
+               state->impair_seed + 1, "impair.net");
+   state->batch = init_batch(state->batch_max, state->batch_latency);
+   init_sockbuf(state->sockbuf_max);
+   init_ecn(state->ecn_mode);
+   init_perf(state->perf_sample);
+   init_hh(state->heavy_hitters);
 
    /* compute snaplen */
    if (state->ipv6)
@@ -155,44 +221,137 @@ struct tun_state *init_tun_state(struct arguments *args) {
    strncpy(state->cli_file_notun6, state->cli_dir, STR_SIZE);
    strncat(state->cli_file_tun6, CLI_TUN_FILE6, STR_SIZE);
    strncat(state->cli_file_notun6, CLI_NOTUN_FILE6, STR_SIZE);
+   state->cli_file_pep    = xmalloc(STR_SIZE);
+   strncpy(state->cli_file_pep, state->cli_dir, STR_SIZE);
+   strncat(state->cli_file_pep, CLI_PEP_FILE, STR_SIZE);
 
    /* init network settings */
+   t = startup_now();
    if (args->ipv6)
       state->default_if = addr_to_itf6(state->public_addr6);
    else
       state->default_if = addr_to_itf4(state->public_addr4);
+   state->txq_net->ring = txring_new(state);
+   startup_phase("itf", t);
+
+   /* the tables are read from here on */
+   if (args->mode == CLI_MODE || args->mode == FULLMESH_MODE)
+      pthread_join(peers, NULL);
    
    /* init synchronizer and garbage collector */
    init_barrier(2);
    init_destructors(state);
+   if (state->stats_interval)
+      xthread_create(stats_thread, (void *)state, 1);
+   state->acct = init_acct(state);
+
+   return state;
+}
+
+void *build_peers(void *arg) {
+   struct tun_state *state = arg;
+   struct arguments *args = state->args;
+   int64_t t = startup_now();
 
+   if (state->cli6) {
+      if (parse_dest_file(args, state) < 0)
+         die("destination file");
+      if (lpm6_build(state->cli6) < 0)
+         die("lpm6_build");
+   } else {
+      if (parse_dest_file4(args, state) < 0)
+         die("destination file");
+   }
+   startup_phase("peers", t);
+   return 0;
+}
+
+struct tun_state *init_tun_instance(struct tun_state *parent,
+                                    struct arguments *args) {
+   struct tun_state *state = xmalloc(sizeof(struct tun_state));
+   memcpy(state, parent, sizeof(struct tun_state));
+   state->args = args;
+
+   /* per-tunnel settings come from the instance cfg file only */
+   state->tun_if        = NULL;
+   state->private_addr4 = NULL;
+   state->private_mask4 = NULL;
+   state->private_addr6 = NULL;
+   state->private_mask6 = NULL;
+   state->public_addr4  = NULL;
+   state->public_addr6  = NULL;
+   state->public_port   = 0;
+   state->raw_header    = NULL;
+   state->demux         = NULL;
+   state->impair_tun    = NULL;
+   state->impair_net    = NULL;
+   state->inst          = NULL;
+   state->acct          = NULL;
+   state->rss           = NULL;
+   state->batch         = NULL;
+   state->port_range    = 1;
+   if (parse_cfg_file(state) < 0)
+      die("instance configuration file");
+   if (!state->private_addr4 || !state->public_port || 
+         state->public_port == parent->public_port || state->demux || 
+         state->impair_tun || state->impair_net || state->inst || 
+         state->port_range != 1 || state->rss_workers) {
+      errno=EINVAL;
+      die("instance requires private-address4 and its own public-server-port, "
+          "without experiment, impair, instance, source-port-range or rss-workers");
+   }
+   /* the public addresses default to the parent's, copied to be owned */
+   if (!state->public_addr4 && parent->public_addr4)
+      state->public_addr4 = strdup(parent->public_addr4);
+   if (!state->public_addr6 && parent->public_addr6)
+      state->public_addr6 = strdup(parent->public_addr6);
+
+   state->raw_header_size = 0;
+   if (args->raw_header)
+      state->raw_header = parse_raw_header(args->raw_header, 
+                                           &state->raw_header_size);
+   if (!(state->recs = recs_new(0)))
+      die("recs_new");
+   state->serv    = init_table(4);
+   state->txq_tun = init_queue(state->queue_len, state->queue_policy, NULL);
+   state->txq_net = init_queue(state->queue_len, state->queue_policy, NULL);
    return state;
 }
 
+void free_tun_instance(struct tun_state *state) {
+   /* the other strings are shared with the parent */
+   g_hash_table_destroy(state->serv);
+   recs_free(state->recs);
+   free_queue(state->txq_tun);
+   free_queue(state->txq_net);
+   if (state->tun_if)
+      free(state->tun_if);
+   if (state->private_addr4)
+      free(state->private_addr4);
+   if (state->private_mask4)
+      free(state->private_mask4);
+   if (state->private_addr6)
+      free(state->private_addr6);
+   if (state->private_mask6)
+      free(state->private_mask6);
+   if (state->public_addr4)
+      free(state->public_addr4);
+   if (state->public_addr6)
+      free(state->public_addr6);
+   if (state->raw_header)
+      free(state->raw_header);
+   free(state);
+}
+
 void free_tun_state(struct tun_state *state) {
 
-#if defined(GLIB1)
-#endif
-   /* Free HTables (GLIB 1 && GLIB 2 < 2.12)  */
-   if (state->serv) 
-      g_hash_table_foreach (state->serv, 
-                            (GHFunc) free_tun_rec_aux,
-                            NULL);
-   if (state->cli4) 
-      g_hash_table_foreach (state->cli4, 
-                            (GHFunc) free_tun_rec_aux,
-                            NULL);
-   /*if (state->cli6) 
-      g_hash_table_foreach (state->cli6, 
-                            (GHFunc) free_tun_rec_aux,
-                            NULL);*/
-//#endif
+   /* the tables hold peer ids, the records belong to the store */
    if (state->serv) 
       g_hash_table_destroy(state->serv); 
    if (state->cli4)
-      g_hash_table_destroy(state->cli4); 
+      lpm4_free(state->cli4);
    if (state->cli6)
-      g_hash_table_destroy(state->cli6);
+      lpm6_free(state->cli6);
 
    /* Free mallocs */
    if (state->private_addr4)
@@ -223,63 +382,91 @@ void free_tun_state(struct tun_state *state) {
       free(state->cli_file_tun6);
    if (state->cli_file_notun6)
       free(state->cli_file_notun6);
+   if (state->cli_file_pep)
+      free(state->cli_file_pep);
    if (state->out_dir)
       free(state->out_dir);
+   if (state->shm_dir)
+      free(state->shm_dir);
+   if (state->load_size)
+      free(state->load_size);
+   if (state->short_size)
+      free(state->short_size);
    if (state->raw_header)
       free(state->raw_header);
+   if (state->demux)
+      free_demux(state->demux);
+   if (state->inst)
+      free_inst(state->inst);
+   if (state->impair_tun)
+      free_impair(state->impair_tun);
+   if (state->impair_net)
+      free_impair(state->impair_net);
+   if (state->txq_tun)
+      free_queue(state->txq_tun);
+   if (state->txq_net && state->txq_net->ring)
+      txring_free(state->txq_net->ring);
+   if (state->txq_net)
+      free_queue(state->txq_net);
+   if (state->batch)
+      free(state->batch);
+   if (state->pep)
+      free_pep(state->pep);
+   if (state->pep_cc)
+      free(state->pep_cc);
+   if (state->spread4)
+      free(state->spread4);
+   if (state->spread6)
+      free(state->spread6);
+   if (state->rss)
+      free_rss(state->rss);
+   if (state->acct)
+      acct_free(state->acct);
 
    /* Free tun_rec's */
-   if (state->cli_private) {
-      int i;
-      for (i=0; i<state->sa_len; i++) 
-         free_tun_rec(state->cli_private[i]);
+   if (state->cli_private)
       free(state->cli_private);
-   }
-   if (state->cli_public) {
-      int i;
-      for (i=0; i<state->sa_len; i++) 
-         free_tun_rec(state->cli_public[i]);
+   if (state->cli_public)
       free(state->cli_public);
-   }
+   if (state->recs)
+      recs_free(state->recs);
    free(state);
 
    destroy_barrier();
 }
 
-struct tun_rec *init_tun_rec(struct tun_state *state) {
-   struct tun_rec *ret = calloc(1, sizeof(struct tun_rec));
-
-   /* IPv4 sockaddr */
-   if (state->dual_stack || !state->ipv6) {
-      ret->sa4        = xmalloc(sizeof(struct sockaddr_in));
-      ret->slen4      = sizeof(struct sockaddr_in);
-   } else {
-      ret->sa4 = NULL;
-      ret->slen4 = 0;
-   }
-
-   /* IPv6 sockaddr */
-   if (state->dual_stack || state->ipv6) {
-      ret->sa6        = xmalloc(sizeof(struct sockaddr_in6));
-      ret->slen6      = sizeof(struct sockaddr_in6);
-   } else {
-      ret->sa6 = NULL;
-      ret->slen6 = 0;
+char *parse_raw_header(const char *hex, uint8_t *size) {
+   *size = strlen(hex)/2;
+   char *header = xmalloc(*size);
+
+   const char *pos = hex;
+   size_t count = 0;
+   /* WARNING: no sanitization */
+   for(count = 0; count < *size; count++) {
+      char buf[3] = {pos[0], pos[1], 0};
+      header[count] = strtol(buf, NULL, 16);
+      pos += 2;
    }
-
-   return ret;
-}
-
-void free_tun_rec_aux(gpointer UNUSED(key),
-                      gpointer value,
-                      gpointer UNUSED(user_data)) { 
-   free_tun_rec((struct tun_rec *)value); 
+   return header;
 }
 
-void free_tun_rec(struct tun_rec *rec) { 
-   if (rec->sa4) free(rec->sa4);
-   if (rec->sa6) free(rec->sa6);
-   if (rec) free(rec); 
+uint32_t add_rec(struct tun_state *state, int sport, const char *addr4,
+                 const char *addr6, int port) {
+   uint32_t id = recs_add(state->recs);
+   if (!id)
+      die("recs_add");
+   struct tun_rec *rec = rec_get(state, id);
+
+   struct sockaddr_in *sa4 = get_addr4(addr4, port);
+   memcpy(&rec->sa4, sa4, sizeof(struct sockaddr_in));
+   free(sa4);
+   if (addr6) {
+      struct sockaddr_in6 *sa6 = get_addr6(addr6, port);
+      memcpy(&rec->sa6, sa6, sizeof(struct sockaddr_in6));
+      free(sa6);
+   }
+   rec->sport = sport;
+   return id;
 }
 
 int parse_cfg_file(struct tun_state *state) {
@@ -349,6 +536,115 @@ int parse_cfg_file(struct tun_state *state) {
          /* interfaces */
          else if (!strcmp(key, "tun-if")) 
             state->tun_if = strdup(val);
+         /* layer 4.5 experiments */
+         else if (!strcmp(key, "experiment")) {
+            char line[1024];
+            if (!fgets(line, sizeof(line), fp) || 
+                  demux_add(state, val, line) < 0)
+               die("experiment");
+            /* keep the newline for the dump below */
+            if (line[strlen(line)-1] == '\n')
+               ungetc('\n', fp);
+         }
+         else if (!strcmp(key, "queue-length")) 
+            state->queue_len = strtol(val, NULL, 10);
+         else if (!strcmp(key, "queue-policy")) 
+            state->queue_policy = !strcmp(val, "fair") ? 
+                                    QUEUE_FAIR_DROP : QUEUE_TAIL_DROP;
+         else if (!strcmp(key, "tx-ring")) 
+            state->tx_ring = strtol(val, NULL, 10);
+         else if (!strcmp(key, "batch-max")) 
+            state->batch_max = strtol(val, NULL, 10);
+         else if (!strcmp(key, "batch-latency")) 
+            state->batch_latency = strtol(val, NULL, 10);
+         /* impairments */
+         else if (!strcmp(key, "impair")) {
+            char line[1024];
+            if (!fgets(line, sizeof(line), fp) || 
+                  impair_add(state, val, line) < 0)
+               die("impair");
+            /* keep the newline for the dump below */
+            if (line[strlen(line)-1] == '\n')
+               ungetc('\n', fp);
+         }
+         /* tunnel instances */
+         else if (!strcmp(key, "instance")) {
+            char line[1024];
+            if (!fgets(line, sizeof(line), fp) || 
+                  inst_add(state, val, line) < 0)
+               die("instance");
+            /* keep the newline for the dump below */
+            if (line[strlen(line)-1] == '\n')
+               ungetc('\n', fp);
+         }
+         else if (!strcmp(key, "instance-workers")) 
+            state->inst_workers = strtol(val, NULL, 10);
+         else if (!strcmp(key, "instance-cpu")) 
+            state->inst_cpu = strtol(val, NULL, 10);
+         else if (!strcmp(key, "impair-pool")) 
+            state->impair_pool = strtol(val, NULL, 10);
+         else if (!strcmp(key, "impair-seed")) 
+            state->impair_seed = strtol(val, NULL, 10);
+         else if (!strcmp(key, "socket-buffer-max")) 
+            state->sockbuf_max = strtol(val, NULL, 10);
+         else if (!strcmp(key, "ecn")) 
+            state->ecn_mode = !strcmp(val, "tos") ? ECN_MODE_TOS :
+                              !strcmp(val, "ecn") ? ECN_MODE_ECN : ECN_MODE_OFF;
+         else if (!strcmp(key, "source-port-range")) 
+            state->port_range = strtol(val, NULL, 10);
+         else if (!strcmp(key, "rss-workers")) 
+            state->rss_workers = strtol(val, NULL, 10);
+         else if (!strcmp(key, "shm-dir")) 
+            state->shm_dir = strdup(val);
+         else if (!strcmp(key, "pep-port")) 
+            state->pep_port = strtol(val, NULL, 10);
+         else if (!strcmp(key, "pep-local-port")) 
+            state->pep_local_port = strtol(val, NULL, 10);
+         else if (!strcmp(key, "pep-tproxy")) 
+            state->pep_tproxy = strtol(val, NULL, 10);
+         else if (!strcmp(key, "pep-cc")) 
+            state->pep_cc = strdup(val);
+         else if (!strcmp(key, "pep-buffer")) 
+            state->pep_buffer = strtol(val, NULL, 10);
+         else if (!strcmp(key, "measure-flows")) 
+            state->measure_flows = strtol(val, NULL, 10);
+         else if (!strcmp(key, "measure-sample")) 
+            state->measure_sample = strtol(val, NULL, 10);
+         else if (!strcmp(key, "series-bin")) 
+            state->series_bin = strtol(val, NULL, 10);
+         else if (!strcmp(key, "series-max")) 
+            state->series_max = strtol(val, NULL, 10);
+         else if (!strcmp(key, "short-flows")) 
+            state->short_flows = strtol(val, NULL, 10);
+         else if (!strcmp(key, "short-requests")) 
+            state->short_requests = strtol(val, NULL, 10);
+         else if (!strcmp(key, "short-size")) 
+            state->short_size = strdup(val);
+         else if (!strcmp(key, "load-pps")) 
+            state->load_pps = strtol(val, NULL, 10);
+         else if (!strcmp(key, "load-port")) 
+            state->load_port = strtol(val, NULL, 10);
+         else if (!strcmp(key, "load-flows")) 
+            state->load_flows = strtol(val, NULL, 10);
+         else if (!strcmp(key, "load-burst")) 
+            state->load_burst = strtol(val, NULL, 10);
+         else if (!strcmp(key, "load-duration")) 
+            state->load_duration = strtol(val, NULL, 10);
+         else if (!strcmp(key, "load-size")) 
+            state->load_size = strdup(val);
+         /* stats */
+         else if (!strcmp(key, "stats-interval")) 
+            state->stats_interval = strtol(val, NULL, 10);
+         else if (!strcmp(key, "perf-sample")) 
+            state->perf_sample = strtol(val, NULL, 10);
+         else if (!strcmp(key, "heavy-hitters")) 
+            state->heavy_hitters = strtol(val, NULL, 10);
+         else if (!strcmp(key, "acct-flows")) 
+            state->acct_flows = strtol(val, NULL, 10);
+         else if (!strcmp(key, "acct-idle")) 
+            state->acct_idle = strtol(val, NULL, 10);
+         else if (!strcmp(key, "acct-active")) 
+            state->acct_active = strtol(val, NULL, 10);
       
          /* NOTE: add cfg parameters here */
       } 
@@ -375,33 +671,34 @@ int parse_dest_file(struct arguments *args, struct tun_state *state) {
       return -1;
    }
 
-   int sport, count=0;
-   char public4[INET_ADDRSTRLEN], private4[INET_ADDRSTRLEN]; 
-   char public6[INET6_ADDRSTRLEN], private6[INET6_ADDRSTRLEN];
-   struct tun_rec *nrec_priv = NULL;
+   int sport, count=0, len4, len6;
+   char public4[INET_ADDRSTRLEN], private4[INET_ADDRSTRLEN+3]; 
+   char public6[INET6_ADDRSTRLEN], private6[INET6_ADDRSTRLEN+4];
    /* build port to public addr lookup table */
    while (fscanf(fp, "%d %s %s %s %s", &sport, public4, private4, 
                                                public6, private6) == 5) {
-      nrec_priv        = init_tun_rec(state);
-      nrec_priv->sa4   = (struct sockaddr *)get_addr4(public4, state->public_port);
-      nrec_priv->sa6   = (struct sockaddr *)get_addr6(public6, state->public_port);
-      nrec_priv->sport = sport;  
+      uint32_t id = add_rec(state, sport, public4, public6, state->public_port);
+      struct rec_priv *priv = recs_priv(state->recs, id);
 
-      /* add to Htables by n-ordered addresses */
-      if (!inet_pton(AF_INET, private4, &nrec_priv->priv_addr4))
+      /* add routes to private prefixes */
+      if ((len4 = lpm_prefix(private4, 32)) < 0) {
+         errno=EINVAL;
+         die("prefix length");
+      }
+      if ((len6 = lpm_prefix(private6, 128)) < 0) {
+         errno=EINVAL;
+         die("prefix length");
+      }
+      if (!inet_pton(AF_INET, private4, &priv->addr4))
          die("inet_pton");      
-      if (!inet_pton(AF_INET6, private6, nrec_priv->priv_addr6))
+      if (!inet_pton(AF_INET6, private6, priv->addr6))
          die("inet_pton");  
-      g_hash_table_insert(state->cli4, &nrec_priv->priv_addr4, nrec_priv);
-      g_hash_table_insert(state->cli6, nrec_priv->priv_addr6, nrec_priv);
-
-      if (state->serv) {
-         struct tun_rec *nrec_pub  = init_tun_rec(state);
-         nrec_pub->sa4    = (struct sockaddr *)get_addr4(public4, sport);
-         nrec_pub->sa6    = (struct sockaddr *)get_addr6(public6, sport);
-         nrec_pub->sport = sport;  
-         g_hash_table_insert(state->serv, &nrec_pub->sport, nrec_pub);
-      }
+      if (lpm4_add(state->cli4, ntohl(priv->addr4), len4, id) < 0 ||
+          lpm6_add(state->cli6, priv->addr6, len6, id) < 0)
+         die("lpm_add");
+
+      if (state->serv)
+         serv_insert(state, sport, add_rec(state, sport, public4, public6, sport));
 
       debug_print("%s:%d\n", public4, sport);
       debug_print("%s:%d\n", public6, sport);
@@ -413,26 +710,24 @@ int parse_dest_file(struct arguments *args, struct tun_state *state) {
    rewind(fp);
 
    /* build destination list */
-   state->cli_private = xmalloc(count * sizeof(struct tun_rec *));
-   state->cli_public  = xmalloc(count * sizeof(struct tun_rec *));
+   state->cli_private = xmalloc(count * sizeof(uint32_t));
+   state->cli_public  = xmalloc(count * sizeof(uint32_t));
    state->sa_len      = count;
    int i = 0, ret; 
    while (fscanf(fp, "%d %s %s %s %s", &sport, public4, private4, 
                                                public6, private6) == 5) {
-      struct tun_rec *nrec_priv = init_tun_rec(state);
-      struct tun_rec *nrec_pub  = init_tun_rec(state);
-
-      /* add private sockaddr */
-      nrec_priv->sa4    = (struct sockaddr *)get_addr4(private4, state->private_port);
-      nrec_priv->sa6    = (struct sockaddr *)get_addr6(private6, state->private_port);
-      nrec_priv->sport = sport;  
-      state->cli_private[i] = nrec_priv;
+      /* add private sockaddr (host address of the prefix) */
+      lpm_prefix(private4, 32);
+      lpm_prefix(private6, 128);
+      state->cli_private[i] = add_rec(state, sport, private4, private6, 
+                                      state->private_port);
+      struct rec_priv *priv = recs_priv(state->recs, state->cli_private[i]);
+      inet_pton(AF_INET, private4, &priv->addr4);
+      inet_pton(AF_INET6, private6, priv->addr6);
 
       /* add public sockaddr */
-      nrec_pub->sa4    = (struct sockaddr *)get_addr4(public4, state->public_port);
-      nrec_pub->sa6    = (struct sockaddr *)get_addr6(public6, state->public_port);
-      nrec_pub->sport = sport;  
-      state->cli_public[i++] = nrec_pub;
+      state->cli_public[i++] = add_rec(state, sport, public4, public6, 
+                                       state->public_port);
    }
    
    fclose(fp);
@@ -457,24 +752,24 @@ int parse_dest_file4(struct arguments *args, struct tun_state *state) {
       return -1;
    }
 
-   int sport, count=0;
-   char public[INET_ADDRSTRLEN], private[INET_ADDRSTRLEN];
+   int sport, count=0, len;
+   char public[INET_ADDRSTRLEN], private[INET_ADDRSTRLEN+3];
    /* build port to public addr lookup table */
    while (fscanf(fp, "%d %s %s", &sport, public, private) == 3) {
-      struct tun_rec *nrec_priv = init_tun_rec(state);
-      nrec_priv->sa4   = (struct sockaddr *)get_addr4(public, state->public_port);
-      nrec_priv->sport = sport;  
-      if (!inet_pton(AF_INET, private, &nrec_priv->priv_addr4))
+      uint32_t id = add_rec(state, sport, public, NULL, state->public_port);
+      struct rec_priv *priv = recs_priv(state->recs, id);
+      if ((len = lpm_prefix(private, 32)) < 0) {
+         errno=EINVAL;
+         die("prefix length");
+      }
+      if (!inet_pton(AF_INET, private, &priv->addr4))
          die("inet_pton");
-      g_hash_table_insert(state->cli4, &nrec_priv->priv_addr4, nrec_priv);
+      if (lpm4_add(state->cli4, ntohl(priv->addr4), len, id) < 0)
+         die("lpm4_add");
       debug_print("%s:%d\n", public, sport);
 
-      if (state->serv) {
-         struct tun_rec *nrec_pub  = init_tun_rec(state);
-         nrec_pub->sa4   = (struct sockaddr *)get_addr4(public, sport);
-         nrec_pub->sport = sport;  
-         g_hash_table_insert(state->serv, &nrec_pub->sport, nrec_pub);
-      }
+      if (state->serv)
+         serv_insert(state, sport, add_rec(state, sport, public, NULL, sport));
       count++;
    }   
   
@@ -482,23 +777,20 @@ int parse_dest_file4(struct arguments *args, struct tun_state *state) {
    rewind(fp);
 
    /* build destination list */
-   state->cli_private = xmalloc(count * sizeof(struct tun_rec *));
-   state->cli_public  = xmalloc(count * sizeof(struct tun_rec *));
+   state->cli_private = xmalloc(count * sizeof(uint32_t));
+   state->cli_public  = xmalloc(count * sizeof(uint32_t));
    state->sa_len      = count;
    int i = 0, ret; 
    while ( (ret = fscanf(fp, "%d %s %s", &sport, public, private)) == 3) {
-      struct tun_rec *nrec_priv = init_tun_rec(state);
-      struct tun_rec *nrec_pub  = init_tun_rec(state);
-
-      /* add private sockaddr */
-      nrec_priv->sa4   = (struct sockaddr *)get_addr4(private, state->private_port);
-      nrec_priv->sport = sport;  
-      state->cli_private[i] = nrec_priv;
+      /* add private sockaddr (host address of the prefix) */
+      lpm_prefix(private, 32);
+      state->cli_private[i] = add_rec(state, sport, private, NULL, 
+                                      state->private_port);
+      inet_pton(AF_INET, private, &recs_priv(state->recs, state->cli_private[i])->addr4);
 
       /* add public sockaddr */
-      nrec_pub->sa4   = (struct sockaddr *)get_addr4(public, state->public_port);
-      nrec_pub->sport = sport;  
-      state->cli_public[i++] = nrec_pub;
+      state->cli_public[i++] = add_rec(state, sport, public, NULL, 
+                                       state->public_port);
    }
    
    fclose(fp);
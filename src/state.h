@@ -13,22 +13,30 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 
+struct demux;
+struct demux_exp;
+struct pkt_queue;
+struct rss;
+struct lpm4;
+struct lpm6;
+struct acct;
+struct impair;
+struct inst_pool;
+struct batch;
+struct pep;
+struct recs;
+
 /** 
  * \struct tun_rec
- *	\brief Represents a peer of the node.
+ *	\brief Represents a peer of the node, one cache line in the peer
+ *         store (recs.h).
  */
 struct tun_rec {
-   struct sockaddr *sa4;        /*!<  The v4 address of the client. */
-   unsigned int     slen4;      /*!<  The size of the v4 sockaddr. */
-   in_addr_t        priv_addr4; /*!<  The private v4 address in network byte order to be used as a key */
-
-   struct sockaddr *sa6;        /*!<  The v6 address of the client. */
-   unsigned int     slen6;      /*!<  The size of the v6 sockaddr. */
-   unsigned char   priv_addr6[16];
-   //struct in6_addr  priv_addr6;  /*!<  The private v6 address in network byte order to be used as a key */
-
+   struct sockaddr_in  sa4;     /*!<  The v4 address of the client. */
+   struct sockaddr_in6 sa6;     /*!<  The v6 address of the client. */
    int              sport;     /*!<  The udp source port. */
-};
+   struct demux_exp *exp;      /*!<  The experiment last seen from this peer or NULL. */
+} __attribute__((aligned(64)));
 
 /** 
  * \struct tun_state 
@@ -47,13 +55,15 @@ struct tun_state {
    char *raw_header;        /*!<  raw header hexstring */
    uint8_t raw_header_size;    /*!<  raw header size */
    uint8_t protocol_num;       /*!<  protocol number */
+   struct demux *demux;        /*!<  The layer 4.5 experiments or NULL */
 
    /* From destination file */
-   GHashTable      *serv;        /*!<  Source port to public address lookup table. */
-   GHashTable      *cli4;        /*!<  Private IPv4 address to public address lookup table. */
-   GHashTable      *cli6;        /*!<  Private IPv6 address to public address lookup table. */
-   struct tun_rec **cli_private; /*!<  Destination list. (private sockaddr's) */
-   struct tun_rec **cli_public;  /*!<  Destination list. (public sockaddr's) */ 
+   struct recs     *recs;        /*!<  The peer records, by id. */
+   GHashTable      *serv;        /*!<  Source port to public address peer id table. */
+   struct lpm4     *cli4;        /*!<  Private IPv4 prefix to public address peer id table. */
+   struct lpm6     *cli6;        /*!<  Private IPv6 prefix to public address peer id table. */
+   uint32_t        *cli_private; /*!<  Destination list. (private sockaddr's peer ids) */
+   uint32_t        *cli_public;  /*!<  Destination list. (public sockaddr's peer ids) */ 
    uint8_t sa_len;               /*!<  Number of destinations. */
 
    /* From cfg file */
@@ -83,6 +93,7 @@ struct tun_state {
    char    *cli_file_notun4;     /*!< The client file location */
    char    *cli_file_tun6;       /*!< The client file location */
    char    *cli_file_notun6;     /*!< The client file location */
+   char    *cli_file_pep;        /*!< The client file location (PEP flow) */
 
    uint32_t buf_length;         /*!< buffer length */
    uint32_t backlog_size;       /*!< backlog size  */
@@ -92,6 +103,78 @@ struct tun_state {
                                      optval (max mss) for tun flow */
 
    uint16_t snaplen;            /*!< the size of saved packets in pcap traces  */
+   uint16_t stats_interval;     /*!< stats dump interval (sec), 0 to dump at exit only */
+   uint32_t perf_sample;        /*!< hardware counters sampling period (calls), 0 to disable */
+   uint8_t  heavy_hitters;      /*!< top talkers per peer, 0 to disable */
+
+   /* Flow accounting */
+   uint32_t acct_flows;          /*!< accounted concurrent flows, 0 to disable */
+   uint16_t acct_idle;           /*!< idle timeout (sec) */
+   uint16_t acct_active;         /*!< active timeout (sec) */
+   struct acct *acct;            /*!< The flow table or NULL */
+
+   /* Retry queues */
+   uint32_t queue_len;           /*!< retry queues length (packets) */
+   uint8_t  queue_policy;        /*!< retry queues drop policy */
+   struct pkt_queue *txq_tun;    /*!< net->tun retry queue */
+   struct pkt_queue *txq_net;    /*!< tun->net retry queue */
+   uint32_t tx_ring;             /*!< raw mode PACKET_MMAP TX ring frames, 0 to disable */
+
+   /* Adaptive batching */
+   uint16_t batch_max;           /*!< maximal read batch, 0 to disable */
+   uint32_t batch_latency;       /*!< batching latency target (us) */
+   struct batch *batch;          /*!< The batching controller or NULL */
+
+   /* Impairments */
+   struct impair *impair_tun;    /*!< net->tun impairments or NULL */
+   struct impair *impair_net;    /*!< tun->net impairments or NULL */
+   uint32_t impair_pool;         /*!< delayed packets per direction */
+   uint32_t impair_seed;         /*!< impairments random seed */
+
+   /* Tunnel instances */
+   struct inst_pool *inst;       /*!< The additional instances or NULL */
+   uint8_t  inst_workers;        /*!< instances worker threads */
+   int16_t  inst_cpu;            /*!< first worker CPU, -1 not to pin */
+
+   uint32_t sockbuf_max;         /*!< UDP socket buffers ceiling (bytes) */
+   uint8_t  ecn_mode;            /*!< inner to outer TOS propagation (enum ecn_mode) */
+
+   /* Source port spreading */
+   uint16_t port_range;          /*!< client source ports [port, port+port_range) */
+   int     *spread4;             /*!< client v4 sockets, by port offset */
+   int     *spread6;             /*!< client v6 sockets, by port offset */
+
+   /* Software RSS */
+   uint8_t  rss_workers;         /*!< tun dispatcher workers, 0 to disable */
+   struct rss *rss;              /*!< The tun dispatcher or NULL */
+
+   /* Shared-memory channels */
+   char    *shm_dir;             /*!< The peer sockets directory, NULL to disable */
+
+   /* Split-TCP proxy */
+   uint16_t pep_port;            /*!< trunk port on the private addresses, 0 to disable */
+   uint16_t pep_local_port;      /*!< TPROXY listener port, explicit ones above it */
+   uint8_t  pep_tproxy;          /*!< terminate TPROXY-redirected connections */
+   char    *pep_cc;              /*!< trunk congestion control, NULL for the default */
+   uint32_t pep_buffer;          /*!< trunk buffer (bytes) */
+   struct pep *pep;              /*!< The proxy or NULL */
+
+   /* Measurement flows */
+   uint32_t measure_flows;       /*!< concurrent flows per path (event engine), 0 for one thread per flow */
+   uint32_t measure_sample;      /*!< TCP_INFO sampling period (ms), 0 at start & end only */
+   uint32_t series_bin;          /*!< received bytes time series bin (ms), 0 to disable */
+   uint16_t series_max;          /*!< time series duration (sec) */
+   uint32_t short_flows;         /*!< short connections per path, 0 to disable */
+   uint16_t short_requests;      /*!< pipelined requests per short connection */
+   char    *short_size;          /*!< object sizes: N, LO-HI, comma-separated with :WEIGHT */
+
+   /* Synthetic load */
+   uint32_t load_pps;            /*!< generated packets/s, 0 to disable the generator */
+   uint16_t load_port;           /*!< sink UDP port, 0 to disable the sink */
+   uint16_t load_flows;          /*!< generated flows (source ports) */
+   uint16_t load_burst;          /*!< packets sent back-to-back */
+   uint16_t load_duration;       /*!< generator duration (sec), 0 to run until shutdown */
+   char    *load_size;           /*!< packet sizes: N, LO-HI or imix */
 };
 
 /**
@@ -112,20 +195,35 @@ struct tun_state *init_tun_state(struct arguments *args);
 void free_tun_state(struct tun_state *state);
 
 /**
- * \fn struct tun_rec *init_tun_rec()
- * \brief Allocate a tun_rec structure.
+ * \fn struct tun_state *init_tun_instance(struct tun_state *parent, struct arguments *args)
+ * \brief Initialize the state of an additional server instance: the
+ *        parent settings overridden by the instance configuration file,
+ *        with its own peer table and retry queues.
  *
- * \return The allocated structure. 
+ * \param parent The program state.
+ * \param args The instance arguments (configuration file, raw header).
+ * \return The instance state.
  */
-struct tun_rec *init_tun_rec(struct tun_state *state);
+struct tun_state *init_tun_instance(struct tun_state *parent,
+                                    struct arguments *args);
 
 /**
- * \fn void free_tun_rec(struct tun_rec *rec)
- * \brief Free a tun_rec structure.
+ * \fn void free_tun_instance(struct tun_state *state)
+ * \brief Free the state of an instance.
  *
- * \param rec The tun_rec structure. 
+ * \param state The instance state.
  */
-void free_tun_rec(struct tun_rec *rec);
+void free_tun_instance(struct tun_state *state);
+
+/**
+ * \fn char *parse_raw_header(const char *hex, uint8_t *size)
+ * \brief Convert a raw header hexstring to bytes.
+ *
+ * \param hex The hexstring
+ * \param size modified on return to indicate the header size.
+ * \return The header (malloc).
+ */ 
+char *parse_raw_header(const char *hex, uint8_t *size);
 
 #endif
 
@@ -0,0 +1,98 @@
+/**
+ * \file stats.c
+ * \brief Runtime counters export.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "debug.h"
+#include "udptun.h"
+
+/**
+ * \struct stats_section
+ *	\brief A registered stats section.
+ */
+struct stats_section {
+   const char  *name; /*!< The section name */
+   stats_dump_t dump; /*!< The dump callback */
+   void        *arg;  /*!< The callback argument */
+};
+
+/**
+ * \var static struct stats_section sections[]
+ * \brief The registered sections.
+ */
+static struct stats_section sections[STATS_MAX_SECTIONS];
+
+/**
+ * \var static int sections_len
+ * \brief The amount of registered sections.
+ */
+static int sections_len;
+
+/**
+ * \var static pthread_mutex_t lock
+ * \brief Protects sections and the stats file.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void stats_register(const char *name, stats_dump_t dump, void *arg) {
+   pthread_mutex_lock(&lock);
+   if (sections_len < STATS_MAX_SECTIONS) {
+      sections[sections_len].name = name;
+      sections[sections_len].dump = dump;
+      sections[sections_len].arg  = arg;
+      sections_len++;
+   } else {
+      debug_print("too many stats sections, dropping %s\n", name);
+   }
+   pthread_mutex_unlock(&lock);
+}
+
+int stats_dump(struct tun_state *state) {
+   struct arguments* args  = state->args;
+   char file_loc[512];
+   snprintf(file_loc, sizeof(file_loc), "%sstats%s%s.txt",
+            state->out_dir ? state->out_dir : "",
+            args->run_id ? "." : "", args->run_id ? args->run_id : "");
+
+   pthread_mutex_lock(&lock);
+   FILE *fp = fopen(file_loc, "w");
+   if (!fp) {
+      pthread_mutex_unlock(&lock);
+      debug_print("can't open %s\n", file_loc);
+      return -1;
+   }
+   for (int i=0; i<sections_len; i++) {
+      fprintf(fp, "[%s]\n", sections[i].name);
+      (*sections[i].dump)(fp, sections[i].arg);
+      fprintf(fp, "\n");
+   }
+   fclose(fp);
+   pthread_mutex_unlock(&lock);
+
+   mode_t m = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+   chmod(file_loc, m);
+   return 0;
+}
+
+void *stats_thread(void *st) {
+   struct tun_state *state = st;
+   int old;
+   while (1) {
+      sleep(state->stats_interval);
+      /* do not get canceled while holding the lock */
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+      stats_dump(state);
+      pthread_setcancelstate(old, NULL);
+   }
+   return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * \file stats.h
+ * \brief Runtime counters export.
+ *
+ *    Modules register a dump callback per section, the sections are
+ *    written to <output-dir>/stats[.<run-id>].txt at exit and every
+ *    stats-interval seconds if set.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_STATS_H
+#define UDPTUN_STATS_H
+
+#include <stdio.h>
+
+#include "state.h"
+
+/**
+ * \def STATS_MAX_SECTIONS
+ * \brief The maximal amount of registered sections.
+ */
+#define STATS_MAX_SECTIONS 32
+
+/**
+ * \typedef stats_dump_t
+ * \brief A section dump callback, writes "key value" lines to fp.
+ */
+typedef void (*stats_dump_t)(FILE *fp, void *arg);
+
+/**
+ * \fn void stats_register(const char *name, stats_dump_t dump, void *arg)
+ * \brief Register a stats section.
+ *
+ * \param name The section name
+ * \param dump The dump callback
+ * \param arg The argument passed to dump
+ */
+void stats_register(const char *name, stats_dump_t dump, void *arg);
+
+/**
+ * \fn int stats_dump(struct tun_state *state)
+ * \brief Write all registered sections to the stats file.
+ *
+ * \param state The program state
+ * \return 0 for success, -1 on error
+ */
+int stats_dump(struct tun_state *state);
+
+/**
+ * \fn void *stats_thread(void *st)
+ * \brief Periodically dump stats (every state->stats_interval sec).
+ *
+ * \param st The program state (struct tun_state *)
+ */
+void *stats_thread(void *st);
+
+#endif
@@ -39,3 +39,8 @@ pthread_t xthread_create(void *(*start_routine) (void *), void *args, int garbag
    return thread_id;
 }
 
+void xthread_detach() {
+   pthread_t self = pthread_self();
+   if (!unset_pthread(self))
+      pthread_detach(self);
+}
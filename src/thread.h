@@ -20,6 +20,14 @@
  */ 
 pthread_t xthread_create(void *(*start_routine) (void *), void *args, int garbage);
 
+/**
+ * \fn void xthread_detach()
+ * \brief Remove the calling thread from the garbage collector and
+ *        detach it, call before a garbage-collected thread returns.
+ *        The thread is left to the destructor if it already took it.
+ */ 
+void xthread_detach();
+
 /**
  * \fn void init_barrier(int nthreads)
  * \brief Initialize synchronization barriers
@@ -0,0 +1,32 @@
+/**
+ * \file timing.h
+ * \brief The monotonic clock.
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_TIMING_H
+#define UDPTUN_TIMING_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * \fn static inline int64_t monotonic_ns()
+ * \brief The current time (ns, CLOCK_MONOTONIC), a vDSO call on Linux.
+ */
+static inline int64_t monotonic_ns() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * \fn static inline int64_t monotonic_us()
+ * \brief The current time (us, CLOCK_MONOTONIC).
+ */
+static inline int64_t monotonic_us() {
+   return monotonic_ns() / 1000;
+}
+
+#endif
@@ -0,0 +1,177 @@
+/**
+ * \file txring.h
+ * \brief PACKET_MMAP transmit ring for the raw outer transport.
+ *
+ *    In raw (non-UDP) mode, the outer IPv4 packets can be written to a
+ *    TPACKET_V2 TX ring of an AF_PACKET socket on the default interface
+ *    instead of being sent one sendto() at a time on the SOCK_RAW
+ *    socket. The Ethernet and IPv4 headers (protocol_num, TOS, DF) are
+ *    built in userspace, frames are filled as packets are forwarded and
+ *    the ring is kicked with a single send() once per select loop.
+ *
+ *    The forwarding path never reads files: a refresh thread copies the
+ *    routes of the interface (/proc/net/route) and the MAC addresses of
+ *    the next hops in use (/proc/net/arp) every TXRING_REFRESH ms to the
+ *    ring, and the send path looks the next hop up in the route copy
+ *    and its MAC address in a set-associative cache keyed by next hop.
+ *    A packet is left to the raw socket, which also triggers the kernel
+ *    neighbour resolution, when its next hop is not resolved yet (it is
+ *    then added to the cache and resolved by the next refresh), when the
+ *    ring is full or when it does not fit a frame, and IPv6 packets
+ *    always are.
+ *
+ * \author k.edeline
+ * \version 0.1
+ */
+
+#ifndef UDPTUN_TXRING_H
+#define UDPTUN_TXRING_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "state.h"
+
+/**
+ * \def TXRING_FRAME_SIZE
+ * \brief The frame size (bytes), a multiple of the page size divisor.
+ */
+#define TXRING_FRAME_SIZE 2048
+
+/**
+ * \def TXRING_BLOCK_SIZE
+ * \brief The ring block size (bytes).
+ */
+#define TXRING_BLOCK_SIZE (1 << 16)
+
+/**
+ * \def TXRING_ROUTES
+ * \brief The amount of routes of the interface kept, longest prefixes
+ *        first.
+ */
+#define TXRING_ROUTES 32
+
+/**
+ * \def TXRING_NEIGH_SETS
+ * \brief The amount of neighbour cache sets (power of 2).
+ */
+#define TXRING_NEIGH_SETS 64
+
+/**
+ * \def TXRING_NEIGH_WAYS
+ * \brief The amount of neighbour cache entries per set.
+ */
+#define TXRING_NEIGH_WAYS 4
+
+/**
+ * \def TXRING_REFRESH
+ * \brief The routes and neighbours refresh period (ms).
+ */
+#define TXRING_REFRESH 1000
+
+/**
+ * \def TXRING_NEIGH_TTL
+ * \brief The lifetime of an unused neighbour (ms).
+ */
+#define TXRING_NEIGH_TTL 30000
+
+/**
+ * \struct txring_route
+ *	\brief A route of the interface.
+ */
+struct txring_route {
+   uint32_t dest;       /*!< The prefix (network order) */
+   uint32_t mask;       /*!< The mask (network order) */
+   uint32_t gw;         /*!< The gateway (network order), 0 if on-link */
+   int      metric;     /*!< The metric */
+};
+
+/**
+ * \struct txring_neigh
+ *	\brief A neighbour cache entry.
+ */
+struct txring_neigh {
+   uint32_t hop;        /*!< The next hop (network order), 0 if free */
+   uint8_t  mac[6];     /*!< The next hop MAC address */
+   uint8_t  ok;         /*!< 1 if resolved */
+   uint32_t used;       /*!< The refresh epoch of the last use */
+};
+
+/**
+ * \struct txring
+ *	\brief A TX ring and its neighbour cache.
+ */
+struct txring {
+   int       fd;           /*!< The AF_PACKET socket */
+   char     *map;          /*!< The mmaped ring */
+   size_t    map_len;      /*!< The ring length */
+   uint32_t  frames;       /*!< The amount of frames */
+   uint32_t  head;         /*!< The next frame to fill */
+   uint32_t  pending;      /*!< Frames filled since the last kick */
+   char      ifname[32];   /*!< The interface */
+   uint8_t   mac[6];       /*!< The interface MAC address */
+   uint32_t  src;          /*!< The source address (network order) */
+   uint32_t  mtu;          /*!< The interface MTU */
+   uint8_t   proto;        /*!< The outer IP protocol */
+   uint16_t  id;           /*!< The next IP identification */
+
+   pthread_t refresh;      /*!< The refresh thread */
+   pthread_spinlock_t lock;  /*!< Protects the routes and neighbours */
+   struct txring_route routes[TXRING_ROUTES]; /*!< The interface routes */
+   uint32_t  nroutes;      /*!< The amount of routes */
+   struct txring_neigh neigh[TXRING_NEIGH_SETS][TXRING_NEIGH_WAYS]; /*!< The neighbour cache */
+   uint32_t  epoch;        /*!< The amount of refreshes */
+
+   uint64_t  sent;         /*!< Packets written to the ring */
+   uint64_t  kicks;        /*!< send() calls */
+   uint64_t  unresolved;   /*!< Packets left to the socket, no neighbour */
+   uint64_t  evicted;      /*!< Resolved neighbours evicted by a miss */
+   uint64_t  full;         /*!< Packets left to the socket, ring full */
+   uint64_t  other;        /*!< Packets left to the socket, v6 or too long */
+};
+
+/**
+ * \fn struct txring *txring_new(struct tun_state *state)
+ * \brief Open a TX ring on the default interface, register its stats
+ *        section and start its refresh thread.
+ *
+ * \param state The program state (tx-ring frames, default_if,
+ *              public_addr4, protocol_num)
+ * \return The ring, NULL if disabled or unavailable
+ */
+struct txring *txring_new(struct tun_state *state);
+
+/**
+ * \fn void txring_free(struct txring *r)
+ * \brief Stop the refresh thread, kick the pending frames and close a
+ *        ring.
+ *
+ * \param r The ring
+ */
+void txring_free(struct txring *r);
+
+/**
+ * \fn int txring_send(struct txring *r, struct sockaddr *sa, int tos, const char *buf, int len)
+ * \brief Fill a frame with an outer packet.
+ *
+ * \param r The ring
+ * \param sa The destination
+ * \param tos The outer TOS or -1
+ * \param buf The outer payload (raw header and inner packet)
+ * \param len The payload length
+ * \return len, -1 if the packet must be sent on the raw socket
+ */
+int txring_send(struct txring *r, struct sockaddr *sa, int tos,
+                const char *buf, int len);
+
+/**
+ * \fn void txring_kick(struct txring *r)
+ * \brief Have the kernel send the filled frames.
+ *
+ * \param r The ring
+ */
+void txring_kick(struct txring *r);
+
+#endif
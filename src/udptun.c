@@ -17,6 +17,7 @@
 #include <signal.h>
 
 #include "udptun.h"
+#include "startup.h"
 
 /* argp variables and structs */
 
@@ -276,9 +277,11 @@ int main(int argc, char *argv[]) {
    struct arguments args;
 
    /* Process arguments */
+   init_startup();
    init_args(&args);
    if (parse_args(argc, argv, &args) < 0) return -1;
    validate_args(&args);
+   startup_mark("args");
    if (args.verbose) print_args(&args);
 
    switch (args.mode) {
@@ -57,6 +57,12 @@
  */
 #define CLI_NOTUN_FILE6 "cli_notun6.dat"
 
+/**
+ * \def CLI_PEP_FILE
+ * \brief The client file of the flow through the split-TCP proxy.
+ */
+#define CLI_PEP_FILE "cli_pep.dat"
+
 /**
  * \def TUN_SNAPLEN4
  * \brief libpcap snapshot length in bytes for IPv4 measurements.
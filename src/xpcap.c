@@ -24,6 +24,14 @@
 #include "state.h"
 #include "thread.h"
 #include "udptun.h"
+#include "startup.h"
+
+/**
+ * \var static pthread_mutex_t compile_lock
+ * \brief Serializes pcap_compile(), not reentrant in older libpcap,
+ *        between the capture threads and gen_bpf().
+ */
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * \fn static void *term_capture(void* arg)
@@ -41,9 +49,11 @@ static void term_capture(void* arg);
  * \param addr The address of this itf
  * \param port 
  * \param filename The location of the trace dump file
+ * \param phase The startup phase name
  */ 
 static void capture(const char *dev, const char *addr4, const char *addr6,  
-                    int port, int proto, char *filename, unsigned int snaplen);
+                    int port, int proto, char *filename, unsigned int snaplen,
+                    const char *phase);
 
 void term_capture(void* arg) {
    pcap_t *handle = (pcap_t *)arg;
@@ -76,7 +86,7 @@ void *capture_tun(void *arg) {
       snaplen = TUN_SNAPLEN4;*/
 
    capture(state->tun_if, state->private_addr4, state->private_addr6, 0, 
-          state->protocol_num, file_loc, state->snaplen);
+          state->protocol_num, file_loc, state->snaplen, "capture.tun");
    return 0;
 }
 
@@ -94,14 +104,17 @@ void *capture_notun(void *arg) {
    strncat(file_loc, ".pcap", 512);
 
    capture(state->default_if, state->public_addr4, state->public_addr6, 
-           state->public_port, state->protocol_num, file_loc, state->snaplen);
+           state->public_port, state->protocol_num, file_loc, state->snaplen,
+           "capture.notun");
    return 0;
 }
 
 void capture(const char *dev, const char *addr4, const char *addr6, 
-             int port, int proto, char *filename, unsigned int snaplen) {
+             int port, int proto, char *filename, unsigned int snaplen,
+             const char *phase) {
 	pcap_t *handle;
    char errbuf[PCAP_ERRBUF_SIZE];
+   int64_t t = startup_now();
 
 	if ( (handle = pcap_open_live(dev, snaplen, 0, 10000, errbuf)) == NULL) 
 	   die("pcap_open_live");
@@ -127,8 +140,10 @@ void capture(const char *dev, const char *addr4, const char *addr6,
                                 "ip proto %d or ip6 proto %d)",
                    addr4, addr6, port, proto, proto);
       }
+      pthread_mutex_lock(&compile_lock);
       if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) 
          die("pcap_compile");
+      pthread_mutex_unlock(&compile_lock);
       if (pcap_setfilter(handle, &fp) == -1) 
          die("pcap_setfilter");
    }
@@ -141,6 +156,7 @@ void capture(const char *dev, const char *addr4, const char *addr6,
 
    /* capture & dump */
    pthread_cleanup_push(&term_capture, handle);
+   startup_phase(phase, t);
    synchronize();
 	pcap_loop(handle, -1, pcap_dump, (void*) dumper);
    pthread_cleanup_pop(0);
@@ -160,13 +176,18 @@ struct sock_fprog *gen_bpf(const char *dev, const char *addr, int sport, int dpo
    else if (!sport && dport)
       sprintf(filter_exp, "dst port %d", dport);
 
-   /* compile filter */
+   /* compile filter, the program outlives the handle */
+   int64_t t = startup_now();
    bpf_u_int32 net = inet_addr(addr);
    handle = pcap_open_live(dev, BUFSIZ, 0, 1000, errbuf);
    if (!handle) 
       die("Couldn't open device %s: %s");
+   pthread_mutex_lock(&compile_lock);
    if (pcap_compile(handle, fp, filter_exp, 0, net) == -1) 
       die("Couldn't parse filter %s: %s\n");
+   pthread_mutex_unlock(&compile_lock);
+   pcap_close(handle);
+   startup_phase("bpf", t);
 
    return (struct sock_fprog *)fp;
 }